@@ -67,11 +67,31 @@ Item {
             }
         }
         
+        // Verification progress
+        ColumnLayout {
+            anchors.centerIn: parent
+            width: parent.width * 0.8
+            spacing: 10
+            visible: flashupGui.loadingFirmware
+            
+            Label {
+                text: "Verifying firmware (" + flashupGui.loadProgress + "%)"
+                Layout.alignment: Qt.AlignHCenter
+            }
+            
+            ProgressBar {
+                Layout.fillWidth: true
+                from: 0
+                to: 100
+                value: flashupGui.loadProgress
+            }
+        }
+        
         // Empty state
         ColumnLayout {
             anchors.centerIn: parent
             spacing: 10
-            visible: !hasFirmware
+            visible: !hasFirmware && !flashupGui.loadingFirmware
             
             Label {
                 text: "No firmware loaded"
@@ -0,0 +1,61 @@
+#include "chunkbufferpool.h"
+
+#include <QMutexLocker>
+
+ChunkBufferPool::ChunkBufferPool(int bufferSize, int capacity)
+    : m_bufferSize(bufferSize),
+      m_capacity(capacity),
+      m_allocations(0)
+{
+    m_buffers.reserve(capacity);
+}
+
+QByteArray ChunkBufferPool::acquire()
+{
+    QMutexLocker locker(&m_mutex);
+    
+    if (!m_buffers.isEmpty()) {
+        return m_buffers.takeLast();
+    }
+    
+    m_allocations++;
+    QByteArray buffer;
+    buffer.reserve(m_bufferSize);
+    return buffer;
+}
+
+void ChunkBufferPool::release(QByteArray &buffer)
+{
+    QByteArray returned;
+    returned.swap(buffer);
+    
+    // A buffer someone else still references would be copied on the next write
+    if (!returned.isDetached() || returned.capacity() < m_bufferSize) {
+        return;
+    }
+    
+    // Reserved buffers keep their storage when emptied
+    returned.resize(0);
+    
+    QMutexLocker locker(&m_mutex);
+    if (m_buffers.size() < m_capacity) {
+        m_buffers.append(returned);
+    }
+}
+
+int ChunkBufferPool::bufferSize() const
+{
+    return m_bufferSize;
+}
+
+int ChunkBufferPool::available() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_buffers.size();
+}
+
+qint64 ChunkBufferPool::allocations() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_allocations;
+}
@@ -0,0 +1,67 @@
+#ifndef CHUNKBUFFERPOOL_H
+#define CHUNKBUFFERPOOL_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QMutex>
+
+/**
+ * @brief The ChunkBufferPool class recycles buffers for chunk data
+ *
+ * Update jobs take their working buffers from the pool when an upload
+ * starts and return them when it ends. Buffers keep their storage while
+ * pooled, and data is read and encoded into them in place, so once every
+ * buffer has grown to the largest chunk an upload allocates nothing per
+ * chunk. A buffer that is still shared when it is returned, e.g. because a
+ * transport queued it, is dropped instead of being reused.
+ *
+ * The pool only covers the job's own buffers: QSerialPort still copies
+ * every write into its own buffer, and text serial and JSON network
+ * responses are parsed into new strings. tst_chunkallocations checks the
+ * transports that allocate nothing per chunk.
+ *
+ * All methods are thread-safe.
+ */
+class ChunkBufferPool
+{
+public:
+    /**
+     * @brief Construct a pool
+     * @param bufferSize Bytes reserved in each new buffer
+     * @param capacity Maximum number of idle buffers kept
+     */
+    explicit ChunkBufferPool(int bufferSize = 128 * 1024, int capacity = 64);
+
+    /**
+     * @brief Take a buffer from the pool
+     * @return Empty buffer with at least bufferSize() bytes reserved
+     */
+    QByteArray acquire();
+
+    /**
+     * @brief Return a buffer to the pool
+     * @param buffer Buffer from acquire(); reset to a null array
+     */
+    void release(QByteArray &buffer);
+
+    int bufferSize() const;
+
+    /**
+     * @brief Get the number of idle buffers
+     */
+    int available() const;
+
+    /**
+     * @brief Get the number of buffers allocated because the pool was empty
+     */
+    qint64 allocations() const;
+
+private:
+    mutable QMutex m_mutex;
+    QVector<QByteArray> m_buffers;
+    int m_bufferSize;
+    int m_capacity;
+    qint64 m_allocations;
+};
+
+#endif // CHUNKBUFFERPOOL_H
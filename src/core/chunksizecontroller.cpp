@@ -0,0 +1,117 @@
+#include "chunksizecontroller.h"
+
+// Constants
+const int INTERVAL_CHUNKS = 8;
+const int RTT_SMOOTHING_SHIFT = 3;          // srtt += (sample - srtt) / 8
+const double GOODPUT_TOLERANCE = 0.95;
+const qint64 RTT_INFLATION_FACTOR = 2;
+const qint64 STEP_DIVISOR = 32;
+
+ChunkSizeController::ChunkSizeController()
+    : m_size(0),
+      m_minimum(0),
+      m_maximum(0),
+      m_step(0),
+      m_srttUs(0),
+      m_minRttUs(0),
+      m_intervalBytes(0),
+      m_intervalChunks(0),
+      m_goodput(0.0),
+      m_lastGoodput(0.0)
+{
+}
+
+void ChunkSizeController::reset(qint64 initial, qint64 minimum, qint64 maximum)
+{
+    m_minimum = qMax<qint64>(1, minimum);
+    m_maximum = qMax(m_minimum, maximum);
+    m_step = qMax(m_minimum, (m_maximum - m_minimum) / STEP_DIVISOR);
+    m_srttUs = 0;
+    m_minRttUs = 0;
+    m_goodput = 0.0;
+    m_lastGoodput = 0.0;
+    
+    setSize(initial);
+    startInterval();
+}
+
+qint64 ChunkSizeController::chunkSize() const
+{
+    return m_size;
+}
+
+bool ChunkSizeController::isAdaptive() const
+{
+    return m_maximum > m_minimum;
+}
+
+void ChunkSizeController::chunkDelivered(qint64 bytes, qint64 rttUs)
+{
+    if (rttUs >= 0) {
+        if (m_srttUs == 0) {
+            m_srttUs = rttUs;
+        } else {
+            m_srttUs += (rttUs - m_srttUs) >> RTT_SMOOTHING_SHIFT;
+        }
+        
+        if (m_minRttUs == 0 || rttUs < m_minRttUs) {
+            m_minRttUs = rttUs;
+        }
+    }
+    
+    if (!isAdaptive()) {
+        return;
+    }
+    
+    m_intervalBytes += bytes;
+    if (++m_intervalChunks < INTERVAL_CHUNKS) {
+        return;
+    }
+    
+    // One measurement interval complete: decide on the next step
+    qint64 elapsedNs = qMax<qint64>(1, m_intervalTimer.nsecsElapsed());
+    m_goodput = static_cast<double>(m_intervalBytes) * 1e9 / elapsedNs;
+    
+    bool latencyInflated = m_minRttUs > 0 && m_srttUs > m_minRttUs * RTT_INFLATION_FACTOR;
+    bool goodputHeld = m_goodput >= m_lastGoodput * GOODPUT_TOLERANCE;
+    
+    if (latencyInflated && !goodputHeld) {
+        // Bigger chunks only queued up on the link
+        setSize(m_size - m_step);
+    } else if (goodputHeld) {
+        setSize(m_size + m_step);
+    }
+    
+    m_lastGoodput = m_goodput;
+    startInterval();
+}
+
+void ChunkSizeController::chunkFailed()
+{
+    // Back off quickly and restart the measurement
+    setSize(m_size / 2);
+    m_lastGoodput = 0.0;
+    startInterval();
+}
+
+qint64 ChunkSizeController::smoothedRttUs() const
+{
+    return m_srttUs;
+}
+
+double ChunkSizeController::goodput() const
+{
+    return m_goodput;
+}
+
+void ChunkSizeController::setSize(qint64 size)
+{
+    m_size = qBound(m_minimum, size, m_maximum);
+}
+
+void ChunkSizeController::startInterval()
+{
+    m_intervalBytes = 0;
+    m_intervalChunks = 0;
+    m_intervalTimer.start();
+}
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef CHUNKSIZECONTROLLER_H
+#define CHUNKSIZECONTROLLER_H
+
+#include <QtGlobal>
+#include <QElapsedTimer>
+
+/**
+ * @brief The ChunkSizeController class adapts the transfer chunk size to the link
+ *
+ * Additive-increase/multiplicative-decrease within device-advertised bounds:
+ * the size grows by one step per measurement interval while goodput keeps up
+ * and latency stays close to the best observed, shrinks by a step when
+ * larger chunks only inflate latency, and halves on every retry.
+ */
+class ChunkSizeController
+{
+public:
+    ChunkSizeController();
+
+    /**
+     * @brief Reset the controller for a new transfer
+     * @param initial Starting chunk size
+     * @param minimum Smallest chunk size the device accepts
+     * @param maximum Largest chunk size the device accepts
+     */
+    void reset(qint64 initial, qint64 minimum, qint64 maximum);
+
+    /**
+     * @brief Get the chunk size to use for the next chunk
+     * @return Chunk size in bytes
+     */
+    qint64 chunkSize() const;
+
+    /**
+     * @brief Check whether the device allows the size to change at all
+     * @return true if minimum and maximum differ
+     */
+    bool isAdaptive() const;
+
+    /**
+     * @brief Record a successfully delivered chunk
+     * @param bytes Chunk size
+     * @param rttUs Time from send to acknowledgement in microseconds, or -1 if unknown
+     */
+    void chunkDelivered(qint64 bytes, qint64 rttUs);
+
+    /**
+     * @brief Record a retry, rejection or acknowledgement timeout
+     */
+    void chunkFailed();
+
+    /**
+     * @brief Get the smoothed acknowledgement latency
+     * @return Latency in microseconds, 0 before the first sample
+     */
+    qint64 smoothedRttUs() const;
+
+    /**
+     * @brief Get the goodput measured over the last interval
+     * @return Bytes per second
+     */
+    double goodput() const;
+
+private:
+    qint64 m_size;
+    qint64 m_minimum;
+    qint64 m_maximum;
+    qint64 m_step;
+    qint64 m_srttUs;
+    qint64 m_minRttUs;
+    qint64 m_intervalBytes;
+    int m_intervalChunks;
+    double m_goodput;
+    double m_lastGoodput;
+    QElapsedTimer m_intervalTimer;
+
+    void setSize(qint64 size);
+    void startInterval();
+};
+
+#endif // CHUNKSIZECONTROLLER_H
\ No newline at end of file
@@ -0,0 +1,67 @@
+#include "crc32.h"
+
+#include <QtEndian>
+
+namespace {
+
+const quint32 CRC32_POLYNOMIAL = 0xEDB88320;
+
+// tables[0] is the classic byte table; tables[k] advances a byte k positions further
+struct Crc32Tables {
+    quint32 tables[8][256];
+
+    Crc32Tables()
+    {
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc >> 1) ^ (CRC32_POLYNOMIAL & (0u - (crc & 1)));
+            }
+            tables[0][i] = crc;
+        }
+        
+        for (quint32 i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                tables[k][i] = (tables[k - 1][i] >> 8) ^ tables[0][tables[k - 1][i] & 0xFF];
+            }
+        }
+    }
+};
+
+const Crc32Tables &crcTables()
+{
+    static const Crc32Tables tables;
+    return tables;
+}
+
+} // namespace
+
+quint32 Crc32::compute(const char *data, qint64 length, quint32 crc)
+{
+    const auto &t = crcTables().tables;
+    const uchar *p = reinterpret_cast<const uchar *>(data);
+    crc = ~crc;
+    
+    // Eight bytes per step; the loads are little-endian so this is byte-order independent
+    while (length >= 8) {
+        quint32 low = qFromLittleEndian<quint32>(p) ^ crc;
+        quint32 high = qFromLittleEndian<quint32>(p + 4);
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+              t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^
+              t[3][high & 0xFF] ^ t[2][(high >> 8) & 0xFF] ^
+              t[1][(high >> 16) & 0xFF] ^ t[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+    }
+    
+    return ~crc;
+}
+
+quint32 Crc32::compute(const QByteArray &data, quint32 crc)
+{
+    return compute(data.constData(), data.size(), crc);
+}
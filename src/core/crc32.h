@@ -0,0 +1,35 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <QtGlobal>
+#include <QByteArray>
+
+/**
+ * @brief The Crc32 class computes CRC-32 checksums for wire frames
+ *
+ * Standard CRC-32 (IEEE 802.3, reflected polynomial 0xEDB88320), the same
+ * as zlib's crc32() and the ROM routines of common bootloaders. Uses
+ * slicing-by-8 tables, which process eight bytes per step.
+ */
+class Crc32
+{
+public:
+    /**
+     * @brief Compute or continue a checksum
+     * @param data Input bytes
+     * @param length Number of bytes
+     * @param crc Checksum of the preceding bytes, 0 to start
+     * @return Checksum of all bytes so far
+     */
+    static quint32 compute(const char *data, qint64 length, quint32 crc = 0);
+
+    /**
+     * @brief Compute or continue a checksum
+     * @param data Input bytes
+     * @param crc Checksum of the preceding bytes, 0 to start
+     * @return Checksum of all bytes so far
+     */
+    static quint32 compute(const QByteArray &data, quint32 crc = 0);
+};
+
+#endif // CRC32_H
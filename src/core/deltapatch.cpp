@@ -0,0 +1,204 @@
+#include "deltapatch.h"
+
+#include <QHash>
+#include <QtEndian>
+#include <cstring>
+
+// Patch format
+static constexpr char PATCH_MAGIC[] = "FUDP";
+const int PATCH_MAGIC_SIZE = 4;
+const int PATCH_HEADER_SIZE = 8;
+const char OP_COPY = 0x01;
+const char OP_INSERT = 0x02;
+
+// Matching parameters: base blocks are indexed at this granularity, and a
+// COPY (9 bytes) must save clearly more than it costs over an INSERT
+const int MATCH_BLOCK_SIZE = 16;
+const int MIN_MATCH_LENGTH = 24;
+const quint32 HASH_MULTIPLIER = 0x01000193;
+
+namespace {
+
+void appendU32(QByteArray &out, quint32 value)
+{
+    char bytes[4];
+    qToLittleEndian(value, bytes);
+    out.append(bytes, 4);
+}
+
+quint32 readU32(const char *p)
+{
+    return qFromLittleEndian<quint32>(p);
+}
+
+quint32 blockHash(const char *p)
+{
+    quint32 hash = 0;
+    for (int i = 0; i < MATCH_BLOCK_SIZE; ++i) {
+        hash = hash * HASH_MULTIPLIER + static_cast<uchar>(p[i]);
+    }
+    return hash;
+}
+
+void appendInsert(QByteArray &out, const char *data, qint64 length)
+{
+    if (length <= 0) {
+        return;
+    }
+    
+    out.append(OP_INSERT);
+    appendU32(out, static_cast<quint32>(length));
+    out.append(data, static_cast<int>(length));
+}
+
+void appendCopy(QByteArray &out, qint64 baseOffset, qint64 length)
+{
+    out.append(OP_COPY);
+    appendU32(out, static_cast<quint32>(baseOffset));
+    appendU32(out, static_cast<quint32>(length));
+}
+
+} // namespace
+
+QByteArray DeltaPatch::create(const QByteArray &base, const QByteArray &target)
+{
+    const char *b = base.constData();
+    const char *t = target.constData();
+    const qint64 baseSize = base.size();
+    const qint64 targetSize = target.size();
+    
+    QByteArray patch;
+    patch.append(PATCH_MAGIC, PATCH_MAGIC_SIZE);
+    appendU32(patch, static_cast<quint32>(targetSize));
+    
+    // Index aligned base blocks; the first occurrence wins
+    QHash<quint32, qint64> blocks;
+    blocks.reserve(static_cast<int>(baseSize / MATCH_BLOCK_SIZE));
+    for (qint64 pos = 0; pos + MATCH_BLOCK_SIZE <= baseSize; pos += MATCH_BLOCK_SIZE) {
+        quint32 hash = blockHash(b + pos);
+        if (!blocks.contains(hash)) {
+            blocks.insert(hash, pos);
+        }
+    }
+    
+    // Multiplier^(block size - 1), to drop the outgoing byte from the rolling hash
+    quint32 outFactor = 1;
+    for (int i = 1; i < MATCH_BLOCK_SIZE; ++i) {
+        outFactor *= HASH_MULTIPLIER;
+    }
+    
+    qint64 literalStart = 0;
+    qint64 lastShift = 0;   // base offset - target offset of the previous COPY
+    qint64 pos = 0;
+    quint32 hash = targetSize >= MATCH_BLOCK_SIZE ? blockHash(t) : 0;
+    
+    while (pos + MATCH_BLOCK_SIZE <= targetSize) {
+        // Edits rarely move the code after them, so try the previous alignment first
+        qint64 candidate = -1;
+        qint64 aligned = pos + lastShift;
+        if (aligned >= 0 && aligned + MATCH_BLOCK_SIZE <= baseSize &&
+            std::memcmp(b + aligned, t + pos, MATCH_BLOCK_SIZE) == 0) {
+            candidate = aligned;
+        } else {
+            auto it = blocks.constFind(hash);
+            if (it != blocks.constEnd() &&
+                std::memcmp(b + it.value(), t + pos, MATCH_BLOCK_SIZE) == 0) {
+                candidate = it.value();
+            }
+        }
+        
+        if (candidate >= 0) {
+            // Grow the match backwards into pending literals and forwards as far as it goes
+            qint64 back = 0;
+            while (pos - back > literalStart && candidate - back > 0 &&
+                   t[pos - back - 1] == b[candidate - back - 1]) {
+                back++;
+            }
+            
+            qint64 forward = MATCH_BLOCK_SIZE;
+            while (pos + forward < targetSize && candidate + forward < baseSize &&
+                   t[pos + forward] == b[candidate + forward]) {
+                forward++;
+            }
+            
+            qint64 length = back + forward;
+            if (length >= MIN_MATCH_LENGTH) {
+                qint64 matchStart = pos - back;
+                appendInsert(patch, t + literalStart, matchStart - literalStart);
+                appendCopy(patch, candidate - back, length);
+                
+                lastShift = candidate - pos;
+                pos = matchStart + length;
+                literalStart = pos;
+                
+                if (pos + MATCH_BLOCK_SIZE <= targetSize) {
+                    hash = blockHash(t + pos);
+                }
+                continue;
+            }
+        }
+        
+        // Slide the window by one byte
+        if (pos + MATCH_BLOCK_SIZE < targetSize) {
+            hash = (hash - static_cast<uchar>(t[pos]) * outFactor) * HASH_MULTIPLIER +
+                   static_cast<uchar>(t[pos + MATCH_BLOCK_SIZE]);
+        }
+        pos++;
+    }
+    
+    appendInsert(patch, t + literalStart, targetSize - literalStart);
+    return patch;
+}
+
+QByteArray DeltaPatch::apply(const QByteArray &base, const QByteArray &patch)
+{
+    if (patch.size() < PATCH_HEADER_SIZE ||
+        std::memcmp(patch.constData(), PATCH_MAGIC, PATCH_MAGIC_SIZE) != 0) {
+        return QByteArray();
+    }
+    
+    const char *p = patch.constData() + PATCH_HEADER_SIZE;
+    const char *end = patch.constData() + patch.size();
+    const qint64 targetSize = readU32(patch.constData() + PATCH_MAGIC_SIZE);
+    
+    QByteArray target;
+    target.reserve(static_cast<int>(targetSize));
+    
+    while (p < end) {
+        char op = *p++;
+        
+        if (op == OP_COPY) {
+            if (end - p < 8) {
+                return QByteArray();
+            }
+            qint64 offset = readU32(p);
+            qint64 length = readU32(p + 4);
+            p += 8;
+            
+            if (offset + length > base.size() || target.size() + length > targetSize) {
+                return QByteArray();
+            }
+            target.append(base.constData() + offset, static_cast<int>(length));
+        } else if (op == OP_INSERT) {
+            if (end - p < 4) {
+                return QByteArray();
+            }
+            qint64 length = readU32(p);
+            p += 4;
+            
+            if (end - p < length || target.size() + length > targetSize) {
+                return QByteArray();
+            }
+            target.append(p, static_cast<int>(length));
+            p += length;
+        } else {
+            return QByteArray();
+        }
+    }
+    
+    if (target.size() != targetSize) {
+        return QByteArray();
+    }
+    
+    return target;
+}
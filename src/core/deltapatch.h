@@ -0,0 +1,40 @@
+#ifndef DELTAPATCH_H
+#define DELTAPATCH_H
+
+#include <QByteArray>
+
+/**
+ * @brief The DeltaPatch class creates and applies binary delta patches
+ *
+ * A patch rebuilds a target image from a base image the device already has,
+ * as a sequence of COPY (from the base) and INSERT (literal bytes) operations
+ * that the device can apply while streaming the patch into its update slot.
+ *
+ * Patch format (all integers little-endian):
+ * - 4 bytes: Magic "FUDP"
+ * - 4 bytes: Target image size
+ * - Operations until the end of the patch:
+ *   - 0x01 COPY:   4 bytes base offset, 4 bytes length
+ *   - 0x02 INSERT: 4 bytes length, followed by that many literal bytes
+ */
+class DeltaPatch
+{
+public:
+    /**
+     * @brief Create a patch that turns base into target
+     * @param base Image installed on the device
+     * @param target New image
+     * @return Patch data
+     */
+    static QByteArray create(const QByteArray &base, const QByteArray &target);
+
+    /**
+     * @brief Apply a patch to a base image
+     * @param base Image the patch was created against
+     * @param patch Patch data
+     * @return Target image, empty if the patch is malformed or does not fit the base
+     */
+    static QByteArray apply(const QByteArray &base, const QByteArray &patch);
+};
+
+#endif // DELTAPATCH_H
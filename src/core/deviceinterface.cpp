@@ -7,4 +7,130 @@ DeviceInterface::DeviceInterface(QObject *parent)
 
 DeviceInterface::~DeviceInterface()
 {
-} 
\ No newline at end of file
+}
+
+QString DeviceInterface::transportGroup() const
+{
+    return deviceId().section(':', 0, 0);
+}
+
+qint64 DeviceInterface::minChunkSize() const
+{
+    return optimalChunkSize();
+}
+
+qint64 DeviceInterface::maxChunkSize() const
+{
+    return optimalChunkSize();
+}
+
+int DeviceInterface::maxWindowSize() const
+{
+    return 1;
+}
+
+bool DeviceInterface::supportsResume() const
+{
+    return false;
+}
+
+bool DeviceInterface::resumeUpdate(const QString &firmwareHash)
+{
+    Q_UNUSED(firmwareHash);
+    return false;
+}
+
+bool DeviceInterface::isHandshakeComplete() const
+{
+    return true;
+}
+
+bool DeviceInterface::supportsDelta() const
+{
+    return false;
+}
+
+QString DeviceInterface::installedFirmwareHash() const
+{
+    return QString();
+}
+
+bool DeviceInterface::beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                                       qint64 targetSize, qint64 patchSize)
+{
+    Q_UNUSED(baseHash);
+    Q_UNUSED(targetHash);
+    Q_UNUSED(targetSize);
+    Q_UNUSED(patchSize);
+    return false;
+}
+
+QStringList DeviceInterface::supportedCompression() const
+{
+    return QStringList();
+}
+
+bool DeviceInterface::setPayloadCompression(const QString &compression, qint64 blockSize)
+{
+    Q_UNUSED(blockSize);
+    return compression.isEmpty();
+}
+
+bool DeviceInterface::supportsFill() const
+{
+    return false;
+}
+
+int DeviceInterface::erasedValue() const
+{
+    return -1;
+}
+
+bool DeviceInterface::fillFirmwareRange(qint64 offset, qint64 length, quint8 value)
+{
+    Q_UNUSED(offset);
+    Q_UNUSED(length);
+    Q_UNUSED(value);
+    return false;
+}
+
+bool DeviceInterface::reportsWriteReadiness() const
+{
+    return false;
+}
+
+bool DeviceInterface::canSendChunk() const
+{
+    return true;
+}
+
+bool DeviceInterface::pullsFirmware() const
+{
+    return false;
+}
+
+bool DeviceInterface::beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware)
+{
+    Q_UNUSED(firmware);
+    return false;
+}
+
+QString DeviceInterface::frameVariant() const
+{
+    return QString();
+}
+
+bool DeviceInterface::encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(offset);
+    Q_UNUSED(frame);
+    return false;
+}
+
+bool DeviceInterface::sendEncodedChunk(const QByteArray &frame, qint64 offset)
+{
+    Q_UNUSED(frame);
+    Q_UNUSED(offset);
+    return false;
+}
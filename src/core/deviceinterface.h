@@ -1,10 +1,16 @@
 #ifndef DEVICEINTERFACE_H
 #define DEVICEINTERFACE_H
 
+#include "logging.h"
+
 #include <QObject>
 #include <QString>
 #include <QByteArray>
 #include <QMap>
+#include <QStringList>
+#include <memory>
+
+class FirmwarePackage;
 
 /**
  * @brief The DeviceInterface class defines the interface for device communication
@@ -46,6 +52,19 @@ public:
      */
     virtual QMap<QString, QString> deviceInfo() const = 0;
 
+    /**
+     * @brief Get the group of devices sharing this device's physical link
+     *
+     * Devices behind the same USB hub or access point compete for bandwidth,
+     * so fleet updates limit how many of them are updated at once. Devices
+     * that only receive a transmission shared with others, such as multicast
+     * receivers, use no bandwidth of their own and are not limited at all.
+     *
+     * @return Group name (default: the scheme of deviceId(), e.g. "net"),
+     *         empty for devices that are not limited
+     */
+    virtual QString transportGroup() const;
+
     /**
      * @brief Connect to the device
      * @return true if connection successful
@@ -107,6 +126,225 @@ public:
      */
     virtual qint64 optimalChunkSize() const = 0;
 
+    /**
+     * @brief Get the smallest chunk size the device accepts
+     * @return Chunk size in bytes (default: optimalChunkSize())
+     */
+    virtual qint64 minChunkSize() const;
+
+    /**
+     * @brief Get the largest chunk size the device accepts
+     *
+     * If this differs from minChunkSize(), the update job adapts the chunk
+     * size within these bounds to the measured link throughput.
+     *
+     * @return Chunk size in bytes (default: optimalChunkSize())
+     */
+    virtual qint64 maxChunkSize() const;
+
+    /**
+     * @brief Get the maximum number of chunks the device accepts in flight
+     *
+     * Devices returning more than 1 must acknowledge every chunk by offset
+     * through chunkAcknowledged() or chunkRejected(), and must accept
+     * sendFirmwareChunk() calls without waiting for earlier acknowledgements.
+     *
+     * @return Window size in chunks (1 = stop-and-wait)
+     */
+    virtual int maxWindowSize() const;
+
+    /**
+     * @brief Check whether the device can continue an interrupted update
+     * @return true if resumeUpdate() is supported
+     */
+    virtual bool supportsResume() const;
+
+    /**
+     * @brief Start or continue an update of a specific firmware image
+     *
+     * Used instead of beginUpdate() by devices that support resume. The device
+     * reports its last committed offset for this image through
+     * resumeOffsetReported() (0 if it has nothing to resume, in which case it
+     * starts a fresh update) and then changes state as for beginUpdate().
+     *
+     * @param firmwareHash SHA-256 of the firmware image as hex string
+     * @return true if the request was sent
+     */
+    virtual bool resumeUpdate(const QString &firmwareHash);
+
+    /**
+     * @brief Check whether the device has reported its capabilities
+     *
+     * Capability queries such as maxWindowSize() or supportsResume() are
+     * only meaningful once this returns true; handshakeCompleted() is
+     * emitted when it becomes true.
+     *
+     * @return true if the connection handshake has finished (default: true)
+     */
+    virtual bool isHandshakeComplete() const;
+
+    /**
+     * @brief Check whether the device can apply delta patches
+     * @return true if beginDeltaUpdate() is supported
+     */
+    virtual bool supportsDelta() const;
+
+    /**
+     * @brief Get the hash of the firmware image currently installed
+     * @return SHA-256 as hex string, empty if unknown
+     */
+    virtual QString installedFirmwareHash() const;
+
+    /**
+     * @brief Start an update that sends a delta patch instead of the full image
+     *
+     * The chunks that follow carry patch data at patch offsets. The device
+     * rebuilds the target image from its installed image and the patch, and
+     * changes state as for beginUpdate().
+     *
+     * @param baseHash SHA-256 of the installed image the patch applies to
+     * @param targetHash SHA-256 of the resulting image
+     * @param targetSize Size of the resulting image in bytes
+     * @param patchSize Size of the patch in bytes
+     * @return true if the request was sent
+     */
+    virtual bool beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                                  qint64 targetSize, qint64 patchSize);
+
+    /**
+     * @brief Get the payload compressions the device can decode
+     * @return Algorithm names as used by FirmwarePackage::compression() (default: none)
+     */
+    virtual QStringList supportedCompression() const;
+
+    /**
+     * @brief Select the encoding of the next update's payload
+     *
+     * Called before beginUpdate() or resumeUpdate(). With a compression set,
+     * chunks carry the package's compressed block stream at stream offsets
+     * and the device decompresses it block by block.
+     *
+     * @param compression Algorithm name, empty for the uncompressed image
+     * @param blockSize Uncompressed size of each block
+     * @return true if the device accepted the encoding
+     */
+    virtual bool setPayloadCompression(const QString &compression, qint64 blockSize);
+
+    /**
+     * @brief Check whether the device can fill ranges of the image itself
+     * @return true if fillFirmwareRange() is supported
+     */
+    virtual bool supportsFill() const;
+
+    /**
+     * @brief Get the value the device's update area reads as after erasing
+     *
+     * Ranges holding this value are skipped without a fill command.
+     *
+     * @return Byte value, or -1 if the update area is not erased up front
+     */
+    virtual int erasedValue() const;
+
+    /**
+     * @brief Fill a range of the firmware with a single byte value
+     *
+     * Used instead of sendFirmwareChunk() for uniform regions such as
+     * padding between partitions. Ranges never overlap chunks, so fills and
+     * chunks may be processed in any order.
+     *
+     * @param offset Offset in firmware
+     * @param length Number of bytes
+     * @param value Fill value
+     * @return true if the command was sent
+     */
+    virtual bool fillFirmwareRange(qint64 offset, qint64 length, quint8 value);
+
+    /**
+     * @brief Check whether the device paces uploads with readyForMoreData()
+     *
+     * Jobs send the next chunk when the signal arrives instead of on a fixed
+     * interval. Devices returning true must emit it whenever they can take
+     * more data again: after a command is acknowledged and after the
+     * transport has drained queued bytes.
+     *
+     * In stop-and-wait mode (maxWindowSize() of 1) the signal must not be
+     * emitted while a chunk awaits its answer, nor after a timeout or an
+     * error. Such devices answer every chunk through chunkAcknowledged() or
+     * chunkRejected(), including chunks that time out; jobs resend rejected
+     * chunks and adapt the chunk size to the acknowledgement times. Devices
+     * returning false get a fixed chunk size.
+     *
+     * @return true if readyForMoreData() is emitted (default: false)
+     */
+    virtual bool reportsWriteReadiness() const;
+
+    /**
+     * @brief Check whether the device can take a chunk right now
+     *
+     * Devices may hold chunks back for a while, e.g. while the link is being
+     * reconfigured. Jobs do not count this as a failed send; they wait for
+     * the next readyForMoreData(), so devices returning false here must emit
+     * it once they can take chunks again.
+     *
+     * @return false if chunks would be refused for now (default: true)
+     */
+    virtual bool canSendChunk() const;
+
+    /**
+     * @brief Check whether the device downloads firmware itself
+     * @return true if updates go through beginPullUpdate() instead of chunks
+     */
+    virtual bool pullsFirmware() const;
+
+    /**
+     * @brief Have the device download a firmware image
+     *
+     * Used instead of beginUpdate() by pull devices. The device changes to
+     * Updating once it accepted the request, reports download progress
+     * through pullProgress() and changes to Rebooting once it has the whole
+     * image; no chunks are sent and finalizeUpdate() is not called.
+     *
+     * @param firmware Package to download; shared so it stays available while served
+     * @return true if the request was sent
+     */
+    virtual bool beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware);
+
+    /**
+     * @brief Get the wire format of this device's chunk frames
+     *
+     * Devices with the same variant encode a chunk into identical bytes, so
+     * jobs updating several of them from one payload share the encoded
+     * frames instead of building them per device.
+     *
+     * @return Variant name, empty if frames cannot be shared (default)
+     */
+    virtual QString frameVariant() const;
+
+    /**
+     * @brief Encode a chunk into the frame sendFirmwareChunk() would write
+     *
+     * The frame is built in place, reusing the storage the array already
+     * has, so encoding into the same buffer again allocates nothing.
+     *
+     * @param data Data chunk
+     * @param offset Offset in firmware
+     * @param frame Receives the encoded frame
+     * @return true if encoded, false if the chunk does not fit into a frame or
+     *         the device does not support frame sharing
+     */
+    virtual bool encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame);
+
+    /**
+     * @brief Send a chunk already encoded by encodeChunkFrame()
+     *
+     * The frame may be shared with other jobs and must not be modified.
+     *
+     * @param frame Encoded frame
+     * @param offset Offset in firmware
+     * @return true if sent successfully
+     */
+    virtual bool sendEncodedChunk(const QByteArray &frame, qint64 offset);
+
 signals:
     /**
      * @brief Emitted when connection status changes
@@ -120,12 +358,60 @@ signals:
      */
     void deviceStateChanged(DeviceState state);
 
+    /**
+     * @brief Emitted when the device confirms a chunk by offset
+     * @param offset Offset of the acknowledged chunk
+     */
+    void chunkAcknowledged(qint64 offset);
+
+    /**
+     * @brief Emitted when the device reports a chunk as bad or missing,
+     *        or did not answer it in time
+     * @param offset Offset of the chunk to retransmit
+     */
+    void chunkRejected(qint64 offset);
+
+    /**
+     * @brief Emitted in reply to resumeUpdate()
+     * @param offset Number of firmware bytes the device has committed
+     */
+    void resumeOffsetReported(qint64 offset);
+
+    /**
+     * @brief Emitted when the device has reported its capabilities
+     */
+    void handshakeCompleted();
+
+    /**
+     * @brief Emitted when the device can take more firmware data
+     * @param credit Number of bytes the transport accepts without queueing
+     */
+    void readyForMoreData(qint64 credit);
+
+    /**
+     * @brief Emitted while a pull device downloads its firmware
+     * @param bytes Bytes of the image the device has received
+     * @param total Image size
+     */
+    void pullProgress(qint64 bytes, qint64 total);
+
     /**
      * @brief Emitted for log messages
      * @param level Log level (0=debug, 1=info, 2=warning, 3=error)
      * @param message Log message
      */
     void logMessage(int level, const QString &message);
+
+    /**
+     * @brief Emitted for structured log events
+     *
+     * Used for frequent messages such as per-chunk or per-response output.
+     * Emitters check FLASHUP_LOG_ENABLED() first, so disabled events are
+     * never built.
+     *
+     * @param event Event with typed fields
+     */
+    void logEvent(const LogEvent &event);
 };
 
 #endif // DEVICEINTERFACE_H 
\ No newline at end of file
@@ -1,48 +1,164 @@
 #include "firmwarepackage.h"
 #include "cryptoutils.h"
+#include "hashcache.h"
 
 #include <QDebug>
 #include <QJsonDocument>
 #include <QJsonObject>
+#include <QJsonArray>
 #include <QCryptographicHash>
+#include <QThread>
+#include <QThreadPool>
+#include <QtEndian>
+#include <atomic>
+#include <cstring>
 #include <stdexcept>
 
 // Magic signature to identify firmware files
 static constexpr char FIRMWARE_MAGIC[] = "FLASHUP";
 
-FirmwarePackage::FirmwarePackage(const QString &filePath)
-    : m_filePath(filePath),
-      m_dataOffset(0),
-      m_dataSize(0)
+// Bounds for the hashing read buffer
+const qint64 MIN_HASH_BLOCK_SIZE = 4 * 1024;
+const qint64 MAX_HASH_BLOCK_SIZE = 16 * 1024 * 1024;
+
+// Payload bytes covered by each recorded chunk digest
+const qint64 HASH_CHUNK_SIZE = 64 * 1024;
+
+// Hash tree limits and node domain separator
+const qint64 MIN_TREE_CHUNK_SIZE = 4 * 1024;
+const qint64 MAX_TREE_CHUNK_SIZE = 16 * 1024 * 1024;
+const char MERKLE_NODE_PREFIX = 0x01;
+const int SHA256_DIGEST_SIZE = 32;
+
+// Compression block limits
+const qint64 MIN_COMPRESSION_BLOCK_SIZE = 4 * 1024;
+const qint64 MAX_COMPRESSION_BLOCK_SIZE = 16 * 1024 * 1024;
+
+// Decoded blocks kept for readers at different offsets, e.g. the jobs of a fleet
+const qint64 DECODED_BLOCK_CACHE_BYTES = 32 * 1024 * 1024;
+const int MIN_DECODED_BLOCKS = 2;
+const int MAX_DECODED_BLOCKS = 16;
+
+// Uniform fill detection: blocks checked one at a time, read in larger windows
+const qint64 FILL_BLOCK_SIZE = 4 * 1024;
+const qint64 FILL_SCAN_WINDOW = 64 * FILL_BLOCK_SIZE;
+
+// How often parallel verification reports progress
+const int PARALLEL_PROGRESS_INTERVAL_MS = 50;
+
+static bool isUniform(const char *data, qint64 size, uchar value)
 {
-    m_file = std::make_unique<QFile>(filePath);
-    
-    if (!m_file->open(QIODevice::ReadOnly)) {
-        throw std::runtime_error(QString("Failed to open firmware file: %1").arg(m_file->errorString()).toStdString());
+    // Compare a word at a time; the compiler vectorizes this loop
+    const quint64 pattern = Q_UINT64_C(0x0101010101010101) * value;
+    qint64 i = 0;
+    for (; i + 8 <= size; i += 8) {
+        quint64 word;
+        std::memcpy(&word, data + i, sizeof(word));
+        if (word != pattern) {
+            return false;
+        }
     }
     
-    // Verify magic signature
-    QByteArray magic = m_file->read(7);
-    if (magic != FIRMWARE_MAGIC) {
-        throw std::runtime_error("Invalid firmware file format");
+    for (; i < size; ++i) {
+        if (static_cast<uchar>(data[i]) != value) {
+            return false;
+        }
     }
     
-    // Read metadata and validate
-    parseMetadata();
-    calculateHash();
+    return true;
+}
+
+static bool readInto(QFile *file, qint64 size, QByteArray *buffer)
+{
+    // Reserving also keeps the storage of a reused buffer when it shrinks
+    buffer->reserve(static_cast<int>(size));
+    buffer->resize(static_cast<int>(size));
     
-    if (!verify()) {
-        throw std::runtime_error("Firmware validation failed");
+    qint64 n = file->read(buffer->data(), size);
+    buffer->resize(static_cast<int>(qMax<qint64>(n, 0)));
+    return n > 0;
+}
+
+static void scanFillBlocks(const char *data, qint64 size, qint64 baseOffset,
+                           QVector<FirmwarePackage::Segment> *fills)
+{
+    for (qint64 pos = 0; pos < size; pos += FILL_BLOCK_SIZE) {
+        qint64 length = qMin(FILL_BLOCK_SIZE, size - pos);
+        uchar value = static_cast<uchar>(data[pos]);
+        if (!isUniform(data + pos, length, value)) {
+            continue;
+        }
+        
+        // Merge runs of blocks with the same fill value
+        qint64 offset = baseOffset + pos;
+        if (!fills->isEmpty() && fills->last().fillValue == value &&
+            fills->last().offset + fills->last().length == offset) {
+            fills->last().length += length;
+            continue;
+        }
+        
+        FirmwarePackage::Segment fill;
+        fill.offset = offset;
+        fill.length = length;
+        fill.fill = true;
+        fill.fillValue = value;
+        fills->append(fill);
     }
 }
 
+FirmwarePackage::FirmwarePackage(const QString &filePath, AccessMode mode)
+    : m_filePath(filePath),
+      m_dataOffset(0),
+      m_dataSize(0),
+      m_chunkHashSize(HASH_CHUNK_SIZE),
+      m_hasHashTree(false),
+      m_compressionBlockSize(0),
+      m_storedSize(0),
+      m_loadedFromCache(false),
+      m_accessMode(Buffered),
+      m_hashBlockSize(0),
+      m_mappedData(nullptr),
+      m_blockUses(0)
+{
+    LoadOptions options;
+    options.accessMode = mode;
+    load(options);
+}
+
+FirmwarePackage::FirmwarePackage(const QString &filePath, const LoadOptions &options)
+    : m_filePath(filePath),
+      m_dataOffset(0),
+      m_dataSize(0),
+      m_chunkHashSize(HASH_CHUNK_SIZE),
+      m_hasHashTree(false),
+      m_compressionBlockSize(0),
+      m_storedSize(0),
+      m_loadedFromCache(false),
+      m_accessMode(Buffered),
+      m_hashBlockSize(0),
+      m_mappedData(nullptr),
+      m_blockUses(0)
+{
+    load(options);
+}
+
 FirmwarePackage::~FirmwarePackage()
 {
+    if (m_mappedData) {
+        m_file->unmap(m_mappedData);
+        m_mappedData = nullptr;
+    }
+    
     if (m_file && m_file->isOpen()) {
         m_file->close();
     }
 }
 
+FirmwarePackage::AccessMode FirmwarePackage::accessMode() const
+{
+    return m_accessMode;
+}
+
 QMap<QString, QString> FirmwarePackage::metadata() const
 {
     return m_metadata;
@@ -50,10 +166,21 @@ QMap<QString, QString> FirmwarePackage::metadata() const
 
 QByteArray FirmwarePackage::data() const
 {
+    if (!m_compression.isEmpty()) {
+        QByteArray image;
+        return decodeRange(0, m_dataSize, &image) ? image : QByteArray();
+    }
+    
+    if (m_mappedData) {
+        return QByteArray::fromRawData(reinterpret_cast<const char *>(m_mappedData),
+                                       static_cast<int>(m_dataSize));
+    }
+    
     if (!m_file || !m_file->isOpen()) {
         return QByteArray();
     }
     
+    QMutexLocker locker(&m_fileMutex);
     m_file->seek(m_dataOffset);
     return m_file->read(m_dataSize);
 }
@@ -77,12 +204,12 @@ bool FirmwarePackage::verify() const
     // 4. Device-specific validation
     
     // Current implementation only verifies data integrity via SHA-256 hash
-    QByteArray firmware = data();
-    QByteArray calculatedHash = QCryptographicHash::hash(firmware, QCryptographicHash::Sha256);
-    QString calculatedHashHex = calculatedHash.toHex();
+    if (m_hasHashTree) {
+        QString imageHash;
+        return verifyChunksParallel(ProgressCallback(), &imageHash) && imageHash == m_sha256;
+    }
     
-    // Check if calculated hash matches the one in metadata
-    return (calculatedHashHex == m_sha256);
+    return hashPayload(ProgressCallback(), nullptr) == m_sha256;
 }
 
 qint64 FirmwarePackage::size() const
@@ -92,7 +219,13 @@ qint64 FirmwarePackage::size() const
 
 QByteArray FirmwarePackage::getChunk(qint64 offset, qint64 size) const
 {
-    if (!m_file || !m_file->isOpen() || offset >= m_dataSize) {
+    QByteArray buffer;
+    return readChunk(offset, size, &buffer);
+}
+
+QByteArray FirmwarePackage::readChunk(qint64 offset, qint64 size, QByteArray *buffer) const
+{
+    if (offset < 0 || offset >= m_dataSize || size <= 0) {
         return QByteArray();
     }
     
@@ -101,8 +234,240 @@ QByteArray FirmwarePackage::getChunk(qint64 offset, qint64 size) const
         size = m_dataSize - offset;
     }
     
-    m_file->seek(m_dataOffset + offset);
-    return m_file->read(size);
+    if (!m_compression.isEmpty()) {
+        return decodeRange(offset, size, buffer) ? *buffer : QByteArray();
+    }
+    
+    return readStored(offset, size, buffer);
+}
+
+QVector<FirmwarePackage::Segment> FirmwarePackage::segments() const
+{
+    QMutexLocker locker(&m_segmentsMutex);
+    if (!m_segments.isEmpty()) {
+        return m_segments;
+    }
+    
+    QVector<Segment> fills = m_declaredFills;
+    for (const Segment &fill : qAsConst(m_declaredFills)) {
+        if (!checkFillSegment(fill)) {
+            qWarning() << "Declared sparse ranges do not match the firmware data, scanning instead";
+            fills.clear();
+            break;
+        }
+    }
+    
+    if (fills.isEmpty()) {
+        fills = scanFillSegments();
+    }
+    
+    // Fill the gaps between fill ranges with data segments
+    qint64 offset = 0;
+    for (const Segment &fill : qAsConst(fills)) {
+        if (fill.offset > offset) {
+            Segment data;
+            data.offset = offset;
+            data.length = fill.offset - offset;
+            m_segments.append(data);
+        }
+        m_segments.append(fill);
+        offset = fill.offset + fill.length;
+    }
+    
+    if (offset < m_dataSize) {
+        Segment data;
+        data.offset = offset;
+        data.length = m_dataSize - offset;
+        m_segments.append(data);
+    }
+    
+    return m_segments;
+}
+
+QVector<FirmwarePackage::Segment> FirmwarePackage::findFillSegments(const QByteArray &image)
+{
+    QVector<Segment> fills;
+    scanFillBlocks(image.constData(), image.size(), 0, &fills);
+    return fills;
+}
+
+QString FirmwarePackage::compression() const
+{
+    return m_compression;
+}
+
+qint64 FirmwarePackage::compressionBlockSize() const
+{
+    return m_compressionBlockSize;
+}
+
+qint64 FirmwarePackage::encodedSize() const
+{
+    return m_storedSize;
+}
+
+QByteArray FirmwarePackage::getEncodedChunk(qint64 offset, qint64 size) const
+{
+    QByteArray buffer;
+    return readEncodedChunk(offset, size, &buffer);
+}
+
+QByteArray FirmwarePackage::readEncodedChunk(qint64 offset, qint64 size, QByteArray *buffer) const
+{
+    if (offset < 0 || offset >= m_storedSize || size <= 0) {
+        return QByteArray();
+    }
+    
+    if (offset + size > m_storedSize) {
+        size = m_storedSize - offset;
+    }
+    
+    return readStored(offset, size, buffer);
+}
+
+bool FirmwarePackage::imageFileRange(QString *filePath, qint64 *offset) const
+{
+    if (!m_compression.isEmpty()) {
+        return false;
+    }
+    
+    *filePath = m_filePath;
+    *offset = m_dataOffset;
+    return true;
+}
+
+qint64 FirmwarePackage::chunkHashSize() const
+{
+    return m_chunkHashSize;
+}
+
+int FirmwarePackage::chunkHashCount() const
+{
+    return m_chunkHashes.size();
+}
+
+QVector<QByteArray> FirmwarePackage::chunkHashes() const
+{
+    return m_chunkHashes;
+}
+
+bool FirmwarePackage::hasHashTree() const
+{
+    return m_hasHashTree;
+}
+
+bool FirmwarePackage::verifyChunk(int index, QByteArray *buffer) const
+{
+    if (index < 0 || index >= m_chunkHashes.size()) {
+        return false;
+    }
+    
+    qint64 offset = index * m_chunkHashSize;
+    QByteArray scratch;
+    QByteArray chunk = readChunk(offset, m_chunkHashSize, buffer ? buffer : &scratch);
+    
+    return !chunk.isEmpty() &&
+           QCryptographicHash::hash(chunk, QCryptographicHash::Sha256) == m_chunkHashes.at(index);
+}
+
+QByteArray FirmwarePackage::merkleRoot(const QVector<QByteArray> &leaves)
+{
+    if (leaves.isEmpty()) {
+        return QByteArray();
+    }
+    
+    QVector<QByteArray> level = leaves;
+    
+    while (level.size() > 1) {
+        QVector<QByteArray> parents;
+        parents.reserve((level.size() + 1) / 2);
+        
+        for (int i = 0; i < level.size(); i += 2) {
+            if (i + 1 == level.size()) {
+                // Odd node out: promote unchanged
+                parents.append(level.at(i));
+                continue;
+            }
+            
+            QCryptographicHash node(QCryptographicHash::Sha256);
+            node.addData(&MERKLE_NODE_PREFIX, 1);
+            node.addData(level.at(i));
+            node.addData(level.at(i + 1));
+            parents.append(node.result());
+        }
+        
+        level = parents;
+    }
+    
+    return level.first();
+}
+
+QVector<FirmwarePackage::Delta> FirmwarePackage::deltas() const
+{
+    return m_deltas;
+}
+
+int FirmwarePackage::findDelta(const QString &baseHash) const
+{
+    for (int i = 0; i < m_deltas.size(); ++i) {
+        if (m_deltas.at(i).baseSha256.compare(baseHash, Qt::CaseInsensitive) == 0) {
+            return i;
+        }
+    }
+    
+    return -1;
+}
+
+QByteArray FirmwarePackage::getDeltaChunk(int index, qint64 offset, qint64 size) const
+{
+    QByteArray buffer;
+    return readDeltaChunk(index, offset, size, &buffer);
+}
+
+QByteArray FirmwarePackage::readDeltaChunk(int index, qint64 offset, qint64 size, QByteArray *buffer) const
+{
+    if (index < 0 || index >= m_deltas.size()) {
+        return QByteArray();
+    }
+    
+    const Delta &delta = m_deltas.at(index);
+    if (offset < 0 || offset >= delta.size || size <= 0) {
+        return QByteArray();
+    }
+    
+    if (offset + size > delta.size) {
+        size = delta.size - offset;
+    }
+    
+    // Patches lie outside the mapped image and are small; read them through the file
+    QMutexLocker locker(&m_fileMutex);
+    m_file->seek(delta.fileOffset + offset);
+    return readInto(m_file.get(), size, buffer) ? *buffer : QByteArray();
+}
+
+bool FirmwarePackage::verifyDelta(int index) const
+{
+    if (index < 0 || index >= m_deltas.size()) {
+        return false;
+    }
+    
+    const Delta &delta = m_deltas.at(index);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    
+    for (qint64 offset = 0; offset < delta.size; offset += m_hashBlockSize) {
+        QByteArray block = getDeltaChunk(index, offset, m_hashBlockSize);
+        if (block.isEmpty()) {
+            return false;
+        }
+        hash.addData(block);
+    }
+    
+    return QString::fromLatin1(hash.result().toHex()) == delta.sha256;
+}
+
+bool FirmwarePackage::loadedFromCache() const
+{
+    return m_loadedFromCache;
 }
 
 int FirmwarePackage::chunkCount(qint64 chunkSize) const
@@ -121,7 +486,7 @@ void FirmwarePackage::parseMetadata()
     // - 7 bytes: Magic "FLASHUP"
     // - 4 bytes: Metadata size (N)
     // - N bytes: JSON metadata
-    // - Rest: Binary firmware data
+    // - Rest: Binary firmware data, followed by any delta patches
     
     m_file->seek(7); // Skip magic
     
@@ -131,11 +496,8 @@ void FirmwarePackage::parseMetadata()
         throw std::runtime_error("Invalid firmware file format");
     }
     
-    // Convert to integer (little-endian)
-    quint32 metadataSize = static_cast<quint32>(sizeData[0]) |
-                          (static_cast<quint32>(sizeData[1]) << 8) |
-                          (static_cast<quint32>(sizeData[2]) << 16) |
-                          (static_cast<quint32>(sizeData[3]) << 24);
+    // Convert to integer (little-endian); bytes are unsigned, or sizes from 128 on would sign-extend
+    quint32 metadataSize = qFromLittleEndian<quint32>(reinterpret_cast<const uchar *>(sizeData.constData()));
     
     // Read metadata JSON
     QByteArray metadataJson = m_file->read(metadataSize);
@@ -151,8 +513,11 @@ void FirmwarePackage::parseMetadata()
     
     QJsonObject obj = doc.object();
     
-    // Extract metadata fields
+    // Extract metadata fields; structured values are parsed separately below
     for (auto it = obj.constBegin(); it != obj.constEnd(); ++it) {
+        if (it.value().isObject() || it.value().isArray()) {
+            continue;
+        }
         m_metadata[it.key()] = it.value().toString();
     }
     
@@ -175,21 +540,599 @@ void FirmwarePackage::parseMetadata()
     m_dataOffset = 7 + 4 + metadataSize;
     m_dataSize = m_file->size() - m_dataOffset;
     
+    // Optional delta patches are stored after the image
+    if (obj.contains("deltas")) {
+        parseDeltas(obj["deltas"].toArray(), m_file->size());
+        for (const Delta &delta : qAsConst(m_deltas)) {
+            m_dataSize -= delta.size;
+        }
+    }
+    
+    // A compressed image is smaller on disk than the image it describes
+    m_storedSize = m_dataSize;
+    if (obj.contains("compression") && m_storedSize > 0) {
+        parseCompression(obj);
+    }
+    
     if (m_dataSize <= 0) {
         throw std::runtime_error("Firmware file contains no data");
     }
+    
+    // Optional uniform fill ranges, otherwise found by scanning on first use
+    if (obj.contains("sparse")) {
+        parseSparse(obj["sparse"].toArray());
+    }
+    
+    // Optional per-chunk hash table with its own Merkle root
+    if (obj.contains("hash_tree")) {
+        parseHashTree(obj["hash_tree"].toObject());
+    }
+}
+
+void FirmwarePackage::parseHashTree(const QJsonObject &tree)
+{
+    // Hash tree format:
+    // "hash_tree": {
+    //     "chunk_size": <bytes per chunk, power of two>,
+    //     "chunks": [<hex SHA-256 of each chunk>, ...],
+    //     "root": <hex Merkle root of the chunk digests>
+    // }
+    // The manifest's sha256 stays the hash of the whole image
+    qint64 chunkSize = static_cast<qint64>(tree["chunk_size"].toDouble());
+    QJsonArray chunks = tree["chunks"].toArray();
+    
+    if (chunkSize < MIN_TREE_CHUNK_SIZE || chunkSize > MAX_TREE_CHUNK_SIZE ||
+        (chunkSize & (chunkSize - 1)) != 0) {
+        throw std::runtime_error("Invalid hash tree chunk size");
+    }
+    
+    // Parallel verification hashes whole chunks out of each decoded block
+    if (!m_compression.isEmpty() && m_compressionBlockSize < chunkSize) {
+        throw std::runtime_error("Compression block size is smaller than the hash tree chunk size");
+    }
+    
+    m_chunkHashSize = chunkSize;
+    if (chunks.size() != chunkCount(chunkSize)) {
+        throw std::runtime_error("Hash tree does not cover the firmware data");
+    }
+    
+    m_chunkHashes.clear();
+    m_chunkHashes.reserve(chunks.size());
+    for (const QJsonValue &value : chunks) {
+        QByteArray digest = QByteArray::fromHex(value.toString().toLatin1());
+        if (digest.size() != SHA256_DIGEST_SIZE) {
+            throw std::runtime_error("Invalid hash tree entry");
+        }
+        m_chunkHashes.append(digest);
+    }
+    
+    // The table is only trusted if it hashes up to the manifest root
+    QString root = tree["root"].toString().toLower();
+    if (root.isEmpty() || QString::fromLatin1(merkleRoot(m_chunkHashes).toHex()) != root) {
+        throw std::runtime_error("Hash tree does not match its root");
+    }
+    
+    m_hasHashTree = true;
+}
+
+void FirmwarePackage::parseDeltas(const QJsonArray &deltas, qint64 payloadEnd)
+{
+    // Delta format:
+    // "deltas": [
+    //     { "base_sha256": <hex>, "sha256": <hex of patch>, "size": <patch bytes> }, ...
+    // ]
+    // Patch data follows the image in the same order
+    qint64 totalSize = 0;
+    
+    m_deltas.clear();
+    m_deltas.reserve(deltas.size());
+    for (const QJsonValue &value : deltas) {
+        QJsonObject object = value.toObject();
+        
+        Delta delta;
+        delta.baseSha256 = object["base_sha256"].toString().toLower();
+        delta.sha256 = object["sha256"].toString().toLower();
+        delta.size = static_cast<qint64>(object["size"].toDouble());
+        
+        if (QByteArray::fromHex(delta.baseSha256.toLatin1()).size() != SHA256_DIGEST_SIZE ||
+            QByteArray::fromHex(delta.sha256.toLatin1()).size() != SHA256_DIGEST_SIZE ||
+            delta.size <= 0) {
+            throw std::runtime_error("Invalid delta patch entry");
+        }
+        
+        totalSize += delta.size;
+        m_deltas.append(delta);
+    }
+    
+    qint64 offset = payloadEnd - totalSize;
+    if (offset <= m_dataOffset) {
+        throw std::runtime_error("Delta patches do not fit in the firmware file");
+    }
+    
+    for (Delta &delta : m_deltas) {
+        delta.fileOffset = offset;
+        offset += delta.size;
+    }
 }
 
-void FirmwarePackage::calculateHash()
+void FirmwarePackage::parseCompression(const QJsonObject &metadata)
 {
-    // TODO: Implement full hash verification
-    // 1. Calculate SHA-256 hash of firmware data
-    // 2. Compare with hash in metadata
-    // 3. Add hash verification to update process
-    // 4. Implement hash caching for large files
+    // Compression format:
+    // "compression": "zlib",
+    // "compression_block_size": <uncompressed bytes per block, power of two>,
+    // "image_size": <uncompressed image size>,
+    // "compressed_blocks": [<stored size of each block>, ...]
+    // Each block is an independent zlib stream; blocks are stored back to back
+    m_compression = metadata["compression"].toString();
+    if (m_compression != "zlib") {
+        throw std::runtime_error(QString("Unsupported firmware compression: %1").arg(m_compression).toStdString());
+    }
     
-    // Current implementation only verifies hash field exists
+    qint64 blockSize = static_cast<qint64>(metadata["compression_block_size"].toDouble());
+    if (blockSize < MIN_COMPRESSION_BLOCK_SIZE || blockSize > MAX_COMPRESSION_BLOCK_SIZE ||
+        (blockSize & (blockSize - 1)) != 0) {
+        throw std::runtime_error("Invalid compression block size");
+    }
+    
+    qint64 imageSize = static_cast<qint64>(metadata["image_size"].toDouble());
+    QJsonArray blocks = metadata["compressed_blocks"].toArray();
+    if (imageSize <= 0 || blocks.size() != (imageSize + blockSize - 1) / blockSize) {
+        throw std::runtime_error("Compressed blocks do not cover the firmware image");
+    }
+    
+    m_blockOffsets.clear();
+    m_blockOffsets.reserve(blocks.size() + 1);
+    m_blockOffsets.append(0);
+    for (const QJsonValue &value : blocks) {
+        qint64 size = static_cast<qint64>(value.toDouble());
+        if (size <= 0) {
+            throw std::runtime_error("Invalid compressed block size");
+        }
+        m_blockOffsets.append(m_blockOffsets.last() + size);
+    }
+    
+    if (m_blockOffsets.last() != m_storedSize) {
+        throw std::runtime_error("Compressed blocks do not match the firmware data");
+    }
+    
+    m_compressionBlockSize = blockSize;
+    m_decodedBlocks.resize(static_cast<int>(qBound<qint64>(MIN_DECODED_BLOCKS,
+                                                           DECODED_BLOCK_CACHE_BYTES / blockSize,
+                                                           MAX_DECODED_BLOCKS)));
+    m_dataSize = imageSize;
+}
+
+void FirmwarePackage::parseSparse(const QJsonArray &ranges)
+{
+    // Sparse format:
+    // "sparse": [
+    //     { "offset": <bytes>, "length": <bytes>, "fill": <byte value> }, ...
+    // ]
+    // Ranges are in order and do not overlap
+    qint64 end = 0;
+    
+    m_declaredFills.clear();
+    m_declaredFills.reserve(ranges.size());
+    for (const QJsonValue &value : ranges) {
+        QJsonObject object = value.toObject();
+        
+        Segment fill;
+        fill.offset = static_cast<qint64>(object["offset"].toDouble());
+        fill.length = static_cast<qint64>(object["length"].toDouble());
+        fill.fill = true;
+        
+        int fillValue = object["fill"].toInt(-1);
+        if (fill.offset < end || fill.length <= 0 || fill.offset + fill.length > m_dataSize ||
+            fillValue < 0 || fillValue > 255) {
+            throw std::runtime_error("Invalid sparse range");
+        }
+        
+        fill.fillValue = static_cast<quint8>(fillValue);
+        end = fill.offset + fill.length;
+        m_declaredFills.append(fill);
+    }
+}
+
+void FirmwarePackage::calculateHash(const ProgressCallback &progress, HashCache *hashCache)
+{
     if (!m_metadata.contains("sha256") || m_metadata["sha256"].isEmpty()) {
         throw std::runtime_error("Missing SHA-256 hash in firmware metadata");
     }
-} 
\ No newline at end of file
+    
+    HashCache::FileIdentity identity = HashCache::identityOf(*m_file);
+    
+    // An unchanged file that already verified against this manifest needs no rehash
+    if (hashCache) {
+        HashCache::Entry entry;
+        if (hashCache->lookup(m_filePath, identity, &entry) &&
+            entry.sha256 == m_sha256 &&
+            entry.chunkSize == m_chunkHashSize &&
+            entry.chunkHashes.size() == chunkCount(m_chunkHashSize) &&
+            (!m_hasHashTree || entry.chunkHashes == m_chunkHashes)) {
+            m_calculatedHash = entry.sha256;
+            m_chunkHashes = entry.chunkHashes;
+            m_loadedFromCache = true;
+            return;
+        }
+    }
+    
+    if (m_hasHashTree) {
+        // Chunk digests come from the manifest next to sha256, which is independent
+        // of the tree root; check the chunks in parallel and the image as a whole
+        QString imageHash;
+        m_calculatedHash = verifyChunksParallel(progress, &imageHash) ? imageHash : QString();
+    } else {
+        m_chunkHashes.clear();
+        m_calculatedHash = hashPayload(progress, &m_chunkHashes);
+    }
+    
+    // Only remember results that verified and whose file did not change meanwhile
+    if (hashCache && m_calculatedHash == m_sha256 &&
+        HashCache::identityOf(*m_file) == identity) {
+        HashCache::Entry entry;
+        entry.sha256 = m_calculatedHash;
+        entry.chunkSize = m_chunkHashSize;
+        entry.chunkHashes = m_chunkHashes;
+        hashCache->store(m_filePath, identity, entry);
+    }
+}
+
+QString FirmwarePackage::hashPayload(const ProgressCallback &progress, QVector<QByteArray> *chunkHashes) const
+{
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    QCryptographicHash chunkHash(QCryptographicHash::Sha256);
+    qint64 chunkFill = 0;
+    qint64 processed = 0;
+    
+    // Stream through a single reusable buffer so memory stays bounded. This
+    // deliberately avoids the mapping, which would fault the whole image in.
+    // Compressed images are hashed one decoded block at a time instead.
+    const bool compressed = !m_compression.isEmpty();
+    QByteArray buffer;
+    if (!compressed) {
+        buffer = QByteArray(static_cast<int>(m_hashBlockSize), Qt::Uninitialized);
+    }
+    
+    while (processed < m_dataSize) {
+        qint64 bytesRead;
+        if (compressed) {
+            if (!decodeBlock(static_cast<int>(processed / m_compressionBlockSize), &buffer)) {
+                return QString();
+            }
+            bytesRead = buffer.size();
+        } else {
+            qint64 blockSize = qMin(m_hashBlockSize, m_dataSize - processed);
+            QMutexLocker locker(&m_fileMutex);
+            m_file->seek(m_dataOffset + processed);
+            bytesRead = m_file->read(buffer.data(), blockSize);
+        }
+        
+        if (bytesRead <= 0) {
+            return QString();
+        }
+        
+        hash.addData(buffer.constData(), static_cast<int>(bytesRead));
+        processed += bytesRead;
+        
+        // Record per-chunk digests in the same pass
+        if (chunkHashes) {
+            const char *p = buffer.constData();
+            qint64 remaining = bytesRead;
+            while (remaining > 0) {
+                qint64 take = qMin(remaining, m_chunkHashSize - chunkFill);
+                chunkHash.addData(p, static_cast<int>(take));
+                chunkFill += take;
+                p += take;
+                remaining -= take;
+                
+                if (chunkFill == m_chunkHashSize) {
+                    chunkHashes->append(chunkHash.result());
+                    chunkHash.reset();
+                    chunkFill = 0;
+                }
+            }
+        }
+        
+        if (progress) {
+            progress(processed, m_dataSize);
+        }
+    }
+    
+    if (chunkHashes && chunkFill > 0) {
+        chunkHashes->append(chunkHash.result());
+    }
+    
+    return QString::fromLatin1(hash.result().toHex());
+}
+
+bool FirmwarePackage::verifyChunksParallel(const ProgressCallback &progress, QString *imageHash) const
+{
+    // Compressed images are verified per decoded block, each holding whole chunks
+    const bool compressed = !m_compression.isEmpty();
+    const int count = compressed ? m_blockOffsets.size() - 1 : m_chunkHashes.size();
+    const HashCache::FileIdentity identity = HashCache::identityOf(*m_file);
+    std::atomic<int> nextChunk(0);
+    std::atomic<qint64> processed(0);
+    std::atomic<bool> failed(false);
+    
+    // Each worker reads through its own handle, so there is no shared seek
+    // position, and holds at most one chunk in memory
+    auto worker = [&]() {
+        QFile file(m_filePath);
+        if (!file.open(QIODevice::ReadOnly) || HashCache::identityOf(file) != identity) {
+            failed = true;
+            return;
+        }
+        
+        if (compressed) {
+            QByteArray block;
+            for (int index = nextChunk++; index < count && !failed; index = nextChunk++) {
+                if (!decodeBlock(index, &block, &file)) {
+                    failed = true;
+                    return;
+                }
+                
+                qint64 blockStart = index * m_compressionBlockSize;
+                for (qint64 pos = 0; pos < block.size(); pos += m_chunkHashSize) {
+                    qint64 length = qMin(m_chunkHashSize, block.size() - pos);
+                    int chunk = static_cast<int>((blockStart + pos) / m_chunkHashSize);
+                    
+                    QCryptographicHash hash(QCryptographicHash::Sha256);
+                    hash.addData(block.constData() + pos, static_cast<int>(length));
+                    if (hash.result() != m_chunkHashes.at(chunk)) {
+                        failed = true;
+                        return;
+                    }
+                }
+                
+                processed += block.size();
+            }
+            return;
+        }
+        
+        QByteArray buffer(static_cast<int>(m_chunkHashSize), Qt::Uninitialized);
+        
+        for (int index = nextChunk++; index < count && !failed; index = nextChunk++) {
+            qint64 offset = index * m_chunkHashSize;
+            qint64 length = qMin(m_chunkHashSize, m_dataSize - offset);
+            
+            if (!file.seek(m_dataOffset + offset) || file.read(buffer.data(), length) != length) {
+                failed = true;
+                return;
+            }
+            
+            QCryptographicHash hash(QCryptographicHash::Sha256);
+            hash.addData(buffer.constData(), static_cast<int>(length));
+            if (hash.result() != m_chunkHashes.at(index)) {
+                failed = true;
+                return;
+            }
+            
+            processed += length;
+        }
+    };
+    
+    QThreadPool pool;
+    int threads = qBound(1, QThread::idealThreadCount(), count);
+    pool.setMaxThreadCount(threads);
+    for (int i = 0; i < threads; ++i) {
+        pool.start(worker);
+    }
+    
+    // SHA-256 of the whole image cannot be combined from chunk digests, so this
+    // thread streams through the image while the workers check the chunks
+    if (imageHash) {
+        *imageHash = hashPayload([&](qint64 hashed, qint64 total) {
+            if (progress) {
+                progress(qMin(hashed, processed.load()), total);
+            }
+        }, nullptr);
+        
+        if (imageHash->isEmpty()) {
+            failed = true;
+        }
+    }
+    
+    while (!pool.waitForDone(PARALLEL_PROGRESS_INTERVAL_MS)) {
+        if (progress) {
+            progress(processed.load(), m_dataSize);
+        }
+    }
+    
+    if (progress) {
+        progress(processed.load(), m_dataSize);
+    }
+    
+    return !failed;
+}
+
+QByteArray FirmwarePackage::readStored(qint64 offset, qint64 size, QByteArray *buffer) const
+{
+    // Mapped mode: no syscall, no copy, no shared seek position
+    if (m_mappedData) {
+        return QByteArray::fromRawData(reinterpret_cast<const char *>(m_mappedData + offset),
+                                       static_cast<int>(size));
+    }
+    
+    if (!m_file || !m_file->isOpen()) {
+        return QByteArray();
+    }
+    
+    // Buffered mode: jobs share one file handle, so seek+read must be atomic
+    QMutexLocker locker(&m_fileMutex);
+    m_file->seek(m_dataOffset + offset);
+    return readInto(m_file.get(), size, buffer) ? *buffer : QByteArray();
+}
+
+bool FirmwarePackage::decodeBlock(int index, QByteArray *out, QFile *file) const
+{
+    if (index < 0 || index >= m_blockOffsets.size() - 1) {
+        return false;
+    }
+    
+    qint64 offset = m_blockOffsets.at(index);
+    qint64 length = m_blockOffsets.at(index + 1) - offset;
+    qint64 expected = qMin(m_compressionBlockSize, m_dataSize - index * m_compressionBlockSize);
+    
+    // qUncompress expects the uncompressed size as a big-endian prefix
+    QByteArray framed(4, Qt::Uninitialized);
+    qToBigEndian(static_cast<quint32>(expected), framed.data());
+    
+    if (file) {
+        if (!file->seek(m_dataOffset + offset)) {
+            return false;
+        }
+        framed.append(file->read(length));
+    } else {
+        QByteArray buffer;
+        framed.append(readStored(offset, length, &buffer));
+    }
+    
+    if (framed.size() != 4 + length) {
+        return false;
+    }
+    
+    *out = qUncompress(framed);
+    return out->size() == expected;
+}
+
+bool FirmwarePackage::decodeRange(qint64 offset, qint64 size, QByteArray *out) const
+{
+    // Reserving also keeps the storage of a reused buffer when it is emptied
+    out->reserve(static_cast<int>(size));
+    out->resize(0);
+    
+    while (size > 0) {
+        int index = static_cast<int>(offset / m_compressionBlockSize);
+        QByteArray block;
+        if (!decodedBlock(index, &block)) {
+            return false;
+        }
+        
+        qint64 within = offset - index * m_compressionBlockSize;
+        qint64 take = qMin(size, block.size() - within);
+        if (take <= 0) {
+            return false;
+        }
+        
+        out->append(block.constData() + within, static_cast<int>(take));
+        offset += take;
+        size -= take;
+    }
+    
+    return true;
+}
+
+bool FirmwarePackage::decodedBlock(int index, QByteArray *block) const
+{
+    // Consecutive chunks mostly fall into the same block, and each reader
+    // keeps its own block among the recently used ones
+    {
+        QMutexLocker locker(&m_blockCacheMutex);
+        for (DecodedBlock &cached : m_decodedBlocks) {
+            if (cached.index == index) {
+                cached.lastUse = ++m_blockUses;
+                *block = cached.data;
+                return true;
+            }
+        }
+    }
+    
+    // Inflate without the lock, so readers of other blocks are not held up;
+    // two readers missing the same block at once both decode it
+    QByteArray data;
+    if (!decodeBlock(index, &data)) {
+        return false;
+    }
+    
+    QMutexLocker locker(&m_blockCacheMutex);
+    DecodedBlock *oldest = nullptr;
+    for (DecodedBlock &cached : m_decodedBlocks) {
+        if (cached.index == index) {
+            oldest = &cached;
+            break;
+        }
+        if (!oldest || cached.lastUse < oldest->lastUse) {
+            oldest = &cached;
+        }
+    }
+    
+    if (oldest) {
+        oldest->index = index;
+        oldest->data = data;
+        oldest->lastUse = ++m_blockUses;
+    }
+    
+    *block = data;
+    return true;
+}
+
+QVector<FirmwarePackage::Segment> FirmwarePackage::scanFillSegments() const
+{
+    QVector<Segment> fills;
+    
+    for (qint64 offset = 0; offset < m_dataSize; offset += FILL_SCAN_WINDOW) {
+        QByteArray window = getChunk(offset, FILL_SCAN_WINDOW);
+        if (window.isEmpty()) {
+            return QVector<Segment>();
+        }
+        scanFillBlocks(window.constData(), window.size(), offset, &fills);
+    }
+    
+    return fills;
+}
+
+bool FirmwarePackage::checkFillSegment(const Segment &segment) const
+{
+    for (qint64 offset = 0; offset < segment.length; offset += FILL_SCAN_WINDOW) {
+        QByteArray window = getChunk(segment.offset + offset, qMin(FILL_SCAN_WINDOW, segment.length - offset));
+        if (window.isEmpty() || !isUniform(window.constData(), window.size(), segment.fillValue)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void FirmwarePackage::mapPayload()
+{
+    // Map only the stored image; the mapping stays valid until the file is closed
+    m_mappedData = m_file->map(m_dataOffset, m_storedSize);
+    
+    if (m_mappedData) {
+        m_accessMode = Mapped;
+    } else {
+        qWarning() << "Failed to map firmware payload, using buffered reads:" << m_file->errorString();
+        m_accessMode = Buffered;
+    }
+}
+
+void FirmwarePackage::load(const LoadOptions &options)
+{
+    m_hashBlockSize = qBound(MIN_HASH_BLOCK_SIZE, options.hashBlockSize, MAX_HASH_BLOCK_SIZE);
+    m_file = std::make_unique<QFile>(m_filePath);
+    
+    // Chunks are read straight into the caller's buffer; QIODevice's own
+    // read buffer would only add a copy and allocate as it grows
+    if (!m_file->open(QIODevice::ReadOnly | QIODevice::Unbuffered)) {
+        throw std::runtime_error(QString("Failed to open firmware file: %1").arg(m_file->errorString()).toStdString());
+    }
+    
+    // Verify magic signature
+    QByteArray magic = m_file->read(7);
+    if (magic != FIRMWARE_MAGIC) {
+        throw std::runtime_error("Invalid firmware file format");
+    }
+    
+    // Read metadata and validate
+    parseMetadata();
+    calculateHash(options.progress, options.hashCache);
+    
+    if (m_calculatedHash != m_sha256) {
+        throw std::runtime_error("Firmware validation failed");
+    }
+    
+    if (options.accessMode == Mapped) {
+        mapPayload();
+    }
+}
\ No newline at end of file
@@ -4,24 +4,91 @@
 #include <QString>
 #include <QByteArray>
 #include <QMap>
+#include <QVector>
 #include <QFile>
 #include <QTemporaryFile>
+#include <QMutex>
+#include <functional>
 #include <memory>
 
+class HashCache;
+class QJsonObject;
+class QJsonArray;
+
 /**
  * @brief The FirmwarePackage class handles firmware file parsing and validation
  */
 class FirmwarePackage
 {
 public:
+    /**
+     * @brief How firmware payload bytes are read from disk
+     */
+    enum AccessMode {
+        Buffered,   ///< Seek and read from the file for every request
+        Mapped      ///< Map the payload once and hand out views into the mapping
+    };
+
+    /**
+     * @brief Progress callback used while hashing the payload
+     * @param processed Bytes hashed so far
+     * @param total Total payload bytes
+     */
+    using ProgressCallback = std::function<void(qint64 processed, qint64 total)>;
+
+    /**
+     * @brief A delta patch carried in the package
+     */
+    struct Delta {
+        QString baseSha256;     ///< Image the patch applies to, as hex string
+        QString sha256;         ///< Hash of the patch data as hex string
+        qint64 size = 0;        ///< Patch size in bytes
+        qint64 fileOffset = 0;  ///< Position of the patch data in the package file
+    };
+
+    /**
+     * @brief A contiguous part of the image
+     */
+    struct Segment {
+        qint64 offset = 0;
+        qint64 length = 0;
+        bool fill = false;      ///< Every byte equals fillValue, so the data need not be sent
+        quint8 fillValue = 0;
+    };
+
+    /**
+     * @brief Options controlling how a package is loaded and verified
+     */
+    struct LoadOptions {
+        AccessMode accessMode = Mapped;
+        qint64 hashBlockSize = 256 * 1024;  ///< Read buffer size, bounds memory used while hashing
+        ProgressCallback progress;          ///< Optional, called once per hashed block
+        HashCache *hashCache = nullptr;     ///< Optional, skips hashing for unchanged files
+    };
+
+    /**
+     * @brief Constructs a FirmwarePackage from a firmware file
+     * @param filePath Path to firmware file
+     * @param mode Requested payload access mode; falls back to Buffered if mapping fails
+     * @throws std::runtime_error if firmware file is invalid
+     */
+    explicit FirmwarePackage(const QString &filePath, AccessMode mode = Mapped);
+
     /**
      * @brief Constructs a FirmwarePackage from a firmware file
      * @param filePath Path to firmware file
+     * @param options Load and verification options
      * @throws std::runtime_error if firmware file is invalid
      */
-    explicit FirmwarePackage(const QString &filePath);
+    FirmwarePackage(const QString &filePath, const LoadOptions &options);
     ~FirmwarePackage();
 
+    /**
+     * @brief Get the access mode actually in use
+     * @return Mapped if the payload is memory-mapped, Buffered otherwise
+     */
+    AccessMode accessMode() const;
+
     /**
      * @brief Get firmware metadata
      * @return Map of metadata key-value pairs
@@ -30,13 +97,18 @@ public:
 
     /**
      * @brief Get firmware binary data
+     *
+     * In Mapped mode the returned array is a non-owning view into the
+     * mapping and must not outlive this package. Compressed packages are
+     * decompressed in full; prefer getChunk() for those.
+     *
      * @return Binary data
      */
     QByteArray data() const;
 
     /**
      * @brief Get SHA-256 hash of firmware
-     * @return Hash as hex string
+     * @return Hash of the whole uncompressed image as hex string, also with a hash tree
      */
     QString sha256Hash() const;
 
@@ -48,24 +120,51 @@ public:
 
     /**
      * @brief Verify firmware integrity
+     *
+     * Re-hashes the payload in hashBlockSize blocks, so memory use does not
+     * depend on the firmware size. Packages with a hash tree also check
+     * every chunk across a thread pool while the image is hashed.
+     *
      * @return true if firmware is valid
      */
     bool verify() const;
 
     /**
-     * @brief Get firmware file size
-     * @return Size in bytes
+     * @brief Get firmware image size
+     * @return Uncompressed size in bytes
      */
     qint64 size() const;
 
     /**
      * @brief Get chunk of firmware data
+     *
+     * Safe to call concurrently from several update jobs. In Mapped mode
+     * the returned array is a non-owning view into the mapping and must
+     * not outlive this package. Compressed packages decode only the blocks
+     * the chunk touches, keeping the last decoded block for the next call.
+     *
      * @param offset Starting position
      * @param size Chunk size in bytes
      * @return Data chunk
      */
     QByteArray getChunk(qint64 offset, qint64 size) const;
 
+    /**
+     * @brief Get a chunk of the image, reading into a caller-owned buffer
+     *
+     * Like getChunk(), but data that has to be read or decompressed is
+     * written into the buffer in place, so reading one chunk after another
+     * into the same buffer allocates nothing once it is large enough. In
+     * Mapped mode uncompressed chunks are still returned as views and the
+     * buffer is left untouched.
+     *
+     * @param offset Starting position
+     * @param size Chunk size in bytes
+     * @param buffer Buffer to read into
+     * @return Data chunk, sharing the buffer's storage if it was read into it
+     */
+    QByteArray readChunk(qint64 offset, qint64 size, QByteArray *buffer) const;
+
     /**
      * @brief Get total number of chunks
      * @param chunkSize Size of each chunk
@@ -73,6 +172,165 @@ public:
      */
     int chunkCount(qint64 chunkSize) const;
 
+    /**
+     * @brief Get the payload size covered by each chunk digest
+     * @return Chunk size in bytes
+     */
+    qint64 chunkHashSize() const;
+
+    /**
+     * @brief Get the number of chunk digests
+     * @return Digest count
+     */
+    int chunkHashCount() const;
+
+    /**
+     * @brief Get the SHA-256 digests of each payload chunk
+     * @return Raw digests, one per chunkHashSize() bytes of payload
+     */
+    QVector<QByteArray> chunkHashes() const;
+
+    /**
+     * @brief Check whether the manifest carries a signed per-chunk hash tree
+     * @return true if the manifest has a chunk hash table and its Merkle root
+     */
+    bool hasHashTree() const;
+
+    /**
+     * @brief Re-check one payload chunk against its recorded digest
+     *
+     * Hashes the bytes getChunk() would hand out right now, so a file that
+     * changed on disk after loading is caught before it is sent.
+     *
+     * @param index Chunk index (offset / chunkHashSize())
+     * @param buffer Optional buffer to read the chunk into, as for readChunk()
+     * @return true if the chunk matches
+     */
+    bool verifyChunk(int index, QByteArray *buffer = nullptr) const;
+
+    /**
+     * @brief Compute the Merkle root of a list of chunk digests
+     *
+     * Each parent is SHA-256(0x01 || left || right); an odd node at the end
+     * of a level is promoted unchanged.
+     *
+     * @param leaves Raw SHA-256 digests of each chunk
+     * @return Raw root digest, empty if there are no leaves
+     */
+    static QByteArray merkleRoot(const QVector<QByteArray> &leaves);
+
+    /**
+     * @brief Get the image split into data and uniform fill segments
+     *
+     * Fill ranges come from the "sparse" metadata if present and are found
+     * by scanning the image block by block otherwise, on the first call.
+     * Declared ranges are checked against the data before they are used.
+     *
+     * @return Segments covering the whole image, in order
+     */
+    QVector<Segment> segments() const;
+
+    /**
+     * @brief Find the uniform fill ranges of an image
+     * @param image Raw image data
+     * @return Fill segments, in order
+     */
+    static QVector<Segment> findFillSegments(const QByteArray &image);
+
+    /**
+     * @brief Get the compression of the stored image
+     * @return Algorithm name ("zlib"), empty if the image is stored uncompressed
+     */
+    QString compression() const;
+
+    /**
+     * @brief Get the uncompressed size of each compressed block
+     * @return Block size in bytes, 0 if uncompressed
+     */
+    qint64 compressionBlockSize() const;
+
+    /**
+     * @brief Get the size of the image as stored in the package
+     * @return Compressed size in bytes, size() if uncompressed
+     */
+    qint64 encodedSize() const;
+
+    /**
+     * @brief Get a chunk of the image as stored in the package
+     *
+     * For compressed packages this is the raw stream of compressed blocks,
+     * for devices that decompress on their side.
+     *
+     * @param offset Starting position within the stored image
+     * @param size Chunk size in bytes
+     * @return Data chunk
+     */
+    QByteArray getEncodedChunk(qint64 offset, qint64 size) const;
+
+    /**
+     * @brief Get a chunk of the stored image, reading into a caller-owned buffer
+     * @see readChunk()
+     */
+    QByteArray readEncodedChunk(qint64 offset, qint64 size, QByteArray *buffer) const;
+
+    /**
+     * @brief Locate the image inside the package file
+     *
+     * Lets servers hand the image to the kernel (e.g. sendfile()) instead of
+     * copying it through getChunk().
+     *
+     * @param filePath Receives the package file path
+     * @param offset Receives the position of the first image byte in the file
+     * @return true if the image is stored uncompressed, so that size() bytes
+     *         at offset are the image itself
+     */
+    bool imageFileRange(QString *filePath, qint64 *offset) const;
+
+    /**
+     * @brief Get the delta patches carried in the package
+     * @return Patches, in file order
+     */
+    QVector<Delta> deltas() const;
+
+    /**
+     * @brief Find the delta patch for an installed image
+     * @param baseHash SHA-256 of the image installed on the device
+     * @return Index into deltas(), or -1 if there is none
+     */
+    int findDelta(const QString &baseHash) const;
+
+    /**
+     * @brief Get a chunk of delta patch data
+     * @param index Index into deltas()
+     * @param offset Starting position within the patch
+     * @param size Chunk size in bytes
+     * @return Data chunk
+     */
+    QByteArray getDeltaChunk(int index, qint64 offset, qint64 size) const;
+
+    /**
+     * @brief Get a chunk of delta patch data, reading into a caller-owned buffer
+     * @see readChunk()
+     */
+    QByteArray readDeltaChunk(int index, qint64 offset, qint64 size, QByteArray *buffer) const;
+
+    /**
+     * @brief Verify a delta patch against its recorded hash
+     *
+     * Patches are not hashed while loading; this should be called before a
+     * patch is sent.
+     *
+     * @param index Index into deltas()
+     * @return true if the patch data is intact
+     */
+    bool verifyDelta(int index) const;
+
+    /**
+     * @brief Check whether the package was verified from the hash cache
+     * @return true if hashing was skipped because of a cache hit
+     */
+    bool loadedFromCache() const;
+
 private:
     QString m_filePath;
     std::unique_ptr<QFile> m_file;
@@ -81,9 +339,50 @@ private:
     QString m_signature;
     qint64 m_dataOffset;
     qint64 m_dataSize;
+    QString m_calculatedHash;
+    QVector<QByteArray> m_chunkHashes;
+    qint64 m_chunkHashSize;
+    bool m_hasHashTree;
+    QVector<Delta> m_deltas;
+    QString m_compression;
+    qint64 m_compressionBlockSize;
+    qint64 m_storedSize;
+    QVector<qint64> m_blockOffsets;
+    QVector<Segment> m_declaredFills;
+    bool m_loadedFromCache;
+    AccessMode m_accessMode;
+    qint64 m_hashBlockSize;
+    uchar *m_mappedData;
+    mutable QMutex m_fileMutex;
+    
+    // Recently decoded blocks of a compressed image, shared by all readers
+    struct DecodedBlock {
+        int index = -1;
+        QByteArray data;
+        quint64 lastUse = 0;
+    };
+    mutable QMutex m_blockCacheMutex;
+    mutable QVector<DecodedBlock> m_decodedBlocks;
+    mutable quint64 m_blockUses;
+    mutable QMutex m_segmentsMutex;
+    mutable QVector<Segment> m_segments;
 
+    void load(const LoadOptions &options);
     void parseMetadata();
-    void calculateHash();
+    void parseHashTree(const QJsonObject &tree);
+    void parseDeltas(const QJsonArray &deltas, qint64 payloadEnd);
+    void parseCompression(const QJsonObject &metadata);
+    void parseSparse(const QJsonArray &ranges);
+    void mapPayload();
+    void calculateHash(const ProgressCallback &progress, HashCache *hashCache);
+    QString hashPayload(const ProgressCallback &progress, QVector<QByteArray> *chunkHashes) const;
+    bool verifyChunksParallel(const ProgressCallback &progress, QString *imageHash) const;
+    QByteArray readStored(qint64 offset, qint64 size, QByteArray *buffer) const;
+    bool decodeBlock(int index, QByteArray *out, QFile *file = nullptr) const;
+    bool decodeRange(qint64 offset, qint64 size, QByteArray *out) const;
+    bool decodedBlock(int index, QByteArray *block) const;
+    QVector<Segment> scanFillSegments() const;
+    bool checkFillSegment(const Segment &segment) const;
 };
 
 #endif // FIRMWAREPACKAGE_H 
\ No newline at end of file
@@ -0,0 +1,190 @@
+#include "firmwarepackagebuilder.h"
+#include "firmwarepackage.h"
+#include "deltapatch.h"
+#include "cryptoutils.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+#include <QtEndian>
+#include <stdexcept>
+
+// Magic signature to identify firmware files
+static constexpr char FIRMWARE_MAGIC[] = "FLASHUP";
+const int FIRMWARE_MAGIC_SIZE = 7;
+
+// Compression level for image blocks; packages are built once and read often
+const int COMPRESSION_LEVEL = 9;
+
+FirmwarePackageBuilder::FirmwarePackageBuilder()
+    : m_hashTreeChunkSize(0),
+      m_compressionBlockSize(0)
+{
+}
+
+void FirmwarePackageBuilder::setMetadata(const QString &key, const QString &value)
+{
+    m_metadata[key] = value;
+}
+
+void FirmwarePackageBuilder::setImage(const QByteArray &image)
+{
+    m_image = image;
+    m_deltas.clear();
+}
+
+void FirmwarePackageBuilder::setHashTreeChunkSize(qint64 chunkSize)
+{
+    m_hashTreeChunkSize = chunkSize;
+}
+
+void FirmwarePackageBuilder::setCompression(const QString &compression, qint64 blockSize)
+{
+    m_compression = compression;
+    m_compressionBlockSize = blockSize;
+}
+
+qint64 FirmwarePackageBuilder::addDeltaBase(const QByteArray &baseImage)
+{
+    if (m_image.isEmpty()) {
+        throw std::runtime_error("Cannot create delta patch without a firmware image");
+    }
+    
+    Delta delta;
+    delta.baseSha256 = CryptoUtils::calculateSHA256(baseImage);
+    delta.patch = DeltaPatch::create(baseImage, m_image);
+    
+    // The full image is always there as fallback, so only keep patches that pay off
+    if (delta.patch.size() >= m_image.size()) {
+        return -1;
+    }
+    
+    if (DeltaPatch::apply(baseImage, delta.patch) != m_image) {
+        throw std::runtime_error("Delta patch does not reproduce the firmware image");
+    }
+    
+    m_deltas.append(delta);
+    return delta.patch.size();
+}
+
+void FirmwarePackageBuilder::write(const QString &filePath) const
+{
+    if (m_image.isEmpty()) {
+        throw std::runtime_error("Firmware image is empty");
+    }
+    
+    static const QStringList requiredFields = {"name", "version", "target"};
+    for (const auto &field : requiredFields) {
+        if (m_metadata.value(field).isEmpty()) {
+            throw std::runtime_error(QString("Missing required metadata field: %1").arg(field).toStdString());
+        }
+    }
+    
+    QJsonObject metadata;
+    for (auto it = m_metadata.constBegin(); it != m_metadata.constEnd(); ++it) {
+        metadata[it.key()] = it.value();
+    }
+    
+    if (metadata["timestamp"].toString().isEmpty()) {
+        metadata["timestamp"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    }
+    
+    // sha256 is always the flat image hash that devices and servers check;
+    // a hash tree carries its own Merkle root
+    metadata["sha256"] = CryptoUtils::calculateSHA256(m_image);
+    if (m_hashTreeChunkSize > 0) {
+        QVector<QByteArray> leaves;
+        QJsonArray chunks;
+        for (qint64 offset = 0; offset < m_image.size(); offset += m_hashTreeChunkSize) {
+            QByteArray digest = QCryptographicHash::hash(m_image.mid(static_cast<int>(offset),
+                                                                     static_cast<int>(m_hashTreeChunkSize)),
+                                                         QCryptographicHash::Sha256);
+            leaves.append(digest);
+            chunks.append(QString::fromLatin1(digest.toHex()));
+        }
+        
+        QJsonObject tree;
+        tree["chunk_size"] = static_cast<double>(m_hashTreeChunkSize);
+        tree["chunks"] = chunks;
+        tree["root"] = QString::fromLatin1(FirmwarePackage::merkleRoot(leaves).toHex());
+        metadata["hash_tree"] = tree;
+    }
+    
+    // Record uniform fill ranges so readers need not scan for them
+    QVector<FirmwarePackage::Segment> fills = FirmwarePackage::findFillSegments(m_image);
+    if (!fills.isEmpty()) {
+        QJsonArray sparse;
+        for (const FirmwarePackage::Segment &fill : fills) {
+            QJsonObject range;
+            range["offset"] = static_cast<double>(fill.offset);
+            range["length"] = static_cast<double>(fill.length);
+            range["fill"] = static_cast<int>(fill.fillValue);
+            sparse.append(range);
+        }
+        metadata["sparse"] = sparse;
+    }
+    
+    // Compress each block on its own and drop qCompress' length prefix, leaving plain zlib streams
+    QByteArray storedImage = m_image;
+    if (!m_compression.isEmpty()) {
+        if (m_compression != "zlib") {
+            throw std::runtime_error(QString("Unsupported firmware compression: %1").arg(m_compression).toStdString());
+        }
+        
+        if (m_compressionBlockSize <= 0 || (m_compressionBlockSize & (m_compressionBlockSize - 1)) != 0 ||
+            m_compressionBlockSize < m_hashTreeChunkSize) {
+            throw std::runtime_error("Invalid compression block size");
+        }
+        
+        QJsonArray blocks;
+        storedImage.clear();
+        for (qint64 offset = 0; offset < m_image.size(); offset += m_compressionBlockSize) {
+            QByteArray block = qCompress(m_image.mid(static_cast<int>(offset),
+                                                     static_cast<int>(m_compressionBlockSize)),
+                                         COMPRESSION_LEVEL).mid(4);
+            blocks.append(static_cast<double>(block.size()));
+            storedImage.append(block);
+        }
+        
+        metadata["compression"] = m_compression;
+        metadata["compression_block_size"] = static_cast<double>(m_compressionBlockSize);
+        metadata["image_size"] = static_cast<double>(m_image.size());
+        metadata["compressed_blocks"] = blocks;
+    }
+    
+    if (!m_deltas.isEmpty()) {
+        QJsonArray deltas;
+        for (const Delta &delta : m_deltas) {
+            QJsonObject entry;
+            entry["base_sha256"] = delta.baseSha256;
+            entry["sha256"] = CryptoUtils::calculateSHA256(delta.patch);
+            entry["size"] = static_cast<double>(delta.patch.size());
+            deltas.append(entry);
+        }
+        metadata["deltas"] = deltas;
+    }
+    
+    QByteArray metadataJson = QJsonDocument(metadata).toJson(QJsonDocument::Compact);
+    char metadataSize[4];
+    qToLittleEndian(static_cast<quint32>(metadataJson.size()), metadataSize);
+    
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        throw std::runtime_error(QString("Failed to create firmware package: %1").arg(file.errorString()).toStdString());
+    }
+    
+    file.write(FIRMWARE_MAGIC, FIRMWARE_MAGIC_SIZE);
+    file.write(metadataSize, sizeof(metadataSize));
+    file.write(metadataJson);
+    file.write(storedImage);
+    for (const Delta &delta : m_deltas) {
+        file.write(delta.patch);
+    }
+    
+    if (!file.commit()) {
+        throw std::runtime_error(QString("Failed to write firmware package: %1").arg(file.errorString()).toStdString());
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef FIRMWAREPACKAGEBUILDER_H
+#define FIRMWAREPACKAGEBUILDER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <QVector>
+
+/**
+ * @brief The FirmwarePackageBuilder class writes FLASHUP firmware packages
+ *
+ * Produces the format read by FirmwarePackage: metadata, the full image and
+ * optionally a per-chunk hash tree and delta patches against earlier images.
+ */
+class FirmwarePackageBuilder
+{
+public:
+    FirmwarePackageBuilder();
+
+    /**
+     * @brief Set a metadata field
+     *
+     * "name", "version" and "target" are required; "timestamp" defaults to
+     * the build time and "sha256" is always computed.
+     *
+     * @param key Field name
+     * @param value Field value
+     */
+    void setMetadata(const QString &key, const QString &value);
+
+    /**
+     * @brief Set the full firmware image
+     * @param image Raw image data
+     */
+    void setImage(const QByteArray &image);
+
+    /**
+     * @brief Add a per-chunk hash tree to the package
+     * @param chunkSize Bytes per chunk (power of two), or 0 for no tree
+     */
+    void setHashTreeChunkSize(qint64 chunkSize);
+
+    /**
+     * @brief Store the image compressed
+     *
+     * The image is split into blocks that are compressed independently, so
+     * readers can decode any part of it without decoding what comes before.
+     *
+     * @param compression Algorithm ("zlib"), or empty to store the image as is
+     * @param blockSize Uncompressed bytes per block (power of two, at least
+     *        the hash tree chunk size)
+     */
+    void setCompression(const QString &compression, qint64 blockSize);
+
+    /**
+     * @brief Add a delta patch against an earlier image
+     *
+     * The patch is only kept if it is smaller than the full image.
+     *
+     * @param baseImage Raw image the patch will be applied to
+     * @return Patch size in bytes, or -1 if the patch was not worth keeping
+     * @throws std::runtime_error if no image was set
+     */
+    qint64 addDeltaBase(const QByteArray &baseImage);
+
+    /**
+     * @brief Write the package
+     * @param filePath Output path
+     * @throws std::runtime_error on missing metadata or write errors
+     */
+    void write(const QString &filePath) const;
+
+private:
+    struct Delta {
+        QString baseSha256;
+        QByteArray patch;
+    };
+
+    QMap<QString, QString> m_metadata;
+    QByteArray m_image;
+    qint64 m_hashTreeChunkSize;
+    QString m_compression;
+    qint64 m_compressionBlockSize;
+    QVector<Delta> m_deltas;
+};
+
+#endif // FIRMWAREPACKAGEBUILDER_H
@@ -2,15 +2,45 @@
 #include "deviceinterface.h"
 #include "firmwarepackage.h"
 #include "updatejob.h"
+#include "hashcache.h"
+#include "transferjournal.h"
+#include "framecache.h"
+#include "chunkbufferpool.h"
+#include "workerpool.h"
+#include "otaserver.h"
 
 #include <QDir>
 #include <QPluginLoader>
 #include <QDebug>
 #include <QCoreApplication>
 
+// Interval between aggregated fleet progress reports
+const int FLEET_REPORT_INTERVAL_MS = 1000;
+
 FlashUpCore::FlashUpCore(QObject *parent)
-    : QObject(parent)
+    : QObject(parent),
+      m_hashCache(std::make_unique<HashCache>()),
+      m_journal(std::make_unique<TransferJournal>()),
+      m_frameCache(std::make_unique<FrameCache>()),
+      m_bufferPool(std::make_unique<ChunkBufferPool>()),
+      m_workers(std::make_unique<WorkerPool>()),
+      m_lastJobId(0),
+      m_loadingFirmware(false),
+      m_fleetRunning(0),
+      m_fleetSucceeded(0),
+      m_fleetFailed(0),
+      m_fleetScheduling(false),
+      m_fleetLastBytes(0)
 {
+    // Events from jobs in worker threads are queued to this thread
+    qRegisterMetaType<LogEvent>();
+    
+    // Packages are loaded one at a time
+    m_loadPool.setMaxThreadCount(1);
+    
+    m_fleetReportTimer.setInterval(FLEET_REPORT_INTERVAL_MS);
+    connect(&m_fleetReportTimer, &QTimer::timeout, this, &FlashUpCore::reportFleetProgress);
+    
     registerPlugins();
     emit logMessage(1, "FlashUp Core initialized");
 }
@@ -18,17 +48,32 @@ FlashUpCore::FlashUpCore(QObject *parent)
 FlashUpCore::~FlashUpCore()
 {
     // Cancel any active jobs before shutting down
+    cancelFleet();
     for (const auto &deviceId : m_activeJobs.keys()) {
         cancelUpdate(deviceId);
     }
+    
+    // A package still loading reports back to this object
+    m_loadPool.waitForDone();
+    
+    releaseDevices();
 }
 
 void FlashUpCore::discoverDevices()
 {
     emit logMessage(1, "Starting device discovery...");
     
-    // Clear out stale devices
-    m_devices.clear();
+    // Clear out stale devices; those being updated stay until their job ends,
+    // and those still on their way back from a worker until the next discovery
+    releaseDevices();
+    for (auto it = m_devices.begin(); it != m_devices.end();) {
+        if (m_activeJobs.contains(it.key()) || (it.value() && m_workers->isAttached(it.value().get()))) {
+            ++it;
+        } else {
+            m_deviceSnapshots.remove(it.key());
+            it = m_devices.erase(it);
+        }
+    }
     
     // TODO: Implement plugin-based device discovery
     // 1. Load and initialize device plugins
@@ -64,29 +109,98 @@ QStringList FlashUpCore::availableDevices() const
 
 QMap<QString, QString> FlashUpCore::deviceInfo(const QString &deviceId) const
 {
-    if (m_devices.contains(deviceId) && m_devices[deviceId]) {
-        return m_devices[deviceId]->deviceInfo();
-    }
-    return QMap<QString, QString>();
+    return deviceSnapshot(deviceId).info;
 }
 
 bool FlashUpCore::loadFirmware(const QString &filePath)
 {
+    // Both loads share the hash cache and would race to replace the package
+    if (m_loadingFirmware) {
+        emit logMessage(3, "Another firmware package is still loading");
+        return false;
+    }
+    
     emit logMessage(1, QString("Loading firmware from %1").arg(filePath));
     
     try {
-        m_currentFirmware = std::make_unique<FirmwarePackage>(filePath);
-        
-        QMap<QString, QString> info = m_currentFirmware->metadata();
-        emit logMessage(1, QString("Loaded firmware: %1 v%2").arg(
-                           info.value("name", "Unknown"),
-                           info.value("version", "0.0.0")));
-        return true;
+        return setFirmware(openFirmware(filePath), QString());
     } catch (const std::exception &e) {
-        emit logMessage(3, QString("Failed to load firmware: %1").arg(e.what()));
+        return setFirmware(nullptr, QString::fromUtf8(e.what()));
+    }
+}
+
+bool FlashUpCore::loadFirmwareAsync(const QString &filePath)
+{
+    if (m_loadingFirmware) {
+        emit logMessage(3, "Another firmware package is still loading");
+        return false;
+    }
+    
+    emit logMessage(1, QString("Loading firmware from %1").arg(filePath));
+    m_loadingFirmware = true;
+    
+    // Progress signals are queued to this thread; the result is applied here
+    // too, so jobs and the fleet scheduler never see a half-loaded package
+    m_loadPool.start([this, filePath]() {
+        std::shared_ptr<FirmwarePackage> firmware;
+        QString error;
+        try {
+            firmware = openFirmware(filePath);
+        } catch (const std::exception &e) {
+            error = QString::fromUtf8(e.what());
+        }
+        
+        QMetaObject::invokeMethod(this, [this, firmware, error]() {
+            m_loadingFirmware = false;
+            emit firmwareLoaded(setFirmware(firmware, error));
+        }, Qt::QueuedConnection);
+    });
+    return true;
+}
+
+bool FlashUpCore::isLoadingFirmware() const
+{
+    return m_loadingFirmware;
+}
+
+std::shared_ptr<FirmwarePackage> FlashUpCore::openFirmware(const QString &filePath)
+{
+    // Verification streams the payload; report progress once per percent
+    FirmwarePackage::LoadOptions options;
+    options.hashCache = m_hashCache.get();
+    int lastProgress = -1;
+    options.progress = [this, &lastProgress](qint64 processed, qint64 total) {
+        int progress = static_cast<int>((static_cast<double>(processed) / total) * 100);
+        if (progress != lastProgress) {
+            lastProgress = progress;
+            emit firmwareLoadProgress(progress);
+        }
+    };
+    
+    return std::make_shared<FirmwarePackage>(filePath, options);
+}
+
+bool FlashUpCore::setFirmware(std::shared_ptr<FirmwarePackage> firmware, const QString &error)
+{
+    if (!firmware) {
+        emit logMessage(3, QString("Failed to load firmware: %1").arg(error));
         m_currentFirmware.reset();
         return false;
     }
+    
+    m_currentFirmware = firmware;
+    
+    QMap<QString, QString> info = m_currentFirmware->metadata();
+    emit logMessage(1, QString("Loaded firmware: %1 v%2").arg(
+                       info.value("name", "Unknown"),
+                       info.value("version", "0.0.0")));
+    
+    if (m_currentFirmware->loadedFromCache() && FLASHUP_LOG_ENABLED(lcCore, Logging::Debug)) {
+        LogEvent event(lcCore(), Logging::Debug, "Firmware hash verified from cache");
+        event.bytes = m_currentFirmware->size();
+        emit logEvent(event);
+    }
+    return true;
 }
 
 QMap<QString, QString> FlashUpCore::firmwareInfo() const
@@ -99,11 +213,6 @@ QMap<QString, QString> FlashUpCore::firmwareInfo() const
 
 bool FlashUpCore::updateFirmware(const QString &deviceId, const QString &firmwarePath)
 {
-    // If a job is already active for this device, cancel it first
-    if (m_activeJobs.contains(deviceId)) {
-        cancelUpdate(deviceId);
-    }
-    
     // If a firmware path was provided, load it
     if (!firmwarePath.isEmpty() && !loadFirmware(firmwarePath)) {
         emit logMessage(3, "Failed to load firmware file");
@@ -116,6 +225,53 @@ bool FlashUpCore::updateFirmware(const QString &deviceId, const QString &firmwar
         return false;
     }
     
+    return startUpdateJob(deviceId, m_currentFirmware);
+}
+
+QString FlashUpCore::serveFirmware(quint16 port, const QString &firmwarePath)
+{
+    if (!firmwarePath.isEmpty() && !loadFirmware(firmwarePath)) {
+        emit logMessage(3, "Failed to load firmware file");
+        return QString();
+    }
+    
+    if (!m_currentFirmware) {
+        emit logMessage(3, "No firmware loaded");
+        return QString();
+    }
+    
+    OtaServer *server = otaServer();
+    if (!server->isListening() && !server->listen(QHostAddress::Any, port)) {
+        return QString();
+    }
+    
+    QString path = server->publish(m_currentFirmware);
+    emit logMessage(1, QString("Serving firmware at %1 on port %2").arg(path).arg(server->serverPort()));
+    return path;
+}
+
+OtaServer *FlashUpCore::otaServer()
+{
+    if (!m_otaServer) {
+        m_otaServer = std::make_unique<OtaServer>();
+        connect(m_otaServer.get(), &OtaServer::logMessage, this, &FlashUpCore::logMessage);
+        connect(m_otaServer.get(), &OtaServer::logEvent, this, &FlashUpCore::logEvent);
+    }
+    return m_otaServer.get();
+}
+
+FrameCache *FlashUpCore::frameCache() const
+{
+    return m_frameCache.get();
+}
+
+bool FlashUpCore::startUpdateJob(const QString &deviceId, std::shared_ptr<FirmwarePackage> firmware)
+{
+    // If a job is already active for this device, cancel it first
+    if (m_activeJobs.contains(deviceId)) {
+        cancelUpdate(deviceId);
+    }
+    
     // Check if device exists
     if (!m_devices.contains(deviceId) || !m_devices[deviceId]) {
         emit logMessage(3, QString("Unknown device: %1").arg(deviceId));
@@ -125,10 +281,23 @@ bool FlashUpCore::updateFirmware(const QString &deviceId, const QString &firmwar
     // Start the update job
     try {
         auto device = m_devices[deviceId];
-        auto firmware = m_currentFirmware.get();
         
-        // Create update job
-        auto job = std::make_shared<UpdateJob>(device, firmware, this);
+        // The device gets a worker thread; the job follows it there and is
+        // deleted in that thread once the last reference is gone
+        refreshDeviceSnapshot(deviceId);
+        QThread *worker = m_workers->attach(device.get());
+        auto job = std::shared_ptr<UpdateJob>(new UpdateJob(device, firmware),
+                                              [](UpdateJob *job) { job->deleteLater(); });
+        job->setJournal(m_journal.get());
+        job->setBufferPool(m_bufferPool.get());
+        
+        // Only fleet jobs send a payload other jobs send too. A single upload
+        // would fill the cache with frames nobody reads again, and each of them
+        // costs an allocation that the job's reused buffers avoid.
+        if (firmware == m_fleetFirmware && m_fleet.contains(deviceId)) {
+            job->setFrameCache(m_frameCache.get());
+        }
+        quint64 jobId = ++m_lastJobId;
         
         // Connect signals
         connect(job.get(), &UpdateJob::progressChanged, this, 
@@ -136,22 +305,40 @@ bool FlashUpCore::updateFirmware(const QString &deviceId, const QString &firmwar
                     emit updateProgress(deviceId, progress, status);
                 });
         
+        // A canceled job may be gone by the time its completion arrives here
+        std::weak_ptr<UpdateJob> weakJob = job;
         connect(job.get(), &UpdateJob::completed, this,
-                [this, deviceId](bool success, const QString &message) {
+                [this, deviceId, jobId, weakJob](bool success, const QString &message) {
                     emit updateComplete(deviceId, success, message);
-                    m_activeJobs.remove(deviceId);
+                    
+                    auto finishedJob = weakJob.lock();
+                    finishFleetDevice(deviceId, jobId, success, finishedJob ? finishedJob->bytesTransferred() : 0);
+                    if (finishedJob && m_activeJobs.value(deviceId) == finishedJob) {
+                        m_activeJobs.remove(deviceId);
+                        refreshDeviceSnapshot(deviceId);
+                        releaseDevice(deviceId);
+                    }
+                    scheduleFleet();
                 });
         
         connect(job.get(), &UpdateJob::logMessage, this,
                 [this](int level, const QString &message) {
                     emit logMessage(level, message);
                 });
+        connect(job.get(), &UpdateJob::logEvent, this, &FlashUpCore::logEvent);
         
         // Store the job
         m_activeJobs[deviceId] = job;
         
-        // Start the job
-        job->start();
+        // A fleet device being started by the scheduler is tracked through this job
+        auto fleetIt = m_fleet.find(deviceId);
+        if (fleetIt != m_fleet.end() && fleetIt->running && fleetIt->jobId == 0) {
+            fleetIt->jobId = jobId;
+        }
+        
+        // Start the job in its worker
+        job->moveToThread(worker);
+        QMetaObject::invokeMethod(job.get(), &UpdateJob::start, Qt::QueuedConnection);
         
         emit logMessage(1, QString("Started firmware update for device %1").arg(deviceId));
         
@@ -164,6 +351,18 @@ bool FlashUpCore::updateFirmware(const QString &deviceId, const QString &firmwar
 
 bool FlashUpCore::cancelUpdate(const QString &deviceId)
 {
+    // Devices still waiting in a fleet queue have no fleet job yet
+    if (m_fleetQueue.removeOne(deviceId)) {
+        emit logMessage(1, QString("Removed device %1 from the fleet queue").arg(deviceId));
+        finishFleetDevice(deviceId, 0, false, 0);
+        scheduleFleet();
+        
+        if (!m_activeJobs.contains(deviceId)) {
+            emit updateComplete(deviceId, false, "Update canceled by user");
+            return true;
+        }
+    }
+    
     if (!m_activeJobs.contains(deviceId) || !m_activeJobs[deviceId]) {
         emit logMessage(2, QString("No active update job for device %1").arg(deviceId));
         return false;
@@ -172,8 +371,11 @@ bool FlashUpCore::cancelUpdate(const QString &deviceId)
     emit logMessage(1, QString("Canceling update for device %1").arg(deviceId));
     
     try {
-        m_activeJobs[deviceId]->cancel();
+        // The job is deleted in its worker after the queued cancel has run,
+        // and the device is handed back after that
+        QMetaObject::invokeMethod(m_activeJobs[deviceId].get(), &UpdateJob::cancel, Qt::QueuedConnection);
         m_activeJobs.remove(deviceId);
+        releaseDevice(deviceId);
         emit updateComplete(deviceId, false, "Update canceled by user");
         return true;
     } catch (const std::exception &e) {
@@ -182,6 +384,285 @@ bool FlashUpCore::cancelUpdate(const QString &deviceId)
     }
 }
 
+bool FlashUpCore::updateFleet(const QStringList &deviceIds, const QString &firmwarePath,
+                              const FleetOptions &options)
+{
+    if (isFleetActive()) {
+        emit logMessage(3, "A fleet update is already in progress");
+        return false;
+    }
+    
+    if (options.maxConcurrent < 1) {
+        emit logMessage(3, "Fleet update needs a concurrency limit of at least 1");
+        return false;
+    }
+    
+    // If a firmware path was provided, load it
+    if (!firmwarePath.isEmpty() && !loadFirmware(firmwarePath)) {
+        emit logMessage(3, "Failed to load firmware file");
+        return false;
+    }
+    
+    if (!m_currentFirmware) {
+        emit logMessage(3, "No firmware loaded");
+        return false;
+    }
+    
+    // Queue known devices once each, in the given order
+    for (const QString &deviceId : deviceIds) {
+        if (m_fleet.contains(deviceId)) {
+            continue;
+        }
+        
+        if (!m_devices.value(deviceId)) {
+            emit logMessage(3, QString("Unknown device: %1").arg(deviceId));
+            continue;
+        }
+        
+        FleetEntry entry;
+        entry.transportGroup = deviceSnapshot(deviceId).transportGroup;
+        m_fleet.insert(deviceId, entry);
+        m_fleetQueue.append(deviceId);
+    }
+    
+    if (m_fleet.isEmpty()) {
+        emit logMessage(3, "No devices to update");
+        return false;
+    }
+    
+    // Later loadFirmware() calls must not change the image for queued devices
+    m_fleetFirmware = m_currentFirmware;
+    m_fleetOptions = options;
+    m_fleetGroupRunning.clear();
+    m_fleetRunning = 0;
+    m_fleetSucceeded = 0;
+    m_fleetFailed = 0;
+    m_fleetLastBytes = 0;
+    m_fleetElapsed.start();
+    m_fleetRateTimer.start();
+    m_fleetReportTimer.start();
+    
+    emit logMessage(1, QString("Starting fleet update of %1 devices (%2 at a time, %3 per transport)")
+                       .arg(m_fleet.size())
+                       .arg(options.maxConcurrent)
+                       .arg(options.maxPerTransport > 0 ? QString::number(options.maxPerTransport)
+                                                        : QString("no limit")));
+    
+    scheduleFleet();
+    return true;
+}
+
+bool FlashUpCore::cancelFleet()
+{
+    if (!isFleetActive()) {
+        return false;
+    }
+    
+    emit logMessage(1, "Canceling fleet update");
+    
+    // Drop the queue first so that canceled jobs do not make room for new ones
+    const QStringList queued = m_fleetQueue;
+    m_fleetQueue.clear();
+    for (const QString &deviceId : queued) {
+        finishFleetDevice(deviceId, 0, false, 0);
+        emit updateComplete(deviceId, false, "Update canceled by user");
+    }
+    
+    QStringList running;
+    for (auto it = m_fleet.constBegin(); it != m_fleet.constEnd(); ++it) {
+        if (it->running) {
+            running.append(it.key());
+        }
+    }
+    
+    for (const QString &deviceId : running) {
+        cancelUpdate(deviceId);
+    }
+    
+    // Nothing was running to report the end of the fleet
+    scheduleFleet();
+    return true;
+}
+
+bool FlashUpCore::isFleetActive() const
+{
+    return !m_fleet.isEmpty();
+}
+
+void FlashUpCore::scheduleFleet()
+{
+    // Starting a job may cancel another one, which calls back in here
+    if (m_fleetScheduling || !isFleetActive()) {
+        return;
+    }
+    m_fleetScheduling = true;
+    
+    // Start queued devices in order, passing over those whose transport group is saturated.
+    // Devices without a group share one transmission and are never held back.
+    int index = 0;
+    while (index < m_fleetQueue.size()) {
+        auto it = m_fleet.find(m_fleetQueue.at(index));
+        if (!it->transportGroup.isEmpty()) {
+            int limited = m_fleetRunning - m_fleetGroupRunning.value(QString());
+            int groupLimit = m_fleetOptions.transportLimits.value(it->transportGroup,
+                                                                  m_fleetOptions.maxPerTransport);
+            if (limited >= m_fleetOptions.maxConcurrent ||
+                (groupLimit > 0 && m_fleetGroupRunning.value(it->transportGroup) >= groupLimit)) {
+                index++;
+                continue;
+            }
+        }
+        
+        QString deviceId = m_fleetQueue.takeAt(index);
+        it->running = true;
+        m_fleetRunning++;
+        m_fleetGroupRunning[it->transportGroup]++;
+        
+        if (!startUpdateJob(deviceId, m_fleetFirmware)) {
+            finishFleetDevice(deviceId, m_fleet.value(deviceId).jobId, false, 0);
+        }
+        
+        // A device that failed to start frees its group for earlier devices again
+        index = 0;
+    }
+    
+    m_fleetScheduling = false;
+    
+    if (!m_fleetQueue.isEmpty() || m_fleetRunning > 0) {
+        return;
+    }
+    
+    // Every device has finished
+    m_fleetReportTimer.stop();
+    qint64 totalBytes = reportFleetProgress();
+    double seconds = m_fleetElapsed.elapsed() / 1000.0;
+    
+    emit logMessage(1, QString("Fleet update finished: %1 succeeded, %2 failed, %3 KiB in %4 s (%5 KiB/s)")
+                       .arg(m_fleetSucceeded)
+                       .arg(m_fleetFailed)
+                       .arg(totalBytes / 1024)
+                       .arg(seconds, 0, 'f', 1)
+                       .arg(seconds > 0 ? totalBytes / 1024.0 / seconds : 0.0, 0, 'f', 1));
+    
+    int succeeded = m_fleetSucceeded;
+    int failed = m_fleetFailed;
+    m_fleet.clear();
+    m_fleetGroupRunning.clear();
+    m_fleetFirmware.reset();
+    
+    emit fleetComplete(succeeded, failed);
+}
+
+void FlashUpCore::finishFleetDevice(const QString &deviceId, quint64 jobId, bool success, qint64 bytes)
+{
+    // Jobs replaced before the fleet reached their device do not count
+    auto it = m_fleet.find(deviceId);
+    if (it == m_fleet.end() || it->finished || it->jobId != jobId) {
+        return;
+    }
+    
+    if (it->running) {
+        it->running = false;
+        m_fleetRunning--;
+        m_fleetGroupRunning[it->transportGroup]--;
+    }
+    
+    it->finished = true;
+    it->bytes = bytes;
+    if (success) {
+        m_fleetSucceeded++;
+    } else {
+        m_fleetFailed++;
+    }
+}
+
+qint64 FlashUpCore::reportFleetProgress()
+{
+    if (!isFleetActive()) {
+        return 0;
+    }
+    
+    qint64 bytes = 0;
+    qint64 progressSum = 0;
+    for (auto it = m_fleet.constBegin(); it != m_fleet.constEnd(); ++it) {
+        if (it->finished) {
+            bytes += it->bytes;
+            progressSum += 100;
+        } else if (it->running) {
+            auto job = m_activeJobs.value(it.key());
+            if (job) {
+                bytes += job->bytesTransferred();
+                progressSum += job->progress();
+            }
+        }
+    }
+    
+    qint64 elapsedMs = m_fleetRateTimer.restart();
+    qint64 bytesPerSecond = elapsedMs > 0 ? qMax<qint64>(0, bytes - m_fleetLastBytes) * 1000 / elapsedMs : 0;
+    m_fleetLastBytes = bytes;
+    
+    emit fleetProgress(static_cast<int>(progressSum / m_fleet.size()),
+                       m_fleetSucceeded + m_fleetFailed, m_fleet.size(), bytesPerSecond);
+    return bytes;
+}
+
+void FlashUpCore::releaseDevices()
+{
+    for (auto it = m_devices.constBegin(); it != m_devices.constEnd(); ++it) {
+        releaseDevice(it.key());
+    }
+}
+
+void FlashUpCore::releaseDevice(const QString &deviceId)
+{
+    // Does not wait for the worker; a new job for the device keeps it there
+    auto device = m_devices.value(deviceId);
+    if (device && !m_activeJobs.contains(deviceId)) {
+        m_workers->detach(device.get());
+    }
+}
+
+void FlashUpCore::refreshDeviceSnapshot(const QString &deviceId)
+{
+    auto device = m_devices.value(deviceId);
+    if (!device) {
+        return;
+    }
+    
+    // Runs directly while the device lives in this thread, queued to its
+    // worker otherwise; the result is applied in this thread either way
+    DeviceInterface *source = device.get();
+    QMetaObject::invokeMethod(source, [this, deviceId, source]() {
+        DeviceSnapshot snapshot;
+        snapshot.info = source->deviceInfo();
+        snapshot.transportGroup = source->transportGroup();
+        
+        QMetaObject::invokeMethod(this, [this, deviceId, source, snapshot]() {
+            if (m_devices.value(deviceId).get() == source) {
+                m_deviceSnapshots.insert(deviceId, snapshot);
+            }
+        });
+    });
+}
+
+FlashUpCore::DeviceSnapshot FlashUpCore::deviceSnapshot(const QString &deviceId) const
+{
+    auto cached = m_deviceSnapshots.constFind(deviceId);
+    if (cached != m_deviceSnapshots.constEnd()) {
+        return cached.value();
+    }
+    
+    // Devices are cached before they first go to a worker, so this one has
+    // always lived in this thread
+    DeviceSnapshot snapshot;
+    auto device = m_devices.value(deviceId);
+    if (device) {
+        snapshot.info = device->deviceInfo();
+        snapshot.transportGroup = device->transportGroup();
+    }
+    return snapshot;
+}
+
 void FlashUpCore::registerPlugins()
 {
     // TODO: Implement dynamic plugin system
@@ -1,6 +1,8 @@
 #ifndef FLASHUPCORE_H
 #define FLASHUPCORE_H
 
+#include "logging.h"
+
 #include <QObject>
 #include <QMap>
 #include <QVector>
@@ -8,14 +10,37 @@
 #include <QString>
 #include <QUrl>
 #include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QThreadPool>
 #include <memory>
 
 class DeviceInterface;
 class FirmwarePackage;
 class UpdateJob;
+class HashCache;
+class TransferJournal;
+class FrameCache;
+class ChunkBufferPool;
+class WorkerPool;
+class OtaServer;
+
+/**
+ * @brief Limits for updating several devices at once
+ */
+struct FleetOptions
+{
+    int maxConcurrent = 8;              ///< Updates running at the same time
+    int maxPerTransport = 4;            ///< Updates per transport group, 0 for no limit
+    QMap<QString, int> transportLimits; ///< Per-group overrides of maxPerTransport
+};
 
 /**
  * @brief The FlashUpCore class manages firmware updates and device interactions
+ *
+ * Devices and their update jobs run on worker threads (see WorkerPool) and
+ * report back through queued signals, so the core and GUI thread never
+ * block a transfer.
  */
 class FlashUpCore : public QObject
 {
@@ -38,6 +63,11 @@ public:
 
     /**
      * @brief Get detailed information about a device
+     *
+     * Devices that have been updated live on worker threads for a while, so
+     * their information is read there and cached here: before each update
+     * and once it has finished.
+     *
      * @param deviceId The device identifier
      * @return Map of properties
      */
@@ -50,6 +80,24 @@ public:
      */
     bool loadFirmware(const QString &filePath);
 
+    /**
+     * @brief Load a firmware package from file without blocking this thread
+     *
+     * The package is opened and verified on a background thread while
+     * firmwareLoadProgress() reports progress. The loaded package replaces
+     * the current one only when firmwareLoaded() is emitted, so updates
+     * started in the meantime use the previous package.
+     *
+     * @param filePath Path to firmware file
+     * @return true if loading was started, false if another load is running
+     */
+    bool loadFirmwareAsync(const QString &filePath);
+
+    /**
+     * @brief Check whether a package is being loaded by loadFirmwareAsync()
+     */
+    bool isLoadingFirmware() const;
+
     /**
      * @brief Get information about currently loaded firmware
      * @return Map of firmware properties
@@ -71,6 +119,61 @@ public:
      */
     bool cancelUpdate(const QString &deviceId);
 
+    /**
+     * @brief Update several devices with the same firmware
+     *
+     * Devices are queued in the given order and started as running updates
+     * finish, so that no more than the configured number run at once, in
+     * total and per transport group (see DeviceInterface::transportGroup()).
+     * Devices without a transport group are started right away and do not
+     * count against either limit.
+     *
+     * @param deviceIds Devices to update
+     * @param firmwarePath Path to firmware file (optional if already loaded)
+     * @param options Concurrency limits
+     * @return true if at least one device was queued
+     */
+    bool updateFleet(const QStringList &deviceIds, const QString &firmwarePath = QString(),
+                     const FleetOptions &options = FleetOptions());
+
+    /**
+     * @brief Cancel a fleet update, dropping queued devices and canceling running ones
+     * @return true if a fleet update was active
+     */
+    bool cancelFleet();
+
+    /**
+     * @brief Check whether a fleet update is in progress
+     * @return true if devices of a fleet update are queued or running
+     */
+    bool isFleetActive() const;
+
+    /**
+     * @brief Serve firmware over HTTP for devices that download it themselves
+     *
+     * Starts the OTA server on first use and publishes the package there.
+     *
+     * @param port Port to listen on, 0 to pick a free one
+     * @param firmwarePath Path to firmware file (optional if already loaded)
+     * @return Request path of the image, empty on failure
+     */
+    QString serveFirmware(quint16 port, const QString &firmwarePath = QString());
+
+    /**
+     * @brief Get the OTA server pull devices download from
+     * @return Server, created on first use; runs in the core's thread
+     */
+    OtaServer *otaServer();
+
+    /**
+     * @brief Get the cache of encoded chunk frames shared by update jobs
+     *
+     * Only jobs of a fleet update use it.
+     *
+     * @return Cache, e.g. to change its capacity
+     */
+    FrameCache *frameCache() const;
+
 signals:
     /**
      * @brief Emitted when a new device is discovered
@@ -85,6 +188,18 @@ signals:
      */
     void deviceLost(const QString &deviceId);
 
+    /**
+     * @brief Emitted while a firmware package is being verified
+     * @param progress Progress percentage (0-100)
+     */
+    void firmwareLoadProgress(int progress);
+
+    /**
+     * @brief Emitted when a package started with loadFirmwareAsync() has been loaded
+     * @param success Whether the package was loaded and is now the current one
+     */
+    void firmwareLoaded(bool success);
+
     /**
      * @brief Emitted when update progress changes
      * @param deviceId The device being updated
@@ -101,6 +216,22 @@ signals:
      */
     void updateComplete(const QString &deviceId, bool success, const QString &message);
 
+    /**
+     * @brief Emitted periodically while a fleet update runs
+     * @param progress Overall progress percentage (0-100); finished devices count as done
+     * @param finished Number of devices that have finished, successfully or not
+     * @param total Number of devices in the fleet update
+     * @param bytesPerSecond Combined throughput of all devices since the last report
+     */
+    void fleetProgress(int progress, int finished, int total, qint64 bytesPerSecond);
+
+    /**
+     * @brief Emitted when every device of a fleet update has finished
+     * @param succeeded Number of devices updated successfully
+     * @param failed Number of devices that failed or were canceled
+     */
+    void fleetComplete(int succeeded, int failed);
+
     /**
      * @brief Emitted for log messages
      * @param level Log level (0=debug, 1=info, 2=warning, 3=error)
@@ -108,13 +239,87 @@ signals:
      */
     void logMessage(int level, const QString &message);
 
+    /**
+     * @brief Emitted for structured log events of jobs, devices and the OTA server
+     * @param event Event with typed fields
+     */
+    void logEvent(const LogEvent &event);
+
 private:
+    /**
+     * @brief A device taking part in a fleet update
+     */
+    struct FleetEntry {
+        QString transportGroup;
+        quint64 jobId = 0;      ///< Job started by the scheduler, 0 while queued
+        bool running = false;
+        bool finished = false;
+        qint64 bytes = 0;       ///< Bytes delivered, once finished
+    };
+
+    /**
+     * @brief What the core reads of a device that may live on a worker thread
+     */
+    struct DeviceSnapshot {
+        QMap<QString, QString> info;
+        QString transportGroup;
+    };
+
     QMap<QString, std::shared_ptr<DeviceInterface>> m_devices;
-    std::unique_ptr<FirmwarePackage> m_currentFirmware;
+    QMap<QString, DeviceSnapshot> m_deviceSnapshots;
+    std::shared_ptr<FirmwarePackage> m_currentFirmware;
+    std::unique_ptr<HashCache> m_hashCache;
+    std::unique_ptr<TransferJournal> m_journal;
+    std::unique_ptr<FrameCache> m_frameCache;
+    std::unique_ptr<ChunkBufferPool> m_bufferPool;
+    std::unique_ptr<WorkerPool> m_workers;
+    std::unique_ptr<OtaServer> m_otaServer;
     QMap<QString, std::shared_ptr<UpdateJob>> m_activeJobs;
+    quint64 m_lastJobId;
+    QThreadPool m_loadPool;
+    bool m_loadingFirmware;
+    
+    // Fleet update state
+    std::shared_ptr<FirmwarePackage> m_fleetFirmware;
+    FleetOptions m_fleetOptions;
+    QMap<QString, FleetEntry> m_fleet;
+    QStringList m_fleetQueue;
+    QMap<QString, int> m_fleetGroupRunning;
+    int m_fleetRunning;
+    int m_fleetSucceeded;
+    int m_fleetFailed;
+    bool m_fleetScheduling;
+    qint64 m_fleetLastBytes;
+    QElapsedTimer m_fleetElapsed;
+    QElapsedTimer m_fleetRateTimer;
+    QTimer m_fleetReportTimer;
     
     // Register plugins
     void registerPlugins();
+    
+    // Open and verify a package; safe to call from the load thread
+    std::shared_ptr<FirmwarePackage> openFirmware(const QString &filePath);
+    
+    // Make a loaded package the current one, or report why it failed to load
+    bool setFirmware(std::shared_ptr<FirmwarePackage> firmware, const QString &error);
+    
+    // Bring devices without a job back from their worker threads
+    void releaseDevices();
+    void releaseDevice(const QString &deviceId);
+    
+    // Read a device's snapshot in the device's thread and cache it here
+    void refreshDeviceSnapshot(const QString &deviceId);
+    
+    // Cached snapshot; devices never attached to a worker are read directly
+    DeviceSnapshot deviceSnapshot(const QString &deviceId) const;
+    
+    // Create and start an update job for a known device
+    bool startUpdateJob(const QString &deviceId, std::shared_ptr<FirmwarePackage> firmware);
+    
+    // Fleet scheduling
+    void scheduleFleet();
+    void finishFleetDevice(const QString &deviceId, quint64 jobId, bool success, qint64 bytes);
+    qint64 reportFleetProgress();
 };
 
 #endif // FLASHUPCORE_H 
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include "framecache.h"
+
+#include <QMutexLocker>
+
+FrameCache::FrameCache(qint64 capacity)
+    : m_capacity(capacity),
+      m_size(0),
+      m_useCounter(0),
+      m_hits(0),
+      m_misses(0)
+{
+}
+
+void FrameCache::setCapacity(qint64 capacity)
+{
+    QMutexLocker locker(&m_mutex);
+    m_capacity = capacity;
+    evict(TableKey());
+}
+
+qint64 FrameCache::capacity() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_capacity;
+}
+
+QByteArray FrameCache::find(const Key &key)
+{
+    QMutexLocker locker(&m_mutex);
+    
+    auto table = m_tables.find(qMakePair(key.payloadId, key.variant));
+    if (table != m_tables.end()) {
+        auto frame = table->frames.constFind(qMakePair(key.offset, key.size));
+        if (frame != table->frames.constEnd()) {
+            table->lastUse = ++m_useCounter;
+            m_hits++;
+            return frame.value();
+        }
+    }
+    
+    m_misses++;
+    return QByteArray();
+}
+
+void FrameCache::insert(const Key &key, const QByteArray &frame)
+{
+    QMutexLocker locker(&m_mutex);
+    
+    if (frame.size() > m_capacity) {
+        return;
+    }
+    
+    TableKey name(key.payloadId, key.variant);
+    Table &table = m_tables[name];
+    table.lastUse = ++m_useCounter;
+    
+    // Two jobs may have encoded the same frame at once; keep the first
+    QPair<qint64, qint64> frameKey(key.offset, key.size);
+    if (table.frames.contains(frameKey)) {
+        return;
+    }
+    
+    table.frames.insert(frameKey, frame);
+    table.bytes += frame.size();
+    m_size += frame.size();
+    evict(name);
+    
+    // The payload being sent is larger than the whole cache: stop growing its table
+    if (m_size > m_capacity) {
+        table.frames.remove(frameKey);
+        table.bytes -= frame.size();
+        m_size -= frame.size();
+    }
+}
+
+qint64 FrameCache::chunkSize(const QString &payloadId, const QString &variant, qint64 proposed)
+{
+    QMutexLocker locker(&m_mutex);
+    
+    auto chunkSize = m_chunkSizes.constFind(qMakePair(payloadId, variant));
+    if (chunkSize != m_chunkSizes.constEnd()) {
+        return chunkSize.value();
+    }
+    
+    m_chunkSizes.insert(qMakePair(payloadId, variant), proposed);
+    return proposed;
+}
+
+void FrameCache::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_tables.clear();
+    m_size = 0;
+}
+
+qint64 FrameCache::size() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_size;
+}
+
+qint64 FrameCache::hits() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_hits;
+}
+
+qint64 FrameCache::misses() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_misses;
+}
+
+void FrameCache::evict(const TableKey &keep)
+{
+    while (m_size > m_capacity) {
+        // Drop the least recently used table other than the one in use
+        auto oldest = m_tables.end();
+        for (auto it = m_tables.begin(); it != m_tables.end(); ++it) {
+            if (it.key() != keep && (oldest == m_tables.end() || it->lastUse < oldest->lastUse)) {
+                oldest = it;
+            }
+        }
+        
+        if (oldest == m_tables.end()) {
+            return;
+        }
+        
+        m_size -= oldest->bytes;
+        m_tables.erase(oldest);
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef FRAMECACHE_H
+#define FRAMECACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QPair>
+
+/**
+ * @brief The FrameCache class shares encoded chunk frames between update jobs
+ *
+ * When many devices of the same kind receive the same payload, every job
+ * would build the same wire frames. Frames are kept in one table per
+ * payload and protocol variant, by offset and chunk size, so each is
+ * encoded once and the other jobs only write the shared, read-only copy. QByteArray's
+ * implicit sharing makes a frame handed out stay valid even after it is
+ * evicted. Jobs only hit each other's frames if they cut the payload at the
+ * same offsets, so they agree on one chunk size through chunkSize() and cut
+ * chunks at multiples of it. Chunks a job cuts short, when it resumes
+ * mid-chunk or reaches a range the device fills itself, only match jobs
+ * that cut them the same way. Only fleet jobs are given a cache; frames of
+ * a single update would never be read again.
+ *
+ * Tables are evicted least recently used first once the cache holds more
+ * than its capacity. All methods are thread-safe.
+ */
+class FrameCache
+{
+public:
+    /**
+     * @brief Identifies one frame
+     */
+    struct Key {
+        QString payloadId;      ///< Firmware SHA-256 plus any encoding or delta
+        QString variant;        ///< Device protocol variant (DeviceInterface::frameVariant())
+        qint64 offset = 0;
+        qint64 size = 0;        ///< Payload bytes in the frame
+    };
+
+    /**
+     * @brief Construct a cache
+     * @param capacity Maximum bytes of frames kept
+     */
+    explicit FrameCache(qint64 capacity = 64 * 1024 * 1024);
+
+    void setCapacity(qint64 capacity);
+    qint64 capacity() const;
+
+    /**
+     * @brief Get a cached frame
+     * @param key Frame to look up
+     * @return The frame, or a null array if it is not cached
+     */
+    QByteArray find(const Key &key);
+
+    /**
+     * @brief Add an encoded frame
+     *
+     * Frames that do not fit into the capacity are not kept.
+     *
+     * @param key Frame identity
+     * @param frame Encoded frame
+     */
+    void insert(const Key &key, const QByteArray &frame);
+
+    /**
+     * @brief Agree on the chunk size frames of a payload are cut at
+     *
+     * The first job to ask sets the size for a payload and variant; later
+     * jobs get that size back and send fixed chunks of it.
+     *
+     * @param payloadId Firmware SHA-256 plus any encoding or delta
+     * @param variant Device protocol variant
+     * @param proposed Chunk size the calling job would use
+     * @return Chunk size to send shared frames with
+     */
+    qint64 chunkSize(const QString &payloadId, const QString &variant, qint64 proposed);
+
+    /**
+     * @brief Drop all frames
+     */
+    void clear();
+
+    /**
+     * @brief Get the bytes of frames held
+     */
+    qint64 size() const;
+
+    /**
+     * @brief Get the number of lookups answered from the cache
+     */
+    qint64 hits() const;
+
+    /**
+     * @brief Get the number of lookups that found no frame
+     */
+    qint64 misses() const;
+
+private:
+    struct Table {
+        QHash<QPair<qint64, qint64>, QByteArray> frames;   ///< By payload offset and size
+        qint64 bytes = 0;
+        quint64 lastUse = 0;
+    };
+
+    typedef QPair<QString, QString> TableKey;     ///< Payload and variant
+
+    void evict(const TableKey &keep);
+
+    mutable QMutex m_mutex;
+    QHash<TableKey, Table> m_tables;
+    QHash<TableKey, qint64> m_chunkSizes;    ///< Kept when tables are evicted
+    qint64 m_capacity;
+    qint64 m_size;
+    quint64 m_useCounter;
+    qint64 m_hits;
+    qint64 m_misses;
+};
+
+#endif // FRAMECACHE_H
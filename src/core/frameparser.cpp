@@ -0,0 +1,163 @@
+#include "frameparser.h"
+
+#include <QtEndian>
+
+// Size of the length prefix of LengthPrefixed messages
+const qint64 LENGTH_PREFIX_SIZE = 4;
+
+namespace {
+
+bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+} // namespace
+
+QByteArray FrameParser::Frame::bytes() const
+{
+    return QByteArray::fromRawData(data, static_cast<int>(size));
+}
+
+FrameParser::Frame FrameParser::Frame::trimmed() const
+{
+    Frame frame = *this;
+    while (frame.size > 0 && isSpace(frame.data[0])) {
+        frame.data++;
+        frame.size--;
+    }
+    while (frame.size > 0 && isSpace(frame.data[frame.size - 1])) {
+        frame.size--;
+    }
+    return frame;
+}
+
+FrameParser::FrameParser(Framing framing, qint64 capacity)
+    : m_buffer(capacity),
+      m_framing(framing),
+      m_scanned(0),
+      m_skip(0),
+      m_discarding(false)
+{
+}
+
+void FrameParser::setFraming(Framing framing)
+{
+    m_framing = framing;
+    m_scanned = 0;
+    m_discarding = false;
+}
+
+FrameParser::Framing FrameParser::framing() const
+{
+    return m_framing;
+}
+
+qint64 FrameParser::write(const char *data, qint64 length)
+{
+    return m_buffer.write(data, length);
+}
+
+FrameParser::Result FrameParser::next(Frame *frame)
+{
+    for (;;) {
+        // Finish dropping an oversized message first
+        if (m_skip > 0) {
+            qint64 n = qMin(m_skip, m_buffer.size());
+            m_buffer.discard(n);
+            m_skip -= n;
+            if (m_skip > 0) {
+                return NeedMoreData;
+            }
+        }
+        
+        if (m_framing == LengthPrefixed) {
+            if (m_buffer.size() < LENGTH_PREFIX_SIZE) {
+                return NeedMoreData;
+            }
+            
+            char prefix[LENGTH_PREFIX_SIZE];
+            m_buffer.peek(prefix, LENGTH_PREFIX_SIZE);
+            qint64 length = qFromLittleEndian<quint32>(prefix);
+            
+            if (LENGTH_PREFIX_SIZE + length > m_buffer.capacity()) {
+                m_buffer.discard(LENGTH_PREFIX_SIZE);
+                m_skip = length;
+                return FrameTooLarge;
+            }
+            
+            if (m_buffer.size() < LENGTH_PREFIX_SIZE + length) {
+                return NeedMoreData;
+            }
+            
+            *frame = view(LENGTH_PREFIX_SIZE, length);
+            m_buffer.discard(LENGTH_PREFIX_SIZE + length);
+            return FrameReady;
+        }
+        
+        // Only search the bytes that arrived since the last call
+        char delimiter = m_framing == LineDelimited ? '\n' : '\0';
+        qint64 end = m_buffer.indexOf(delimiter, m_scanned);
+        if (end < 0) {
+            m_scanned = m_buffer.size();
+            if (!m_buffer.isFull()) {
+                return NeedMoreData;
+            }
+            
+            // The delimiter can never fit; drop the message up to wherever it ends
+            m_buffer.clear();
+            m_scanned = 0;
+            if (m_discarding) {
+                return NeedMoreData;
+            }
+            m_discarding = true;
+            return FrameTooLarge;
+        }
+        
+        m_scanned = 0;
+        if (m_discarding) {
+            // Tail of an oversized message
+            m_buffer.discard(end + 1);
+            m_discarding = false;
+            continue;
+        }
+        
+        *frame = view(0, end);
+        m_buffer.discard(end + 1);
+        return FrameReady;
+    }
+}
+
+qint64 FrameParser::size() const
+{
+    return m_buffer.size();
+}
+
+void FrameParser::clear()
+{
+    m_buffer.clear();
+    m_scanned = 0;
+    m_skip = 0;
+    m_discarding = false;
+}
+
+FrameParser::Frame FrameParser::view(qint64 offset, qint64 length)
+{
+    Frame frame;
+    frame.size = length;
+    
+    RingBuffer::Span spans[2];
+    m_buffer.readSpans(spans);
+    if (offset + length <= spans[0].size) {
+        frame.data = spans[0].data + offset;
+        return frame;
+    }
+    
+    // The message wraps around the end of the ring; make it contiguous
+    if (!m_scratch) {
+        m_scratch.reset(new char[m_buffer.capacity()]);
+    }
+    m_buffer.peek(m_scratch.get(), length, offset);
+    frame.data = m_scratch.get();
+    return frame;
+}
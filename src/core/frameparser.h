@@ -0,0 +1,141 @@
+#ifndef FRAMEPARSER_H
+#define FRAMEPARSER_H
+
+#include "ringbuffer.h"
+
+#include <QByteArray>
+#include <memory>
+
+/**
+ * @brief The FrameParser class splits a byte stream into messages
+ *
+ * Received bytes go straight into a fixed-capacity ring buffer and complete
+ * messages are handed out as views into it, so parsing neither allocates nor
+ * moves the remaining bytes per message. Only a message that wraps around
+ * the end of the ring is copied, into a scratch buffer allocated once.
+ *
+ * Messages that can never fit into the buffer are dropped and reported, and
+ * parsing resumes with the next message.
+ */
+class FrameParser
+{
+public:
+    enum Framing {
+        LineDelimited,      ///< Messages end with '\n'
+        ZeroDelimited,      ///< Messages end with a 0x00 byte (e.g. COBS frames)
+        LengthPrefixed      ///< Messages start with their length as a 32-bit little-endian integer
+    };
+
+    enum Result {
+        NeedMoreData,       ///< No complete message buffered
+        FrameReady,         ///< A message was returned
+        FrameTooLarge       ///< A message larger than the buffer was dropped
+    };
+
+    /**
+     * @brief A message without its delimiter or length prefix
+     *
+     * The bytes stay valid until more data is written to the parser.
+     */
+    struct Frame {
+        const char *data = nullptr;
+        qint64 size = 0;
+
+        /**
+         * @brief Get the message as a byte array sharing its bytes
+         */
+        QByteArray bytes() const;
+
+        /**
+         * @brief Get the message without leading and trailing whitespace
+         */
+        Frame trimmed() const;
+    };
+
+    /**
+     * @brief Construct a parser
+     * @param framing How messages are delimited
+     * @param capacity Buffer size in bytes, rounded up to a power of two;
+     *        also the largest message that can be received
+     */
+    FrameParser(Framing framing, qint64 capacity);
+
+    /**
+     * @brief Change how messages are delimited
+     *
+     * Takes effect for the next message, so protocols can switch framing
+     * between two messages that arrived in the same read.
+     *
+     * @param framing How messages are delimited
+     */
+    void setFraming(Framing framing);
+    Framing framing() const;
+
+    /**
+     * @brief Append received bytes
+     * @param data Bytes
+     * @param length Number of bytes
+     * @return Number of bytes stored, less than length if the buffer filled up
+     */
+    qint64 write(const char *data, qint64 length);
+
+    /**
+     * @brief Read bytes directly into the free space of the buffer
+     * @param read Called as read(char *data, qint64 maxLength) and returning
+     *        the number of bytes stored, like QIODevice::read()
+     * @return Number of bytes added; 0 if the buffer is full or nothing was read
+     */
+    template <typename ReadFunction>
+    qint64 fill(ReadFunction read);
+
+    /**
+     * @brief Take the next complete message
+     * @param frame Receives the message if FrameReady is returned
+     * @return Parse result
+     */
+    Result next(Frame *frame);
+
+    /**
+     * @brief Get the number of buffered bytes not yet returned as messages
+     */
+    qint64 size() const;
+
+    /**
+     * @brief Drop all buffered bytes
+     */
+    void clear();
+
+private:
+    Frame view(qint64 offset, qint64 length);
+
+    RingBuffer m_buffer;
+    std::unique_ptr<char[]> m_scratch;
+    Framing m_framing;
+    qint64 m_scanned;       ///< Bytes already searched for a delimiter
+    qint64 m_skip;          ///< Bytes of an oversized length-prefixed message still to drop
+    bool m_discarding;      ///< Dropping an oversized delimited message up to its delimiter
+};
+
+template <typename ReadFunction>
+qint64 FrameParser::fill(ReadFunction read)
+{
+    RingBuffer::Span spans[2];
+    int count = m_buffer.writeSpans(spans);
+
+    qint64 total = 0;
+    for (int i = 0; i < count; ++i) {
+        qint64 n = read(spans[i].data, spans[i].size);
+        if (n <= 0) {
+            break;
+        }
+
+        m_buffer.commit(n);
+        total += n;
+        if (n < spans[i].size) {
+            break;
+        }
+    }
+    return total;
+}
+
+#endif // FRAMEPARSER_H
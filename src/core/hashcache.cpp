@@ -0,0 +1,166 @@
+#include "hashcache.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+
+#ifdef Q_OS_UNIX
+#include <sys/stat.h>
+#endif
+
+// Cache file format
+const quint32 CACHE_MAGIC = 0x46554843; // "FUHC"
+const quint32 CACHE_VERSION = 1;
+const int SHA256_DIGEST_SIZE = 32;
+
+bool HashCache::FileIdentity::operator==(const FileIdentity &other) const
+{
+    return size == other.size &&
+           mtimeNs == other.mtimeNs &&
+           inode == other.inode &&
+           device == other.device;
+}
+
+HashCache::HashCache(const QString &cacheDir)
+    : m_cacheDir(cacheDir)
+{
+    if (m_cacheDir.isEmpty()) {
+        m_cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/hashcache";
+    }
+}
+
+HashCache::FileIdentity HashCache::identityOf(const QFile &file)
+{
+    FileIdentity identity;
+
+#ifdef Q_OS_UNIX
+    // fstat the open handle so the identity belongs to the file actually read
+    struct stat st;
+    if (file.handle() < 0 || ::fstat(file.handle(), &st) != 0) {
+        return identity;
+    }
+    
+    identity.size = static_cast<qint64>(st.st_size);
+#if defined(Q_OS_DARWIN)
+    identity.mtimeNs = static_cast<qint64>(st.st_mtimespec.tv_sec) * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    identity.mtimeNs = static_cast<qint64>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+    identity.inode = static_cast<quint64>(st.st_ino);
+    identity.device = static_cast<quint64>(st.st_dev);
+#else
+    // No inode on this platform; size and mtime still catch rewrites
+    QFileInfo info(file.fileName());
+    if (!info.exists()) {
+        return identity;
+    }
+    
+    identity.size = info.size();
+    identity.mtimeNs = info.lastModified().toMSecsSinceEpoch() * 1000000LL;
+#endif
+    
+    return identity;
+}
+
+bool HashCache::lookup(const QString &filePath, const FileIdentity &identity, Entry *entry) const
+{
+    if (!identity.isValid() || !entry) {
+        return false;
+    }
+    
+    QFile file(entryPath(filePath));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_15);
+    
+    quint32 magic = 0;
+    quint32 version = 0;
+    QString cachedPath;
+    FileIdentity cachedIdentity;
+    Entry cached;
+    qint32 chunkCount = 0;
+    
+    in >> magic >> version;
+    if (magic != CACHE_MAGIC || version != CACHE_VERSION) {
+        return false;
+    }
+    
+    in >> cachedPath
+       >> cachedIdentity.size >> cachedIdentity.mtimeNs >> cachedIdentity.inode >> cachedIdentity.device
+       >> cached.sha256 >> cached.chunkSize >> chunkCount;
+    
+    if (in.status() != QDataStream::Ok || chunkCount < 0) {
+        return false;
+    }
+    
+    // Any change to the file invalidates the entry
+    if (cachedPath != QFileInfo(filePath).canonicalFilePath() || cachedIdentity != identity) {
+        return false;
+    }
+    
+    cached.chunkHashes.reserve(chunkCount);
+    for (qint32 i = 0; i < chunkCount; ++i) {
+        QByteArray digest(SHA256_DIGEST_SIZE, Qt::Uninitialized);
+        if (in.readRawData(digest.data(), SHA256_DIGEST_SIZE) != SHA256_DIGEST_SIZE) {
+            return false;
+        }
+        cached.chunkHashes.append(digest);
+    }
+    
+    *entry = cached;
+    return true;
+}
+
+bool HashCache::store(const QString &filePath, const FileIdentity &identity, const Entry &entry)
+{
+    if (!identity.isValid() || entry.sha256.isEmpty()) {
+        return false;
+    }
+    
+    if (!QDir().mkpath(m_cacheDir)) {
+        qWarning() << "Failed to create hash cache directory" << m_cacheDir;
+        return false;
+    }
+    
+    // QSaveFile replaces the entry atomically, so readers never see a torn write
+    QSaveFile file(entryPath(filePath));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write hash cache entry:" << file.errorString();
+        return false;
+    }
+    
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_15);
+    
+    out << CACHE_MAGIC << CACHE_VERSION
+        << QFileInfo(filePath).canonicalFilePath()
+        << identity.size << identity.mtimeNs << identity.inode << identity.device
+        << entry.sha256 << entry.chunkSize << static_cast<qint32>(entry.chunkHashes.size());
+    
+    for (const QByteArray &digest : entry.chunkHashes) {
+        out.writeRawData(digest.constData(), SHA256_DIGEST_SIZE);
+    }
+    
+    return file.commit();
+}
+
+void HashCache::remove(const QString &filePath)
+{
+    QFile::remove(entryPath(filePath));
+}
+
+QString HashCache::entryPath(const QString &filePath) const
+{
+    QByteArray key = QFileInfo(filePath).canonicalFilePath().toUtf8();
+    QByteArray name = QCryptographicHash::hash(key, QCryptographicHash::Sha256).toHex();
+    return m_cacheDir + "/" + QString::fromLatin1(name) + ".cache";
+}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+
+class QFile;
+
+/**
+ * @brief The HashCache class persists verified firmware hashes on disk
+ *
+ * Entries are keyed by the canonical file path and validated against the
+ * file's identity (size, modification time, inode and device), so a file
+ * that has been rewritten, replaced or touched since it was hashed is never
+ * served from the cache.
+ */
+class HashCache
+{
+public:
+    /**
+     * @brief Identity of a file on disk, used to detect changes
+     */
+    struct FileIdentity {
+        qint64 size = -1;
+        qint64 mtimeNs = 0;
+        quint64 inode = 0;
+        quint64 device = 0;
+
+        bool isValid() const { return size >= 0; }
+        bool operator==(const FileIdentity &other) const;
+        bool operator!=(const FileIdentity &other) const { return !(*this == other); }
+    };
+
+    /**
+     * @brief A cached verification result
+     */
+    struct Entry {
+        QString sha256;                     ///< Verified payload hash as hex string
+        qint64 chunkSize = 0;               ///< Payload bytes covered by each chunk digest
+        QVector<QByteArray> chunkHashes;    ///< Raw SHA-256 digest of each chunk
+    };
+
+    /**
+     * @brief Construct a cache stored in a directory
+     * @param cacheDir Directory for cache files (default: application cache location)
+     */
+    explicit HashCache(const QString &cacheDir = QString());
+
+    /**
+     * @brief Get the identity of an open file
+     * @param file Open file
+     * @return File identity, invalid on error
+     */
+    static FileIdentity identityOf(const QFile &file);
+
+    /**
+     * @brief Look up a cached result for a file
+     * @param filePath Path to the firmware file
+     * @param identity Current identity of the file
+     * @param entry Filled with the cached result on a hit
+     * @return true on a valid cache hit
+     */
+    bool lookup(const QString &filePath, const FileIdentity &identity, Entry *entry) const;
+
+    /**
+     * @brief Store a verified result for a file
+     * @param filePath Path to the firmware file
+     * @param identity Identity of the file that was hashed
+     * @param entry Verified result
+     * @return true if the entry was written
+     */
+    bool store(const QString &filePath, const FileIdentity &identity, const Entry &entry);
+
+    /**
+     * @brief Drop the cached result for a file
+     * @param filePath Path to the firmware file
+     */
+    void remove(const QString &filePath);
+
+private:
+    QString m_cacheDir;
+
+    QString entryPath(const QString &filePath) const;
+};
+
+#endif // HASHCACHE_H
\ No newline at end of file
@@ -0,0 +1,44 @@
+#include "logging.h"
+
+#include <QStringList>
+
+// Debug output is opt-in through logging rules
+Q_LOGGING_CATEGORY(lcCore, "flashup.core", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcJob, "flashup.job", QtInfoMsg)
+Q_LOGGING_CATEGORY(lcOta, "flashup.ota", QtInfoMsg)
+
+bool Logging::isEnabled(const QLoggingCategory &category, int level)
+{
+    switch (level) {
+        case Debug: return category.isDebugEnabled();
+        case Info: return category.isInfoEnabled();
+        case Warning: return category.isWarningEnabled();
+        default: return category.isCriticalEnabled();
+    }
+}
+
+LogEvent::LogEvent(const QLoggingCategory &category, int level, const QString &message)
+    : level(level),
+      category(category.categoryName()),
+      message(message)
+{
+}
+
+QString LogEvent::toString() const
+{
+    QStringList fields;
+    if (!deviceId.isEmpty()) {
+        fields << deviceId;
+    }
+    if (offset >= 0) {
+        fields << QString("offset %1").arg(offset);
+    }
+    if (bytes >= 0) {
+        fields << QString("%1 bytes").arg(bytes);
+    }
+    
+    if (fields.isEmpty()) {
+        return message;
+    }
+    return QString("%1 (%2)").arg(message, fields.join(", "));
+}
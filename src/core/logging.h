@@ -0,0 +1,94 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+#include <QString>
+#include <QMetaType>
+#include <QLoggingCategory>
+
+/**
+ * Lowest level compiled in; building with FLASHUP_LOG_MIN_LEVEL=1
+ * (CMake option FLASHUP_DEBUG_LOGGING=OFF) removes debug events entirely.
+ */
+#ifndef FLASHUP_LOG_MIN_LEVEL
+#define FLASHUP_LOG_MIN_LEVEL 0
+#endif
+
+/**
+ * @brief Check whether events of a level are wanted in a category
+ *
+ * Guard every event with this before building it, so that disabled events
+ * cost a single check and no formatting:
+ *
+ * @code
+ * if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+ *     LogEvent event(lcJob(), Logging::Debug, "Chunk sent");
+ *     event.offset = offset;
+ *     emit logEvent(event);
+ * }
+ * @endcode
+ *
+ * Levels below FLASHUP_LOG_MIN_LEVEL make the condition a compile-time
+ * false, so the guarded code is dropped.
+ */
+#define FLASHUP_LOG_ENABLED(category, level) \
+    ((level) >= FLASHUP_LOG_MIN_LEVEL && Logging::isEnabled(category(), (level)))
+
+namespace Logging {
+
+/**
+ * @brief Log levels, matching the level argument of the logMessage() signals
+ */
+enum Level {
+    Debug = 0,
+    Info = 1,
+    Warning = 2,
+    Error = 3
+};
+
+/**
+ * @brief Check a level against a category's rules
+ *
+ * Categories follow Qt's logging rules, e.g.
+ * QT_LOGGING_RULES="flashup.serial.debug=true". FlashUp categories have
+ * debug output disabled unless a rule enables it.
+ *
+ * @param category Logging category
+ * @param level Level
+ * @return true if events of this level should be emitted
+ */
+bool isEnabled(const QLoggingCategory &category, int level);
+
+} // namespace Logging
+
+/**
+ * @brief A log event with typed fields
+ *
+ * Fields stay separate until the event is shown, so nothing is formatted
+ * for events that are filtered out on the way.
+ */
+struct LogEvent
+{
+    int level = Logging::Info;
+    const char *category = "";      ///< Category name, e.g. "flashup.job"
+    QString deviceId;               ///< Empty if not about a device
+    qint64 offset = -1;             ///< Firmware offset, -1 if none
+    qint64 bytes = -1;              ///< Byte count, -1 if none
+    QString message;                ///< Text without the fields above
+
+    LogEvent() = default;
+    LogEvent(const QLoggingCategory &category, int level, const QString &message);
+
+    /**
+     * @brief Format the message with its fields
+     * @return e.g. "Chunk sent (serial:/dev/ttyUSB0, offset 4096, 1024 bytes)"
+     */
+    QString toString() const;
+};
+
+Q_DECLARE_METATYPE(LogEvent)
+
+Q_DECLARE_LOGGING_CATEGORY(lcCore)
+Q_DECLARE_LOGGING_CATEGORY(lcJob)
+Q_DECLARE_LOGGING_CATEGORY(lcOta)
+
+#endif // LOGGING_H
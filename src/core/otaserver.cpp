@@ -0,0 +1,609 @@
+#include "otaserver.h"
+#include "firmwarepackage.h"
+
+#include <QTcpSocket>
+#include <QFile>
+#include <QMutexLocker>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+#include <sys/sendfile.h>
+#include <csignal>
+#include <cerrno>
+#endif
+
+// Constants
+const int MAX_REQUEST_HEAD_SIZE = 8 * 1024;
+const int KEEP_ALIVE_TIMEOUT_MS = 30000;
+const int IDLE_CHECK_INTERVAL_MS = 5000;
+
+// Body bytes sent to one client before the others get a turn
+const qint64 SEND_BURST_SIZE = 1024 * 1024;
+
+// Copying path: slice size and bytes to keep queued in the socket
+const qint64 SEND_SLICE_SIZE = 64 * 1024;
+const qint64 SEND_QUEUE_TARGET = 256 * 1024;
+
+// sendfile() path: slice queued through the socket when the kernel buffer is
+// full, so that bytesWritten() tells when to continue
+const qint64 WAKEUP_SLICE_SIZE = 4 * 1024;
+
+namespace {
+
+enum RangeResult {
+    NoRange,            ///< No usable Range header; send the whole image
+    ValidRange,
+    UnsatisfiableRange
+};
+
+QString clientAddress(const QHostAddress &address)
+{
+    bool isIPv4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isIPv4);
+    return isIPv4 ? QHostAddress(ipv4).toString() : address.toString();
+}
+
+QByteArray reasonPhrase(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 416: return "Range Not Satisfiable";
+        case 431: return "Request Header Fields Too Large";
+        default: return "Error";
+    }
+}
+
+// Parse a single "bytes=first-last", "bytes=first-" or "bytes=-suffix" range
+// into [*start, *end). Multiple ranges would need a multipart response, so
+// they are ignored like malformed ones and the whole image is sent.
+RangeResult parseRange(const QByteArray &value, qint64 size, qint64 *start, qint64 *end)
+{
+    QByteArray spec = value.trimmed();
+    if (!spec.startsWith("bytes=") || spec.contains(',')) {
+        return NoRange;
+    }
+    
+    spec = spec.mid(6);
+    int dash = spec.indexOf('-');
+    if (dash < 0) {
+        return NoRange;
+    }
+    
+    QByteArray first = spec.left(dash).trimmed();
+    QByteArray last = spec.mid(dash + 1).trimmed();
+    bool ok = false;
+    
+    if (first.isEmpty()) {
+        qint64 suffix = last.toLongLong(&ok);
+        if (!ok || suffix < 0) {
+            return NoRange;
+        }
+        if (suffix == 0 || size == 0) {
+            return UnsatisfiableRange;
+        }
+        
+        *start = qMax<qint64>(0, size - suffix);
+        *end = size;
+        return ValidRange;
+    }
+    
+    qint64 from = first.toLongLong(&ok);
+    if (!ok || from < 0) {
+        return NoRange;
+    }
+    
+    qint64 to = size - 1;
+    if (!last.isEmpty()) {
+        to = last.toLongLong(&ok);
+        if (!ok || to < from) {
+            return NoRange;
+        }
+    }
+    
+    if (from >= size) {
+        return UnsatisfiableRange;
+    }
+    
+    *start = from;
+    *end = qMin(to, size - 1) + 1;
+    return ValidRange;
+}
+
+bool matchesEtag(const QByteArray &value, const QByteArray &etag)
+{
+    const QList<QByteArray> tags = value.split(',');
+    for (const QByteArray &tag : tags) {
+        QByteArray trimmed = tag.trimmed();
+        if (trimmed.startsWith("W/")) {
+            trimmed = trimmed.mid(2);
+        }
+        if (trimmed == "*" || trimmed == etag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // namespace
+
+OtaServer::OtaServer(QObject *parent)
+    : QObject(parent),
+      m_server(this),
+      m_port(0),
+      m_idleTimer(this)
+{
+    connect(&m_server, &QTcpServer::newConnection,
+            this, &OtaServer::onNewConnection);
+    
+    connect(&m_idleTimer, &QTimer::timeout,
+            this, &OtaServer::onIdleCheck);
+}
+
+OtaServer::~OtaServer()
+{
+    close();
+}
+
+bool OtaServer::listen(const QHostAddress &address, quint16 port)
+{
+#ifdef Q_OS_LINUX
+    // sendfile() cannot be told MSG_NOSIGNAL; a client closing mid-body must
+    // end in EPIPE rather than kill the process
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    if (!m_server.listen(address, port)) {
+        emit logMessage(3, QString("OTA server failed to listen on port %1: %2")
+                           .arg(port).arg(m_server.errorString()));
+        return false;
+    }
+    
+    m_port.storeRelease(m_server.serverPort());
+    m_idleTimer.start(IDLE_CHECK_INTERVAL_MS);
+    emit logMessage(1, QString("OTA server listening on port %1").arg(serverPort()));
+    return true;
+}
+
+void OtaServer::close()
+{
+    m_server.close();
+    m_port.storeRelease(0);
+    m_idleTimer.stop();
+    
+    const QList<QTcpSocket *> sockets = m_connections.keys();
+    for (QTcpSocket *socket : sockets) {
+        socket->abort();
+        dropConnection(socket);
+    }
+}
+
+bool OtaServer::isListening() const
+{
+    // Devices on worker threads ask too, so the socket itself is not read here
+    return m_port.loadAcquire() != 0;
+}
+
+quint16 OtaServer::serverPort() const
+{
+    return static_cast<quint16>(m_port.loadAcquire());
+}
+
+QString OtaServer::errorString() const
+{
+    return m_server.errorString();
+}
+
+QString OtaServer::publish(std::shared_ptr<FirmwarePackage> firmware)
+{
+    QString path = QString("/firmware/%1.bin").arg(firmware->sha256Hash());
+    
+    QMutexLocker locker(&m_imagesMutex);
+    if (m_images.contains(path)) {
+        return path;
+    }
+    
+    auto image = std::make_shared<Image>();
+    image->firmware = firmware;
+    image->path = path;
+    image->etag = '"' + firmware->sha256Hash().toLatin1() + '"';
+    image->size = firmware->size();
+
+#ifdef Q_OS_LINUX
+    // Uncompressed images go from the package file straight to the sockets
+    QString filePath;
+    if (firmware->imageFileRange(&filePath, &image->fileOffset)) {
+        image->file.reset(new QFile(filePath));
+        if (!image->file->open(QIODevice::ReadOnly)) {
+            image->file.reset();
+        }
+    }
+#endif
+
+    m_images.insert(path, image);
+    return path;
+}
+
+void OtaServer::unpublish(const QString &path)
+{
+    QMutexLocker locker(&m_imagesMutex);
+    m_images.remove(path);
+}
+
+QUrl OtaServer::url(const QString &path, const QString &host) const
+{
+    QUrl url;
+    url.setScheme("http");
+    url.setHost(host);
+    url.setPort(serverPort());
+    url.setPath(path);
+    return url;
+}
+
+QMap<QString, OtaServer::ClientStats> OtaServer::clientStats() const
+{
+    QMap<QString, ClientStats> stats = m_stats;
+    QMap<QString, qint64> sendMs = m_sendMs;
+    
+    // Bodies still being sent count with the time spent on them so far
+    for (const std::shared_ptr<Connection> &connection : m_connections) {
+        if (connection->sending) {
+            sendMs[connection->client] += connection->sendTimer.elapsed();
+        }
+    }
+    
+    for (auto it = stats.begin(); it != stats.end(); ++it) {
+        qint64 ms = sendMs.value(it.key());
+        it->bytesPerSecond = ms > 0 ? it->bytesSent * 1000 / ms : 0;
+    }
+    return stats;
+}
+
+void OtaServer::onNewConnection()
+{
+    while (m_server.hasPendingConnections()) {
+        QTcpSocket *socket = m_server.nextPendingConnection();
+        
+        auto connection = std::make_shared<Connection>();
+        connection->socket = socket;
+        connection->client = clientAddress(socket->peerAddress());
+        connection->idleTimer.start();
+        m_connections.insert(socket, connection);
+        
+        ClientStats &stats = m_stats[connection->client];
+        stats.address = connection->client;
+        stats.connections++;
+        
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() {
+            std::shared_ptr<Connection> connection = m_connections.value(socket);
+            if (connection) {
+                processRequests(*connection);
+            }
+        });
+        connect(socket, &QTcpSocket::bytesWritten, this, [this, socket]() {
+            std::shared_ptr<Connection> connection = m_connections.value(socket);
+            if (connection && connection->sending) {
+                sendBody(*connection);
+            }
+        });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            dropConnection(socket);
+        });
+    }
+}
+
+void OtaServer::onIdleCheck()
+{
+    QList<QTcpSocket *> idle;
+    for (const std::shared_ptr<Connection> &connection : qAsConst(m_connections)) {
+        if (!connection->sending && connection->idleTimer.elapsed() > KEEP_ALIVE_TIMEOUT_MS) {
+            idle.append(connection->socket);
+        }
+    }
+    
+    for (QTcpSocket *socket : qAsConst(idle)) {
+        socket->disconnectFromHost();
+    }
+}
+
+void OtaServer::dropConnection(QTcpSocket *socket)
+{
+    std::shared_ptr<Connection> connection = m_connections.take(socket);
+    if (!connection) {
+        return;
+    }
+    
+    if (connection->sending) {
+        m_sendMs[connection->client] += connection->sendTimer.elapsed();
+        emit logMessage(2, QString("%1 disconnected at byte %2 of %3")
+                           .arg(connection->client).arg(connection->position).arg(connection->end));
+    }
+    
+    m_stats[connection->client].connections--;
+    socket->deleteLater();
+}
+
+void OtaServer::processRequests(Connection &connection)
+{
+    // Pipelined requests wait in the socket until the current body is sent
+    while (!connection.sending && connection.socket->state() == QAbstractSocket::ConnectedState) {
+        connection.request += connection.socket->read(MAX_REQUEST_HEAD_SIZE + 4 - connection.request.size());
+        
+        int end = connection.request.indexOf("\r\n\r\n");
+        if (end < 0) {
+            if (connection.request.size() >= MAX_REQUEST_HEAD_SIZE) {
+                connection.keepAlive = false;
+                sendResponse(connection, 431, {"Content-Length: 0"});
+                connection.socket->disconnectFromHost();
+            }
+            return;
+        }
+        
+        QByteArray head = connection.request.left(end);
+        connection.request.remove(0, end + 4);
+        handleRequest(connection, head);
+        
+        if (!connection.sending && !connection.keepAlive) {
+            connection.socket->disconnectFromHost();
+            return;
+        }
+    }
+}
+
+void OtaServer::handleRequest(Connection &connection, const QByteArray &head)
+{
+    m_stats[connection.client].requests++;
+    
+    auto reject = [this, &connection](int status, QList<QByteArray> headers = QList<QByteArray>()) {
+        QByteArray body = reasonPhrase(status) + "\n";
+        headers << "Content-Type: text/plain" << "Content-Length: " + QByteArray::number(body.size());
+        sendResponse(connection, status, headers, body);
+    };
+    
+    QList<QByteArray> lines = head.split('\n');
+    QList<QByteArray> requestLine = lines.takeFirst().trimmed().split(' ');
+    if (requestLine.size() != 3 || !requestLine.at(2).startsWith("HTTP/1.")) {
+        connection.keepAlive = false;
+        reject(400);
+        return;
+    }
+    
+    QHash<QByteArray, QByteArray> headers;
+    for (const QByteArray &line : qAsConst(lines)) {
+        int colon = line.indexOf(':');
+        if (colon > 0) {
+            headers.insert(line.left(colon).trimmed().toLower(), line.mid(colon + 1).trimmed());
+        }
+    }
+    
+    // HTTP/1.1 keeps connections open unless told otherwise, HTTP/1.0 only when asked to
+    QByteArray connectionHeader = headers.value("connection").toLower();
+    connection.keepAlive = requestLine.at(2) == "HTTP/1.0" ? connectionHeader.contains("keep-alive")
+                                                           : !connectionHeader.contains("close");
+    
+    const QByteArray &method = requestLine.at(0);
+    if (method != "GET" && method != "HEAD") {
+        // A request body may follow that we would have to skip; close instead
+        connection.keepAlive = false;
+        reject(405, {"Allow: GET, HEAD"});
+        return;
+    }
+    
+    QByteArray target = requestLine.at(1);
+    if (!target.startsWith('/')) {
+        target = QUrl::fromEncoded(target).path(QUrl::FullyEncoded).toLatin1();
+    }
+    int query = target.indexOf('?');
+    if (query >= 0) {
+        target.truncate(query);
+    }
+    
+    std::shared_ptr<Image> image = findImage(QString::fromLatin1(target));
+    if (!image) {
+        reject(404);
+        return;
+    }
+    
+    QByteArray etagHeader = "ETag: " + image->etag;
+    if (headers.contains("if-none-match") && matchesEtag(headers.value("if-none-match"), image->etag)) {
+        sendResponse(connection, 304, {etagHeader});
+        return;
+    }
+    
+    // A resumed download only gets the rest of the image if it is still the same image
+    qint64 start = 0;
+    qint64 end = image->size;
+    RangeResult range = NoRange;
+    if (headers.contains("range") &&
+        (!headers.contains("if-range") || headers.value("if-range") == image->etag)) {
+        range = parseRange(headers.value("range"), image->size, &start, &end);
+    }
+    
+    if (range == UnsatisfiableRange) {
+        reject(416, {"Content-Range: bytes */" + QByteArray::number(image->size)});
+        return;
+    }
+    
+    QList<QByteArray> responseHeaders;
+    responseHeaders << "Content-Type: application/octet-stream"
+                    << "Content-Length: " + QByteArray::number(end - start)
+                    << "Accept-Ranges: bytes"
+                    << etagHeader;
+    if (range == ValidRange) {
+        responseHeaders << "Content-Range: bytes " + QByteArray::number(start) + "-" +
+                           QByteArray::number(end - 1) + "/" + QByteArray::number(image->size);
+    }
+    
+    if (FLASHUP_LOG_ENABLED(lcOta, Logging::Debug)) {
+        LogEvent event(lcOta(), Logging::Debug, QString("%1 %2").arg(QString::fromLatin1(method), image->path));
+        event.deviceId = connection.client;
+        event.offset = start;
+        event.bytes = end - start;
+        emit logEvent(event);
+    }
+    
+    sendResponse(connection, range == ValidRange ? 206 : 200, responseHeaders);
+    if (method == "HEAD" || start == end) {
+        return;
+    }
+    
+    connection.image = image;
+    connection.start = start;
+    connection.position = start;
+    connection.end = end;
+    connection.sending = true;
+    connection.sendTimer.start();
+    sendBody(connection);
+}
+
+void OtaServer::sendResponse(Connection &connection, int status, const QList<QByteArray> &headers,
+                             const QByteArray &body)
+{
+    QByteArray response;
+    response.reserve(256 + body.size());
+    response += "HTTP/1.1 " + QByteArray::number(status) + ' ' + reasonPhrase(status) + "\r\n";
+    for (const QByteArray &header : headers) {
+        response += header + "\r\n";
+    }
+    response += connection.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    response += body;
+    
+    connection.socket->write(response);
+}
+
+void OtaServer::sendBody(Connection &connection)
+{
+    qint64 burst = 0;
+    while (connection.position < connection.end &&
+           connection.socket->state() == QAbstractSocket::ConnectedState) {
+        // Take turns with other clients rather than sending a whole image to a fast one
+        if (burst >= SEND_BURST_SIZE) {
+            resumeLater(connection.socket);
+            break;
+        }
+        
+        qint64 remaining = connection.end - connection.position;
+        qint64 sent = 0;
+        
+        if (connection.image->file) {
+            // Headers and slices queued in the socket must go out first;
+            // bytesWritten() brings us back once they have
+            if (connection.socket->bytesToWrite() > 0) {
+                break;
+            }
+            
+            sent = sendFile(connection, qMin(remaining, SEND_BURST_SIZE - burst));
+            if (sent == 0) {
+                // The kernel buffer is full
+                sent = writeSlice(connection, qMin(remaining, WAKEUP_SLICE_SIZE));
+                if (sent > 0) {
+                    burst += sent;
+                }
+                break;
+            }
+        } else {
+            if (connection.socket->bytesToWrite() >= SEND_QUEUE_TARGET) {
+                break;
+            }
+            
+            sent = writeSlice(connection, qMin(remaining, SEND_SLICE_SIZE));
+        }
+        
+        if (sent < 0) {
+            break;
+        }
+        burst += sent;
+    }
+    
+    if (burst > 0) {
+        m_stats[connection.client].bytesSent += burst;
+        emit bytesServed(connection.client, connection.image->path, connection.start, connection.position,
+                         connection.image->size);
+    }
+    
+    if (connection.sending && connection.position >= connection.end) {
+        finishBody(connection);
+    }
+}
+
+qint64 OtaServer::writeSlice(Connection &connection, qint64 size)
+{
+    QByteArray data = connection.image->firmware->getChunk(connection.position, size);
+    if (data.isEmpty() || connection.socket->write(data) != data.size()) {
+        emit logMessage(3, QString("Failed to read image for %1 at offset %2")
+                           .arg(connection.client).arg(connection.position));
+        connection.socket->abort();
+        return -1;
+    }
+    
+    connection.position += data.size();
+    return data.size();
+}
+
+qint64 OtaServer::sendFile(Connection &connection, qint64 size)
+{
+#ifdef Q_OS_LINUX
+    off_t offset = static_cast<off_t>(connection.image->fileOffset + connection.position);
+    for (;;) {
+        ssize_t n = ::sendfile(static_cast<int>(connection.socket->socketDescriptor()),
+                               connection.image->file->handle(), &offset, static_cast<size_t>(size));
+        if (n > 0) {
+            connection.position += n;
+            return n;
+        }
+        
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        
+        // A 0 return means the package file is shorter than it was when loaded
+        emit logMessage(3, QString("sendfile to %1 failed: %2")
+                           .arg(connection.client, n < 0 ? qt_error_string(errno) : QString("end of file")));
+        connection.socket->abort();
+        return -1;
+    }
+#else
+    Q_UNUSED(connection);
+    Q_UNUSED(size);
+    return -1;
+#endif
+}
+
+void OtaServer::finishBody(Connection &connection)
+{
+    connection.sending = false;
+    connection.image.reset();
+    connection.idleTimer.restart();
+    m_sendMs[connection.client] += connection.sendTimer.elapsed();
+    
+    if (!connection.keepAlive) {
+        connection.socket->disconnectFromHost();
+        return;
+    }
+    
+    processRequests(connection);
+}
+
+void OtaServer::resumeLater(QTcpSocket *socket)
+{
+    // Queued on the socket, so the call is dropped if the socket goes away first
+    QMetaObject::invokeMethod(socket, [this, socket]() {
+        std::shared_ptr<Connection> connection = m_connections.value(socket);
+        if (connection && connection->sending) {
+            sendBody(*connection);
+        }
+    }, Qt::QueuedConnection);
+}
+
+std::shared_ptr<OtaServer::Image> OtaServer::findImage(const QString &path) const
+{
+    QMutexLocker locker(&m_imagesMutex);
+    return m_images.value(path);
+}
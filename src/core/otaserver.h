@@ -0,0 +1,187 @@
+#ifndef OTASERVER_H
+#define OTASERVER_H
+
+#include "logging.h"
+
+#include <QObject>
+#include <QAtomicInteger>
+#include <QTcpServer>
+#include <QHostAddress>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QUrl>
+#include <memory>
+
+class QTcpSocket;
+class QFile;
+class FirmwarePackage;
+
+/**
+ * @brief The OtaServer class serves firmware packages over HTTP/1.1
+ *
+ * Pull-mode devices download their image themselves; the server hands out
+ * every published package at /firmware/<sha256>.bin with single-range
+ * requests, keep-alive and pipelining, and an ETag equal to the SHA-256 so
+ * that interrupted downloads resume with If-Range. All connections are
+ * served from the thread the server lives in.
+ *
+ * On Linux the body of an uncompressed package goes from the package file
+ * to the socket with sendfile(), so serving does not copy the image through
+ * user space. Compressed packages are decoded with getChunk().
+ */
+class OtaServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Transfer totals of one client address
+     */
+    struct ClientStats {
+        QString address;
+        int connections = 0;        ///< Open connections
+        qint64 requests = 0;
+        qint64 bytesSent = 0;       ///< Body bytes handed to the socket
+        qint64 bytesPerSecond = 0;  ///< Average while a body was being sent
+    };
+
+    explicit OtaServer(QObject *parent = nullptr);
+    ~OtaServer();
+
+    /**
+     * @brief Start accepting connections
+     * @param address Address to listen on
+     * @param port Port to listen on, 0 to pick a free one
+     * @return true if the server is listening
+     */
+    bool listen(const QHostAddress &address = QHostAddress::Any, quint16 port = 0);
+
+    /**
+     * @brief Stop accepting connections and drop open ones
+     */
+    void close();
+
+    /**
+     * @brief Check whether the server accepts connections
+     *
+     * May be called from any thread, as may serverPort() and url().
+     */
+    bool isListening() const;
+    quint16 serverPort() const;
+    QString errorString() const;
+
+    /**
+     * @brief Make a firmware package available for download
+     *
+     * Publishing the same image again returns the same path. May be called
+     * from any thread.
+     *
+     * @param firmware Package to serve; kept alive while published or downloading
+     * @return Request path of the image
+     */
+    QString publish(std::shared_ptr<FirmwarePackage> firmware);
+
+    /**
+     * @brief Stop offering an image; downloads in progress still finish
+     * @param path Path returned by publish()
+     */
+    void unpublish(const QString &path);
+
+    /**
+     * @brief Get the URL a device reaches a published image at
+     * @param path Path returned by publish()
+     * @param host Host address of this machine as seen from the device
+     * @return Download URL
+     */
+    QUrl url(const QString &path, const QString &host) const;
+
+    /**
+     * @brief Get the transfer totals of every client seen so far
+     * @return Stats keyed by client address
+     */
+    QMap<QString, ClientStats> clientStats() const;
+
+signals:
+    /**
+     * @brief Emitted after body bytes of an image were handed to a client's socket
+     * @param client Client address, IPv4-mapped addresses converted to IPv4
+     * @param path Request path of the image
+     * @param start First image byte of this response's range
+     * @param end One past the last image byte sent so far in this response
+     * @param total Image size
+     */
+    void bytesServed(const QString &client, const QString &path, qint64 start, qint64 end, qint64 total);
+
+    /**
+     * @brief Emitted for log messages
+     * @param level Log level (0=debug, 1=info, 2=warning, 3=error)
+     * @param message Log message
+     */
+    void logMessage(int level, const QString &message);
+
+    /**
+     * @brief Emitted for structured log events, e.g. one per request
+     * @param event Event with typed fields
+     */
+    void logEvent(const LogEvent &event);
+
+private slots:
+    void onNewConnection();
+    void onIdleCheck();
+
+private:
+    /**
+     * @brief A published image
+     */
+    struct Image {
+        std::shared_ptr<FirmwarePackage> firmware;
+        QString path;
+        QByteArray etag;
+        qint64 size = 0;
+        std::unique_ptr<QFile> file;    ///< Package file for sendfile(), nullptr to copy through getChunk()
+        qint64 fileOffset = 0;          ///< Position of the image in file
+    };
+
+    /**
+     * @brief A client connection and the response it is sending
+     */
+    struct Connection {
+        QTcpSocket *socket = nullptr;
+        QString client;
+        QByteArray request;             ///< Received bytes of the next request head
+        std::shared_ptr<Image> image;   ///< Image of the body being sent
+        qint64 start = 0;               ///< First image byte of the body
+        qint64 position = 0;            ///< Next image byte to send
+        qint64 end = 0;                 ///< One past the last image byte of the body
+        bool sending = false;
+        bool keepAlive = true;
+        QElapsedTimer sendTimer;        ///< Time spent on the current body
+        QElapsedTimer idleTimer;        ///< Time since the last request finished
+    };
+
+    QTcpServer m_server;
+    QAtomicInt m_port;                  ///< Port listened on, 0 while not listening
+    mutable QMutex m_imagesMutex;
+    QHash<QString, std::shared_ptr<Image>> m_images;
+    QHash<QTcpSocket *, std::shared_ptr<Connection>> m_connections;
+    QMap<QString, ClientStats> m_stats;
+    QMap<QString, qint64> m_sendMs;     ///< Per client, time spent sending finished bodies
+    QTimer m_idleTimer;
+
+    void dropConnection(QTcpSocket *socket);
+    void processRequests(Connection &connection);
+    void handleRequest(Connection &connection, const QByteArray &head);
+    void sendResponse(Connection &connection, int status, const QList<QByteArray> &headers,
+                      const QByteArray &body = QByteArray());
+    void sendBody(Connection &connection);
+    qint64 writeSlice(Connection &connection, qint64 size);
+    qint64 sendFile(Connection &connection, qint64 size);
+    void finishBody(Connection &connection);
+    void resumeLater(QTcpSocket *socket);
+    std::shared_ptr<Image> findImage(const QString &path) const;
+};
+
+#endif // OTASERVER_H
@@ -0,0 +1,165 @@
+#include "ringbuffer.h"
+
+#include <cstring>
+
+RingBuffer::RingBuffer(qint64 capacity)
+    : m_capacity(1),
+      m_head(0),
+      m_size(0)
+{
+    // Power-of-two capacity turns wrap-around into a mask
+    while (m_capacity < capacity) {
+        m_capacity <<= 1;
+    }
+    m_mask = m_capacity - 1;
+    m_data.reset(new char[m_capacity]);
+}
+
+qint64 RingBuffer::capacity() const
+{
+    return m_capacity;
+}
+
+qint64 RingBuffer::size() const
+{
+    return m_size;
+}
+
+qint64 RingBuffer::freeSpace() const
+{
+    return m_capacity - m_size;
+}
+
+bool RingBuffer::isEmpty() const
+{
+    return m_size == 0;
+}
+
+bool RingBuffer::isFull() const
+{
+    return m_size == m_capacity;
+}
+
+qint64 RingBuffer::write(const char *data, qint64 length)
+{
+    Span spans[2];
+    writeSpans(spans);
+    
+    qint64 written = 0;
+    for (const Span &span : spans) {
+        qint64 n = qMin(span.size, length - written);
+        if (n <= 0) {
+            break;
+        }
+        std::memcpy(span.data, data + written, n);
+        written += n;
+    }
+    
+    commit(written);
+    return written;
+}
+
+qint64 RingBuffer::read(char *data, qint64 maxLength)
+{
+    qint64 n = peek(data, maxLength);
+    discard(n);
+    return n;
+}
+
+qint64 RingBuffer::readAll(QByteArray &out)
+{
+    Span spans[2];
+    int count = readSpans(spans);
+    for (int i = 0; i < count; ++i) {
+        out.append(spans[i].data, static_cast<int>(spans[i].size));
+    }
+    
+    qint64 n = m_size;
+    clear();
+    return n;
+}
+
+qint64 RingBuffer::peek(char *data, qint64 maxLength, qint64 offset) const
+{
+    qint64 length = qMin(maxLength, m_size - offset);
+    if (length <= 0) {
+        return 0;
+    }
+    
+    qint64 start = (m_head + offset) & m_mask;
+    qint64 first = qMin(length, m_capacity - start);
+    std::memcpy(data, m_data.get() + start, first);
+    std::memcpy(data + first, m_data.get(), length - first);
+    return length;
+}
+
+char RingBuffer::at(qint64 index) const
+{
+    return m_data[(m_head + index) & m_mask];
+}
+
+qint64 RingBuffer::indexOf(char c, qint64 from) const
+{
+    if (from >= m_size) {
+        return -1;
+    }
+    
+    // Search each contiguous part with memchr
+    qint64 start = (m_head + from) & m_mask;
+    qint64 first = qMin(m_size - from, m_capacity - start);
+    const char *base = m_data.get();
+    
+    const void *found = std::memchr(base + start, c, first);
+    if (found) {
+        return from + (static_cast<const char *>(found) - (base + start));
+    }
+    
+    qint64 second = m_size - from - first;
+    found = second > 0 ? std::memchr(base, c, second) : nullptr;
+    if (found) {
+        return from + first + (static_cast<const char *>(found) - base);
+    }
+    
+    return -1;
+}
+
+void RingBuffer::discard(qint64 length)
+{
+    length = qBound<qint64>(0, length, m_size);
+    m_head = (m_head + length) & m_mask;
+    m_size -= length;
+    
+    // Restart at the front when empty so later data stays contiguous
+    if (m_size == 0) {
+        m_head = 0;
+    }
+}
+
+void RingBuffer::clear()
+{
+    m_head = 0;
+    m_size = 0;
+}
+
+int RingBuffer::readSpans(Span spans[2]) const
+{
+    qint64 first = qMin(m_size, m_capacity - m_head);
+    spans[0] = {m_data.get() + m_head, first};
+    spans[1] = {m_data.get(), m_size - first};
+    return (first > 0 ? 1 : 0) + (spans[1].size > 0 ? 1 : 0);
+}
+
+int RingBuffer::writeSpans(Span spans[2])
+{
+    qint64 tail = (m_head + m_size) & m_mask;
+    qint64 free = m_capacity - m_size;
+    qint64 first = qMin(free, m_capacity - tail);
+    spans[0] = {m_data.get() + tail, first};
+    spans[1] = {m_data.get(), free - first};
+    return (first > 0 ? 1 : 0) + (spans[1].size > 0 ? 1 : 0);
+}
+
+void RingBuffer::commit(qint64 length)
+{
+    m_size += qBound<qint64>(0, length, m_capacity - m_size);
+}
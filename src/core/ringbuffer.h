@@ -0,0 +1,128 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <memory>
+
+/**
+ * @brief The RingBuffer class is a fixed-capacity byte queue
+ *
+ * Storage is allocated once. Besides copying reads and writes, the free and
+ * filled regions are exposed as at most two contiguous spans each, so
+ * read()/write() system calls and parsers can work on the buffer in place.
+ *
+ * Not thread-safe; callers sharing a buffer provide their own locking.
+ */
+class RingBuffer
+{
+public:
+    /**
+     * @brief A contiguous region of the buffer
+     */
+    struct Span {
+        char *data = nullptr;
+        qint64 size = 0;
+    };
+
+    /**
+     * @brief Construct a buffer
+     * @param capacity Capacity in bytes, rounded up to a power of two
+     */
+    explicit RingBuffer(qint64 capacity);
+
+    qint64 capacity() const;
+    qint64 size() const;
+    qint64 freeSpace() const;
+    bool isEmpty() const;
+    bool isFull() const;
+
+    /**
+     * @brief Append bytes
+     * @param data Bytes to append
+     * @param length Number of bytes
+     * @return Number of bytes stored, less than length if the buffer filled up
+     */
+    qint64 write(const char *data, qint64 length);
+
+    /**
+     * @brief Remove bytes from the front
+     * @param data Destination
+     * @param maxLength Maximum number of bytes
+     * @return Number of bytes copied
+     */
+    qint64 read(char *data, qint64 maxLength);
+
+    /**
+     * @brief Move all bytes to the end of a byte array
+     * @param out Destination
+     * @return Number of bytes moved
+     */
+    qint64 readAll(QByteArray &out);
+
+    /**
+     * @brief Copy bytes without removing them
+     * @param data Destination
+     * @param maxLength Maximum number of bytes
+     * @param offset Position of the first byte to copy
+     * @return Number of bytes copied
+     */
+    qint64 peek(char *data, qint64 maxLength, qint64 offset = 0) const;
+
+    /**
+     * @brief Get a byte
+     * @param index Position from the front (must be less than size())
+     */
+    char at(qint64 index) const;
+
+    /**
+     * @brief Find a byte
+     * @param c Byte to find
+     * @param from Position to start at
+     * @return Position from the front, or -1 if not found
+     */
+    qint64 indexOf(char c, qint64 from = 0) const;
+
+    /**
+     * @brief Drop bytes from the front
+     * @param length Number of bytes (clamped to size())
+     */
+    void discard(qint64 length);
+
+    /**
+     * @brief Drop all bytes
+     */
+    void clear();
+
+    /**
+     * @brief Get the filled region in order
+     * @param spans Receives up to two spans; the second is empty unless the data wraps
+     * @return Number of non-empty spans
+     */
+    int readSpans(Span spans[2]) const;
+
+    /**
+     * @brief Get the free region in order
+     *
+     * Bytes placed there become part of the buffer through commit().
+     *
+     * @param spans Receives up to two spans; the second is empty unless the free space wraps
+     * @return Number of non-empty spans
+     */
+    int writeSpans(Span spans[2]);
+
+    /**
+     * @brief Append bytes placed into the spans from writeSpans()
+     * @param length Number of bytes (clamped to freeSpace())
+     */
+    void commit(qint64 length);
+
+private:
+    std::unique_ptr<char[]> m_data;
+    qint64 m_capacity;
+    qint64 m_mask;
+    qint64 m_head;      ///< Position of the first byte
+    qint64 m_size;
+};
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,220 @@
+#include "transferjournal.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QThread>
+
+// Journal file format and write throttling
+const quint32 JOURNAL_MAGIC = 0x46554A4E; // "FUJN"
+const quint32 JOURNAL_VERSION = 1;
+const qint64 FLUSH_BYTES = 64 * 1024;
+const qint64 FLUSH_INTERVAL_MS = 1000;
+
+TransferJournal::TransferJournal(const QString &journalDir)
+    : m_journalDir(journalDir),
+      m_writer(nullptr),
+      m_stopping(false)
+{
+    if (m_journalDir.isEmpty()) {
+        m_journalDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/journal";
+    }
+    
+    m_writer = QThread::create([this]() { runWriter(); });
+    m_writer->setObjectName("FlashUp journal writer");
+    m_writer->start();
+}
+
+TransferJournal::~TransferJournal()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_writeQueued.wakeOne();
+    }
+    
+    m_writer->wait();
+    delete m_writer;
+}
+
+qint64 TransferJournal::committedOffset(const QString &deviceId, const QString &firmwareHash) const
+{
+    QString key = entryKey(deviceId, firmwareHash);
+    
+    {
+        QMutexLocker locker(&m_mutex);
+        auto it = m_entries.constFind(key);
+        if (it != m_entries.constEnd()) {
+            return it->removed ? -1 : it->offset;
+        }
+    }
+    
+    // Files are only written for known entries, so this one is not being written
+    QFile file(entryPath(key));
+    if (!file.open(QIODevice::ReadOnly)) {
+        return -1;
+    }
+    
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_15);
+    
+    quint32 magic = 0;
+    quint32 version = 0;
+    QString storedDevice;
+    QString storedHash;
+    qint64 offset = -1;
+    
+    in >> magic >> version >> storedDevice >> storedHash >> offset;
+    
+    if (in.status() != QDataStream::Ok || magic != JOURNAL_MAGIC || version != JOURNAL_VERSION ||
+        storedDevice != deviceId || storedHash != firmwareHash) {
+        return -1;
+    }
+    
+    return offset;
+}
+
+void TransferJournal::record(const QString &deviceId, const QString &firmwareHash, qint64 offset)
+{
+    record(entryKey(deviceId, firmwareHash), deviceId, firmwareHash, offset);
+}
+
+void TransferJournal::record(const QString &key, const QString &deviceId, const QString &firmwareHash, qint64 offset)
+{
+    QMutexLocker locker(&m_mutex);
+    
+    // Only the first record of a transfer creates its entry; later ones share the strings
+    Entry &entry = m_entries[key];
+    entry.deviceId = deviceId;
+    entry.firmwareHash = firmwareHash;
+    entry.offset = offset;
+    
+    // A transfer started again after it was removed gets a new file
+    if (entry.removed) {
+        entry.removed = false;
+        entry.writtenOffset = -1;
+    }
+    
+    if (!entry.lastWrite.isValid() ||
+        entry.offset - entry.writtenOffset >= FLUSH_BYTES ||
+        entry.lastWrite.hasExpired(FLUSH_INTERVAL_MS)) {
+        queueWrite(entry);
+    }
+}
+
+void TransferJournal::flush(const QString &deviceId, const QString &firmwareHash)
+{
+    QString key = entryKey(deviceId, firmwareHash);
+    QMutexLocker locker(&m_mutex);
+    
+    auto it = m_entries.find(key);
+    if (it != m_entries.end() && !it->removed && it->offset != it->writtenOffset) {
+        queueWrite(it.value());
+    }
+}
+
+void TransferJournal::remove(const QString &deviceId, const QString &firmwareHash)
+{
+    QString key = entryKey(deviceId, firmwareHash);
+    QMutexLocker locker(&m_mutex);
+    
+    // The writer removes the file after any write still queued for it
+    Entry &entry = m_entries[key];
+    entry.removed = true;
+    queueWrite(entry);
+}
+
+QString TransferJournal::entryKey(const QString &deviceId, const QString &firmwareHash) const
+{
+    // Payload identifiers may share a hash prefix, so the key covers all of it
+    QByteArray device = QCryptographicHash::hash(deviceId.toUtf8(), QCryptographicHash::Sha256).toHex().left(16);
+    QByteArray payload = QCryptographicHash::hash(firmwareHash.toUtf8(), QCryptographicHash::Sha256).toHex().left(16);
+    return QString::fromLatin1(device + "-" + payload);
+}
+
+QString TransferJournal::entryPath(const QString &key) const
+{
+    return m_journalDir + "/" + key + ".journal";
+}
+
+void TransferJournal::queueWrite(Entry &entry)
+{
+    // Throttle retries as well, so an unwritable directory does not cost a write per chunk
+    entry.lastWrite.start();
+    
+    if (!entry.queued) {
+        entry.queued = true;
+        m_writeQueued.wakeOne();
+    }
+}
+
+void TransferJournal::runWriter()
+{
+    QMutexLocker locker(&m_mutex);
+    
+    for (;;) {
+        auto it = m_entries.begin();
+        while (it != m_entries.end() && !it->queued) {
+            ++it;
+        }
+        
+        if (it == m_entries.end()) {
+            // Everything queued before the destructor ran has been written
+            if (m_stopping) {
+                return;
+            }
+            m_writeQueued.wait(&m_mutex);
+            continue;
+        }
+        
+        // Write a snapshot without the lock, so recording never waits for the disk
+        QString key = it.key();
+        Entry snapshot = it.value();
+        it->queued = false;
+        locker.unlock();
+        
+        bool done = snapshot.removed ? QFile::remove(entryPath(key)) || !QFile::exists(entryPath(key))
+                                     : write(key, snapshot);
+        
+        locker.relock();
+        it = m_entries.find(key);
+        if (it == m_entries.end() || !done) {
+            continue;
+        }
+        
+        if (snapshot.removed) {
+            // Unless the transfer was recorded again meanwhile
+            if (it->removed && !it->queued) {
+                m_entries.erase(it);
+            }
+        } else if (!it->removed) {
+            it->writtenOffset = snapshot.offset;
+        }
+    }
+}
+
+bool TransferJournal::write(const QString &key, const Entry &entry) const
+{
+    if (!QDir().mkpath(m_journalDir)) {
+        qWarning() << "Failed to create transfer journal directory" << m_journalDir;
+        return false;
+    }
+    
+    // QSaveFile keeps the previous entry intact if we are interrupted mid-write
+    QSaveFile file(entryPath(key));
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "Failed to write transfer journal:" << file.errorString();
+        return false;
+    }
+    
+    // The key is only a file name; device and hash are stored in full and checked on read
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_15);
+    out << JOURNAL_MAGIC << JOURNAL_VERSION << entry.deviceId << entry.firmwareHash << entry.offset;
+    
+    return file.commit();
+}
\ No newline at end of file
@@ -0,0 +1,115 @@
+#ifndef TRANSFERJOURNAL_H
+#define TRANSFERJOURNAL_H
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+
+class QThread;
+
+/**
+ * @brief The TransferJournal class records upload progress so transfers can resume
+ *
+ * One small entry is kept per device and payload, holding the end of
+ * the contiguous range the device has acknowledged. Progress is recorded in
+ * memory on every acknowledgement and written to disk at most every
+ * FLUSH_INTERVAL or FLUSH_BYTES, so journaling stays off the hot path.
+ * Files are written and removed by one background thread, so no caller
+ * ever waits for another transfer's disk writes. All methods are
+ * thread-safe.
+ */
+class TransferJournal
+{
+public:
+    /**
+     * @brief Construct a journal stored in a directory
+     * @param journalDir Directory for journal files (default: application data location)
+     */
+    explicit TransferJournal(const QString &journalDir = QString());
+    
+    /**
+     * @brief Write all unsaved progress and stop the writer thread
+     */
+    ~TransferJournal();
+
+    /**
+     * @brief Get the recorded committed offset of a transfer
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     * @return Committed offset, or -1 if there is no entry
+     */
+    qint64 committedOffset(const QString &deviceId, const QString &firmwareHash) const;
+
+    /**
+     * @brief Record acknowledged progress of a transfer
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     * @param offset End of the contiguous acknowledged range
+     */
+    void record(const QString &deviceId, const QString &firmwareHash, qint64 offset);
+
+    /**
+     * @brief Record acknowledged progress of a transfer under a precomputed key
+     *
+     * Building a key hashes both identifiers, so callers recording on every
+     * acknowledgement compute it once with entryKey() and pass it here.
+     *
+     * @param key Entry key from entryKey() for deviceId and firmwareHash
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     * @param offset End of the contiguous acknowledged range
+     */
+    void record(const QString &key, const QString &deviceId, const QString &firmwareHash, qint64 offset);
+
+    /**
+     * @brief Write any unsaved progress of a transfer to disk
+     *
+     * The write is queued to the writer thread; the destructor waits for it.
+     *
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     */
+    void flush(const QString &deviceId, const QString &firmwareHash);
+
+    /**
+     * @brief Forget a transfer, e.g. after it completed
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     */
+    void remove(const QString &deviceId, const QString &firmwareHash);
+
+    /**
+     * @brief Get the key of a transfer's entry
+     * @param deviceId Device identifier
+     * @param firmwareHash Payload identifier, the firmware SHA-256 plus any encoding
+     * @return Key, also used as the journal file name
+     */
+    QString entryKey(const QString &deviceId, const QString &firmwareHash) const;
+
+private:
+    struct Entry {
+        QString deviceId;
+        QString firmwareHash;
+        qint64 offset = 0;
+        qint64 writtenOffset = -1;
+        QElapsedTimer lastWrite;
+        bool queued = false;    ///< Waiting for the writer thread
+        bool removed = false;   ///< File to be removed; dropped once it is gone
+    };
+
+    QString m_journalDir;
+    QHash<QString, Entry> m_entries;
+    mutable QMutex m_mutex;
+    QWaitCondition m_writeQueued;
+    QThread *m_writer;
+    bool m_stopping;
+
+    QString entryPath(const QString &key) const;
+    void queueWrite(Entry &entry);
+    void runWriter();
+    bool write(const QString &key, const Entry &entry) const;
+};
+
+#endif // TRANSFERJOURNAL_H
\ No newline at end of file
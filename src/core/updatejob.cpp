@@ -1,26 +1,83 @@
 #include "updatejob.h"
 #include "deviceinterface.h"
 #include "firmwarepackage.h"
+#include "transferjournal.h"
+#include "framecache.h"
+#include "chunkbufferpool.h"
+#include "logging.h"
 
 #include <QDebug>
 
 // Constants
 const int DEFAULT_MAX_RETRIES = 3;
 const int DEFAULT_RETRY_INTERVAL_MS = 1000;
+// Pacing for devices that do not report when they can take more data
 const int DEFAULT_CHUNK_INTERVAL_MS = 10;
+const int DEFAULT_ACK_TIMEOUT_MS = 3000;
+const int ACK_CHECK_INTERVAL_MS = 250;
+const int DEFAULT_MAX_RECONNECTS = 5;
+const int RECONNECT_INTERVAL_MS = 2000;
+const int HANDSHAKE_TIMEOUT_MS = 3000;
+
+namespace {
+
+// Built once, so that progress reports during an upload format no strings
+const QString &uploadingStatus(int progress)
+{
+    static const QVector<QString> statuses = []() {
+        QVector<QString> list;
+        for (int i = 0; i <= 100; ++i) {
+            list.append(QString("Uploading firmware (%1%)").arg(i));
+        }
+        return list;
+    }();
+    return statuses.at(qBound(0, progress, 100));
+}
+
+} // namespace
 
 UpdateJob::UpdateJob(std::shared_ptr<DeviceInterface> device, 
-                     FirmwarePackage *firmware,
+                     std::shared_ptr<FirmwarePackage> firmware,
                      QObject *parent)
     : QObject(parent),
       m_device(device),
       m_firmware(firmware),
+      m_deviceId(device->deviceId()),
       m_state(Idle),
       m_progress(0),
       m_currentOffset(0),
       m_retryCount(0),
       m_maxRetries(DEFAULT_MAX_RETRIES),
-      m_paused(false)
+      m_retryTimer(this),
+      m_chunkTimer(this),
+      m_paused(false),
+      m_windowSize(1),
+      m_outstanding(0),
+      m_ackedBytes(0),
+      m_unackedChunks(0),
+      m_inFlightHead(0),
+      m_inFlightCount(0),
+      m_ackTimer(this),
+      m_journal(nullptr),
+      m_frameCache(nullptr),
+      m_bufferPool(nullptr),
+      m_resumeSupported(false),
+      m_awaitingResumeOffset(false),
+      m_deviceReady(false),
+      m_resumeOffset(0),
+      m_reconnectAttempts(0),
+      m_reconnectTimer(this),
+      m_handshakeTimer(this),
+      m_deltaIndex(-1),
+      m_compressedPayload(false),
+      m_payloadSize(firmware->size()),
+      m_sparse(false),
+      m_segmentIndex(0),
+      m_skippedBytes(0),
+      m_deliveredBytes(0),
+      m_paced(false),
+      m_credit(-1),
+      m_pull(false)
 {
     // Connect device signals
     connect(m_device.get(), &DeviceInterface::connectionStatusChanged,
@@ -29,6 +86,20 @@ UpdateJob::UpdateJob(std::shared_ptr<DeviceInterface> device,
             this, &UpdateJob::onDeviceStateChanged);
     connect(m_device.get(), &DeviceInterface::logMessage,
             this, &UpdateJob::logMessage);
+    connect(m_device.get(), &DeviceInterface::logEvent,
+            this, &UpdateJob::logEvent);
+    connect(m_device.get(), &DeviceInterface::chunkAcknowledged,
+            this, &UpdateJob::onChunkAcknowledged);
+    connect(m_device.get(), &DeviceInterface::chunkRejected,
+            this, &UpdateJob::onChunkRejected);
+    connect(m_device.get(), &DeviceInterface::resumeOffsetReported,
+            this, &UpdateJob::onResumeOffsetReported);
+    connect(m_device.get(), &DeviceInterface::handshakeCompleted,
+            this, &UpdateJob::onHandshakeCompleted);
+    connect(m_device.get(), &DeviceInterface::readyForMoreData,
+            this, &UpdateJob::onReadyForMoreData);
+    connect(m_device.get(), &DeviceInterface::pullProgress,
+            this, &UpdateJob::onPullProgress);
     
     // Setup timers
     m_retryTimer.setSingleShot(true);
@@ -39,22 +110,53 @@ UpdateJob::UpdateJob(std::shared_ptr<DeviceInterface> device,
     connect(&m_chunkTimer, &QTimer::timeout,
             this, &UpdateJob::onUploadNextChunk);
     
+    connect(&m_ackTimer, &QTimer::timeout,
+            this, &UpdateJob::onAckTimeoutCheck);
+    
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, &QTimer::timeout,
+            this, &UpdateJob::onReconnectTimeout);
+    
+    m_handshakeTimer.setSingleShot(true);
+    connect(&m_handshakeTimer, &QTimer::timeout,
+            this, &UpdateJob::onHandshakeTimeout);
+    
     // Get optimal chunk size from device
     m_chunkSize = m_device->optimalChunkSize();
     if (m_chunkSize <= 0) {
         m_chunkSize = 4096; // Default chunk size
     }
     
-    emit logMessage(0, QString("Update job created for device %1").arg(m_device->deviceId()));
+    if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+        LogEvent event(lcJob(), Logging::Debug, "Update job created");
+        event.deviceId = m_deviceId;
+        emit logEvent(event);
+    }
 }
 
 UpdateJob::~UpdateJob()
 {
-    if (m_state == Uploading || m_state == Preparing || m_state == Connecting) {
+    if (m_state == Uploading || m_state == Preparing || m_state == Connecting ||
+        m_state == Reconnecting) {
         cancel();
     }
 }
 
+void UpdateJob::setJournal(TransferJournal *journal)
+{
+    m_journal = journal;
+}
+
+void UpdateJob::setFrameCache(FrameCache *cache)
+{
+    m_frameCache = cache;
+}
+
+void UpdateJob::setBufferPool(ChunkBufferPool *pool)
+{
+    m_bufferPool = pool;
+}
+
 void UpdateJob::start()
 {
     if (m_state != Idle) {
@@ -70,10 +172,7 @@ void UpdateJob::start()
     // Connect to device
     if (m_device->isConnected()) {
         // Already connected, proceed to prepare
-        setState(Preparing);
-        if (!m_device->beginUpdate()) {
-            failUpdate("Failed to initialize update on device");
-        }
+        prepareWhenReady();
     } else {
         // Connect first
         if (!m_device->connect()) {
@@ -92,6 +191,13 @@ void UpdateJob::cancel()
     
     m_retryTimer.stop();
     m_chunkTimer.stop();
+    m_ackTimer.stop();
+    m_reconnectTimer.stop();
+    m_handshakeTimer.stop();
+    
+    if (m_journal) {
+        m_journal->flush(m_deviceId, transferId());
+    }
     
     if (m_device->isConnected()) {
         m_device->cancelUpdate();
@@ -108,42 +214,65 @@ UpdateJob::State UpdateJob::state() const
 
 int UpdateJob::progress() const
 {
-    return m_progress;
+    return m_progress.loadRelaxed();
+}
+
+qint64 UpdateJob::bytesTransferred() const
+{
+    return m_deliveredBytes.loadRelaxed();
 }
 
 void UpdateJob::onDeviceConnectionStatusChanged(DeviceInterface::ConnectionStatus status)
 {
-    emit logMessage(0, QString("Device connection status: %1").arg(status));
+    if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+        LogEvent event(lcJob(), Logging::Debug, QString("Device connection status: %1").arg(status));
+        event.deviceId = m_deviceId;
+        emit logEvent(event);
+    }
     
     if (m_state == Connecting) {
         if (status == DeviceInterface::Connected) {
-            // Connected, proceed to prepare
-            setState(Preparing);
-            if (!m_device->beginUpdate()) {
-                failUpdate("Failed to initialize update on device");
-            }
+            // Connected, proceed to prepare once the device has described itself
+            prepareWhenReady();
         } else if (status == DeviceInterface::Error) {
-            // Connection failed
-            failUpdate("Failed to connect to device");
+            // Connection failed; keep trying if we are recovering an interrupted upload
+            if (m_reconnectAttempts == 0 || !tryReconnect()) {
+                failUpdate("Failed to connect to device");
+            }
         }
     } else if (status == DeviceInterface::Disconnected && 
               (m_state == Uploading || m_state == Preparing || m_state == Finalizing)) {
-        // Device disconnected during update
-        failUpdate("Device disconnected during update");
+        // Device disconnected during update; resume from the committed offset if we can
+        if (m_state == Finalizing || !m_resumeSupported || !tryReconnect()) {
+            failUpdate("Device disconnected during update");
+        }
     }
 }
 
 void UpdateJob::onDeviceStateChanged(DeviceInterface::DeviceState state)
 {
-    emit logMessage(0, QString("Device state: %1").arg(state));
+    if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+        LogEvent event(lcJob(), Logging::Debug, QString("Device state: %1").arg(state));
+        event.deviceId = m_deviceId;
+        emit logEvent(event);
+    }
     
-    if (m_state == Preparing && state == DeviceInterface::Ready) {
-        // Device is ready to receive firmware
-        m_currentOffset = 0;
-        startUpload();
+    if (m_state == Preparing &&
+        (state == DeviceInterface::Ready || state == DeviceInterface::Updating)) {
+        // Device is ready to receive firmware; a resume also needs the device's offset
+        m_deviceReady = true;
+        if (!m_awaitingResumeOffset) {
+            startUpload();
+        }
     } else if (m_state == Finalizing && state == DeviceInterface::Rebooting) {
         // Device is rebooting, update is complete
         completeUpdate();
+    } else if (m_state == Uploading && m_pull && state == DeviceInterface::Rebooting) {
+        // A pull device reboots as soon as it has downloaded the whole image
+        m_currentOffset = m_payloadSize;
+        m_ackedBytes = m_payloadSize;
+        setProgress(100);
+        completeUpdate();
     } else if (state == DeviceInterface::Error) {
         // Device reported an error
         failUpdate("Device reported an error");
@@ -156,8 +285,26 @@ void UpdateJob::onUploadNextChunk()
         return;
     }
     
+    if (m_windowSize > 1) {
+        fillWindow();
+        return;
+    }
+    
+    // A paced chunk still unacknowledged when the timer fires is sent again
+    if (m_paced && m_unackedChunks > 0) {
+        emit logMessage(2, QString("Chunk at offset %1 not acknowledged, retransmitting").arg(m_ackedBytes));
+        if (!rewindUnackedChunks()) {
+            return;
+        }
+    }
+    
+    // Let the device fill uniform regions itself
+    if (!skipFillSegments()) {
+        return;
+    }
+    
     // Check if we're done
-    if (m_currentOffset >= m_firmware->size()) {
+    if (m_currentOffset >= m_payloadSize) {
         setState(Finalizing);
         if (!m_device->finalizeUpdate()) {
             failUpdate("Failed to finalize update");
@@ -165,24 +312,40 @@ void UpdateJob::onUploadNextChunk()
         return;
     }
     
-    // Get next chunk
-    QByteArray chunk = m_firmware->getChunk(m_currentOffset, m_chunkSize);
+    // Send next chunk to device
+    qint64 chunkSize = nextChunkSize();
+    ChunkResult result = sendPayloadChunk(m_currentOffset, chunkSize);
+    if (result == ChunkCorrupt) {
+        failUpdate(QString("Firmware data at offset %1 failed verification").arg(m_currentOffset));
+        return;
+    }
     
-    // Send chunk to device
-    if (m_device->sendFirmwareChunk(chunk, m_currentOffset)) {
-        // Chunk sent successfully
-        m_currentOffset += chunk.size();
-        m_retryCount = 0;
+    if (result == ChunkSent) {
+        // Chunk sent successfully; progress and the chunk sizer follow its acknowledgement
+        m_currentOffset += chunkSize;
+        m_unackedChunks++;
+        m_sentTimer.start();
         
-        // Update progress
-        int progress = static_cast<int>((static_cast<double>(m_currentOffset) / m_firmware->size()) * 100);
-        setProgress(progress);
+        if (!m_paced) {
+            // Nothing acknowledges chunks sent to such devices, so count them as delivered,
+            // but keep them out of the journal
+            m_ackedBytes = m_currentOffset;
+            m_unackedChunks = 0;
+            m_retryCount = 0;
+            setProgress(static_cast<int>((static_cast<double>(m_ackedBytes) / m_payloadSize) * 100));
+        }
         
-        // Schedule next chunk
-        m_chunkTimer.start(DEFAULT_CHUNK_INTERVAL_MS);
+        // Schedule next chunk; paced devices trigger it early through readyForMoreData()
+        // once the chunk is acknowledged, and resend it if the timer fires first
+        m_chunkTimer.start(m_paced ? DEFAULT_ACK_TIMEOUT_MS : DEFAULT_CHUNK_INTERVAL_MS);
+    } else if (result == ChunkDeferred) {
+        // Not a failure: the device reports readiness once it can take the chunk
+        m_chunkTimer.start(m_paced ? DEFAULT_ACK_TIMEOUT_MS : DEFAULT_RETRY_INTERVAL_MS);
     } else if (m_retryCount < m_maxRetries) {
-        // Failed to send chunk, retry
+        // Failed to send chunk, retry with a smaller chunk
         m_retryCount++;
+        m_chunkSizer.chunkFailed();
+        updateChunkSize();
         emit logMessage(2, QString("Failed to send chunk, retrying (%1/%2)...").arg(m_retryCount).arg(m_maxRetries));
         m_retryTimer.start(DEFAULT_RETRY_INTERVAL_MS);
     } else {
@@ -197,6 +360,207 @@ void UpdateJob::onRetryTimeout()
     onUploadNextChunk();
 }
 
+void UpdateJob::onChunkAcknowledged(qint64 offset)
+{
+    if (m_state != Uploading) {
+        return;
+    }
+    
+    if (m_windowSize <= 1) {
+        // The stop-and-wait chunk in flight starts at the acknowledged offset
+        if (m_paced && m_unackedChunks > 0 && offset == m_ackedBytes) {
+            acknowledgeSentChunks();
+            recordProgress(m_ackedBytes);
+        }
+        return;
+    }
+    
+    int index = findInFlight(offset);
+    if (index < 0) {
+        // Duplicate or late acknowledgement
+        return;
+    }
+    
+    InFlightChunk &chunk = inFlightAt(index);
+    if (chunk.awaitingAck) {
+        m_outstanding--;
+    }
+    
+    // Only first transmissions give unambiguous latency samples
+    qint64 rttUs = (chunk.retries == 0 && chunk.awaitingAck) ? chunk.sentTimer.nsecsElapsed() / 1000 : -1;
+    m_chunkSizer.chunkDelivered(chunk.size, rttUs);
+    updateChunkSize();
+    
+    m_ackedBytes += chunk.size;
+    chunk.awaitingAck = false;
+    chunk.acknowledged = true;
+    
+    // The window starts at the oldest chunk still unacknowledged
+    while (m_inFlightCount > 0 && inFlightAt(0).acknowledged) {
+        m_inFlightHead = (m_inFlightHead + 1) % m_inFlight.size();
+        m_inFlightCount--;
+    }
+    m_retryCount = 0;
+    
+    // Only the contiguous prefix below the oldest unacknowledged chunk is committed
+    recordProgress(m_inFlightCount > 0 ? inFlightAt(0).offset : m_ackedBytes);
+    
+    int progress = static_cast<int>((static_cast<double>(m_ackedBytes) / m_payloadSize) * 100);
+    setProgress(progress);
+    
+    fillWindow();
+}
+
+void UpdateJob::onChunkRejected(qint64 offset)
+{
+    if (m_state != Uploading) {
+        return;
+    }
+    
+    if (m_windowSize <= 1) {
+        if (!m_paced || m_unackedChunks == 0 || offset != m_ackedBytes) {
+            // Duplicate or late rejection
+            return;
+        }
+        
+        emit logMessage(2, QString("Device rejected chunk at offset %1").arg(offset));
+        if (rewindUnackedChunks()) {
+            m_chunkTimer.stop();
+            m_retryTimer.start(DEFAULT_RETRY_INTERVAL_MS);
+        }
+        return;
+    }
+    
+    int index = findInFlight(offset);
+    if (index < 0) {
+        return;
+    }
+    
+    emit logMessage(2, QString("Device rejected chunk at offset %1").arg(offset));
+    requeueChunk(inFlightAt(index));
+    
+    if (m_state == Uploading) {
+        fillWindow();
+    }
+}
+
+void UpdateJob::onReadyForMoreData(qint64 credit)
+{
+    if (m_state != Uploading || !m_paced) {
+        return;
+    }
+    
+    m_credit = credit;
+    
+    if (m_windowSize > 1) {
+        if (!m_paused) {
+            fillWindow();
+        }
+        return;
+    }
+    
+    // Readiness is no acknowledgement; a chunk still in flight waits for its own
+    if (m_unackedChunks == 0 && m_chunkTimer.isActive()) {
+        // A chunk is due; send it now instead of when the timer fires
+        m_chunkTimer.stop();
+        onUploadNextChunk();
+    }
+}
+
+void UpdateJob::onPullProgress(qint64 bytes, qint64 total)
+{
+    if (m_state != Uploading || !m_pull || total <= 0) {
+        return;
+    }
+    
+    m_currentOffset = bytes;
+    m_ackedBytes = bytes;
+    setProgress(static_cast<int>((static_cast<double>(bytes) / total) * 100));
+}
+
+void UpdateJob::onAckTimeoutCheck()
+{
+    if (m_state != Uploading) {
+        m_ackTimer.stop();
+        return;
+    }
+    
+    // Selectively retransmit only the chunks whose acknowledgement is overdue
+    for (int index = 0; index < m_inFlightCount; ++index) {
+        InFlightChunk &chunk = inFlightAt(index);
+        if (chunk.awaitingAck && chunk.sentTimer.hasExpired(DEFAULT_ACK_TIMEOUT_MS)) {
+            emit logMessage(2, QString("Chunk at offset %1 not acknowledged, retransmitting").arg(chunk.offset));
+            requeueChunk(chunk);
+            
+            if (m_state != Uploading) {
+                return;
+            }
+        }
+    }
+    
+    fillWindow();
+}
+
+void UpdateJob::onResumeOffsetReported(qint64 offset)
+{
+    if (m_state != Preparing || !m_awaitingResumeOffset) {
+        return;
+    }
+    
+    m_awaitingResumeOffset = false;
+    
+    // Never resume past what either side has recorded as committed
+    qint64 resumeOffset = qBound<qint64>(0, offset, m_payloadSize);
+    if (m_journal) {
+        qint64 journalOffset = m_journal->committedOffset(m_deviceId, transferId());
+        if (journalOffset >= 0) {
+            resumeOffset = qMin(resumeOffset, journalOffset);
+        }
+    }
+    m_resumeOffset = resumeOffset;
+    
+    if (m_resumeOffset > 0) {
+        emit logMessage(1, QString("Resuming upload at offset %1 of %2")
+                           .arg(m_resumeOffset).arg(m_payloadSize));
+    }
+    
+    if (m_deviceReady) {
+        startUpload();
+    }
+}
+
+void UpdateJob::onReconnectTimeout()
+{
+    if (m_state != Reconnecting) {
+        return;
+    }
+    
+    m_reconnectAttempts++;
+    emit logMessage(1, QString("Reconnecting to device (%1/%2)...")
+                       .arg(m_reconnectAttempts).arg(DEFAULT_MAX_RECONNECTS));
+    
+    setState(Connecting);
+    if (!m_device->connect() && m_state == Connecting && !tryReconnect()) {
+        failUpdate("Failed to reconnect to device");
+    }
+}
+
+void UpdateJob::onHandshakeCompleted()
+{
+    if (m_state == Connecting && m_device->isConnected()) {
+        m_handshakeTimer.stop();
+        prepareDevice();
+    }
+}
+
+void UpdateJob::onHandshakeTimeout()
+{
+    if (m_state == Connecting && m_device->isConnected()) {
+        emit logMessage(2, "Device did not report its capabilities, using defaults");
+        prepareDevice();
+    }
+}
+
 void UpdateJob::setState(State state)
 {
     if (m_state != state) {
@@ -212,51 +576,631 @@ void UpdateJob::setState(State state)
             case Complete: stateStr = "Update complete"; break;
             case Failed: stateStr = "Update failed"; break;
             case Canceled: stateStr = "Update canceled"; break;
+            case Reconnecting: stateStr = "Reconnecting to device"; break;
+        }
+        
+        if (state == Complete || state == Failed || state == Canceled) {
+            releaseBuffers();
         }
         
-        emit progressChanged(m_progress, stateStr);
-        emit logMessage(1, QString("Update state: %1").arg(stateStr));
+        emit progressChanged(m_progress.loadRelaxed(), stateStr);
+        
+        if (FLASHUP_LOG_ENABLED(lcJob, Logging::Info)) {
+            LogEvent event(lcJob(), Logging::Info, QString("Update state: %1").arg(stateStr));
+            event.deviceId = m_deviceId;
+            event.offset = m_currentOffset;
+            emit logEvent(event);
+        }
     }
 }
 
 void UpdateJob::setProgress(int progress)
 {
-    if (m_progress != progress) {
-        m_progress = progress;
+    // Published for other threads
+    m_deliveredBytes.storeRelaxed(m_ackedBytes);
+    
+    if (m_progress.loadRelaxed() != progress) {
+        m_progress.storeRelaxed(progress);
         
         QString stateStr;
         switch (m_state) {
-            case Idle: stateStr = "Idle"; break;
-            case Connecting: stateStr = "Connecting to device"; break;
-            case Preparing: stateStr = "Preparing device"; break;
-            case Uploading: stateStr = QString("Uploading firmware (%1%)").arg(progress); break;
-            case Finalizing: stateStr = "Finalizing update"; break;
-            case Complete: stateStr = "Update complete"; break;
-            case Failed: stateStr = "Update failed"; break;
-            case Canceled: stateStr = "Update canceled"; break;
+            case Idle: stateStr = QStringLiteral("Idle"); break;
+            case Connecting: stateStr = QStringLiteral("Connecting to device"); break;
+            case Preparing: stateStr = QStringLiteral("Preparing device"); break;
+            case Uploading: stateStr = uploadingStatus(progress); break;
+            case Finalizing: stateStr = QStringLiteral("Finalizing update"); break;
+            case Complete: stateStr = QStringLiteral("Update complete"); break;
+            case Failed: stateStr = QStringLiteral("Update failed"); break;
+            case Canceled: stateStr = QStringLiteral("Update canceled"); break;
+            case Reconnecting: stateStr = QStringLiteral("Reconnecting to device"); break;
         }
         
+        // The status strings are built once, but a receiver in another
+        // thread still costs one allocation per percent for the queued call
         emit progressChanged(progress, stateStr);
     }
 }
 
+void UpdateJob::prepareWhenReady()
+{
+    if (m_device->isHandshakeComplete()) {
+        m_handshakeTimer.stop();
+        prepareDevice();
+    } else if (!m_handshakeTimer.isActive()) {
+        m_handshakeTimer.start(HANDSHAKE_TIMEOUT_MS);
+    }
+}
+
+void UpdateJob::prepareDevice()
+{
+    setState(Preparing);
+    m_deviceReady = false;
+    m_resumeOffset = 0;
+    
+    // Send a patch if the package has one for the image the device runs
+    m_deltaIndex = -1;
+    m_compressedPayload = false;
+    m_payloadSize = m_firmware->size();
+    
+    // Pull devices download the image themselves; the job only follows their progress
+    m_pull = m_device->pullsFirmware();
+    if (m_pull) {
+        m_resumeSupported = false;
+        m_awaitingResumeOffset = false;
+        
+        if (!m_device->beginPullUpdate(m_firmware)) {
+            failUpdate("Failed to request firmware download from device");
+        }
+        return;
+    }
+    
+    if (m_device->supportsDelta()) {
+        QString installedHash = m_device->installedFirmwareHash();
+        int index = installedHash.isEmpty() ? -1 : m_firmware->findDelta(installedHash);
+        
+        if (index >= 0 && m_firmware->verifyDelta(index)) {
+            m_deltaIndex = index;
+            m_payloadSize = m_firmware->deltas().at(index).size;
+        } else if (index >= 0) {
+            emit logMessage(2, "Delta patch failed verification, sending full image");
+        }
+    }
+    
+    if (m_deltaIndex >= 0) {
+        emit logMessage(1, QString("Sending delta patch (%1 of %2 bytes)")
+                           .arg(m_payloadSize).arg(m_firmware->size()));
+        
+        // Patch transfers are short and start over instead of resuming
+        m_resumeSupported = false;
+        m_awaitingResumeOffset = false;
+        
+        const FirmwarePackage::Delta delta = m_firmware->deltas().at(m_deltaIndex);
+        if (!m_device->beginDeltaUpdate(delta.baseSha256, m_firmware->sha256Hash(),
+                                        m_firmware->size(), delta.size)) {
+            failUpdate("Failed to initialize delta update on device");
+        }
+        return;
+    }
+    
+    // Pass compressed blocks through to devices that decode them themselves
+    QString compression = m_firmware->compression();
+    QStringList deviceCompression = m_device->supportedCompression();
+    if (!deviceCompression.isEmpty()) {
+        m_compressedPayload = !compression.isEmpty() && deviceCompression.contains(compression);
+        if (m_compressedPayload) {
+            m_payloadSize = m_firmware->encodedSize();
+            emit logMessage(1, QString("Sending %1 compressed image (%2 of %3 bytes)")
+                               .arg(compression).arg(m_payloadSize).arg(m_firmware->size()));
+        }
+        
+        if (!m_device->setPayloadCompression(m_compressedPayload ? compression : QString(),
+                                             m_firmware->compressionBlockSize())) {
+            failUpdate("Device rejected the payload encoding");
+            return;
+        }
+    }
+    
+    // Devices that can resume report how much of this image they already hold
+    m_resumeSupported = m_device->supportsResume();
+    m_awaitingResumeOffset = m_resumeSupported;
+    
+    bool started = m_resumeSupported ? m_device->resumeUpdate(m_firmware->sha256Hash())
+                                     : m_device->beginUpdate();
+    if (!started) {
+        failUpdate("Failed to initialize update on device");
+    }
+}
+
+QByteArray UpdateJob::payloadChunk(qint64 offset, qint64 size)
+{
+    // Data that is not a view into the mapping is read into the job's own buffer
+    if (m_deltaIndex >= 0) {
+        return m_firmware->readDeltaChunk(m_deltaIndex, offset, size, &m_chunkBuffer);
+    }
+    
+    if (m_compressedPayload) {
+        return m_firmware->readEncodedChunk(offset, size, &m_chunkBuffer);
+    }
+    
+    return m_firmware->readChunk(offset, size, &m_chunkBuffer);
+}
+
+void UpdateJob::releaseBuffers()
+{
+    if (m_bufferPool) {
+        m_bufferPool->release(m_chunkBuffer);
+    }
+    m_chunkBuffer = QByteArray();
+}
+
+QString UpdateJob::transferId() const
+{
+    // Offsets of a compressed transfer are stream offsets, so keep them apart
+    if (m_compressedPayload) {
+        return m_firmware->sha256Hash() + "+" + m_firmware->compression();
+    }
+    
+    return m_firmware->sha256Hash();
+}
+
+QString UpdateJob::payloadId() const
+{
+    if (m_deltaIndex >= 0) {
+        return m_firmware->deltas().at(m_deltaIndex).sha256;
+    }
+    
+    return transferId();
+}
+
+UpdateJob::ChunkResult UpdateJob::sendPayloadChunk(qint64 offset, qint64 size)
+{
+    if (!m_device->canSendChunk()) {
+        if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+            LogEvent event(lcJob(), Logging::Debug, "Device not ready, holding chunk");
+            event.deviceId = m_deviceId;
+            event.offset = offset;
+            emit logEvent(event);
+        }
+        return ChunkDeferred;
+    }
+    
+    if (m_frameVariant.isEmpty()) {
+        // Check the bytes against the verified digests right before they go out
+        if (!verifyChunkRange(offset, size)) {
+            return ChunkCorrupt;
+        }
+        
+        return m_device->sendFirmwareChunk(payloadChunk(offset, size), offset) ? ChunkSent : ChunkRefused;
+    }
+    
+    FrameCache::Key key;
+    key.payloadId = m_payloadId;
+    key.variant = m_frameVariant;
+    key.offset = offset;
+    key.size = size;
+    
+    // Cached frames were built from verified data by whichever job sent them first
+    QByteArray frame = m_frameCache->find(key);
+    if (frame.isNull()) {
+        if (!verifyChunkRange(offset, size)) {
+            return ChunkCorrupt;
+        }
+        
+        // The cache keeps this frame, so it gets its own storage instead of a pooled buffer
+        if (!m_device->encodeChunkFrame(payloadChunk(offset, size), offset, &frame)) {
+            return ChunkRefused;
+        }
+        m_frameCache->insert(key, frame);
+    }
+    
+    return m_device->sendEncodedChunk(frame, offset) ? ChunkSent : ChunkRefused;
+}
+
 void UpdateJob::startUpload()
 {
+    // Everything below the resume offset is committed on the device
+    m_ackedBytes = m_resumeOffset;
+    
     setState(Uploading);
-    setProgress(0);
+    setProgress(static_cast<int>((static_cast<double>(m_resumeOffset) / m_payloadSize) * 100));
+    
+    if (m_pull) {
+        m_currentOffset = 0;
+        m_windowSize = 1;
+        emit logMessage(1, "Device is downloading the firmware...");
+        return;
+    }
+    
     emit logMessage(1, "Starting firmware upload...");
     
     // Start sending chunks
-    m_currentOffset = 0;
+    m_currentOffset = m_resumeOffset;
     m_retryCount = 0;
+    m_reconnectAttempts = 0;
     m_paused = false;
+    m_verifiedChunks = QBitArray(m_firmware->chunkHashCount());
+    
+    // Chunks are read into one buffer for the whole upload
+    if (m_bufferPool && m_chunkBuffer.isNull()) {
+        m_chunkBuffer = m_bufferPool->acquire();
+    }
+    
+    // Identifiers needed for every chunk; the frame variant is fixed once the handshake is done
+    m_transferId = transferId();
+    m_payloadId = payloadId();
+    m_frameVariant = m_frameCache ? m_device->frameVariant() : QString();
+    m_journalKey = m_journal ? m_journal->entryKey(m_deviceId, m_transferId) : QString();
+    
+    // Pipeline chunks if the device accepts more than one in flight
+    m_windowSize = qMax(1, m_device->maxWindowSize());
+    
+    // Paced devices tell when they can take data; the credit is unknown until they do
+    m_paced = m_device->reportsWriteReadiness();
+    m_credit = -1;
+    
+    // Chunk bounds are known once the device has completed its handshake
+    qint64 minChunkSize = m_device->minChunkSize();
+    qint64 maxChunkSize = m_device->maxChunkSize();
+    if (minChunkSize <= 0 || maxChunkSize < minChunkSize) {
+        minChunkSize = maxChunkSize = m_chunkSize;
+    }
+    
+    // The chunk sizer needs acknowledgement times, which stop-and-wait
+    // devices only give if they also report their readiness
+    if (m_windowSize <= 1 && !m_paced && maxChunkSize > minChunkSize) {
+        m_chunkSize = qBound(minChunkSize, m_chunkSize, maxChunkSize);
+        minChunkSize = maxChunkSize = m_chunkSize;
+        emit logMessage(1, QString("Device does not report acknowledgements, using a fixed chunk size of %1 bytes")
+                           .arg(m_chunkSize));
+    }
+    
+    // Jobs sharing frames must cut the payload at the same offsets, so they
+    // send fixed chunks of the size the first of them chose
+    if (!m_frameVariant.isEmpty()) {
+        qint64 sharedChunkSize = m_frameCache->chunkSize(m_payloadId, m_frameVariant,
+                                                         qBound(minChunkSize, m_chunkSize, maxChunkSize));
+        if (sharedChunkSize >= minChunkSize && sharedChunkSize <= maxChunkSize) {
+            m_chunkSize = minChunkSize = maxChunkSize = sharedChunkSize;
+        } else {
+            emit logMessage(2, QString("Device does not accept the shared chunk size of %1 bytes, encoding its own frames")
+                               .arg(sharedChunkSize));
+            m_frameVariant.clear();
+        }
+    }
+    
+    m_chunkSizer.reset(m_chunkSize, minChunkSize, maxChunkSize);
+    if (m_chunkSizer.isAdaptive()) {
+        emit logMessage(1, QString("Adapting chunk size between %1 and %2 bytes")
+                           .arg(minChunkSize).arg(maxChunkSize));
+    }
+    updateChunkSize();
+    
+    m_outstanding = 0;
+    m_unackedChunks = 0;
+    
+    // Chunks acknowledged out of order wait in the ring for those before them,
+    // so it has room for a second window of them
+    m_inFlight = QVector<InFlightChunk>(2 * m_windowSize);
+    m_inFlightHead = 0;
+    m_inFlightCount = 0;
+    
+    if (m_windowSize > 1) {
+        emit logMessage(1, QString("Using windowed transfer with up to %1 chunks in flight").arg(m_windowSize));
+        m_ackTimer.start(ACK_CHECK_INTERVAL_MS);
+    }
+    
+    // Uniform regions of a plain image are filled by the device instead of sent
+    m_sparse = m_deltaIndex < 0 && !m_compressedPayload && m_device->supportsFill();
+    m_segments.clear();
+    m_segmentIndex = 0;
+    m_skippedBytes = 0;
+    
+    if (m_sparse) {
+        m_segments = m_firmware->segments();
+        
+        qint64 fillBytes = 0;
+        for (const FirmwarePackage::Segment &segment : qAsConst(m_segments)) {
+            if (segment.fill) {
+                fillBytes += segment.length;
+            }
+        }
+        
+        if (fillBytes > 0) {
+            emit logMessage(1, QString("Skipping %1 bytes of uniform fill").arg(fillBytes));
+        }
+    }
     
     // Schedule first chunk
     m_chunkTimer.start(0);
 }
 
+bool UpdateJob::verifyChunkRange(qint64 offset, qint64 size)
+{
+    // Delta patches are verified as a whole before the update starts, and
+    // compressed streams are checked by the device after decoding
+    qint64 hashSize = m_firmware->chunkHashSize();
+    if (m_deltaIndex >= 0 || m_compressedPayload || m_verifiedChunks.isEmpty() || hashSize <= 0) {
+        return true;
+    }
+    
+    qint64 end = qMin(offset + size, m_firmware->size());
+    int first = static_cast<int>(offset / hashSize);
+    int last = static_cast<int>((end - 1) / hashSize);
+    
+    // Each hashed chunk is checked once per job, when it is first sent
+    for (int index = first; index <= last && index < m_verifiedChunks.size(); ++index) {
+        if (m_verifiedChunks.testBit(index)) {
+            continue;
+        }
+        
+        if (!m_firmware->verifyChunk(index, &m_chunkBuffer)) {
+            return false;
+        }
+        
+        m_verifiedChunks.setBit(index);
+    }
+    
+    return true;
+}
+
+void UpdateJob::fillWindow()
+{
+    // Retransmit requeued chunks first, then extend the window with new data
+    for (int index = 0; index < m_inFlightCount && m_outstanding < m_windowSize; ++index) {
+        InFlightChunk &chunk = inFlightAt(index);
+        if (!chunk.awaitingAck && !chunk.acknowledged && !sendWindowChunk(chunk)) {
+            return;
+        }
+    }
+    
+    // Beyond the first outstanding chunk, only send what the transport has room for
+    while (m_outstanding < m_windowSize && m_inFlightCount < m_inFlight.size() &&
+           (m_credit != 0 || m_outstanding == 0)) {
+        if (!skipFillSegments()) {
+            return;
+        }
+        
+        if (m_currentOffset >= m_payloadSize) {
+            break;
+        }
+        
+        // Reuse the next free slot of the ring
+        InFlightChunk &chunk = inFlightAt(m_inFlightCount++);
+        chunk = InFlightChunk();
+        chunk.offset = m_currentOffset;
+        chunk.size = nextChunkSize();
+        m_currentOffset += chunk.size;
+        
+        if (!sendWindowChunk(chunk)) {
+            return;
+        }
+    }
+    
+    // Everything sent and acknowledged
+    if (m_inFlightCount == 0 && m_currentOffset >= m_payloadSize) {
+        m_ackTimer.stop();
+        setState(Finalizing);
+        if (!m_device->finalizeUpdate()) {
+            failUpdate("Failed to finalize update");
+        }
+    }
+}
+
+UpdateJob::InFlightChunk &UpdateJob::inFlightAt(int index)
+{
+    return m_inFlight[(m_inFlightHead + index) % m_inFlight.size()];
+}
+
+int UpdateJob::findInFlight(qint64 offset)
+{
+    // The window is a few dozen chunks at most
+    for (int index = 0; index < m_inFlightCount; ++index) {
+        const InFlightChunk &chunk = inFlightAt(index);
+        if (chunk.offset == offset && !chunk.acknowledged) {
+            return index;
+        }
+    }
+    
+    return -1;
+}
+
+bool UpdateJob::sendWindowChunk(InFlightChunk &chunk)
+{
+    ChunkResult result = sendPayloadChunk(chunk.offset, chunk.size);
+    if (result == ChunkCorrupt) {
+        failUpdate(QString("Firmware data at offset %1 failed verification").arg(chunk.offset));
+        return false;
+    }
+    
+    if (result == ChunkDeferred) {
+        // Leave the chunk queued without counting a retry; readyForMoreData() resumes sending
+        if (!m_paced && !m_retryTimer.isActive()) {
+            m_retryTimer.start(DEFAULT_RETRY_INTERVAL_MS);
+        }
+        return false;
+    }
+    
+    if (result == ChunkRefused) {
+        // Transport refused the chunk; leave it queued and try again later
+        if (++chunk.retries > m_maxRetries) {
+            failUpdate("Failed to send firmware chunk after maximum retries");
+        } else if (!m_retryTimer.isActive()) {
+            m_retryTimer.start(DEFAULT_RETRY_INTERVAL_MS);
+        }
+        return false;
+    }
+    
+    chunk.awaitingAck = true;
+    chunk.sentTimer.start();
+    m_outstanding++;
+    
+    if (m_credit > 0) {
+        m_credit = qMax<qint64>(0, m_credit - chunk.size);
+    }
+    return true;
+}
+
+void UpdateJob::requeueChunk(InFlightChunk &chunk)
+{
+    if (chunk.awaitingAck) {
+        chunk.awaitingAck = false;
+        m_outstanding--;
+    }
+    
+    m_chunkSizer.chunkFailed();
+    updateChunkSize();
+    
+    if (++chunk.retries > m_maxRetries) {
+        failUpdate("Firmware chunk not acknowledged after maximum retries");
+    }
+}
+
+void UpdateJob::acknowledgeSentChunks()
+{
+    qint64 bytes = m_currentOffset - m_ackedBytes;
+    if (m_unackedChunks == 0 || bytes <= 0) {
+        return;
+    }
+    
+    // Only a single chunk in flight gives an unambiguous latency sample
+    qint64 rttUs = m_unackedChunks == 1 ? m_sentTimer.nsecsElapsed() / 1000 : -1;
+    m_chunkSizer.chunkDelivered(bytes, rttUs);
+    updateChunkSize();
+    
+    m_ackedBytes = m_currentOffset;
+    m_unackedChunks = 0;
+    m_retryCount = 0;
+    
+    setProgress(static_cast<int>((static_cast<double>(m_ackedBytes) / m_payloadSize) * 100));
+}
+
+bool UpdateJob::rewindUnackedChunks()
+{
+    // Everything after the last acknowledged offset goes out again
+    m_currentOffset = m_ackedBytes;
+    m_unackedChunks = 0;
+    m_chunkSizer.chunkFailed();
+    updateChunkSize();
+    
+    if (++m_retryCount > m_maxRetries) {
+        failUpdate("Firmware chunk not acknowledged after maximum retries");
+        return false;
+    }
+    return true;
+}
+
+void UpdateJob::recordProgress(qint64 committed)
+{
+    // Called for chunk acknowledgements only, never for readiness reports or
+    // chunks that nothing acknowledges, so the journal holds no offset the
+    // device has not confirmed
+    if (!m_journal || m_deltaIndex >= 0) {
+        return;
+    }
+    
+    m_journal->record(m_journalKey, m_deviceId, m_transferId, committed);
+}
+
+bool UpdateJob::tryReconnect()
+{
+    if (m_reconnectAttempts >= DEFAULT_MAX_RECONNECTS) {
+        return false;
+    }
+    
+    m_retryTimer.stop();
+    m_chunkTimer.stop();
+    m_ackTimer.stop();
+    
+    if (m_journal) {
+        m_journal->flush(m_deviceId, transferId());
+    }
+    
+    if (m_reconnectAttempts == 0) {
+        emit logMessage(2, "Connection to device lost, will try to resume");
+    }
+    
+    setState(Reconnecting);
+    m_reconnectTimer.start(RECONNECT_INTERVAL_MS);
+    return true;
+}
+
+bool UpdateJob::skipFillSegments()
+{
+    while (m_sparse && m_segmentIndex < m_segments.size() && m_currentOffset < m_payloadSize) {
+        const FirmwarePackage::Segment &segment = m_segments.at(m_segmentIndex);
+        qint64 end = segment.offset + segment.length;
+        
+        if (m_currentOffset >= end) {
+            m_segmentIndex++;
+            continue;
+        }
+        
+        if (!segment.fill) {
+            return true;
+        }
+        
+        // A resumed transfer may start in the middle of a fill range
+        qint64 length = end - m_currentOffset;
+        if (segment.fillValue != m_device->erasedValue() &&
+            !m_device->fillFirmwareRange(m_currentOffset, length, segment.fillValue)) {
+            failUpdate(QString("Failed to fill firmware range at offset %1").arg(m_currentOffset));
+            return false;
+        }
+        
+        m_currentOffset = end;
+        m_ackedBytes += length;
+        m_skippedBytes += length;
+        m_segmentIndex++;
+    }
+    
+    return true;
+}
+
+qint64 UpdateJob::nextChunkSize() const
+{
+    // Chunks never reach into the fill range that follows them
+    qint64 end = m_payloadSize;
+    if (m_sparse && m_segmentIndex < m_segments.size()) {
+        const FirmwarePackage::Segment &segment = m_segments.at(m_segmentIndex);
+        end = qMin(end, segment.offset + segment.length);
+    }
+    
+    // Shared frames are cut on a grid of the shared chunk size, so a job resuming
+    // or continuing after a fill range first sends a short chunk up to the next
+    // grid line. Chunks cut short by a fill range still differ from those of
+    // jobs that send the range, so they are encoded once more.
+    if (!m_frameVariant.isEmpty()) {
+        end = qMin(end, (m_currentOffset / m_chunkSize + 1) * m_chunkSize);
+    }
+    
+    return qMin(m_chunkSize, end - m_currentOffset);
+}
+
+void UpdateJob::updateChunkSize()
+{
+    qint64 chunkSize = m_chunkSizer.chunkSize();
+    if (chunkSize > 0 && chunkSize != m_chunkSize) {
+        if (FLASHUP_LOG_ENABLED(lcJob, Logging::Debug)) {
+            LogEvent event(lcJob(), Logging::Debug, QString("Chunk size changed from %1 bytes (goodput %2 B/s)")
+                                                    .arg(m_chunkSize).arg(qRound64(m_chunkSizer.goodput())));
+            event.deviceId = m_deviceId;
+            event.bytes = chunkSize;
+            emit logEvent(event);
+        }
+        m_chunkSize = chunkSize;
+    }
+}
+
 void UpdateJob::failUpdate(const QString &reason)
 {
+    m_ackTimer.stop();
+    m_reconnectTimer.stop();
+    m_handshakeTimer.stop();
+    
+    if (m_journal) {
+        m_journal->flush(m_deviceId, transferId());
+    }
+    
     emit logMessage(3, QString("Update failed: %1").arg(reason));
     setState(Failed);
     emit completed(false, reason);
@@ -264,6 +1208,15 @@ void UpdateJob::failUpdate(const QString &reason)
 
 void UpdateJob::completeUpdate()
 {
+    if (m_journal) {
+        m_journal->remove(m_deviceId, transferId());
+    }
+    
+    if (m_skippedBytes > 0) {
+        emit logMessage(1, QString("Sent %1 of %2 bytes, the rest was filled by the device")
+                           .arg(m_payloadSize - m_skippedBytes).arg(m_payloadSize));
+    }
+    
     emit logMessage(1, "Update completed successfully");
     setState(Complete);
     emit completed(true, "Firmware updated successfully");
@@ -1,15 +1,29 @@
 #ifndef UPDATEJOB_H
 #define UPDATEJOB_H
 
+#include "deviceinterface.h"
+#include "chunksizecontroller.h"
+#include "firmwarepackage.h"
+#include "logging.h"
+
 #include <QObject>
 #include <QTimer>
+#include <QBitArray>
+#include <QElapsedTimer>
+#include <QVector>
+#include <QAtomicInteger>
 #include <memory>
 
-class DeviceInterface;
-class FirmwarePackage;
+class TransferJournal;
+class FrameCache;
+class ChunkBufferPool;
 
 /**
  * @brief The UpdateJob class manages the firmware update process for a device
+ *
+ * A job runs in the thread of its device and is driven through queued calls
+ * and signals; only progress() and bytesTransferred() may be called from
+ * other threads.
  */
 class UpdateJob : public QObject
 {
@@ -24,21 +38,45 @@ public:
         Finalizing,
         Complete,
         Failed,
-        Canceled
+        Canceled,
+        Reconnecting
     };
 
     /**
      * @brief Construct a new UpdateJob
      * @param device Device to update
-     * @param firmware Firmware package to use
+     * @param firmware Firmware package to use; shared so that chunk views
+     *        into a mapped package stay valid while the job runs
      * @param parent Parent object
      */
     UpdateJob(std::shared_ptr<DeviceInterface> device, 
-              FirmwarePackage *firmware,
+              std::shared_ptr<FirmwarePackage> firmware,
               QObject *parent = nullptr);
     
     ~UpdateJob();
 
+    /**
+     * @brief Set the journal used to record progress for resumable transfers
+     * @param journal Journal shared by all jobs (not owned, may be nullptr)
+     */
+    void setJournal(TransferJournal *journal);
+
+    /**
+     * @brief Set the cache of encoded chunk frames shared with other jobs
+     *
+     * Jobs with a cache send fixed chunks of the size agreed through it
+     * (see FrameCache::chunkSize()) instead of adapting the chunk size.
+     *
+     * @param cache Frame cache shared by the jobs of a fleet (not owned, may be nullptr)
+     */
+    void setFrameCache(FrameCache *cache);
+
+    /**
+     * @brief Set the pool the job takes its chunk buffer from
+     * @param pool Buffer pool shared by all jobs (not owned, may be nullptr)
+     */
+    void setBufferPool(ChunkBufferPool *pool);
+
     /**
      * @brief Start the update process
      */
@@ -56,11 +94,17 @@ public:
     State state() const;
 
     /**
-     * @brief Get current progress
+     * @brief Get current progress (thread-safe)
      * @return Progress value (0-100)
      */
     int progress() const;
 
+    /**
+     * @brief Get the number of payload bytes delivered to the device (thread-safe)
+     * @return Bytes delivered or filled so far, including resumed bytes
+     */
+    qint64 bytesTransferred() const;
+
 signals:
     /**
      * @brief Emitted when update progress changes
@@ -83,17 +127,55 @@ signals:
      */
     void logMessage(int level, const QString &message);
 
+    /**
+     * @brief Emitted for structured log events of the job and its device
+     * @param event Event, only built if its level is enabled
+     */
+    void logEvent(const LogEvent &event);
+
 private slots:
     void onDeviceConnectionStatusChanged(DeviceInterface::ConnectionStatus status);
     void onDeviceStateChanged(DeviceInterface::DeviceState state);
     void onUploadNextChunk();
     void onRetryTimeout();
+    void onChunkAcknowledged(qint64 offset);
+    void onChunkRejected(qint64 offset);
+    void onAckTimeoutCheck();
+    void onResumeOffsetReported(qint64 offset);
+    void onReconnectTimeout();
+    void onHandshakeCompleted();
+    void onHandshakeTimeout();
+    void onReadyForMoreData(qint64 credit);
+    void onPullProgress(qint64 bytes, qint64 total);
 
 private:
+    /**
+     * @brief A chunk sent in windowed mode that has not been acknowledged yet
+     */
+    struct InFlightChunk {
+        qint64 offset = 0;
+        qint64 size = 0;
+        int retries = 0;
+        bool awaitingAck = false;   ///< false while queued for (re)transmission
+        bool acknowledged = false;  ///< Acknowledged before an earlier chunk
+        QElapsedTimer sentTimer;
+    };
+
+    /**
+     * @brief Outcome of handing a chunk to the device
+     */
+    enum ChunkResult {
+        ChunkSent,
+        ChunkRefused,   ///< Transport did not take it; may be retried
+        ChunkDeferred,  ///< Device cannot take chunks for now; resent when it is ready
+        ChunkCorrupt    ///< Payload data failed verification
+    };
+
     std::shared_ptr<DeviceInterface> m_device;
-    FirmwarePackage *m_firmware;
+    std::shared_ptr<FirmwarePackage> m_firmware;
+    QString m_deviceId;
     State m_state;
-    int m_progress;
+    QAtomicInt m_progress;
     qint64 m_currentOffset;
     qint64 m_chunkSize;
     int m_retryCount;
@@ -101,10 +183,70 @@ private:
     QTimer m_retryTimer;
     QTimer m_chunkTimer;
     bool m_paused;
+    QBitArray m_verifiedChunks;
+    int m_windowSize;
+    int m_outstanding;
+    qint64 m_ackedBytes;
+    int m_unackedChunks;            ///< Stop-and-wait chunks sent since the last acknowledgement
+    QElapsedTimer m_sentTimer;      ///< Started when the last stop-and-wait chunk was sent
+    QVector<InFlightChunk> m_inFlight;  ///< Ring of chunks from the oldest unacknowledged one
+    int m_inFlightHead;
+    int m_inFlightCount;
+    QTimer m_ackTimer;
+    ChunkSizeController m_chunkSizer;
+    TransferJournal *m_journal;
+    FrameCache *m_frameCache;
+    ChunkBufferPool *m_bufferPool;
+    QByteArray m_chunkBuffer;
+    
+    // Built once per upload instead of per chunk
+    QString m_transferId;
+    QString m_payloadId;
+    QString m_frameVariant;
+    QString m_journalKey;
+
+    bool m_resumeSupported;
+    bool m_awaitingResumeOffset;
+    bool m_deviceReady;
+    qint64 m_resumeOffset;
+    int m_reconnectAttempts;
+    QTimer m_reconnectTimer;
+    QTimer m_handshakeTimer;
+    int m_deltaIndex;
+    bool m_compressedPayload;
+    qint64 m_payloadSize;
+    bool m_sparse;
+    QVector<FirmwarePackage::Segment> m_segments;
+    int m_segmentIndex;
+    qint64 m_skippedBytes;
+    QAtomicInteger<qint64> m_deliveredBytes;
+    bool m_paced;
+    qint64 m_credit;
+    bool m_pull;
 
     void setState(State state);
     void setProgress(int progress);
+    void prepareWhenReady();
+    void prepareDevice();
+    QByteArray payloadChunk(qint64 offset, qint64 size);
+    void releaseBuffers();
+    QString transferId() const;
+    QString payloadId() const;
+    ChunkResult sendPayloadChunk(qint64 offset, qint64 size);
+    bool skipFillSegments();
+    qint64 nextChunkSize() const;
     void startUpload();
+    void acknowledgeSentChunks();
+    bool rewindUnackedChunks();
+    void recordProgress(qint64 committed);
+    bool tryReconnect();
+    bool verifyChunkRange(qint64 offset, qint64 size);
+    void fillWindow();
+    InFlightChunk &inFlightAt(int index);
+    int findInFlight(qint64 offset);
+    bool sendWindowChunk(InFlightChunk &chunk);
+    void requeueChunk(InFlightChunk &chunk);
+    void updateChunkSize();
     void failUpdate(const QString &reason);
     void completeUpdate();
 };
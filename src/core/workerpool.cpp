@@ -0,0 +1,131 @@
+#include "workerpool.h"
+
+#include <QObject>
+#include <QThread>
+#include <QDebug>
+
+WorkerPool::WorkerPool(int maxThreads)
+    : m_maxThreads(maxThreads > 0 ? maxThreads : qMax(2, QThread::idealThreadCount() * 2))
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    // Each worker handles what was queued to it first, such as handovers of
+    // detached objects; deferred deletes still pending follow as it finishes
+    for (const auto &worker : m_workers) {
+        QThread *thread = worker->thread.get();
+        QMetaObject::invokeMethod(worker->context.get(), [thread]() {
+            thread->quit();
+        }, Qt::QueuedConnection);
+    }
+    for (const auto &worker : m_workers) {
+        worker->thread->wait();
+    }
+}
+
+QThread *WorkerPool::attach(QObject *object)
+{
+    auto assigned = m_assignments.constFind(object);
+    if (assigned != m_assignments.constEnd()) {
+        return assigned.value()->thread.get();
+    }
+    
+    // A detached object the worker has not handed over yet stays there
+    auto handover = m_handovers.find(object);
+    if (handover != m_handovers.end()) {
+        std::shared_ptr<Handover> pending = handover.value();
+        m_handovers.erase(handover);
+        
+        QMutexLocker locker(&pending->mutex);
+        if (!pending->done) {
+            pending->canceled = true;
+            pending->worker->objects++;
+            m_assignments.insert(object, pending->worker);
+            return pending->worker->thread.get();
+        }
+    }
+    
+    if (object->parent()) {
+        qWarning() << "WorkerPool: cannot move an object with a parent to a worker thread";
+        return object->thread();
+    }
+    
+    // Prefer an idle worker, then a new one, then the least loaded one
+    std::shared_ptr<Worker> target;
+    for (const auto &worker : m_workers) {
+        if (!target || worker->objects < target->objects) {
+            target = worker;
+        }
+    }
+    
+    if ((!target || target->objects > 0) && m_workers.size() < m_maxThreads) {
+        target = std::make_shared<Worker>();
+        target->thread = std::make_unique<QThread>();
+        target->thread->setObjectName(QString("FlashUp I/O %1").arg(m_workers.size() + 1));
+        target->context = std::make_unique<QObject>();
+        target->context->moveToThread(target->thread.get());
+        target->thread->start();
+        m_workers.append(target);
+    }
+    
+    object->moveToThread(target->thread.get());
+    target->objects++;
+    m_assignments.insert(object, target);
+    return target->thread.get();
+}
+
+void WorkerPool::detach(QObject *object)
+{
+    auto assigned = m_assignments.find(object);
+    if (assigned == m_assignments.end()) {
+        return;
+    }
+    
+    // Handovers the workers have completed are of no further interest
+    for (auto it = m_handovers.begin(); it != m_handovers.end();) {
+        QMutexLocker locker(&it.value()->mutex);
+        if (it.value()->done) {
+            locker.unlock();
+            it = m_handovers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    
+    auto handover = std::make_shared<Handover>();
+    handover->worker = assigned.value();
+    handover->worker->objects--;
+    m_assignments.erase(assigned);
+    m_handovers.insert(object, handover);
+    
+    // Only the owning thread may push an object to another thread
+    QThread *caller = QThread::currentThread();
+    QMetaObject::invokeMethod(object, [object, caller, handover]() {
+        QMutexLocker locker(&handover->mutex);
+        if (!handover->canceled) {
+            object->moveToThread(caller);
+            handover->done = true;
+        }
+    }, Qt::QueuedConnection);
+}
+
+bool WorkerPool::isAttached(QObject *object) const
+{
+    if (m_assignments.contains(object)) {
+        return true;
+    }
+    
+    auto handover = m_handovers.constFind(object);
+    if (handover == m_handovers.constEnd()) {
+        return false;
+    }
+    
+    QMutexLocker locker(&handover.value()->mutex);
+    return !handover.value()->done;
+}
+
+int WorkerPool::threadCount() const
+{
+    return m_workers.size();
+}
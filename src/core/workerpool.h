@@ -0,0 +1,104 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QHash>
+#include <QMutex>
+#include <QVector>
+#include <memory>
+
+class QObject;
+class QThread;
+
+/**
+ * @brief The WorkerPool class runs device I/O on threads of its own
+ *
+ * Objects attached to the pool are moved to a worker thread with a running
+ * event loop, so their sockets, serial ports and timers are serviced no
+ * matter how busy the GUI thread is. Each object gets an idle worker while
+ * there are fewer workers than the limit, so one slow device does not delay
+ * the others; past the limit, objects share the least loaded worker.
+ *
+ * The pool itself is used from the thread that created it.
+ */
+class WorkerPool
+{
+public:
+    /**
+     * @brief Construct a pool
+     * @param maxThreads Maximum number of worker threads, 0 for twice the
+     *        ideal thread count (workers mostly wait on I/O)
+     */
+    explicit WorkerPool(int maxThreads = 0);
+
+    /**
+     * @brief Stop all workers
+     *
+     * Objects deleted with deleteLater() are deleted as their worker stops;
+     * others should be detached first.
+     */
+    ~WorkerPool();
+
+    /**
+     * @brief Move an object to a worker thread
+     *
+     * Objects that are already attached stay on their worker, as do objects
+     * detached whose worker has not handed them over yet. Objects with a
+     * parent cannot change threads and stay where they are.
+     *
+     * @param object Object living in the calling thread, or attached before
+     * @return Thread the object now lives in
+     */
+    QThread *attach(QObject *object);
+
+    /**
+     * @brief Move an attached object back to the calling thread
+     *
+     * Does not wait for the object's worker, which hands the object over
+     * once it has handled the events queued to it before. Until then the
+     * object must only be used through queued calls and deleted with
+     * deleteLater(), which follows it to the calling thread.
+     *
+     * @param object Attached object
+     */
+    void detach(QObject *object);
+
+    /**
+     * @brief Check whether an object may still live in a worker thread
+     * @param object Object to check
+     * @return true if attached, or detached and not handed over yet
+     */
+    bool isAttached(QObject *object) const;
+
+    /**
+     * @brief Get the number of worker threads started so far
+     * @return Thread count
+     */
+    int threadCount() const;
+
+private:
+    struct Worker {
+        std::unique_ptr<QThread> thread;
+        std::unique_ptr<QObject> context;   ///< Lives in the worker, to queue calls to it
+        int objects = 0;
+    };
+
+    /**
+     * @brief An object on its way back from its worker
+     *
+     * The worker moves the object unless attach() canceled the handover
+     * first; the mutex orders the two.
+     */
+    struct Handover {
+        std::shared_ptr<Worker> worker;
+        QMutex mutex;
+        bool canceled = false;
+        bool done = false;
+    };
+
+    int m_maxThreads;
+    QVector<std::shared_ptr<Worker>> m_workers;
+    QHash<QObject *, std::shared_ptr<Worker>> m_assignments;
+    QHash<QObject *, std::shared_ptr<Handover>> m_handovers;
+};
+
+#endif // WORKERPOOL_H
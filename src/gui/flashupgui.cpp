@@ -18,6 +18,8 @@ FlashUpGUI::FlashUpGUI(FlashUpCore *core, QObject *parent)
       m_updateProgress(0),
       m_updateStatus("Idle"),
       m_updateActive(false),
+      m_loadProgress(0),
+      m_loadingFirmware(false),
       m_logModel(new LogModel(this))
 {
     // Connect core signals
@@ -25,12 +27,18 @@ FlashUpGUI::FlashUpGUI(FlashUpCore *core, QObject *parent)
             this, &FlashUpGUI::onDeviceDiscovered);
     connect(m_core, &FlashUpCore::deviceLost,
             this, &FlashUpGUI::onDeviceLost);
+    connect(m_core, &FlashUpCore::firmwareLoadProgress,
+            this, &FlashUpGUI::onFirmwareLoadProgress);
+    connect(m_core, &FlashUpCore::firmwareLoaded,
+            this, &FlashUpGUI::onFirmwareLoaded);
     connect(m_core, &FlashUpCore::updateProgress,
             this, &FlashUpGUI::onUpdateProgress);
     connect(m_core, &FlashUpCore::updateComplete,
             this, &FlashUpGUI::onUpdateComplete);
     connect(m_core, &FlashUpCore::logMessage,
             this, &FlashUpGUI::onLogMessage);
+    connect(m_core, &FlashUpCore::logEvent,
+            this, &FlashUpGUI::onLogEvent);
     
     // Setup auto-refresh timer
     connect(&m_autoRefreshTimer, &QTimer::timeout,
@@ -85,6 +93,16 @@ bool FlashUpGUI::updateActive() const
     return m_updateActive;
 }
 
+int FlashUpGUI::loadProgress() const
+{
+    return m_loadProgress;
+}
+
+bool FlashUpGUI::loadingFirmware() const
+{
+    return m_loadingFirmware;
+}
+
 LogModel* FlashUpGUI::logModel() const
 {
     return m_logModel;
@@ -104,9 +122,24 @@ bool FlashUpGUI::loadFirmware(const QUrl &fileUrl)
         return false;
     }
     
-    onLogMessage(1, QString("Loading firmware from %1").arg(filePath));
+    if (!m_core->loadFirmwareAsync(filePath)) {
+        emit notification("Error", "Another firmware file is still loading", 2);
+        return false;
+    }
     
-    if (m_core->loadFirmware(filePath)) {
+    m_loadingFirmware = true;
+    m_loadProgress = 0;
+    emit loadingFirmwareChanged();
+    emit loadProgressChanged();
+    return true;
+}
+
+void FlashUpGUI::onFirmwareLoaded(bool success)
+{
+    m_loadingFirmware = false;
+    emit loadingFirmwareChanged();
+    
+    if (success) {
         // Update firmware info
         QMap<QString, QString> info = m_core->firmwareInfo();
         m_firmwareInfo.clear();
@@ -120,11 +153,11 @@ bool FlashUpGUI::loadFirmware(const QUrl &fileUrl)
         QString name = info.value("name", "Unknown");
         QString version = info.value("version", "0.0.0");
         emit notification("Firmware Loaded", QString("%1 v%2").arg(name, version), 3);
-        
-        return true;
     } else {
+        // The previous package was dropped with the failed load
+        m_firmwareInfo.clear();
+        emit firmwareInfoChanged();
         emit notification("Error", "Failed to load firmware file", 2);
-        return false;
     }
 }
 
@@ -135,6 +168,11 @@ bool FlashUpGUI::startUpdate()
         return false;
     }
     
+    if (m_loadingFirmware) {
+        emit notification("Error", "Firmware is still being verified", 2);
+        return false;
+    }
+    
     if (m_firmwareInfo.isEmpty()) {
         emit notification("Error", "No firmware loaded", 2);
         return false;
@@ -203,6 +241,9 @@ bool FlashUpGUI::saveLogs(const QUrl &fileUrl) const
         return false;
     }
     
+    // Include messages still waiting for the next frame
+    m_logModel->flush();
+    
     QTextStream out(&file);
     out << "FlashUp Log - " << QDateTime::currentDateTime().toString() << "\n\n";
     
@@ -254,6 +295,14 @@ void FlashUpGUI::onDeviceLost(const QString &deviceId)
     }
 }
 
+void FlashUpGUI::onFirmwareLoadProgress(int progress)
+{
+    if (m_loadProgress != progress) {
+        m_loadProgress = progress;
+        emit loadProgressChanged();
+    }
+}
+
 void FlashUpGUI::onUpdateProgress(const QString &deviceId, int progress, const QString &status)
 {
     if (deviceId == m_selectedDevice) {
@@ -283,6 +332,11 @@ void FlashUpGUI::onLogMessage(int level, const QString &message)
     m_logModel->addMessage(level, message);
 }
 
+void FlashUpGUI::onLogEvent(const LogEvent &event)
+{
+    m_logModel->addEvent(event);
+}
+
 void FlashUpGUI::autoRefreshDevices()
 {
     // Only auto-refresh if no update is in progress
@@ -1,6 +1,8 @@
 #ifndef FLASHUPGUI_H
 #define FLASHUPGUI_H
 
+#include "core/logging.h"
+
 #include <QObject>
 #include <QStringList>
 #include <QMap>
@@ -25,6 +27,8 @@ class FlashUpGUI : public QObject
     Q_PROPERTY(int updateProgress READ updateProgress NOTIFY updateProgressChanged)
     Q_PROPERTY(QString updateStatus READ updateStatus NOTIFY updateStatusChanged)
     Q_PROPERTY(bool updateActive READ updateActive NOTIFY updateActiveChanged)
+    Q_PROPERTY(int loadProgress READ loadProgress NOTIFY loadProgressChanged)
+    Q_PROPERTY(bool loadingFirmware READ loadingFirmware NOTIFY loadingFirmwareChanged)
     Q_PROPERTY(LogModel* logModel READ logModel CONSTANT)
 
 public:
@@ -39,6 +43,8 @@ public:
     int updateProgress() const;
     QString updateStatus() const;
     bool updateActive() const;
+    int loadProgress() const;
+    bool loadingFirmware() const;
     LogModel* logModel() const;
 
 public slots:
@@ -49,8 +55,12 @@ public slots:
     
     /**
      * @brief Load firmware from file
+     *
+     * The package is verified in the background; a notification reports
+     * the result and firmwareInfo changes once it has loaded.
+     *
      * @param fileUrl URL to firmware file
-     * @return true if successful
+     * @return true if loading was started
      */
     bool loadFirmware(const QUrl &fileUrl);
     
@@ -93,6 +103,8 @@ signals:
     void updateProgressChanged();
     void updateStatusChanged();
     void updateActiveChanged();
+    void loadProgressChanged();
+    void loadingFirmwareChanged();
     
     /**
      * @brief Emitted when a notification should be shown to the user
@@ -105,9 +117,12 @@ signals:
 private slots:
     void onDeviceDiscovered(const QString &deviceId, const QMap<QString, QString> &info);
     void onDeviceLost(const QString &deviceId);
+    void onFirmwareLoadProgress(int progress);
+    void onFirmwareLoaded(bool success);
     void onUpdateProgress(const QString &deviceId, int progress, const QString &status);
     void onUpdateComplete(const QString &deviceId, bool success, const QString &message);
     void onLogMessage(int level, const QString &message);
+    void onLogEvent(const LogEvent &event);
     void autoRefreshDevices();
 
 private:
@@ -118,6 +133,8 @@ private:
     int m_updateProgress;
     QString m_updateStatus;
     bool m_updateActive;
+    int m_loadProgress;
+    bool m_loadingFirmware;
     LogModel *m_logModel;
     QTimer m_autoRefreshTimer;
 };
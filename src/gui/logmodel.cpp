@@ -1,8 +1,21 @@
 #include "logmodel.h"
 
+// Constants
+const int DEFAULT_CAPACITY = 1000;
+
+// Views are updated at most once per frame
+const int FLUSH_INTERVAL_MS = 16;
+
 LogModel::LogModel(QObject *parent)
-    : QAbstractListModel(parent)
+    : QAbstractListModel(parent),
+      m_entries(DEFAULT_CAPACITY),
+      m_head(0),
+      m_count(0),
+      m_flushTimer(this)
 {
+    m_flushTimer.setSingleShot(true);
+    m_flushTimer.setInterval(FLUSH_INTERVAL_MS);
+    connect(&m_flushTimer, &QTimer::timeout, this, &LogModel::flush);
 }
 
 int LogModel::rowCount(const QModelIndex &parent) const
@@ -11,16 +24,16 @@ int LogModel::rowCount(const QModelIndex &parent) const
         return 0;
     }
     
-    return m_entries.size();
+    return m_count;
 }
 
 QVariant LogModel::data(const QModelIndex &index, int role) const
 {
-    if (!index.isValid() || index.row() < 0 || index.row() >= m_entries.size()) {
+    if (!index.isValid() || index.row() < 0 || index.row() >= m_count) {
         return QVariant();
     }
     
-    const LogEntry &entry = m_entries.at(index.row());
+    const LogEntry &entry = entryAt(index.row());
     
     switch (role) {
         case TimestampRole:
@@ -28,47 +41,127 @@ QVariant LogModel::data(const QModelIndex &index, int role) const
         case TimestampStrRole:
             return entry.timestamp.toString("HH:mm:ss.zzz");
         case LevelRole:
-            return entry.level;
+            return entry.event.level;
         case LevelStrRole:
-            return levelToString(entry.level);
+            return levelToString(entry.event.level);
         case MessageRole:
-            return entry.message;
+            return entry.event.toString();
         case ColorRole:
-            return levelToColor(entry.level);
+            return levelToColor(entry.event.level);
+        case CategoryRole:
+            return QString::fromLatin1(entry.event.category);
+        case DeviceIdRole:
+            return entry.event.deviceId;
+        case OffsetRole:
+            return entry.event.offset;
+        case BytesRole:
+            return entry.event.bytes;
         case Qt::DisplayRole:
             return QString("[%1] %2: %3")
                    .arg(entry.timestamp.toString("HH:mm:ss"))
-                   .arg(levelToString(entry.level))
-                   .arg(entry.message);
+                   .arg(levelToString(entry.event.level))
+                   .arg(entry.event.toString());
         default:
             return QVariant();
     }
 }
 
 void LogModel::addMessage(int level, const QString &message)
+{
+    LogEvent event;
+    event.level = level;
+    event.message = message;
+    addEvent(event);
+}
+
+void LogModel::addEvent(const LogEvent &event)
 {
     LogEntry entry;
     entry.timestamp = QDateTime::currentDateTime();
-    entry.level = level;
-    entry.message = message;
+    entry.event = event;
     
-    beginInsertRows(QModelIndex(), m_entries.size(), m_entries.size());
-    m_entries.append(entry);
-    endInsertRows();
+    // Views see the message with the others logged during this frame
+    m_pending.append(entry);
+    if (!m_flushTimer.isActive()) {
+        m_flushTimer.start();
+    }
+}
+
+void LogModel::flush()
+{
+    m_flushTimer.stop();
+    if (m_pending.isEmpty()) {
+        return;
+    }
     
-    // Keep a maximum of 1000 log entries
-    if (m_entries.size() > 1000) {
-        beginRemoveRows(QModelIndex(), 0, 0);
-        m_entries.removeFirst();
+    // Of a burst larger than the whole log only the newest messages are kept
+    int capacity = m_entries.size();
+    int skip = qMax(0, m_pending.size() - capacity);
+    int incoming = m_pending.size() - skip;
+    
+    int drop = qMax(0, m_count + incoming - capacity);
+    if (drop > 0) {
+        beginRemoveRows(QModelIndex(), 0, drop - 1);
+        m_head = (m_head + drop) % capacity;
+        m_count -= drop;
         endRemoveRows();
     }
+    
+    beginInsertRows(QModelIndex(), m_count, m_count + incoming - 1);
+    for (int i = skip; i < m_pending.size(); ++i) {
+        m_entries[(m_head + m_count) % capacity] = m_pending.at(i);
+        m_count++;
+    }
+    endInsertRows();
+    
+    m_pending.clear();
 }
 
 void LogModel::clear()
 {
+    m_flushTimer.stop();
+    m_pending.clear();
+    
+    beginResetModel();
+    m_entries = QVector<LogEntry>(m_entries.size());
+    m_head = 0;
+    m_count = 0;
+    endResetModel();
+}
+
+int LogModel::capacity() const
+{
+    return m_entries.size();
+}
+
+void LogModel::setCapacity(int capacity)
+{
+    capacity = qMax(1, capacity);
+    if (capacity == m_entries.size()) {
+        return;
+    }
+    
+    flush();
+    
+    // Keep the newest entries, oldest first at the start of the new ring
+    int keep = qMin(m_count, capacity);
+    QVector<LogEntry> entries(capacity);
+    for (int i = 0; i < keep; ++i) {
+        entries[i] = entryAt(m_count - keep + i);
+    }
+    
     beginResetModel();
-    m_entries.clear();
+    m_entries = entries;
+    m_head = 0;
+    m_count = keep;
     endResetModel();
+    
+    emit capacityChanged();
+}
+
+const LogEntry &LogModel::entryAt(int row) const
+{
+    return m_entries.at((m_head + row) % m_entries.size());
 }
 
 QHash<int, QByteArray> LogModel::roleNames() const
@@ -80,6 +173,10 @@ QHash<int, QByteArray> LogModel::roleNames() const
     roles[LevelStrRole] = "levelStr";
     roles[MessageRole] = "message";
     roles[ColorRole] = "color";
+    roles[CategoryRole] = "category";
+    roles[DeviceIdRole] = "deviceId";
+    roles[OffsetRole] = "offset";
+    roles[BytesRole] = "bytes";
     return roles;
 }
 
@@ -1,25 +1,36 @@
 #ifndef LOGMODEL_H
 #define LOGMODEL_H
 
+#include "core/logging.h"
+
 #include <QAbstractListModel>
 #include <QDateTime>
 #include <QVector>
+#include <QTimer>
 
 /**
  * @brief The LogEntry struct represents a single log message
+ *
+ * Plain messages are stored as events without fields. The message text of
+ * an event is only formatted when a view asks for it.
  */
 struct LogEntry {
     QDateTime timestamp;
-    int level;
-    QString message;
+    LogEvent event;
 };
 
 /**
  * @brief The LogModel class provides a model for log messages
+ *
+ * Entries live in a ring buffer of fixed capacity, so dropping the oldest
+ * one is free. Messages are collected and handed to views at most once per
+ * frame, as one range of removed and one range of inserted rows, however
+ * many were logged in between.
  */
 class LogModel : public QAbstractListModel
 {
     Q_OBJECT
+    Q_PROPERTY(int capacity READ capacity WRITE setCapacity NOTIFY capacityChanged)
 
 public:
     enum LogRoles {
@@ -28,7 +39,11 @@ public:
         LevelRole,
         LevelStrRole,
         MessageRole,
-        ColorRole
+        ColorRole,
+        CategoryRole,
+        DeviceIdRole,
+        OffsetRole,
+        BytesRole
     };
 
     explicit LogModel(QObject *parent = nullptr);
@@ -55,10 +70,36 @@ public:
      */
     void addMessage(int level, const QString &message);
     
+    /**
+     * @brief Add a structured log event
+     * @param event Event; its fields are available through the model roles
+     */
+    void addEvent(const LogEvent &event);
+    
+    /**
+     * @brief Add pending messages to the model now instead of on the next frame
+     */
+    void flush();
+    
     /**
      * @brief Clear all log messages
      */
     void clear();
+    
+    /**
+     * @brief Get the maximum number of entries kept
+     * @return Capacity
+     */
+    int capacity() const;
+    
+    /**
+     * @brief Set the maximum number of entries kept; the oldest are dropped
+     * @param capacity Capacity (at least 1)
+     */
+    void setCapacity(int capacity);
+
+signals:
+    void capacityChanged();
 
 protected:
     /**
@@ -68,7 +109,13 @@ protected:
     QHash<int, QByteArray> roleNames() const override;
 
 private:
-    QVector<LogEntry> m_entries;
+    QVector<LogEntry> m_entries;    ///< Ring of capacity entries
+    int m_head;                     ///< Slot of the oldest entry
+    int m_count;
+    QVector<LogEntry> m_pending;    ///< Messages not yet in the model
+    QTimer m_flushTimer;
+    
+    const LogEntry &entryAt(int row) const;
     
     /**
      * @brief Get string representation of log level
@@ -5,9 +5,65 @@
 #include <QFontDatabase>
 #include <QCommandLineParser>
 #include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QTimer>
+#include <stdexcept>
 
 #include "gui/flashupgui.h"
 #include "core/flashupcore.h"
+#include "core/firmwarepackagebuilder.h"
+#include "core/otaserver.h"
+
+static QByteArray readImage(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        throw std::runtime_error(QString("Failed to open %1: %2").arg(filePath, file.errorString()).toStdString());
+    }
+    return file.readAll();
+}
+
+// Block size for compressed packages
+const qint64 PACKAGE_COMPRESSION_BLOCK_SIZE = 64 * 1024;
+
+// Interval between client reports while serving firmware
+const int SERVE_REPORT_INTERVAL_MS = 5000;
+
+static int buildPackage(const QString &outputPath, const QString &imagePath,
+                        const QStringList &basePaths, const QMap<QString, QString> &metadata,
+                        bool compress)
+{
+    try {
+        FirmwarePackageBuilder builder;
+        if (compress) {
+            builder.setCompression("zlib", PACKAGE_COMPRESSION_BLOCK_SIZE);
+        }
+        
+        for (auto it = metadata.constBegin(); it != metadata.constEnd(); ++it) {
+            builder.setMetadata(it.key(), it.value());
+        }
+        
+        QByteArray image = readImage(imagePath);
+        builder.setImage(image);
+        
+        for (const QString &basePath : basePaths) {
+            qint64 patchSize = builder.addDeltaBase(readImage(basePath));
+            if (patchSize < 0) {
+                qWarning() << "Skipping delta against" << basePath << "- patch is not smaller than the image";
+            } else {
+                qInfo() << "Delta against" << basePath << ":" << patchSize << "of" << image.size() << "bytes";
+            }
+        }
+        
+        builder.write(outputPath);
+    } catch (const std::exception &e) {
+        qCritical() << "Failed to build firmware package:" << e.what();
+        return 1;
+    }
+    
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
@@ -17,11 +73,11 @@ int main(int argc, char *argv[])
     QCoreApplication::setOrganizationDomain("flashup.io");
     QCoreApplication::setApplicationName("FlashUp");
     QCoreApplication::setApplicationVersion("0.1.0");
-
+    
     // Create the application
     QGuiApplication app(argc, argv);
     app.setWindowIcon(QIcon(":/images/logo.png"));
-
+    
     // Command line parser
     QCommandLineParser parser;
     parser.setApplicationDescription("FlashUp - Firmware/OTA updater & diagnostics tool");
@@ -34,27 +90,125 @@ int main(int argc, char *argv[])
     QCommandLineOption firmwareOption({"f", "firmware"}, "Firmware file path", "filepath");
     parser.addOption(firmwareOption);
     
-    QCommandLineOption deviceOption({"d", "device"}, "Target device identifier", "device");
+    QCommandLineOption deviceOption({"d", "device"}, "Target device identifier (repeatable)", "device");
     parser.addOption(deviceOption);
     
+    QCommandLineOption maxConcurrentOption("max-concurrent", "Devices updated at the same time", "count", "8");
+    parser.addOption(maxConcurrentOption);
+    
+    QCommandLineOption maxPerTransportOption("max-per-transport", "Devices updated at the same time per USB hub or network (0 = no limit)", "count", "4");
+    parser.addOption(maxPerTransportOption);
+    
+    QCommandLineOption packOption({"p", "pack"}, "Build a firmware package from a raw image and exit", "output");
+    parser.addOption(packOption);
+    
+    QCommandLineOption imageOption("image", "Raw firmware image to package", "filepath");
+    parser.addOption(imageOption);
+    
+    QCommandLineOption deltaBaseOption("delta-base", "Previous raw image to add a delta patch for (repeatable)", "filepath");
+    parser.addOption(deltaBaseOption);
+    
+    QCommandLineOption compressOption("compress", "Store the packaged image zlib-compressed");
+    parser.addOption(compressOption);
+    
+    QCommandLineOption nameOption("name", "Firmware name for the package", "name");
+    parser.addOption(nameOption);
+    
+    QCommandLineOption fwVersionOption("fw-version", "Firmware version for the package", "version");
+    parser.addOption(fwVersionOption);
+    
+    QCommandLineOption targetOption("target", "Target device type for the package", "target");
+    parser.addOption(targetOption);
+    
+    QCommandLineOption serveOption("serve", "Serve the firmware over HTTP for pull devices until interrupted", "port");
+    parser.addOption(serveOption);
+    
     parser.process(app);
     
+    // Package builder mode
+    if (parser.isSet(packOption)) {
+        QMap<QString, QString> metadata;
+        metadata["name"] = parser.value(nameOption);
+        metadata["version"] = parser.value(fwVersionOption);
+        metadata["target"] = parser.value(targetOption);
+        
+        return buildPackage(parser.value(packOption), parser.value(imageOption),
+                            parser.values(deltaBaseOption), metadata, parser.isSet(compressOption));
+    }
+    
     bool headless = parser.isSet(headlessOption);
     QString firmwarePath = parser.value(firmwareOption);
-    QString deviceId = parser.value(deviceOption);
-
+    QStringList deviceIds = parser.values(deviceOption);
+    
     // Initialize the core
     FlashUpCore core;
     
+    // Firmware server mode
+    if (parser.isSet(serveOption)) {
+        QObject::connect(&core, &FlashUpCore::logMessage, [](int level, const QString &message) {
+            if (level > 0) {
+                qInfo().noquote() << message;
+            }
+        });
+        // Only events enabled by the logging rules reach this point
+        QObject::connect(&core, &FlashUpCore::logEvent, [](const LogEvent &event) {
+            qInfo().noquote() << event.toString();
+        });
+        
+        if (core.serveFirmware(parser.value(serveOption).toUShort(), firmwarePath).isEmpty()) {
+            return 1;
+        }
+        
+        OtaServer *server = core.otaServer();
+        QTimer reportTimer;
+        QObject::connect(&reportTimer, &QTimer::timeout, [server]() {
+            const QMap<QString, OtaServer::ClientStats> stats = server->clientStats();
+            for (const OtaServer::ClientStats &client : stats) {
+                qInfo().noquote() << QString("%1: %2 requests, %3 KiB sent, %4 KiB/s, %5 open")
+                                     .arg(client.address).arg(client.requests).arg(client.bytesSent / 1024)
+                                     .arg(client.bytesPerSecond / 1024).arg(client.connections);
+            }
+        });
+        reportTimer.start(SERVE_REPORT_INTERVAL_MS);
+        return app.exec();
+    }
+    
     // Check for headless mode
     if (headless) {
-        if (firmwarePath.isEmpty() || deviceId.isEmpty()) {
+        if (firmwarePath.isEmpty() || deviceIds.isEmpty()) {
             qCritical() << "Firmware path and device ID are required in headless mode.";
             return 1;
         }
         
-        bool success = core.updateFirmware(deviceId, firmwarePath);
-        return success ? 0 : 1;
+        if (deviceIds.size() == 1) {
+            bool success = core.updateFirmware(deviceIds.first(), firmwarePath);
+            return success ? 0 : 1;
+        }
+        
+        // Several devices: run them as one fleet and report until all have finished
+        FleetOptions options;
+        options.maxConcurrent = parser.value(maxConcurrentOption).toInt();
+        options.maxPerTransport = parser.value(maxPerTransportOption).toInt();
+        
+        QObject::connect(&core, &FlashUpCore::fleetProgress,
+                         [](int progress, int finished, int total, qint64 bytesPerSecond) {
+            qInfo().noquote() << QString("Fleet: %1% (%2/%3 devices, %4 KiB/s)")
+                                 .arg(progress).arg(finished).arg(total).arg(bytesPerSecond / 1024);
+        });
+        QObject::connect(&core, &FlashUpCore::updateComplete,
+                         [](const QString &deviceId, bool success, const QString &message) {
+            qInfo().noquote() << deviceId << (success ? "OK:" : "FAILED:") << message;
+        });
+        QObject::connect(&core, &FlashUpCore::fleetComplete,
+                         &app, [](int succeeded, int failed) {
+            Q_UNUSED(succeeded);
+            QCoreApplication::exit(failed > 0 ? 1 : 0);
+        }, Qt::QueuedConnection);
+        
+        if (!core.updateFleet(deviceIds, firmwarePath, options)) {
+            return 1;
+        }
+        return app.exec();
     }
     
     // GUI mode
@@ -0,0 +1,199 @@
+#include "multicastdevice.h"
+#include "multicastsession.h"
+#include "core/firmwarepackage.h"
+
+#include <QHostAddress>
+#include <QDebug>
+
+MulticastDevice::MulticastDevice(const QString &address, MulticastSession *session, QObject *parent)
+    : DeviceInterface(parent),
+      m_address(address),
+      m_session(session),
+      m_status(Disconnected),
+      m_state(Idle),
+      m_joining(false)
+{
+    QObject::connect(m_session, &MulticastSession::receiverProgress,
+                     this, &MulticastDevice::onReceiverProgress);
+    QObject::connect(m_session, &MulticastSession::receiverFinished,
+                     this, &MulticastDevice::onReceiverFinished);
+}
+
+MulticastDevice::~MulticastDevice()
+{
+    disconnect();
+}
+
+QString MulticastDevice::deviceId() const
+{
+    return QString("mcast:%1").arg(m_address);
+}
+
+QMap<QString, QString> MulticastDevice::deviceInfo() const
+{
+    MulticastSession::Options options = m_session->options();
+    
+    QMap<QString, QString> info;
+    info["type"] = "Multicast";
+    info["address"] = m_address;
+    info["group"] = QString("%1:%2").arg(options.group.toString()).arg(options.port);
+    info["status"] = m_status == Connected ? "Connected" : "Disconnected";
+    return info;
+}
+
+QString MulticastDevice::transportGroup() const
+{
+    // Every receiver gets the same datagrams, so fleet limits would only split
+    // the receivers across several sessions that each send the whole image
+    return QString();
+}
+
+bool MulticastDevice::connect()
+{
+    if (QHostAddress(m_address).isNull()) {
+        emit logMessage(3, QString("Multicast receivers are identified by IP address, not %1").arg(m_address));
+        return false;
+    }
+    
+    // Receivers only talk to the session; there is no link of their own
+    m_status = Connected;
+    emit connectionStatusChanged(m_status);
+    return true;
+}
+
+void MulticastDevice::disconnect()
+{
+    leaveSession();
+    
+    if (m_status != Disconnected) {
+        m_status = Disconnected;
+        emit connectionStatusChanged(m_status);
+    }
+}
+
+bool MulticastDevice::isConnected() const
+{
+    return m_status == Connected;
+}
+
+DeviceInterface::ConnectionStatus MulticastDevice::connectionStatus() const
+{
+    return m_status;
+}
+
+DeviceInterface::DeviceState MulticastDevice::deviceState() const
+{
+    return m_state;
+}
+
+bool MulticastDevice::beginUpdate()
+{
+    emit logMessage(3, "Multicast receivers take their firmware from the session; use beginPullUpdate()");
+    return false;
+}
+
+bool MulticastDevice::sendFirmwareChunk(const QByteArray &data, qint64 offset)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(offset);
+    return false;
+}
+
+bool MulticastDevice::finalizeUpdate()
+{
+    // The device finishes on its own once it holds the whole image
+    return true;
+}
+
+bool MulticastDevice::cancelUpdate()
+{
+    if (m_state != Updating && !m_joining) {
+        return false;
+    }
+    
+    emit logMessage(1, "Leaving multicast session...");
+    leaveSession();
+    m_state = Idle;
+    emit deviceStateChanged(m_state);
+    return true;
+}
+
+qint64 MulticastDevice::optimalChunkSize() const
+{
+    // Not used, the session sets the datagram size
+    return 0;
+}
+
+bool MulticastDevice::pullsFirmware() const
+{
+    return true;
+}
+
+bool MulticastDevice::beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware)
+{
+    if (!isConnected() || m_joining || m_state == Updating) {
+        emit logMessage(3, "Cannot begin update: device not connected or busy");
+        return false;
+    }
+    
+    // The session may run in another thread; it confirms the join with a progress report
+    m_joining = true;
+    MulticastSession *session = m_session;
+    QString address = m_address;
+    QMetaObject::invokeMethod(m_session, [session, address, firmware]() {
+        if (!session->addReceiver(address, firmware)) {
+            emit session->receiverFinished(address, false);
+        }
+    }, Qt::QueuedConnection);
+    return true;
+}
+
+void MulticastDevice::onReceiverProgress(const QString &address, qint64 bytes, qint64 total)
+{
+    if (address != m_address || (!m_joining && m_state != Updating)) {
+        return;
+    }
+    
+    if (m_joining) {
+        m_joining = false;
+        m_state = Updating;
+        emit deviceStateChanged(m_state);
+    }
+    
+    emit pullProgress(bytes, total);
+}
+
+void MulticastDevice::onReceiverFinished(const QString &address, bool success)
+{
+    if (address != m_address || (!m_joining && m_state != Updating)) {
+        return;
+    }
+    
+    m_joining = false;
+    
+    if (success) {
+        emit logMessage(1, "Device has received the whole image");
+        m_state = Rebooting;
+        emit deviceStateChanged(m_state);
+        return;
+    }
+    
+    emit logMessage(3, "Device did not receive the image");
+    m_state = Idle;
+    m_status = Disconnected;
+    emit connectionStatusChanged(m_status);
+}
+
+void MulticastDevice::leaveSession()
+{
+    if (!m_joining && m_state != Updating) {
+        return;
+    }
+    
+    m_joining = false;
+    MulticastSession *session = m_session;
+    QString address = m_address;
+    QMetaObject::invokeMethod(m_session, [session, address]() {
+        session->removeReceiver(address);
+    }, Qt::QueuedConnection);
+}
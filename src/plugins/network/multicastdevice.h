@@ -0,0 +1,64 @@
+#ifndef MULTICASTDEVICE_H
+#define MULTICASTDEVICE_H
+
+#include "core/deviceinterface.h"
+
+#include <QString>
+
+class MulticastSession;
+
+/**
+ * @brief The MulticastDevice class implements DeviceInterface for receivers of a multicast session
+ *
+ * The device takes its image from a MulticastSession shared by every device
+ * on the subnet instead of from its own transfer, so the update job only
+ * follows the progress the device reports to the session (see
+ * DeviceInterface::pullsFirmware()). The device checks the SHA-256 from the
+ * session announcement and reboots into the new image.
+ */
+class MulticastDevice : public DeviceInterface
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Construct a multicast receiver
+     * @param address Device address, as the source address of its reports
+     * @param session Session the device receives from; must outlive the device
+     * @param parent Parent object
+     */
+    MulticastDevice(const QString &address, MulticastSession *session, QObject *parent = nullptr);
+    ~MulticastDevice();
+
+    // DeviceInterface interface
+    QString deviceId() const override;
+    QMap<QString, QString> deviceInfo() const override;
+    QString transportGroup() const override;
+    bool connect() override;
+    void disconnect() override;
+    bool isConnected() const override;
+    ConnectionStatus connectionStatus() const override;
+    DeviceState deviceState() const override;
+    bool beginUpdate() override;
+    bool sendFirmwareChunk(const QByteArray &data, qint64 offset) override;
+    bool finalizeUpdate() override;
+    bool cancelUpdate() override;
+    qint64 optimalChunkSize() const override;
+    bool pullsFirmware() const override;
+    bool beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware) override;
+
+private slots:
+    void onReceiverProgress(const QString &address, qint64 bytes, qint64 total);
+    void onReceiverFinished(const QString &address, bool success);
+
+private:
+    QString m_address;
+    MulticastSession *m_session;
+    ConnectionStatus m_status;
+    DeviceState m_state;
+    bool m_joining;
+
+    void leaveSession();
+};
+
+#endif // MULTICASTDEVICE_H
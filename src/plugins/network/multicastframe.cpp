@@ -0,0 +1,111 @@
+#include "multicastframe.h"
+#include "core/crc32.h"
+
+#include <QtEndian>
+#include <cstring>
+
+// "FUMC" read as a little-endian integer
+const quint32 MAGIC = 0x434D5546;
+
+namespace {
+
+QByteArray header(MulticastFrame::Type type, quint32 session, int payloadSize)
+{
+    QByteArray datagram(MulticastFrame::HEADER_SIZE + payloadSize, '\0');
+    char *out = datagram.data();
+    qToLittleEndian(MAGIC, out);
+    out[4] = static_cast<char>(type);
+    qToLittleEndian(session, out + 8);
+    return datagram;
+}
+
+} // namespace
+
+QByteArray MulticastFrame::encodeAnnounce(quint32 session, const ImageInfo &info)
+{
+    QByteArray datagram = header(Announce, session, 20 + 32);
+    char *out = datagram.data() + HEADER_SIZE;
+    qToLittleEndian(static_cast<quint64>(info.size), out);
+    qToLittleEndian(info.chunkSize, out + 8);
+    qToLittleEndian(info.chunkCount, out + 12);
+    out[16] = static_cast<char>(info.fecGroupSize);
+    std::memcpy(out + 20, info.sha256.constData(), qMin(info.sha256.size(), 32));
+    return datagram;
+}
+
+QByteArray MulticastFrame::encodeData(quint32 session, quint32 index, const QByteArray &data)
+{
+    QByteArray datagram = header(Data, session, 8 + data.size());
+    char *out = datagram.data() + HEADER_SIZE;
+    qToLittleEndian(index, out);
+    qToLittleEndian(Crc32::compute(data), out + 4);
+    std::memcpy(out + 8, data.constData(), data.size());
+    return datagram;
+}
+
+QByteArray MulticastFrame::encodeParity(quint32 session, quint32 first, quint8 count, const QByteArray &parity)
+{
+    QByteArray datagram = header(Parity, session, 12 + parity.size());
+    char *out = datagram.data() + HEADER_SIZE;
+    qToLittleEndian(first, out);
+    out[4] = static_cast<char>(count);
+    qToLittleEndian(Crc32::compute(parity), out + 8);
+    std::memcpy(out + 12, parity.constData(), parity.size());
+    return datagram;
+}
+
+QByteArray MulticastFrame::encodeRoundEnd(quint32 session, quint32 round)
+{
+    QByteArray datagram = header(RoundEnd, session, 4);
+    qToLittleEndian(round, datagram.data() + HEADER_SIZE);
+    return datagram;
+}
+
+QByteArray MulticastFrame::encodeStatus(quint32 session, const StatusReport &report)
+{
+    QByteArray datagram = header(Status, session, 12 + report.missing.size());
+    char *out = datagram.data() + HEADER_SIZE;
+    qToLittleEndian(report.round, out);
+    qToLittleEndian(report.received, out + 4);
+    qToLittleEndian(report.base, out + 8);
+    std::memcpy(out + 12, report.missing.constData(), report.missing.size());
+    return datagram;
+}
+
+bool MulticastFrame::decodeHeader(const QByteArray &datagram, quint8 *type, quint32 *session)
+{
+    if (datagram.size() < HEADER_SIZE || qFromLittleEndian<quint32>(datagram.constData()) != MAGIC) {
+        return false;
+    }
+    
+    *type = static_cast<quint8>(datagram.at(4));
+    *session = qFromLittleEndian<quint32>(datagram.constData() + 8);
+    return true;
+}
+
+bool MulticastFrame::decodeStatus(const QByteArray &datagram, StatusReport *report)
+{
+    quint8 type = 0;
+    quint32 session = 0;
+    if (!decodeHeader(datagram, &type, &session) || type != Status ||
+        datagram.size() < STATUS_HEADER_SIZE) {
+        return false;
+    }
+    
+    const char *in = datagram.constData() + HEADER_SIZE;
+    report->round = qFromLittleEndian<quint32>(in);
+    report->received = qFromLittleEndian<quint32>(in + 4);
+    report->base = qFromLittleEndian<quint32>(in + 8);
+    report->missing = datagram.mid(STATUS_HEADER_SIZE);
+    return true;
+}
+
+void MulticastFrame::xorInto(QByteArray *parity, const QByteArray &data)
+{
+    char *out = parity->data();
+    const char *in = data.constData();
+    int size = qMin(parity->size(), data.size());
+    for (int i = 0; i < size; ++i) {
+        out[i] ^= in[i];
+    }
+}
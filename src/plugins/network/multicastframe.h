@@ -0,0 +1,90 @@
+#ifndef MULTICASTFRAME_H
+#define MULTICASTFRAME_H
+
+#include <QByteArray>
+
+/**
+ * @brief The MulticastFrame class encodes the datagrams of the multicast protocol
+ *
+ * Every datagram starts with a 12-byte header (integers little-endian):
+ * - 4 bytes: Magic ("FUMC")
+ * - 1 byte:  Type
+ * - 3 bytes: Reserved, zero
+ * - 4 bytes: Session ID, changes whenever a new image is distributed
+ *
+ * Host to group:
+ * - Announce: u64 image size, u32 chunk size, u32 chunk count,
+ *   u8 FEC group size (0 = no parity), 3 reserved bytes, 32-byte SHA-256
+ * - Data: u32 chunk index, u32 CRC-32 of the data, data
+ * - Parity: u32 first chunk index, u8 chunk count, 3 reserved bytes,
+ *   u32 CRC-32, XOR of the group's chunks (each zero-padded to the chunk size)
+ * - RoundEnd: u32 round number; receivers answer with a Status
+ *
+ * Receiver to host (unicast to the source of the group datagrams):
+ * - Status: u32 round, u32 chunks held, u32 base chunk index, then a bitmap
+ *   of missing chunks starting at base (bit i of byte i / 8, LSB first)
+ */
+class MulticastFrame
+{
+public:
+    enum Type : quint8 {
+        Announce = 0x01,
+        Data = 0x02,
+        Parity = 0x03,
+        RoundEnd = 0x04,
+        Status = 0x81
+    };
+
+    static const int HEADER_SIZE = 12;
+    static const int DATA_HEADER_SIZE = HEADER_SIZE + 8;
+    static const int PARITY_HEADER_SIZE = HEADER_SIZE + 12;
+    static const int STATUS_HEADER_SIZE = HEADER_SIZE + 12;
+
+    /**
+     * @brief Description of the image being distributed
+     */
+    struct ImageInfo {
+        qint64 size = 0;
+        quint32 chunkSize = 0;
+        quint32 chunkCount = 0;
+        quint8 fecGroupSize = 0;
+        QByteArray sha256;          ///< Raw 32-byte digest
+    };
+
+    /**
+     * @brief A receiver's report of what it still misses
+     */
+    struct StatusReport {
+        quint32 round = 0;
+        quint32 received = 0;       ///< Chunks held, parity-recovered ones included
+        quint32 base = 0;           ///< Chunk index of the first bitmap bit
+        QByteArray missing;         ///< Bitmap of missing chunks from base on
+    };
+
+    static QByteArray encodeAnnounce(quint32 session, const ImageInfo &info);
+    static QByteArray encodeData(quint32 session, quint32 index, const QByteArray &data);
+    static QByteArray encodeParity(quint32 session, quint32 first, quint8 count, const QByteArray &parity);
+    static QByteArray encodeRoundEnd(quint32 session, quint32 round);
+    static QByteArray encodeStatus(quint32 session, const StatusReport &report);
+
+    /**
+     * @brief Read the type and session of a datagram
+     * @return true if the datagram has a valid header
+     */
+    static bool decodeHeader(const QByteArray &datagram, quint8 *type, quint32 *session);
+
+    /**
+     * @brief Decode a Status datagram
+     * @return true if the datagram is a well-formed Status
+     */
+    static bool decodeStatus(const QByteArray &datagram, StatusReport *report);
+
+    /**
+     * @brief XOR data into a parity block
+     * @param parity Parity block, at least as large as data
+     * @param data Chunk data; shorter chunks count as zero-padded
+     */
+    static void xorInto(QByteArray *parity, const QByteArray &data);
+};
+
+#endif // MULTICASTFRAME_H
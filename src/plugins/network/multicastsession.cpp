@@ -0,0 +1,336 @@
+#include "multicastsession.h"
+#include "core/firmwarepackage.h"
+#include "core/logging.h"
+
+#include <QNetworkDatagram>
+#include <QRandomGenerator>
+#include <QDebug>
+
+// Per-round and per-datagram output; enable with QT_LOGGING_RULES="flashup.multicast.debug=true"
+Q_LOGGING_CATEGORY(lcMulticast, "flashup.multicast", QtInfoMsg)
+
+// Constants
+const int SEND_TICK_MS = 5;
+const int ANNOUNCE_INTERVAL_MS = 1000;
+const int REPORT_WINDOW_MS = 500;
+const int ROUND_END_REPEATS = 3;
+
+// Report windows a receiver may miss in a row before it is given up on
+const int MAX_SILENT_ROUNDS = 10;
+
+namespace {
+
+QString normalizedAddress(const QHostAddress &address)
+{
+    bool isIPv4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isIPv4);
+    return isIPv4 ? QHostAddress(ipv4).toString() : address.toString();
+}
+
+} // namespace
+
+MulticastSession::MulticastSession(const Options &options, QObject *parent)
+    : QObject(parent),
+      m_options(options),
+      m_socket(this),
+      m_sessionId(0),
+      m_chunkCount(0),
+      m_round(0),
+      m_nextChunk(0),
+      m_parityGroup(-1),
+      m_parityCount(0),
+      m_sendFailures(0),
+      m_sendTimer(this),
+      m_reportTimer(this)
+{
+    connect(&m_socket, &QUdpSocket::readyRead,
+            this, &MulticastSession::onReadyRead);
+    
+    m_sendTimer.setInterval(SEND_TICK_MS);
+    m_sendTimer.setTimerType(Qt::PreciseTimer);
+    connect(&m_sendTimer, &QTimer::timeout,
+            this, &MulticastSession::onSendTick);
+    
+    m_reportTimer.setSingleShot(true);
+    connect(&m_reportTimer, &QTimer::timeout,
+            this, &MulticastSession::onReportWindowEnd);
+}
+
+MulticastSession::~MulticastSession()
+{
+    stop();
+}
+
+MulticastSession::Options MulticastSession::options() const
+{
+    return m_options;
+}
+
+bool MulticastSession::addReceiver(const QString &address, std::shared_ptr<FirmwarePackage> firmware)
+{
+    if (m_firmware && m_firmware->sha256Hash() != firmware->sha256Hash()) {
+        emit logMessage(3, "Multicast session is busy distributing another image");
+        return false;
+    }
+    
+    if (!m_firmware) {
+        if (!openSocket()) {
+            return false;
+        }
+        start(firmware);
+    }
+    
+    m_receivers.insert(address, Receiver());
+    emit logMessage(1, QString("%1 joined the multicast session").arg(address));
+    emit receiverProgress(address, 0, m_firmware->size());
+    return true;
+}
+
+void MulticastSession::removeReceiver(const QString &address)
+{
+    if (m_receivers.remove(address) > 0 && m_receivers.isEmpty()) {
+        stop();
+    }
+}
+
+bool MulticastSession::isRunning() const
+{
+    return m_firmware != nullptr;
+}
+
+void MulticastSession::onSendTick()
+{
+    // Late joiners learn about the session from the periodic announcement
+    if (m_announceTimer.elapsed() >= ANNOUNCE_INTERVAL_MS) {
+        send(m_announce);
+        m_announceTimer.restart();
+    }
+    
+    // Spread the datagrams evenly instead of bursting them into the switch
+    qint64 budget = qMax<qint64>(1, m_options.bytesPerSecond * SEND_TICK_MS / 1000);
+    while (budget > 0) {
+        while (m_nextChunk < m_chunkCount && !m_pending.testBit(m_nextChunk)) {
+            m_nextChunk++;
+        }
+        
+        if (m_nextChunk >= m_chunkCount) {
+            endRound();
+            return;
+        }
+        
+        sendChunk(m_nextChunk++);
+        budget -= m_options.chunkSize;
+    }
+}
+
+void MulticastSession::onReportWindowEnd()
+{
+    for (auto it = m_receivers.begin(); it != m_receivers.end();) {
+        if (!it->reported && ++it->silentRounds > MAX_SILENT_ROUNDS) {
+            QString address = it.key();
+            it = m_receivers.erase(it);
+            emit logMessage(2, QString("%1 stopped reporting, giving up on it").arg(address));
+            emit receiverFinished(address, false);
+        } else {
+            it->reported = false;
+            ++it;
+        }
+    }
+    
+    if (m_receivers.isEmpty()) {
+        stop();
+        return;
+    }
+    
+    // Nothing reported missing, but not everyone has answered yet: ask again
+    if (m_missing.count(true) == 0) {
+        endRound();
+        return;
+    }
+    
+    beginRound(m_missing);
+}
+
+void MulticastSession::onReadyRead()
+{
+    while (m_socket.hasPendingDatagrams()) {
+        QNetworkDatagram datagram = m_socket.receiveDatagram();
+        
+        quint8 type = 0;
+        quint32 session = 0;
+        MulticastFrame::StatusReport report;
+        if (!m_firmware || !MulticastFrame::decodeHeader(datagram.data(), &type, &session) ||
+            session != m_sessionId || !MulticastFrame::decodeStatus(datagram.data(), &report)) {
+            continue;
+        }
+        
+        QString address = normalizedAddress(datagram.senderAddress());
+        auto it = m_receivers.find(address);
+        if (it == m_receivers.end()) {
+            continue;
+        }
+        
+        it->reported = true;
+        it->silentRounds = 0;
+        it->received = qMin<qint64>(report.received, m_chunkCount);
+        
+        // Whatever any receiver misses goes out once in the next round
+        const char *bitmap = report.missing.constData();
+        for (qint64 bit = 0; bit < report.missing.size() * 8; ++bit) {
+            qint64 index = report.base + bit;
+            if (index >= m_chunkCount) {
+                break;
+            }
+            if (bitmap[bit / 8] & (1 << (bit % 8))) {
+                m_missing.setBit(static_cast<int>(index));
+            }
+        }
+        
+        qint64 size = m_firmware->size();
+        emit receiverProgress(address, qMin(it->received * m_options.chunkSize, size), size);
+        
+        if (it->received >= m_chunkCount) {
+            m_receivers.erase(it);
+            emit logMessage(1, QString("%1 received the whole image").arg(address));
+            emit receiverFinished(address, true);
+            
+            if (m_receivers.isEmpty()) {
+                emit logMessage(1, QString("Multicast session finished after %1 rounds").arg(m_round));
+                stop();
+                return;
+            }
+        }
+    }
+}
+
+bool MulticastSession::openSocket()
+{
+    if (m_socket.state() == QAbstractSocket::BoundState) {
+        return true;
+    }
+    
+    if (!m_socket.bind(QHostAddress(QHostAddress::AnyIPv4), 0)) {
+        emit logMessage(3, QString("Failed to open multicast socket: %1").arg(m_socket.errorString()));
+        return false;
+    }
+    
+    m_socket.setSocketOption(QAbstractSocket::MulticastTtlOption, m_options.ttl);
+    
+    // Receivers on this host, such as test clients on loopback, see the group too
+    m_socket.setSocketOption(QAbstractSocket::MulticastLoopbackOption, 1);
+    return true;
+}
+
+void MulticastSession::start(std::shared_ptr<FirmwarePackage> firmware)
+{
+    m_firmware = firmware;
+    m_sessionId = QRandomGenerator::global()->generate();
+    m_chunkCount = static_cast<int>((firmware->size() + m_options.chunkSize - 1) / m_options.chunkSize);
+    m_round = 0;
+    
+    MulticastFrame::ImageInfo info;
+    info.size = firmware->size();
+    info.chunkSize = static_cast<quint32>(m_options.chunkSize);
+    info.chunkCount = static_cast<quint32>(m_chunkCount);
+    info.fecGroupSize = static_cast<quint8>(qBound(0, m_options.fecGroupSize, 255));
+    info.sha256 = QByteArray::fromHex(firmware->sha256Hash().toLatin1());
+    m_announce = MulticastFrame::encodeAnnounce(m_sessionId, info);
+    
+    emit logMessage(1, QString("Multicasting %1 chunks to %2:%3")
+                       .arg(m_chunkCount).arg(m_options.group.toString()).arg(m_options.port));
+    
+    beginRound(QBitArray(m_chunkCount, true));
+}
+
+void MulticastSession::stop()
+{
+    m_sendTimer.stop();
+    m_reportTimer.stop();
+    m_firmware.reset();
+    m_receivers.clear();
+    m_socket.close();
+}
+
+void MulticastSession::beginRound(QBitArray chunks)
+{
+    m_round++;
+    m_pending = chunks;
+    m_missing = QBitArray(m_chunkCount);
+    m_nextChunk = 0;
+    m_parityGroup = -1;
+    m_parityCount = 0;
+    m_sendFailures = 0;
+    
+    if (FLASHUP_LOG_ENABLED(lcMulticast, Logging::Debug)) {
+        LogEvent event(lcMulticast(), Logging::Debug, QString("Multicast round %1").arg(m_round));
+        event.bytes = static_cast<qint64>(m_pending.count(true)) * m_options.chunkSize;
+        emit logEvent(event);
+    }
+    
+    send(m_announce);
+    m_announceTimer.start();
+    m_sendTimer.start();
+}
+
+void MulticastSession::endRound()
+{
+    m_sendTimer.stop();
+    
+    // Sent a few times, as a lost round end would cost a whole report window
+    QByteArray roundEnd = MulticastFrame::encodeRoundEnd(m_sessionId, m_round);
+    for (int i = 0; i < ROUND_END_REPEATS; ++i) {
+        send(roundEnd);
+    }
+    
+    if (m_sendFailures > 0 && FLASHUP_LOG_ENABLED(lcMulticast, Logging::Debug)) {
+        LogEvent event(lcMulticast(), Logging::Debug,
+                       QString("Multicast round %1: %2 datagrams not sent").arg(m_round).arg(m_sendFailures));
+        emit logEvent(event);
+    }
+    
+    m_reportTimer.start(REPORT_WINDOW_MS);
+}
+
+void MulticastSession::sendChunk(int index)
+{
+    QByteArray data = m_firmware->getChunk(static_cast<qint64>(index) * m_options.chunkSize,
+                                           m_options.chunkSize);
+    send(MulticastFrame::encodeData(m_sessionId, static_cast<quint32>(index), data));
+    
+    int groupSize = m_options.fecGroupSize;
+    if (groupSize < 2) {
+        return;
+    }
+    
+    int group = index / groupSize;
+    if (group != m_parityGroup) {
+        m_parityGroup = group;
+        m_parityCount = 0;
+        m_parity.fill('\0', static_cast<int>(m_options.chunkSize));
+    }
+    
+    MulticastFrame::xorInto(&m_parity, data);
+    m_parityCount++;
+    
+    // Parity can only restore a chunk if it covers the whole group, as in the first round
+    int first = group * groupSize;
+    int count = qMin(groupSize, m_chunkCount - first);
+    if (m_parityCount == count) {
+        send(MulticastFrame::encodeParity(m_sessionId, static_cast<quint32>(first),
+                                          static_cast<quint8>(count), m_parity));
+    }
+}
+
+void MulticastSession::send(const QByteArray &datagram)
+{
+    if (m_socket.writeDatagram(datagram, m_options.group, m_options.port) >= 0) {
+        return;
+    }
+    
+    // A failing socket usually fails every datagram of the round, so warn once per round;
+    // receivers report what was lost and get it in the next one
+    if (m_sendFailures++ == 0) {
+        emit logMessage(2, QString("Multicast send failed in round %1: %2")
+                           .arg(m_round).arg(m_socket.errorString()));
+    }
+}
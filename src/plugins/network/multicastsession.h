@@ -0,0 +1,140 @@
+#ifndef MULTICASTSESSION_H
+#define MULTICASTSESSION_H
+
+#include "multicastframe.h"
+#include "core/logging.h"
+
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QBitArray>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMap>
+#include <memory>
+
+class FirmwarePackage;
+
+/**
+ * @brief The MulticastSession class distributes one firmware image to many devices over UDP multicast
+ *
+ * The image is sent to the group in rounds. The first round carries every
+ * chunk, followed by an XOR parity chunk per FEC group, so a receiver can
+ * rebuild one lost chunk per group on its own. At the end of a round the
+ * receivers report a bitmap of the chunks they still miss, and the next
+ * round resends only the union of those. The data sent therefore depends on
+ * the loss rate rather than on the number of devices.
+ *
+ * Receivers may join while a session runs and get the rounds they missed
+ * through the same repair mechanism. Multicast has no congestion control,
+ * so datagrams are paced to a fixed rate.
+ */
+class MulticastSession : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Options {
+        QHostAddress group = QHostAddress(QStringLiteral("239.255.70.85"));
+        quint16 port = 47085;
+        qint64 chunkSize = 1024;            ///< Payload per datagram, keep below the path MTU
+        qint64 bytesPerSecond = 1024 * 1024;
+        int fecGroupSize = 8;               ///< Data chunks per parity chunk, 0 for no parity
+        int ttl = 1;                        ///< Hops; 1 keeps datagrams on the local subnet
+    };
+
+    explicit MulticastSession(const Options &options = Options(), QObject *parent = nullptr);
+    ~MulticastSession();
+
+    Options options() const;
+
+    /**
+     * @brief Add a device to the session, starting it if it is not running
+     *
+     * A running session only takes receivers of the image it distributes.
+     * Must be called in the session's thread.
+     *
+     * @param address Device address, as the source address of its reports
+     * @param firmware Image to distribute
+     * @return true if the receiver was added
+     */
+    bool addReceiver(const QString &address, std::shared_ptr<FirmwarePackage> firmware);
+
+    /**
+     * @brief Stop waiting for a device; the session ends when no receivers remain
+     * @param address Device address
+     */
+    void removeReceiver(const QString &address);
+
+    bool isRunning() const;
+
+signals:
+    /**
+     * @brief Emitted when a receiver reports how much of the image it holds
+     * @param address Device address
+     * @param bytes Bytes held
+     * @param total Image size
+     */
+    void receiverProgress(const QString &address, qint64 bytes, qint64 total);
+
+    /**
+     * @brief Emitted when a receiver has the whole image or was given up on
+     * @param address Device address
+     * @param success true if the device reported every chunk
+     */
+    void receiverFinished(const QString &address, bool success);
+
+    /**
+     * @brief Emitted for log messages
+     * @param level Log level (0=debug, 1=info, 2=warning, 3=error)
+     * @param message Log message
+     */
+    void logMessage(int level, const QString &message);
+
+    /**
+     * @brief Emitted for structured log events, such as per-round or per-datagram output
+     * @param event Event with typed fields
+     */
+    void logEvent(const LogEvent &event);
+
+private slots:
+    void onSendTick();
+    void onReportWindowEnd();
+    void onReadyRead();
+
+private:
+    struct Receiver {
+        qint64 received = 0;    ///< Chunks held
+        int silentRounds = 0;   ///< Rounds without a report
+        bool reported = false;  ///< Reported since the last round ended
+    };
+
+    Options m_options;
+    QUdpSocket m_socket;
+    std::shared_ptr<FirmwarePackage> m_firmware;
+    QByteArray m_announce;
+    quint32 m_sessionId;
+    int m_chunkCount;
+    quint32 m_round;
+    QBitArray m_pending;        ///< Chunks still to send this round
+    QBitArray m_missing;        ///< Chunks reported missing, sent next round
+    int m_nextChunk;
+    QByteArray m_parity;        ///< XOR of the current FEC group so far
+    int m_parityGroup;          ///< Index of the current FEC group, -1 for none
+    int m_parityCount;          ///< Chunks of the current group sent this round
+    int m_sendFailures;         ///< Datagrams that could not be sent this round
+    QMap<QString, Receiver> m_receivers;
+    QTimer m_sendTimer;
+    QTimer m_reportTimer;
+    QElapsedTimer m_announceTimer;
+
+    bool openSocket();
+    void start(std::shared_ptr<FirmwarePackage> firmware);
+    void stop();
+    void beginRound(QBitArray chunks);
+    void endRound();
+    void sendChunk(int index);
+    void send(const QByteArray &datagram);
+};
+
+#endif // MULTICASTSESSION_H
@@ -1,21 +1,54 @@
 #include "networkdevice.h"
+#include "networkframe.h"
 
 #include <QJsonDocument>
 #include <QJsonObject>
-#include <QDataStream>
+#include <QJsonArray>
 #include <QDebug>
+#include <QtEndian>
+#include <QNetworkInterface>
+#include <QUdpSocket>
+#include <cstring>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#endif
 
 // Constants
 const int TIMEOUT_MS = 5000;
+const int ROUTE_LOOKUP_TIMEOUT_MS = 1000;
 const qint64 DEFAULT_CHUNK_SIZE = 4096;
+const int MAX_WINDOW_SIZE = 64;
+const qint64 MIN_CHUNK_SIZE_LIMIT = 512;
+const qint64 MAX_CHUNK_SIZE_LIMIT = 65536;
+const qint64 RESPONSE_BUFFER_SIZE = 1024 * 1024;
+
+// Bytes of firmware data to keep queued for the socket ahead of the network
+const qint64 SEND_BUFFER_TARGET = 256 * 1024;
 
 NetworkDevice::NetworkDevice(const QString &address, quint16 port, QObject *parent)
     : DeviceInterface(parent),
       m_address(address),
       m_port(port),
+      m_socket(this),
       m_status(Disconnected),
       m_state(Idle),
-      m_waitingForResponse(false)
+      m_parser(FrameParser::LengthPrefixed, RESPONSE_BUFFER_SIZE),
+      m_timeoutTimer(this),
+      m_waitingForResponse(false),
+      m_requestChunkOffset(-1),
+      m_maxWindowSize(1),
+      m_minChunkSize(DEFAULT_CHUNK_SIZE),
+      m_maxChunkSize(DEFAULT_CHUNK_SIZE),
+      m_supportsResume(false),
+      m_supportsDelta(false),
+      m_handshakeComplete(false),
+      m_compressionBlockSize(0),
+      m_supportsFill(false),
+      m_erasedValue(-1),
+      m_binaryChunks(false)
 {
     // Connect socket signals
     QObject::connect(&m_socket, &QTcpSocket::connected,
@@ -26,6 +59,8 @@ NetworkDevice::NetworkDevice(const QString &address, quint16 port, QObject *pare
                      this, &NetworkDevice::onError);
     QObject::connect(&m_socket, &QTcpSocket::readyRead,
                      this, &NetworkDevice::onReadyRead);
+    QObject::connect(&m_socket, &QTcpSocket::bytesWritten,
+                     this, &NetworkDevice::onBytesWritten);
     
     // Setup timeout timer
     m_timeoutTimer.setSingleShot(true);
@@ -43,6 +78,54 @@ QString NetworkDevice::deviceId() const
     return QString("net:%1:%2").arg(m_address).arg(m_port);
 }
 
+QString NetworkDevice::transportGroup() const
+{
+    // Devices reached through the same local subnet share its access point,
+    // so group by the interface address the route to the device leaves from
+    QHostAddress local = m_socket.localAddress();
+    if (local.isNull()) {
+        QHostAddress remote(m_address);
+        if (remote.isNull()) {
+            // Host names are only resolved on connect
+            return DeviceInterface::transportGroup();
+        }
+        
+        // Connecting a UDP socket only selects the route; nothing is sent
+        QUdpSocket socket;
+        socket.connectToHost(remote, m_port);
+        if (!socket.waitForConnected(ROUTE_LOOKUP_TIMEOUT_MS)) {
+            return DeviceInterface::transportGroup();
+        }
+        local = socket.localAddress();
+    }
+    
+    const QList<QNetworkInterface> interfaces = QNetworkInterface::allInterfaces();
+    for (const QNetworkInterface &iface : interfaces) {
+        const QList<QNetworkAddressEntry> entries = iface.addressEntries();
+        for (const QNetworkAddressEntry &entry : entries) {
+            if (!entry.ip().isEqual(local, QHostAddress::TolerantConversion)) {
+                continue;
+            }
+            
+            int prefixLength = entry.prefixLength();
+            QHostAddress network;
+            if (entry.ip().protocol() == QAbstractSocket::IPv4Protocol) {
+                quint32 mask = prefixLength > 0 ? ~quint32(0) << (32 - prefixLength) : 0;
+                network = QHostAddress(entry.ip().toIPv4Address() & mask);
+            } else {
+                Q_IPV6ADDR address = entry.ip().toIPv6Address();
+                for (int i = 0; i < 16; ++i) {
+                    int bits = qBound(0, prefixLength - i * 8, 8);
+                    address[i] &= quint8(0xFF00 >> bits);
+                }
+                network = QHostAddress(address);
+            }
+            return QString("net:%1/%2").arg(network.toString()).arg(prefixLength);
+        }
+    }
+    return DeviceInterface::transportGroup();
+}
+
 QMap<QString, QString> NetworkDevice::deviceInfo() const
 {
     QMap<QString, QString> info;
@@ -80,10 +163,23 @@ void NetworkDevice::disconnect()
         m_socket.waitForDisconnected(1000);
     }
     
-    m_buffer.clear();
+    m_parser.clear();
     m_pendingCommands.clear();
     m_timeoutTimer.stop();
     m_waitingForResponse = false;
+    m_requestChunkOffset = -1;
+    m_maxWindowSize = 1;
+    m_minChunkSize = DEFAULT_CHUNK_SIZE;
+    m_maxChunkSize = DEFAULT_CHUNK_SIZE;
+    m_supportsResume = false;
+    m_supportsDelta = false;
+    m_handshakeComplete = false;
+    m_installedFirmwareHash.clear();
+    m_supportedCompression.clear();
+    m_payloadCompression.clear();
+    m_supportsFill = false;
+    m_erasedValue = -1;
+    m_binaryChunks = false;
     
     m_status = Disconnected;
     emit connectionStatusChanged(m_status);
@@ -118,6 +214,7 @@ bool NetworkDevice::beginUpdate()
     // Send update begin request
     QJsonObject data;
     data["action"] = "begin_update";
+    addPayloadCompression(data);
     
     QByteArray jsonData = QJsonDocument(data).toJson(QJsonDocument::Compact);
     
@@ -136,16 +233,93 @@ bool NetworkDevice::sendFirmwareChunk(const QByteArray &data, qint64 offset)
         return false;
     }
     
-    // Create chunk request
-    QJsonObject reqData;
-    reqData["action"] = "write_chunk";
-    reqData["offset"] = static_cast<qint64>(offset);
-    reqData["size"] = data.size();
+    // Binary chunks go out as header plus the caller's buffer, without building a request
+    bool windowed = m_maxWindowSize > 1;
+    if (m_binaryChunks && (windowed || !m_waitingForResponse)) {
+        char header[NetworkFrame::SIZE_PREFIX_SIZE + NetworkFrame::CHUNK_HEADER_SIZE];
+        NetworkFrame::encodeChunkHeader(offset, data, header);
+        
+        if (!writeGathered(header, sizeof(header), data)) {
+            emit logMessage(3, QString("Failed to send firmware chunk at offset %1").arg(offset));
+            return false;
+        }
+        
+        if (!windowed) {
+            m_waitingForResponse = true;
+            m_requestChunkOffset = offset;
+            m_timeoutTimer.start(TIMEOUT_MS);
+        }
+        return true;
+    }
+    
+    // Queued requests keep their frame, so only an unqueued one may reuse the buffer
+    QByteArray queued;
+    QByteArray *frame = (windowed || !m_waitingForResponse) ? &m_chunkFrame : &queued;
+    encodeChunkFrame(data, offset, frame);
+    return sendEncodedChunk(*frame, offset);
+}
+
+QString NetworkDevice::frameVariant() const
+{
+    return m_binaryChunks ? "net-binary" : "net-json";
+}
+
+bool NetworkDevice::encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame)
+{
+    // Create chunk request; JSON only for devices without the binary header
+    if (m_binaryChunks) {
+        NetworkFrame::encodeChunk(offset, data, frame);
+        return true;
+    }
+    
+    // Same bytes as createRequest("update", <compact JSON> + "\n" + data), formatted
+    // on the stack so the request is built in place
+    char body[96];
+    int bodySize = qsnprintf(body, sizeof(body), "{\"action\":\"write_chunk\",\"offset\":%lld,\"size\":%d}\n",
+                             static_cast<long long>(offset), data.size());
+    char header[64];
+    int headerSize = qsnprintf(header, sizeof(header), "{\"command\":\"update\",\"data_size\":%d}",
+                               bodySize + data.size());
+    
+    quint32 messageSize = static_cast<quint32>(headerSize + bodySize + data.size());
+    int size = static_cast<int>(sizeof(messageSize) + messageSize);
+    frame->reserve(size);
+    frame->resize(size);
+    
+    char *out = frame->data();
+    qToLittleEndian(messageSize, out);
+    out += sizeof(messageSize);
+    std::memcpy(out, header, headerSize);
+    out += headerSize;
+    std::memcpy(out, body, bodySize);
+    out += bodySize;
+    std::memcpy(out, data.constData(), data.size());
+    return true;
+}
+
+bool NetworkDevice::sendEncodedChunk(const QByteArray &frame, qint64 offset)
+{
+    if (!isConnected() || m_state != Updating) {
+        emit logMessage(3, "Cannot send firmware: device not in update mode");
+        return false;
+    }
     
-    QByteArray jsonData = QJsonDocument(reqData).toJson(QJsonDocument::Compact);
-    QByteArray request = createRequest("update", jsonData + "\n" + data);
+    // In windowed mode chunks are acknowledged by offset and bypass the response gate
+    bool windowed = m_maxWindowSize > 1;
+    bool sent;
+    if (windowed || !m_waitingForResponse) {
+        // A shared frame is written straight from its buffer, like the header path above
+        sent = writeGathered(frame.constData(), frame.size(), QByteArray());
+        if (sent && !windowed) {
+            m_waitingForResponse = true;
+            m_requestChunkOffset = offset;
+            m_timeoutTimer.start(TIMEOUT_MS);
+        }
+    } else {
+        sent = sendRequest(frame, offset);
+    }
     
-    if (!sendRequest(request)) {
+    if (!sent) {
         emit logMessage(3, QString("Failed to send firmware chunk at offset %1").arg(offset));
         return false;
     }
@@ -206,6 +380,141 @@ qint64 NetworkDevice::optimalChunkSize() const
     return DEFAULT_CHUNK_SIZE;
 }
 
+qint64 NetworkDevice::minChunkSize() const
+{
+    return m_minChunkSize;
+}
+
+qint64 NetworkDevice::maxChunkSize() const
+{
+    return m_maxChunkSize;
+}
+
+int NetworkDevice::maxWindowSize() const
+{
+    return m_maxWindowSize;
+}
+
+bool NetworkDevice::supportsResume() const
+{
+    return m_supportsResume;
+}
+
+bool NetworkDevice::resumeUpdate(const QString &firmwareHash)
+{
+    if (!isConnected()) {
+        emit logMessage(3, "Cannot resume update: device not connected");
+        return false;
+    }
+    
+    emit logMessage(1, "Resuming firmware update...");
+    
+    // Send update resume request; the status reply carries the committed offset
+    QJsonObject data;
+    data["action"] = "resume_update";
+    data["sha256"] = firmwareHash;
+    addPayloadCompression(data);
+    
+    QByteArray jsonData = QJsonDocument(data).toJson(QJsonDocument::Compact);
+    
+    if (!sendRequest(createRequest("update", jsonData))) {
+        emit logMessage(3, "Failed to send update resume request");
+        return false;
+    }
+    
+    return true;
+}
+
+bool NetworkDevice::isHandshakeComplete() const
+{
+    return m_handshakeComplete;
+}
+
+bool NetworkDevice::supportsDelta() const
+{
+    return m_supportsDelta;
+}
+
+QString NetworkDevice::installedFirmwareHash() const
+{
+    return m_installedFirmwareHash;
+}
+
+bool NetworkDevice::beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                                     qint64 targetSize, qint64 patchSize)
+{
+    if (!isConnected()) {
+        emit logMessage(3, "Cannot begin update: device not connected");
+        return false;
+    }
+    
+    emit logMessage(1, "Beginning delta firmware update...");
+    
+    // Same as begin_update, with the patch described so the device can rebuild the image
+    QJsonObject delta;
+    delta["base_sha256"] = baseHash;
+    delta["target_sha256"] = targetHash;
+    delta["target_size"] = static_cast<double>(targetSize);
+    delta["patch_size"] = static_cast<double>(patchSize);
+    
+    QJsonObject data;
+    data["action"] = "begin_update";
+    data["delta"] = delta;
+    
+    QByteArray jsonData = QJsonDocument(data).toJson(QJsonDocument::Compact);
+    
+    if (!sendRequest(createRequest("update", jsonData))) {
+        emit logMessage(3, "Failed to send delta update begin request");
+        return false;
+    }
+    
+    return true;
+}
+
+QStringList NetworkDevice::supportedCompression() const
+{
+    return m_supportedCompression;
+}
+
+bool NetworkDevice::setPayloadCompression(const QString &compression, qint64 blockSize)
+{
+    if (!compression.isEmpty() && !m_supportedCompression.contains(compression)) {
+        emit logMessage(3, QString("Device does not support %1 compression").arg(compression));
+        return false;
+    }
+    
+    // Sent along with the next begin_update or resume_update request
+    m_payloadCompression = compression;
+    m_compressionBlockSize = blockSize;
+    return true;
+}
+
+bool NetworkDevice::supportsFill() const
+{
+    return m_supportsFill;
+}
+
+int NetworkDevice::erasedValue() const
+{
+    return m_erasedValue;
+}
+
+bool NetworkDevice::fillFirmwareRange(qint64 offset, qint64 length, quint8 value)
+{
+    if (!isConnected()) {
+        return false;
+    }
+    
+    QJsonObject data;
+    data["action"] = "fill";
+    data["offset"] = static_cast<double>(offset);
+    data["length"] = static_cast<double>(length);
+    data["value"] = static_cast<int>(value);
+    
+    QByteArray jsonData = QJsonDocument(data).toJson(QJsonDocument::Compact);
+    return sendRequest(createRequest("update", jsonData));
+}
+
 void NetworkDevice::onConnected()
 {
     m_timeoutTimer.stop();
@@ -215,6 +524,9 @@ void NetworkDevice::onConnected()
     m_status = Connected;
     emit connectionStatusChanged(m_status);
     
+    // Chunks are written whole, so don't hold back the tail of one waiting for the next
+    m_socket.setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    
     // Send info request to get device information
     sendRequest(createRequest("info"));
 }
@@ -226,10 +538,23 @@ void NetworkDevice::onDisconnected()
     m_status = Disconnected;
     emit connectionStatusChanged(m_status);
     
-    m_buffer.clear();
+    m_parser.clear();
     m_pendingCommands.clear();
     m_timeoutTimer.stop();
     m_waitingForResponse = false;
+    m_requestChunkOffset = -1;
+    m_maxWindowSize = 1;
+    m_minChunkSize = DEFAULT_CHUNK_SIZE;
+    m_maxChunkSize = DEFAULT_CHUNK_SIZE;
+    m_supportsResume = false;
+    m_supportsDelta = false;
+    m_handshakeComplete = false;
+    m_installedFirmwareHash.clear();
+    m_supportedCompression.clear();
+    m_payloadCompression.clear();
+    m_supportsFill = false;
+    m_erasedValue = -1;
+    m_binaryChunks = false;
 }
 
 void NetworkDevice::onError(QAbstractSocket::SocketError error)
@@ -243,12 +568,20 @@ void NetworkDevice::onError(QAbstractSocket::SocketError error)
 
 void NetworkDevice::onReadyRead()
 {
-    // Read available data
-    QByteArray data = m_socket.readAll();
-    m_buffer.append(data);
-    
-    // Process complete responses
-    processResponse();
+    // Read straight into the parser, emptying it whenever it fills up
+    qint64 bytesRead = 0;
+    do {
+        bytesRead = m_parser.fill([this](char *data, qint64 maxLength) { return m_socket.read(data, maxLength); });
+        
+        // Process complete responses
+        processResponse();
+    } while (bytesRead > 0 && m_socket.bytesAvailable() > 0);
+}
+
+void NetworkDevice::onBytesWritten(qint64 bytes)
+{
+    Q_UNUSED(bytes);
+    reportWriteReadiness();
 }
 
 void NetworkDevice::onTimeout()
@@ -256,7 +589,8 @@ void NetworkDevice::onTimeout()
     emit logMessage(2, "Request timeout");
     
     if (m_waitingForResponse) {
-        m_waitingForResponse = false;
+        // An unanswered chunk counts as rejected, so the job sends it again
+        finishRequest(false);
         
         // Send next request if any
         if (!m_pendingCommands.isEmpty()) {
@@ -265,32 +599,49 @@ void NetworkDevice::onTimeout()
     }
 }
 
+bool NetworkDevice::reportsWriteReadiness() const
+{
+    return true;
+}
+
+void NetworkDevice::reportWriteReadiness()
+{
+    // In stop-and-wait mode the device takes the next chunk once every request is answered
+    if (m_state != Updating ||
+        (m_maxWindowSize <= 1 && (m_waitingForResponse || !m_pendingCommands.isEmpty()))) {
+        return;
+    }
+    
+    qint64 credit = SEND_BUFFER_TARGET - m_socket.bytesToWrite();
+    if (credit > 0) {
+        emit readyForMoreData(credit);
+    }
+}
+
 void NetworkDevice::processResponse()
 {
-    // Check if we have a complete response
+    // Handle every complete response
     // Format: [SIZE:4][JSON_DATA]
     
-    while (m_buffer.size() >= 4) {
-        // Read message size (first 4 bytes)
-        quint32 messageSize = 0;
-        QDataStream sizeStream(m_buffer);
-        sizeStream.setByteOrder(QDataStream::LittleEndian);
-        sizeStream >> messageSize;
-        
-        // Check if we have enough data to read the complete message
-        if (m_buffer.size() < static_cast<int>(4 + messageSize)) {
-            // Not enough data yet, wait for more
-            return;
+    FrameParser::Frame frame;
+    FrameParser::Result result;
+    bool refused = false;
+    while ((result = m_parser.next(&frame)) != FrameParser::NeedMoreData) {
+        if (result == FrameParser::FrameTooLarge) {
+            emit logMessage(3, "Dropped oversized response");
+            continue;
         }
         
-        // Read the JSON response
-        QByteArray jsonData = m_buffer.mid(4, messageSize);
-        
-        // Remove processed data from buffer
-        m_buffer.remove(0, 4 + messageSize);
+        // Chunk acknowledgements from devices using binary chunks skip JSON entirely
+        if (m_binaryChunks && NetworkFrame::isBinary(frame.data, frame.size)) {
+            if (!processChunkResponse(frame.data, frame.size)) {
+                refused = true;
+            }
+            continue;
+        }
         
-        // Parse the JSON response
-        QJsonDocument doc = QJsonDocument::fromJson(jsonData);
+        // Parse the JSON response in place
+        QJsonDocument doc = QJsonDocument::fromJson(frame.bytes());
         if (doc.isNull() || !doc.isObject()) {
             emit logMessage(3, "Received invalid JSON response");
             continue;
@@ -301,15 +652,59 @@ void NetworkDevice::processResponse()
         // Process the response
         QString status = response["status"].toString();
         
+        // Windowed chunk acknowledgements carry their offset and do not
+        // complete the pending control request
+        if (m_maxWindowSize > 1 && response.contains("chunk")) {
+            qint64 offset = response["chunk"].toObject()["offset"].toVariant().toLongLong();
+            if (status == "ok") {
+                emit chunkAcknowledged(offset);
+            } else {
+                emit chunkRejected(offset);
+            }
+            continue;
+        }
+        
         if (status == "ok") {
             // Request succeeded
-            m_timeoutTimer.stop();
-            m_waitingForResponse = false;
+            finishRequest(true);
             
             // Process specific response data
             if (response.contains("info")) {
                 QJsonObject info = response["info"].toObject();
                 
+                // Devices that support pipelining advertise a window size
+                m_maxWindowSize = qBound(1, info["window"].toInt(1), MAX_WINDOW_SIZE);
+                
+                // ...and the chunk size range they can buffer
+                if (info.contains("min_chunk") && info.contains("max_chunk")) {
+                    m_minChunkSize = qBound(MIN_CHUNK_SIZE_LIMIT,
+                                            static_cast<qint64>(info["min_chunk"].toDouble()),
+                                            MAX_CHUNK_SIZE_LIMIT);
+                    m_maxChunkSize = qBound(m_minChunkSize,
+                                            static_cast<qint64>(info["max_chunk"].toDouble()),
+                                            MAX_CHUNK_SIZE_LIMIT);
+                }
+                
+                // ...and whether they can continue an interrupted update
+                m_supportsResume = info["resume"].toBool();
+                
+                // ...and which image they run, for delta updates
+                m_supportsDelta = info["delta"].toBool();
+                m_installedFirmwareHash = info["firmware_sha256"].toString();
+                
+                // ...whether they fill uniform ranges themselves
+                m_supportsFill = info["fill"].toBool();
+                m_erasedValue = qBound(-1, info["erased_value"].toInt(-1), 255);
+                
+                // ...whether they take chunks with a binary header
+                m_binaryChunks = info["binary_chunks"].toBool();
+                
+                // ...and which compressed payloads they can decode
+                m_supportedCompression.clear();
+                for (const QJsonValue &value : info["compression"].toArray()) {
+                    m_supportedCompression.append(value.toString());
+                }
+                
                 // Update device state based on info
                 QString state = info["state"].toString();
                 if (state == "idle") {
@@ -325,6 +720,11 @@ void NetworkDevice::processResponse()
                 emit deviceStateChanged(m_state);
                 
                 emit logMessage(1, QString("Device info: %1").arg(QString::fromUtf8(QJsonDocument(info).toJson())));
+                
+                if (!m_handshakeComplete) {
+                    m_handshakeComplete = true;
+                    emit handshakeCompleted();
+                }
             } else if (response.contains("update_status")) {
                 QJsonObject updateStatus = response["update_status"].toObject();
                 
@@ -334,6 +734,10 @@ void NetworkDevice::processResponse()
                 if (action == "begin_update" && success) {
                     m_state = Updating;
                     emit deviceStateChanged(m_state);
+                } else if (action == "resume_update" && success) {
+                    emit resumeOffsetReported(updateStatus["offset"].toVariant().toLongLong());
+                    m_state = Updating;
+                    emit deviceStateChanged(m_state);
                 } else if (action == "end_update" && success) {
                     m_state = Rebooting;
                     emit deviceStateChanged(m_state);
@@ -351,8 +755,8 @@ void NetworkDevice::processResponse()
             QString error = response["error"].toString();
             emit logMessage(3, QString("Request failed: %1").arg(error));
             
-            m_timeoutTimer.stop();
-            m_waitingForResponse = false;
+            finishRequest(false);
+            refused = true;
             
             // Send next request if any
             if (!m_pendingCommands.isEmpty()) {
@@ -360,6 +764,59 @@ void NetworkDevice::processResponse()
             }
         }
     }
+    
+    // Acknowledgements free the device for more data; a failed request does not
+    if (!refused) {
+        reportWriteReadiness();
+    }
+}
+
+bool NetworkDevice::processChunkResponse(const char *data, qint64 length)
+{
+    // Returns false if the device refused the chunk awaiting its response
+    quint8 opcode = 0;
+    qint64 offset = 0;
+    if (!NetworkFrame::decodeResponse(data, length, &opcode, &offset)) {
+        emit logMessage(3, "Received invalid binary response");
+        return true;
+    }
+    
+    bool accepted = opcode == NetworkFrame::ChunkAck;
+    
+    // Windowed acknowledgements do not complete the pending control request
+    if (m_maxWindowSize > 1) {
+        if (accepted) {
+            emit chunkAcknowledged(offset);
+        } else {
+            emit chunkRejected(offset);
+        }
+        return true;
+    }
+    
+    // In stop-and-wait mode the acknowledgement answers the chunk request itself,
+    // and the job resends a rejected chunk
+    if (!accepted) {
+        emit logMessage(3, QString("Device rejected chunk at offset %1").arg(offset));
+    }
+    
+    finishRequest(accepted);
+    
+    if (!m_pendingCommands.isEmpty()) {
+        sendNextRequest();
+    }
+    return accepted;
+}
+
+void NetworkDevice::addPayloadCompression(QJsonObject &request) const
+{
+    if (m_payloadCompression.isEmpty()) {
+        return;
+    }
+    
+    QJsonObject compression;
+    compression["algorithm"] = m_payloadCompression;
+    compression["block_size"] = static_cast<double>(m_compressionBlockSize);
+    request["compression"] = compression;
 }
 
 QByteArray NetworkDevice::createRequest(const QString &cmd, const QByteArray &data)
@@ -377,13 +834,14 @@ QByteArray NetworkDevice::createRequest(const QString &cmd, const QByteArray &da
     // Calculate total message size (header + data)
     quint32 messageSize = headerJson.size() + data.size();
     
-    // Create result buffer
+    // Create result buffer in one allocation
     QByteArray result;
-    QDataStream stream(&result, QIODevice::WriteOnly);
-    stream.setByteOrder(QDataStream::LittleEndian);
+    result.reserve(static_cast<int>(sizeof(messageSize) + messageSize));
     
     // Write size and header
-    stream << messageSize;
+    char sizeBytes[sizeof(messageSize)];
+    qToLittleEndian(messageSize, sizeBytes);
+    result.append(sizeBytes, sizeof(sizeBytes));
     result.append(headerJson);
     
     // Append data if any
@@ -394,7 +852,7 @@ QByteArray NetworkDevice::createRequest(const QString &cmd, const QByteArray &da
     return result;
 }
 
-bool NetworkDevice::sendRequest(const QByteArray &req)
+bool NetworkDevice::sendRequest(const QByteArray &req, qint64 chunkOffset)
 {
     if (!isConnected()) {
         return false;
@@ -402,7 +860,7 @@ bool NetworkDevice::sendRequest(const QByteArray &req)
     
     // If already waiting for a response, queue the request
     if (m_waitingForResponse) {
-        m_pendingCommands.enqueue(req);
+        m_pendingCommands.enqueue({req, chunkOffset});
         return true;
     }
     
@@ -414,26 +872,94 @@ bool NetworkDevice::sendRequest(const QByteArray &req)
     }
     
     m_waitingForResponse = true;
+    m_requestChunkOffset = chunkOffset;
     m_timeoutTimer.start(TIMEOUT_MS);
     
     return true;
 }
 
+bool NetworkDevice::writeGathered(const char *header, qint64 headerSize, const QByteArray &data)
+{
+    qint64 total = headerSize + data.size();
+    qint64 written = 0;
+
+#ifdef Q_OS_LINUX
+    // Hand both buffers to the kernel in one call, so the data goes from its
+    // own buffer (e.g. the mapped package) into the socket without another copy.
+    // Bytes Qt still has buffered must go out first.
+    qintptr fd = m_socket.socketDescriptor();
+    if (fd != -1 && m_socket.bytesToWrite() == 0) {
+        iovec iov[2];
+        iov[0].iov_base = const_cast<char *>(header);
+        iov[0].iov_len = static_cast<size_t>(headerSize);
+        iov[1].iov_base = const_cast<char *>(data.constData());
+        iov[1].iov_len = static_cast<size_t>(data.size());
+        
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = 2;
+        
+        ssize_t n;
+        do {
+            n = ::sendmsg(static_cast<int>(fd), &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+        
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return false;
+        }
+        written = qMax<qint64>(n, 0);
+    }
+#endif
+
+    // Whatever the kernel did not take is queued in the socket and sent when it drains
+    if (written < headerSize) {
+        if (m_socket.write(header + written, headerSize - written) != headerSize - written) {
+            return false;
+        }
+        written = headerSize;
+    }
+    if (written < total) {
+        qint64 dataOffset = written - headerSize;
+        if (m_socket.write(data.constData() + dataOffset, data.size() - dataOffset) != data.size() - dataOffset) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void NetworkDevice::sendNextRequest()
 {
     if (m_pendingCommands.isEmpty() || m_waitingForResponse) {
         return;
     }
     
-    QByteArray req = m_pendingCommands.dequeue();
+    PendingRequest req = m_pendingCommands.dequeue();
     
     // Send request
-    qint64 bytesWritten = m_socket.write(req);
-    if (bytesWritten != req.size()) {
+    qint64 bytesWritten = m_socket.write(req.request);
+    if (bytesWritten != req.request.size()) {
         emit logMessage(3, "Failed to write data to socket");
         return;
     }
     
     m_waitingForResponse = true;
+    m_requestChunkOffset = req.chunkOffset;
     m_timeoutTimer.start(TIMEOUT_MS);
+}
+
+void NetworkDevice::finishRequest(bool accepted)
+{
+    qint64 chunkOffset = m_requestChunkOffset;
+    m_timeoutTimer.stop();
+    m_waitingForResponse = false;
+    m_requestChunkOffset = -1;
+    
+    // In stop-and-wait mode the answer to a chunk request is the chunk's acknowledgement
+    if (chunkOffset >= 0) {
+        if (accepted) {
+            emit chunkAcknowledged(chunkOffset);
+        } else {
+            emit chunkRejected(chunkOffset);
+        }
+    }
 } 
\ No newline at end of file
@@ -2,12 +2,14 @@
 #define NETWORKDEVICE_H
 
 #include "core/deviceinterface.h"
+#include "core/frameparser.h"
 
 #include <QTcpSocket>
 #include <QTimer>
 #include <QByteArray>
 #include <QQueue>
 #include <QHostAddress>
+#include <QJsonObject>
 
 /**
  * @brief The NetworkDevice class implements DeviceInterface for network-connected devices
@@ -22,6 +24,7 @@ public:
 
     // DeviceInterface interface
     QString deviceId() const override;
+    QString transportGroup() const override;
     QMap<QString, QString> deviceInfo() const override;
     bool connect() override;
     void disconnect() override;
@@ -33,30 +36,78 @@ public:
     bool finalizeUpdate() override;
     bool cancelUpdate() override;
     qint64 optimalChunkSize() const override;
+    qint64 minChunkSize() const override;
+    qint64 maxChunkSize() const override;
+    int maxWindowSize() const override;
+    bool supportsResume() const override;
+    bool resumeUpdate(const QString &firmwareHash) override;
+    bool isHandshakeComplete() const override;
+    bool supportsDelta() const override;
+    QString installedFirmwareHash() const override;
+    bool beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                          qint64 targetSize, qint64 patchSize) override;
+    QStringList supportedCompression() const override;
+    bool setPayloadCompression(const QString &compression, qint64 blockSize) override;
+    bool supportsFill() const override;
+    int erasedValue() const override;
+    bool fillFirmwareRange(qint64 offset, qint64 length, quint8 value) override;
+    bool reportsWriteReadiness() const override;
+    QString frameVariant() const override;
+    bool encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame) override;
+    bool sendEncodedChunk(const QByteArray &frame, qint64 offset) override;
 
 private slots:
     void onConnected();
     void onDisconnected();
     void onError(QAbstractSocket::SocketError error);
     void onReadyRead();
+    void onBytesWritten(qint64 bytes);
     void onTimeout();
     void processResponse();
 
 private:
+    /**
+     * @brief A request queued behind the one awaiting its response
+     */
+    struct PendingRequest {
+        QByteArray request;
+        qint64 chunkOffset;     ///< Offset of the chunk it carries, -1 for other requests
+    };
+
     QString m_address;
     quint16 m_port;
     QTcpSocket m_socket;
     ConnectionStatus m_status;
     DeviceState m_state;
-    QByteArray m_buffer;
+    FrameParser m_parser;
     QTimer m_timeoutTimer;
-    QQueue<QByteArray> m_pendingCommands;
+    QQueue<PendingRequest> m_pendingCommands;
+    QByteArray m_chunkFrame;
     bool m_waitingForResponse;
+    qint64 m_requestChunkOffset;    ///< Chunk awaiting its response in stop-and-wait mode, -1 if none
+    int m_maxWindowSize;
+    qint64 m_minChunkSize;
+    qint64 m_maxChunkSize;
+    bool m_supportsResume;
+    bool m_supportsDelta;
+    bool m_handshakeComplete;
+    QString m_installedFirmwareHash;
+    QStringList m_supportedCompression;
+    QString m_payloadCompression;
+    qint64 m_compressionBlockSize;
+    bool m_supportsFill;
+    int m_erasedValue;
+    bool m_binaryChunks;
 
     // Network protocol commands
     QByteArray createRequest(const QString &cmd, const QByteArray &data = QByteArray());
-    bool sendRequest(const QByteArray &req);
+    bool sendRequest(const QByteArray &req, qint64 chunkOffset = -1);
+    bool writeGathered(const char *header, qint64 headerSize, const QByteArray &data);
     void sendNextRequest();
+    void finishRequest(bool accepted);
+    void addPayloadCompression(QJsonObject &request) const;
+    bool processChunkResponse(const char *data, qint64 length);
+    void reportWriteReadiness();
 };
 
 #endif // NETWORKDEVICE_H 
\ No newline at end of file
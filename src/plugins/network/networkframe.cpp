@@ -0,0 +1,54 @@
+#include "networkframe.h"
+#include "core/crc32.h"
+
+#include <QtEndian>
+#include <cstring>
+
+bool NetworkFrame::isBinary(const char *data, qint64 length)
+{
+    return length > 0 && data[0] != '{';
+}
+
+void NetworkFrame::encodeChunkHeader(qint64 offset, const QByteArray &data, char *out)
+{
+    qToLittleEndian(static_cast<quint32>(CHUNK_HEADER_SIZE + data.size()), out);
+    out += SIZE_PREFIX_SIZE;
+    
+    out[0] = static_cast<char>(WriteChunk);
+    out[1] = out[2] = out[3] = 0;
+    qToLittleEndian(static_cast<quint64>(offset), out + 4);
+    qToLittleEndian(static_cast<quint32>(data.size()), out + 12);
+    qToLittleEndian(Crc32::compute(data), out + 16);
+}
+
+QByteArray NetworkFrame::encodeChunk(qint64 offset, const QByteArray &data)
+{
+    QByteArray request;
+    encodeChunk(offset, data, &request);
+    return request;
+}
+
+void NetworkFrame::encodeChunk(qint64 offset, const QByteArray &data, QByteArray *request)
+{
+    // Prefix, header and data in one buffer and one copy of the data
+    int size = SIZE_PREFIX_SIZE + CHUNK_HEADER_SIZE + data.size();
+    request->reserve(size);
+    request->resize(size);
+    encodeChunkHeader(offset, data, request->data());
+    std::memcpy(request->data() + SIZE_PREFIX_SIZE + CHUNK_HEADER_SIZE, data.constData(), data.size());
+}
+
+bool NetworkFrame::decodeResponse(const char *data, qint64 length, quint8 *opcode, qint64 *offset)
+{
+    if (length != RESPONSE_SIZE) {
+        return false;
+    }
+    
+    *opcode = static_cast<quint8>(data[0]);
+    if (*opcode != ChunkAck && *opcode != ChunkNak) {
+        return false;
+    }
+    
+    *offset = static_cast<qint64>(qFromLittleEndian<quint64>(data + 4));
+    return true;
+}
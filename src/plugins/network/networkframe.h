@@ -0,0 +1,91 @@
+#ifndef NETWORKFRAME_H
+#define NETWORKFRAME_H
+
+#include <QByteArray>
+
+/**
+ * @brief The NetworkFrame class encodes the binary messages of the network protocol
+ *
+ * Devices that advertise "binary_chunks" receive firmware chunks and send
+ * chunk acknowledgements as fixed binary headers instead of JSON. Binary
+ * messages share the length-prefixed stream with JSON control messages and
+ * are told apart by their first byte, which is never '{'.
+ *
+ * Chunk request (integers little-endian):
+ * - 4 bytes: Message size (header + data)
+ * - 1 byte:  Opcode (WriteChunk)
+ * - 3 bytes: Reserved, zero
+ * - 8 bytes: Offset
+ * - 4 bytes: Data length
+ * - 4 bytes: CRC-32 of the data
+ * - Data
+ *
+ * Chunk response:
+ * - 4 bytes: Message size (12)
+ * - 1 byte:  Opcode (ChunkAck or ChunkNak)
+ * - 3 bytes: Reserved, zero
+ * - 8 bytes: Offset of the chunk
+ */
+class NetworkFrame
+{
+public:
+    enum Opcode : quint8 {
+        WriteChunk = 0x01,
+        ChunkAck = 0x81,
+        ChunkNak = 0x82
+    };
+
+    static const int SIZE_PREFIX_SIZE = 4;
+    static const int CHUNK_HEADER_SIZE = 20;
+    static const int RESPONSE_SIZE = 12;
+
+    /**
+     * @brief Check whether a message is binary rather than JSON
+     * @param data Message without its size prefix
+     * @param length Number of bytes
+     */
+    static bool isBinary(const char *data, qint64 length);
+
+    /**
+     * @brief Write the size prefix and header of a chunk request
+     *
+     * Lets the data be sent from its own buffer right after the header.
+     *
+     * @param offset Offset of the chunk
+     * @param data Chunk data
+     * @param out Destination of SIZE_PREFIX_SIZE + CHUNK_HEADER_SIZE bytes
+     */
+    static void encodeChunkHeader(qint64 offset, const QByteArray &data, char *out);
+
+    /**
+     * @brief Build a complete chunk request, size prefix included
+     * @param offset Offset of the chunk
+     * @param data Chunk data
+     * @return Request ready to be written to the socket
+     */
+    static QByteArray encodeChunk(qint64 offset, const QByteArray &data);
+
+    /**
+     * @brief Build a complete chunk request into an existing buffer
+     *
+     * Reuses the buffer's storage, so encoding one chunk after another into
+     * the same buffer allocates nothing once it is large enough.
+     *
+     * @param offset Offset of the chunk
+     * @param data Chunk data
+     * @param request Receives the request
+     */
+    static void encodeChunk(qint64 offset, const QByteArray &data, QByteArray *request);
+
+    /**
+     * @brief Decode a chunk response
+     * @param data Message without its size prefix
+     * @param length Number of bytes
+     * @param opcode Receives the opcode
+     * @param offset Receives the chunk offset
+     * @return true if the message is a well-formed chunk response
+     */
+    static bool decodeResponse(const char *data, qint64 length, quint8 *opcode, qint64 *offset);
+};
+
+#endif // NETWORKFRAME_H
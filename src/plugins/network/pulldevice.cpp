@@ -0,0 +1,471 @@
+#include "pulldevice.h"
+#include "core/otaserver.h"
+#include "core/firmwarepackage.h"
+
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QHostInfo>
+#include <QUdpSocket>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QDebug>
+#include <iterator>
+
+// Constants
+const int TRIGGER_TIMEOUT_MS = 5000;
+
+// Time without any image bytes served before the download counts as failed
+const int STALL_TIMEOUT_MS = 60000;
+
+// Interval of status queries once every image byte was served
+const int STATUS_POLL_INTERVAL_MS = 1000;
+
+namespace {
+
+// Same form as OtaServer reports client addresses in
+QString normalizedAddress(const QHostAddress &address)
+{
+    bool isIPv4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isIPv4);
+    return isIPv4 ? QHostAddress(ipv4).toString() : address.toString();
+}
+
+} // namespace
+
+PullDevice::PullDevice(const QString &address, quint16 port, OtaServer *server, QObject *parent)
+    : DeviceInterface(parent),
+      m_address(address),
+      m_port(port),
+      m_server(server),
+      m_network(this),
+      m_lookupId(-1),
+      m_status(Disconnected),
+      m_state(Idle),
+      m_served(0),
+      m_total(0),
+      m_stallTimer(this),
+      m_statusTimer(this)
+{
+    QObject::connect(m_server, &OtaServer::bytesServed,
+                     this, &PullDevice::onBytesServed);
+    
+    m_stallTimer.setSingleShot(true);
+    QObject::connect(&m_stallTimer, &QTimer::timeout,
+                     this, &PullDevice::onStallTimeout);
+    
+    m_statusTimer.setSingleShot(true);
+    QObject::connect(&m_statusTimer, &QTimer::timeout,
+                     this, &PullDevice::queryStatus);
+}
+
+PullDevice::~PullDevice()
+{
+    disconnect();
+}
+
+void PullDevice::setServerHost(const QString &host)
+{
+    m_serverHost = host;
+}
+
+QString PullDevice::deviceId() const
+{
+    return QString("pull:%1:%2").arg(m_address).arg(m_port);
+}
+
+QMap<QString, QString> PullDevice::deviceInfo() const
+{
+    QMap<QString, QString> info;
+    info["type"] = "HTTP pull";
+    info["address"] = m_address;
+    info["port"] = QString::number(m_port);
+    info["status"] = m_status == Connected ? "Connected" : "Disconnected";
+    if (!m_firmwareUrl.isEmpty()) {
+        info["firmwareUrl"] = m_firmwareUrl.toString();
+    }
+    return info;
+}
+
+bool PullDevice::connect()
+{
+    // The device is only contacted to trigger a download; there is no link to hold
+    m_status = Connected;
+    emit connectionStatusChanged(m_status);
+    return true;
+}
+
+void PullDevice::disconnect()
+{
+    if (m_reply) {
+        m_reply->abort();
+    }
+    
+    resetUpdate();
+    
+    if (m_status != Disconnected) {
+        m_status = Disconnected;
+        emit connectionStatusChanged(m_status);
+    }
+}
+
+bool PullDevice::isConnected() const
+{
+    return m_status == Connected;
+}
+
+DeviceInterface::ConnectionStatus PullDevice::connectionStatus() const
+{
+    return m_status;
+}
+
+DeviceInterface::DeviceState PullDevice::deviceState() const
+{
+    return m_state;
+}
+
+bool PullDevice::beginUpdate()
+{
+    emit logMessage(3, "Pull devices download their firmware; use beginPullUpdate()");
+    return false;
+}
+
+bool PullDevice::sendFirmwareChunk(const QByteArray &data, qint64 offset)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(offset);
+    return false;
+}
+
+bool PullDevice::finalizeUpdate()
+{
+    // The device finishes on its own once it has the whole image
+    return true;
+}
+
+bool PullDevice::cancelUpdate()
+{
+    if (m_state != Updating && !m_reply && m_lookupId < 0) {
+        return false;
+    }
+    
+    emit logMessage(1, "Canceling firmware download...");
+    
+    if (m_reply) {
+        m_reply->abort();
+    }
+    
+    // Best effort; the device may already be past the point of stopping
+    QNetworkReply *reply = m_network.post(QNetworkRequest(endpoint("/ota/cancel")), QByteArray());
+    QObject::connect(reply, &QNetworkReply::finished, reply, &QNetworkReply::deleteLater);
+    
+    resetUpdate();
+    m_state = Idle;
+    emit deviceStateChanged(m_state);
+    return true;
+}
+
+qint64 PullDevice::optimalChunkSize() const
+{
+    // Not used, the device sizes its own requests
+    return 0;
+}
+
+bool PullDevice::pullsFirmware() const
+{
+    return true;
+}
+
+bool PullDevice::beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware)
+{
+    if (!isConnected() || m_reply || m_lookupId >= 0) {
+        emit logMessage(3, "Cannot begin update: device not connected or busy");
+        return false;
+    }
+    
+    if (!m_server->isListening()) {
+        emit logMessage(3, "Cannot begin update: OTA server is not running");
+        return false;
+    }
+    
+    resetUpdate();
+    m_pendingFirmware = firmware;
+    
+    // Host names are looked up without blocking this thread; the request
+    // goes out once the lookup has finished
+    QHostAddress address(m_address);
+    if (address.isNull()) {
+        m_lookupId = QHostInfo::lookupHost(m_address, this, &PullDevice::onAddressResolved);
+        return true;
+    }
+    
+    m_clientAddresses = QStringList(normalizedAddress(address));
+    return requestDownload();
+}
+
+void PullDevice::onAddressResolved(const QHostInfo &info)
+{
+    // Lookups aborted by a cancel may still report back
+    if (info.lookupId() != m_lookupId) {
+        return;
+    }
+    m_lookupId = -1;
+    
+    m_clientAddresses.clear();
+    const QList<QHostAddress> addresses = info.addresses();
+    for (const QHostAddress &resolved : addresses) {
+        m_clientAddresses.append(normalizedAddress(resolved));
+    }
+    
+    if (m_clientAddresses.isEmpty()) {
+        emit logMessage(3, QString("Cannot resolve device address %1: %2")
+                           .arg(m_address, info.errorString()));
+    }
+    
+    // The update has already begun, so failures end it like a refused request
+    if (m_clientAddresses.isEmpty() || !requestDownload()) {
+        resetUpdate();
+        m_status = Disconnected;
+        emit connectionStatusChanged(m_status);
+    }
+}
+
+bool PullDevice::requestDownload()
+{
+    QString host = m_serverHost.isEmpty() ? localAddress() : m_serverHost;
+    if (host.isEmpty()) {
+        emit logMessage(3, "Cannot determine the address the device reaches this host at");
+        return false;
+    }
+    
+    std::shared_ptr<FirmwarePackage> firmware = m_pendingFirmware;
+    resetUpdate();
+    m_total = firmware->size();
+    m_path = m_server->publish(firmware);
+    m_firmwareUrl = m_server->url(m_path, host);
+    
+    QJsonObject data;
+    data["url"] = m_firmwareUrl.toString();
+    data["sha256"] = firmware->sha256Hash();
+    data["size"] = firmware->size();
+    
+    emit logMessage(1, QString("Requesting download of %1").arg(m_firmwareUrl.toString()));
+    
+    QNetworkRequest request(endpoint("/ota"));
+    request.setHeader(QNetworkRequest::ContentTypeHeader, "application/json");
+    request.setTransferTimeout(TRIGGER_TIMEOUT_MS);
+    
+    m_reply = m_network.post(request, QJsonDocument(data).toJson(QJsonDocument::Compact));
+    QObject::connect(m_reply, &QNetworkReply::finished,
+                     this, &PullDevice::onTriggerFinished);
+    return true;
+}
+
+void PullDevice::onTriggerFinished()
+{
+    QNetworkReply *reply = m_reply;
+    m_reply = nullptr;
+    if (!reply) {
+        return;
+    }
+    reply->deleteLater();
+    
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() != QNetworkReply::NoError || status < 200 || status >= 300) {
+        if (reply->error() != QNetworkReply::OperationCanceledError) {
+            emit logMessage(3, QString("Device did not accept the download request: %1")
+                               .arg(reply->errorString()));
+            m_status = Disconnected;
+            emit connectionStatusChanged(m_status);
+        }
+        return;
+    }
+    
+    emit logMessage(1, "Device is downloading firmware");
+    
+    m_state = Updating;
+    emit deviceStateChanged(m_state);
+    m_stallTimer.start(STALL_TIMEOUT_MS);
+    checkComplete();
+}
+
+void PullDevice::onBytesServed(const QString &client, const QString &path, qint64 start, qint64 end, qint64 total)
+{
+    // The device may start downloading before its reply to the request arrives
+    bool active = m_state == Updating || m_reply;
+    if (!active || path != m_path || !m_clientAddresses.contains(client)) {
+        return;
+    }
+    
+    // Ranges may come in any order and overlap, e.g. when a download restarts
+    // or resumes, so only bytes not served before count
+    qint64 served = m_served;
+    addServedRange(start, end);
+    if (m_served == served) {
+        return;
+    }
+    
+    emit pullProgress(m_served, total);
+    
+    if (m_state == Updating) {
+        m_stallTimer.start(STALL_TIMEOUT_MS);
+        checkComplete();
+    }
+}
+
+void PullDevice::onStallTimeout()
+{
+    if (m_state != Updating) {
+        return;
+    }
+    
+    if (m_served >= m_total) {
+        failDownload("Device did not confirm the download");
+    } else {
+        failDownload(QString("Device stopped downloading with %1 of %2 bytes served").arg(m_served).arg(m_total));
+    }
+}
+
+void PullDevice::queryStatus()
+{
+    if (m_state != Updating || m_statusReply) {
+        return;
+    }
+    
+    QNetworkRequest request(endpoint("/ota/status"));
+    request.setTransferTimeout(TRIGGER_TIMEOUT_MS);
+    
+    m_statusReply = m_network.get(request);
+    QObject::connect(m_statusReply, &QNetworkReply::finished,
+                     this, &PullDevice::onStatusFinished);
+}
+
+void PullDevice::onStatusFinished()
+{
+    QNetworkReply *reply = m_statusReply;
+    m_statusReply = nullptr;
+    if (!reply) {
+        return;
+    }
+    reply->deleteLater();
+    
+    if (m_state != Updating || reply->error() == QNetworkReply::OperationCanceledError) {
+        return;
+    }
+    
+    if (reply->error() == QNetworkReply::ContentNotFoundError) {
+        // Nothing to ask; the served ranges are all there is to go by
+        emit logMessage(2, "Device does not report its download status, assuming it received the whole image");
+        completeDownload();
+        return;
+    }
+    
+    if (reply->error() == QNetworkReply::NoError) {
+        QJsonObject status = QJsonDocument::fromJson(reply->readAll()).object();
+        QString state = status["state"].toString();
+        qint64 received = static_cast<qint64>(status["received"].toDouble());
+        
+        if (state == "error") {
+            failDownload(QString("Device reported a failed download: %1").arg(status["error"].toString()));
+            return;
+        }
+        
+        if (state == "done" || received >= m_total) {
+            completeDownload();
+            return;
+        }
+    }
+    
+    // Still downloading or not answering; the stall timer ends the wait
+    m_statusTimer.start(STATUS_POLL_INTERVAL_MS);
+}
+
+QString PullDevice::localAddress() const
+{
+    // Connecting a UDP socket only selects the route; nothing is sent
+    QUdpSocket socket;
+    socket.connectToHost(QHostAddress(m_clientAddresses.first()), m_port);
+    if (!socket.waitForConnected(TRIGGER_TIMEOUT_MS)) {
+        return QString();
+    }
+    return normalizedAddress(socket.localAddress());
+}
+
+QUrl PullDevice::endpoint(const QString &path) const
+{
+    QUrl url;
+    url.setScheme("http");
+    url.setHost(m_address);
+    url.setPort(m_port);
+    url.setPath(path);
+    return url;
+}
+
+void PullDevice::addServedRange(qint64 start, qint64 end)
+{
+    if (end <= start) {
+        return;
+    }
+    
+    // Merge with every range it overlaps or touches
+    auto it = m_servedRanges.upperBound(start);
+    if (it != m_servedRanges.begin() && std::prev(it).value() >= start) {
+        --it;
+        start = it.key();
+    }
+    
+    while (it != m_servedRanges.end() && it.key() <= end) {
+        end = qMax(end, it.value());
+        m_served -= it.value() - it.key();
+        it = m_servedRanges.erase(it);
+    }
+    
+    m_servedRanges.insert(start, end);
+    m_served += end - start;
+}
+
+void PullDevice::checkComplete()
+{
+    // Served bytes may still be queued or lost; the device has to confirm them
+    if (m_served < m_total || m_statusReply || m_statusTimer.isActive()) {
+        return;
+    }
+    
+    emit logMessage(1, "Every image byte was served, waiting for the device to confirm");
+    queryStatus();
+}
+
+void PullDevice::completeDownload()
+{
+    emit logMessage(1, "Device has downloaded the whole image");
+    m_stallTimer.stop();
+    m_statusTimer.stop();
+    m_state = Rebooting;
+    emit deviceStateChanged(m_state);
+}
+
+void PullDevice::failDownload(const QString &reason)
+{
+    emit logMessage(3, reason);
+    
+    resetUpdate();
+    m_state = Idle;
+    emit deviceStateChanged(m_state);
+    m_status = Disconnected;
+    emit connectionStatusChanged(m_status);
+}
+
+void PullDevice::resetUpdate()
+{
+    if (m_lookupId >= 0) {
+        QHostInfo::abortHostLookup(m_lookupId);
+        m_lookupId = -1;
+    }
+    if (m_statusReply) {
+        m_statusReply->abort();
+    }
+    m_pendingFirmware.reset();
+    m_stallTimer.stop();
+    m_statusTimer.stop();
+    m_servedRanges.clear();
+    m_served = 0;
+}
@@ -0,0 +1,118 @@
+#ifndef PULLDEVICE_H
+#define PULLDEVICE_H
+
+#include "core/deviceinterface.h"
+
+#include <QMap>
+#include <QNetworkAccessManager>
+#include <QPointer>
+#include <QStringList>
+#include <QTimer>
+#include <QUrl>
+
+class OtaServer;
+class QHostInfo;
+class QNetworkReply;
+
+/**
+ * @brief The PullDevice class implements DeviceInterface for devices that download their firmware
+ *
+ * Instead of receiving chunks, the device is told where to fetch the image
+ * and downloads it from the host's OtaServer over HTTP, e.g. with an
+ * esp_https_ota style client. The update is triggered with
+ *
+ *     POST http://<device>:<port>/ota
+ *     {"url": "http://<host>:<server port>/firmware/<sha256>.bin",
+ *      "sha256": "<sha256>", "size": <image size>}
+ *
+ * which the device answers with any 2xx status once it starts downloading.
+ * A device given by host name is looked up asynchronously first, so
+ * beginPullUpdate() returns before the request is sent.
+ * Progress is taken from the image ranges the server has sent to the
+ * device's address. Once they cover the whole image, the device is asked
+ *
+ *     GET http://<device>:<port>/ota/status
+ *     {"state": "downloading" | "done" | "error", "received": <bytes>}
+ *
+ * until it confirms the download, since bytes handed to the socket may
+ * still be lost. Devices without this endpoint (404) are taken to have the
+ * image once every byte was served. The device checks the SHA-256 itself
+ * and reboots into the new image.
+ */
+class PullDevice : public DeviceInterface
+{
+    Q_OBJECT
+
+public:
+    /**
+     * @brief Construct a pull device
+     * @param address Device host name or address
+     * @param port Port of the device's trigger endpoint
+     * @param server Server the device downloads from; must outlive the device
+     * @param parent Parent object
+     */
+    PullDevice(const QString &address, quint16 port, OtaServer *server, QObject *parent = nullptr);
+    ~PullDevice();
+
+    /**
+     * @brief Set the host name or address the device reaches the server at
+     * @param host Host, empty to use the local address of the route to the device
+     */
+    void setServerHost(const QString &host);
+
+    // DeviceInterface interface
+    QString deviceId() const override;
+    QMap<QString, QString> deviceInfo() const override;
+    bool connect() override;
+    void disconnect() override;
+    bool isConnected() const override;
+    ConnectionStatus connectionStatus() const override;
+    DeviceState deviceState() const override;
+    bool beginUpdate() override;
+    bool sendFirmwareChunk(const QByteArray &data, qint64 offset) override;
+    bool finalizeUpdate() override;
+    bool cancelUpdate() override;
+    qint64 optimalChunkSize() const override;
+    bool pullsFirmware() const override;
+    bool beginPullUpdate(std::shared_ptr<FirmwarePackage> firmware) override;
+
+private slots:
+    void onAddressResolved(const QHostInfo &info);
+    void onTriggerFinished();
+    void onBytesServed(const QString &client, const QString &path, qint64 start, qint64 end, qint64 total);
+    void onStallTimeout();
+    void queryStatus();
+    void onStatusFinished();
+
+private:
+    QString m_address;
+    quint16 m_port;
+    OtaServer *m_server;
+    QNetworkAccessManager m_network;
+    QPointer<QNetworkReply> m_reply;
+    QPointer<QNetworkReply> m_statusReply;
+    int m_lookupId;                 ///< Pending host name lookup, -1 if none
+    std::shared_ptr<FirmwarePackage> m_pendingFirmware;  ///< Image to request once the address is resolved
+    QString m_serverHost;
+    ConnectionStatus m_status;
+    DeviceState m_state;
+    QString m_path;
+    QUrl m_firmwareUrl;
+    QStringList m_clientAddresses;  ///< Addresses the device's downloads come from
+    QMap<qint64, qint64> m_servedRanges;    ///< Merged image ranges sent to the device, start to end
+    qint64 m_served;                ///< Image bytes covered by m_servedRanges
+    qint64 m_total;
+    QTimer m_stallTimer;
+    QTimer m_statusTimer;
+
+    bool requestDownload();
+    QString localAddress() const;
+    QUrl endpoint(const QString &path) const;
+    void addServedRange(qint64 start, qint64 end);
+    void checkComplete();
+    void completeDownload();
+    void failDownload(const QString &reason);
+    void resetUpdate();
+};
+
+#endif // PULLDEVICE_H
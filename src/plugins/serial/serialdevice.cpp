@@ -1,33 +1,91 @@
 #include "serialdevice.h"
+#include "serialreactor.h"
+#include "serialframe.h"
+#include "core/logging.h"
 
 #include <QDebug>
 #include <QCoreApplication>
 #include <QDateTime>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QRegularExpression>
+#include <QSerialPortInfo>
+#include <QtEndian>
+#include <cstring>
+
+// Per-frame traffic; enable with QT_LOGGING_RULES="flashup.serial.debug=true"
+Q_LOGGING_CATEGORY(lcSerial, "flashup.serial", QtInfoMsg)
 
 // Constants
 const int TIMEOUT_MS = 3000;
 const qint64 DEFAULT_CHUNK_SIZE = 1024;
+const int MAX_WINDOW_SIZE = 32;
+const qint64 RESPONSE_BUFFER_SIZE = 128 * 1024;
+
+// Bytes of firmware data to keep queued for the port ahead of the line
+const qint64 SEND_BUFFER_TARGET = 16 * 1024;
+const qint64 MIN_CHUNK_SIZE_LIMIT = 64;
+const qint64 MAX_CHUNK_SIZE_LIMIT = 16384;
+const qint32 DEFAULT_BAUD_RATE = 115200;
+const qint32 DEFAULT_MAX_BAUD_RATE = 3000000;
+
+// Rates the host can offer after the handshake, fastest first
+const qint32 HOST_BAUD_RATES[] = {4000000, 3000000, 2000000, 1500000, 1000000, 921600, 460800, 230400};
+
+// Line errors within the window that make the host step down to a slower rate
+const int LINE_ERROR_THRESHOLD = 8;
+const int LINE_ERROR_WINDOW_MS = 10000;
+
+// Time for the echo probe after a speed change; devices fall back to the old rate after the same time
+const int BAUD_PROBE_TIMEOUT_MS = 500;
 
 SerialDevice::SerialDevice(const QString &portName, QObject *parent)
     : DeviceInterface(parent),
       m_portName(portName),
+      m_serialPort(this),
+      m_backend(QtSerialPortBackend),
       m_status(Disconnected),
       m_state(Idle),
-      m_waitingForAck(false)
+      m_parser(FrameParser::LineDelimited, RESPONSE_BUFFER_SIZE),
+      m_timeoutTimer(this),
+      m_waitingForAck(false),
+      m_commandChunkOffset(-1),
+      m_handshakeComplete(false),
+      m_binaryFraming(false),
+      m_framingRequested(false),
+      m_maxBaudRate(DEFAULT_MAX_BAUD_RATE),
+      m_baudRate(DEFAULT_BAUD_RATE),
+      m_probeBaudRate(0),
+      m_baudChange(BaudIdle),
+      m_baudNegotiated(false),
+      m_lineErrors(0),
+      m_stepDownPending(false)
 {
     // Setup serial port
     m_serialPort.setPortName(portName);
-    m_serialPort.setBaudRate(QSerialPort::Baud115200);
+    m_serialPort.setBaudRate(DEFAULT_BAUD_RATE);
     m_serialPort.setDataBits(QSerialPort::Data8);
     m_serialPort.setParity(QSerialPort::NoParity);
     m_serialPort.setStopBits(QSerialPort::OneStop);
     m_serialPort.setFlowControl(QSerialPort::NoFlowControl);
     
+    if (qgetenv("FLASHUP_SERIAL_BACKEND") == "epoll" && SerialReactor::isSupported()) {
+        m_backend = ReactorBackend;
+    }
+    
+    bool limitSet = false;
+    qint32 limit = qEnvironmentVariableIntValue("FLASHUP_SERIAL_MAX_BAUD", &limitSet);
+    if (limitSet) {
+        m_maxBaudRate = limit;
+    }
+    
     // Connect signals
     QObject::connect(&m_serialPort, &QSerialPort::readyRead,
                      this, &SerialDevice::onReadyRead);
     QObject::connect(&m_serialPort, &QSerialPort::errorOccurred,
                      this, &SerialDevice::onError);
+    QObject::connect(&m_serialPort, &QSerialPort::bytesWritten,
+                     this, &SerialDevice::onBytesWritten);
     
     // Setup timeout timer
     m_timeoutTimer.setSingleShot(true);
@@ -40,6 +98,30 @@ SerialDevice::~SerialDevice()
     disconnect();
 }
 
+void SerialDevice::setBackend(Backend backend)
+{
+    if (isPortOpen()) {
+        emit logMessage(2, "Serial backend can only be changed while disconnected");
+        return;
+    }
+    m_backend = backend;
+}
+
+SerialDevice::Backend SerialDevice::backend() const
+{
+    return m_backend;
+}
+
+void SerialDevice::setMaxBaudRate(qint32 baudRate)
+{
+    m_maxBaudRate = baudRate;
+}
+
+qint32 SerialDevice::maxBaudRate() const
+{
+    return m_maxBaudRate;
+}
+
 QString SerialDevice::deviceId() const
 {
     return QString("serial:%1").arg(m_portName);
@@ -50,14 +132,35 @@ QMap<QString, QString> SerialDevice::deviceInfo() const
     QMap<QString, QString> info;
     info["type"] = "Serial";
     info["port"] = m_portName;
-    info["baudRate"] = QString::number(m_serialPort.baudRate());
-    info["status"] = m_serialPort.isOpen() ? "Connected" : "Disconnected";
+    info["baudRate"] = QString::number(m_baudRate);
+    info["status"] = isPortOpen() ? "Connected" : "Disconnected";
+    info["backend"] = m_backend == ReactorBackend ? "epoll" : "QSerialPort";
     return info;
 }
 
+QString SerialDevice::transportGroup() const
+{
+#ifdef Q_OS_LINUX
+    // Adapters behind one hub share its upstream link, so group by the hub's USB path
+    // (e.g. .../usb1/1-2/1-2.3/1-2.3:1.0 is port 3 of hub 1-2)
+    QString portName = QSerialPortInfo(m_portName).portName();
+    QString devicePath = QFileInfo(QString("/sys/class/tty/%1/device").arg(portName)).canonicalFilePath();
+    static const QRegularExpression usbDevice("^\\d+-[\\d.]+$");
+    
+    const QStringList parts = devicePath.split('/', Qt::SkipEmptyParts);
+    for (auto it = parts.crbegin(); it != parts.crend(); ++it) {
+        if (usbDevice.match(*it).hasMatch()) {
+            int hubEnd = it->lastIndexOf('.');
+            return QString("usb:%1").arg(hubEnd > 0 ? it->left(hubEnd) : it->section('-', 0, 0));
+        }
+    }
+#endif
+    return DeviceInterface::transportGroup();
+}
+
 bool SerialDevice::connect()
 {
-    if (m_serialPort.isOpen()) {
+    if (isPortOpen()) {
         // Already connected
         return true;
     }
@@ -67,16 +170,42 @@ bool SerialDevice::connect()
     m_status = Connecting;
     emit connectionStatusChanged(m_status);
     
-    if (m_serialPort.open(QIODevice::ReadWrite)) {
+    // Every session starts at the bootloader's default speed
+    m_baudRate = DEFAULT_BAUD_RATE;
+    m_serialPort.setBaudRate(m_baudRate);
+    
+    bool opened = false;
+    QString errorString;
+    if (m_backend == ReactorBackend) {
+        m_reactorPort = SerialReactor::instance()->open(
+            m_portName, m_serialPort.baudRate(), this,
+            [this]() { onReadyRead(); },
+            [this](const QString &message) { onReactorError(message); },
+            &errorString);
+        opened = m_reactorPort != nullptr;
+    } else {
+        opened = m_serialPort.open(QIODevice::ReadWrite);
+        errorString = m_serialPort.errorString();
+    }
+    
+    if (opened) {
         emit logMessage(1, "Connected to serial device");
         m_status = Connected;
         emit connectionStatusChanged(m_status);
         
-        // Send initial handshake
+        // Send initial handshake; capabilities are known once INFO is answered
+        m_handshakeComplete = false;
+        m_binaryFraming = false;
+        m_framingRequested = false;
+        m_parser.setFraming(FrameParser::LineDelimited);
+        m_baudChange = BaudIdle;
+        m_baudNegotiated = false;
+        m_baudRates.clear();
+        m_lineErrors = 0;
         sendCommand(createCommand("INFO"));
         return true;
     } else {
-        emit logMessage(3, QString("Failed to open serial port: %1").arg(m_serialPort.errorString()));
+        emit logMessage(3, QString("Failed to open serial port: %1").arg(errorString));
         m_status = Error;
         emit connectionStatusChanged(m_status);
         return false;
@@ -85,14 +214,29 @@ bool SerialDevice::connect()
 
 void SerialDevice::disconnect()
 {
+    if (m_reactorPort) {
+        m_reactorPort->close();
+        m_reactorPort.reset();
+    }
     if (m_serialPort.isOpen()) {
         m_serialPort.close();
     }
     
-    m_buffer.clear();
+    m_parser.clear();
     m_pendingCommands.clear();
     m_timeoutTimer.stop();
     m_waitingForAck = false;
+    m_commandChunkOffset = -1;
+    m_capabilities.clear();
+    m_handshakeComplete = false;
+    m_binaryFraming = false;
+    m_framingRequested = false;
+    m_parser.setFraming(FrameParser::LineDelimited);
+    m_baudChange = BaudIdle;
+    m_baudNegotiated = false;
+    m_baudRates.clear();
+    m_lineErrors = 0;
+    m_stepDownPending = false;
     
     m_status = Disconnected;
     emit connectionStatusChanged(m_status);
@@ -102,7 +246,7 @@ void SerialDevice::disconnect()
 
 bool SerialDevice::isConnected() const
 {
-    return m_serialPort.isOpen();
+    return isPortOpen();
 }
 
 DeviceInterface::ConnectionStatus SerialDevice::connectionStatus() const
@@ -134,22 +278,69 @@ bool SerialDevice::beginUpdate()
 }
 
 bool SerialDevice::sendFirmwareChunk(const QByteArray &data, qint64 offset)
+{
+    // Frames are built in the same buffer every time, and the transport copies them out
+    if (!encodeChunkFrame(data, offset, &m_chunkFrame)) {
+        emit logMessage(3, QString("Firmware chunk at offset %1 is too large for a frame").arg(offset));
+        return false;
+    }
+    
+    return sendEncodedChunk(m_chunkFrame, offset);
+}
+
+QString SerialDevice::frameVariant() const
+{
+    return m_binaryFraming ? "serial-cobs" : "serial-text";
+}
+
+bool SerialDevice::encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame)
+{
+    if (m_binaryFraming) {
+        return SerialFrame::encode(SerialFrame::Chunk, static_cast<quint32>(offset), data, frame);
+    }
+    
+    // Text chunk command "CHUNK:<offset LE32><data>\n", written in place
+    const char prefix[] = "CHUNK:";
+    int prefixSize = static_cast<int>(sizeof(prefix) - 1);
+    int size = prefixSize + 4 + data.size() + 1;
+    frame->reserve(size);
+    frame->resize(size);
+    
+    char *out = frame->data();
+    std::memcpy(out, prefix, prefixSize);
+    qToLittleEndian(static_cast<quint32>(offset), out + prefixSize);
+    std::memcpy(out + prefixSize + 4, data.constData(), data.size());
+    out[size - 1] = '\n';
+    return true;
+}
+
+bool SerialDevice::sendEncodedChunk(const QByteArray &frame, qint64 offset)
 {
     if (!isConnected() || m_state != Updating) {
         emit logMessage(3, "Cannot send firmware: device not in update mode");
         return false;
     }
     
-    // Create chunk command with offset and data
-    QByteArray offsetBytes;
-    offsetBytes.resize(4);
-    for (int i = 0; i < 4; ++i) {
-        offsetBytes[i] = (offset >> (i * 8)) & 0xFF;
+    // Jobs check canSendChunk() first, so this only catches callers that do not
+    if (!canSendChunk()) {
+        if (FLASHUP_LOG_ENABLED(lcSerial, Logging::Debug)) {
+            LogEvent event(lcSerial(), Logging::Debug, "Holding firmware chunk while the serial line speed changes");
+            event.deviceId = deviceId();
+            event.offset = offset;
+            emit logEvent(event);
+        }
+        return false;
     }
     
-    QByteArray cmd = createCommand("CHUNK", offsetBytes + data);
+    if (frame.isEmpty()) {
+        emit logMessage(3, QString("Firmware chunk at offset %1 is too large for a frame").arg(offset));
+        return false;
+    }
+    
+    // In windowed mode chunks are acknowledged by offset and bypass the ACK gate
+    bool sent = (maxWindowSize() > 1) ? writeCommand(frame) : sendCommand(frame, offset);
     
-    if (!sendCommand(cmd)) {
+    if (!sent) {
         emit logMessage(3, QString("Failed to send firmware chunk at offset %1").arg(offset));
         return false;
     }
@@ -200,14 +391,152 @@ qint64 SerialDevice::optimalChunkSize() const
     return DEFAULT_CHUNK_SIZE;
 }
 
-void SerialDevice::onReadyRead()
+qint64 SerialDevice::minChunkSize() const
+{
+    // Advertised by the device as "min_chunk=N" in its INFO response
+    qint64 size = m_capabilities.value("min_chunk").toLongLong();
+    return size > 0 ? qBound(MIN_CHUNK_SIZE_LIMIT, size, MAX_CHUNK_SIZE_LIMIT) : DEFAULT_CHUNK_SIZE;
+}
+
+qint64 SerialDevice::maxChunkSize() const
+{
+    // Advertised by the device as "max_chunk=N" in its INFO response
+    qint64 size = m_capabilities.value("max_chunk").toLongLong();
+    return size > 0 ? qBound(MIN_CHUNK_SIZE_LIMIT, size, MAX_CHUNK_SIZE_LIMIT) : DEFAULT_CHUNK_SIZE;
+}
+
+int SerialDevice::maxWindowSize() const
 {
-    // Read available data
-    QByteArray data = m_serialPort.readAll();
-    m_buffer.append(data);
+    // Advertised by the device as "window=N" in its INFO response
+    return qBound(1, m_capabilities.value("window", "1").toInt(), MAX_WINDOW_SIZE);
+}
+
+bool SerialDevice::supportsResume() const
+{
+    // Advertised by the device as "resume=1" in its INFO response
+    return m_capabilities.value("resume") == "1";
+}
+
+bool SerialDevice::resumeUpdate(const QString &firmwareHash)
+{
+    if (!isConnected()) {
+        emit logMessage(3, "Cannot resume update: device not connected");
+        return false;
+    }
+    
+    emit logMessage(1, "Resuming firmware update...");
     
-    // Process complete responses
-    processResponse();
+    // The device answers with "RESUME:<offset>", 0 if it starts over
+    if (!sendCommand(createCommand("UPDATE_RESUME", firmwareHash.toLatin1()))) {
+        emit logMessage(3, "Failed to send update resume command");
+        return false;
+    }
+    
+    return true;
+}
+
+bool SerialDevice::isHandshakeComplete() const
+{
+    return m_handshakeComplete;
+}
+
+bool SerialDevice::supportsDelta() const
+{
+    // Advertised by the device as "delta=1" in its INFO response
+    return m_capabilities.value("delta") == "1";
+}
+
+QString SerialDevice::installedFirmwareHash() const
+{
+    // Advertised by the device as "fw_sha256=<hex>" in its INFO response
+    return m_capabilities.value("fw_sha256");
+}
+
+bool SerialDevice::beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                                    qint64 targetSize, qint64 patchSize)
+{
+    if (!isConnected()) {
+        emit logMessage(3, "Cannot begin update: device not connected");
+        return false;
+    }
+    
+    emit logMessage(1, "Beginning delta firmware update...");
+    
+    // "UPDATE_DELTA:<base sha256>,<target sha256>,<target size>,<patch size>"
+    QByteArray args = QString("%1,%2,%3,%4").arg(baseHash, targetHash)
+                      .arg(targetSize).arg(patchSize).toLatin1();
+    if (!sendCommand(createCommand("UPDATE_DELTA", args))) {
+        emit logMessage(3, "Failed to send delta update begin command");
+        return false;
+    }
+    
+    return true;
+}
+
+QStringList SerialDevice::supportedCompression() const
+{
+    // Advertised by the device as "compression=<name>[,<name>...]" in its INFO response
+    return m_capabilities.value("compression").split(',', Qt::SkipEmptyParts);
+}
+
+bool SerialDevice::setPayloadCompression(const QString &compression, qint64 blockSize)
+{
+    // Devices start every update uncompressed unless told otherwise
+    if (compression.isEmpty()) {
+        return true;
+    }
+    
+    if (!supportedCompression().contains(compression)) {
+        emit logMessage(3, QString("Device does not support %1 compression").arg(compression));
+        return false;
+    }
+    
+    // "UPDATE_COMPRESSION:<algorithm>,<block size>", applies to the next UPDATE_BEGIN/UPDATE_RESUME
+    QByteArray args = QString("%1,%2").arg(compression).arg(blockSize).toLatin1();
+    return sendCommand(createCommand("UPDATE_COMPRESSION", args));
+}
+
+bool SerialDevice::supportsFill() const
+{
+    // Advertised by the device as "fill=1" in its INFO response
+    return m_capabilities.value("fill") == "1";
+}
+
+int SerialDevice::erasedValue() const
+{
+    // Advertised as "erased=<byte>" by devices that erase the update area up front
+    bool ok = false;
+    int value = m_capabilities.value("erased").toInt(&ok);
+    return (ok && value >= 0 && value <= 255) ? value : -1;
+}
+
+bool SerialDevice::fillFirmwareRange(qint64 offset, qint64 length, quint8 value)
+{
+    if (!isConnected()) {
+        return false;
+    }
+    
+    // "FILL:<offset>,<length>,<value>"
+    QByteArray args = QString("%1,%2,%3").arg(offset).arg(length).arg(value).toLatin1();
+    return sendCommand(createCommand("FILL", args));
+}
+
+void SerialDevice::onReadyRead()
+{
+    // Read straight into the parser, emptying it whenever it fills up
+    qint64 bytesRead = 0;
+    do {
+        bytesRead = m_parser.fill([this](char *data, qint64 maxLength) { return readPort(data, maxLength); });
+        
+        // Process complete responses
+        processResponse();
+    } while (bytesRead > 0 && bytesAvailable() > 0);
+}
+
+void SerialDevice::onBytesWritten(qint64 bytes)
+{
+    Q_UNUSED(bytes);
+    reportWriteReadiness();
 }
 
 void SerialDevice::onError(QSerialPort::SerialPortError error)
@@ -225,12 +554,51 @@ void SerialDevice::onError(QSerialPort::SerialPortError error)
     }
 }
 
+void SerialDevice::onReactorError(const QString &message)
+{
+    emit logMessage(3, QString("Serial port error: %1").arg(message));
+    
+    m_status = Error;
+    emit connectionStatusChanged(m_status);
+}
+
 void SerialDevice::onTimeout()
 {
     emit logMessage(2, "Command timeout");
     
-    if (m_waitingForAck) {
+    // No answer to FRAMING means the device keeps talking text
+    if (m_framingRequested) {
+        handleFramingReply(QByteArray());
+        return;
+    }
+    
+    if (m_baudChange == BaudProbing) {
+        // The device also returns to the old rate when the probe goes unanswered
+        emit logMessage(2, QString("No echo at %1 baud, staying at %2 baud").arg(m_probeBaudRate).arg(m_baudRate));
+        m_baudRates.removeAll(m_probeBaudRate);
+        setPortBaudRate(m_baudRate);
+        m_parser.clear();
+        
+        // Try the slower rates that were offered along with the failed one
+        m_baudChange = BaudIdle;
         m_waitingForAck = false;
+        if (!proposeBaudRates(m_proposedBaudRates)) {
+            finishBaudChange();
+        }
+        return;
+    }
+    
+    if (m_baudChange == BaudProposed) {
+        emit logMessage(2, "Device did not answer the line speed proposal");
+        finishBaudChange();
+        return;
+    }
+    
+    if (m_waitingForAck) {
+        recordLineError();
+        
+        // An unanswered chunk counts as rejected, so the job sends it again
+        finishCommand(false);
         
         // Send next command if any
         if (!m_pendingCommands.isEmpty()) {
@@ -241,54 +609,405 @@ void SerialDevice::onTimeout()
 
 void SerialDevice::processResponse()
 {
-    // Process complete responses in buffer
-    // Assumes each response ends with '\n'
-    
-    while (m_buffer.contains('\n')) {
-        int newlinePos = m_buffer.indexOf('\n');
-        QByteArray line = m_buffer.left(newlinePos).trimmed();
-        m_buffer.remove(0, newlinePos + 1);
-        
-        // Parse response
-        emit logMessage(0, QString("Serial response: %1").arg(QString::fromUtf8(line)));
+    // Text responses end with '\n'; binary frames end with a 0x00 delimiter.
+    // The mode can change between two responses in the same read.
+    FrameParser::Frame frame;
+    FrameParser::Result result;
+    bool refused = false;
+    while ((result = m_parser.next(&frame)) != FrameParser::NeedMoreData) {
+        if (result == FrameParser::FrameTooLarge) {
+            emit logMessage(2, "Dropped oversized serial response");
+            recordLineError();
+            continue;
+        }
         
-        if (line.startsWith("ACK")) {
+        if (m_binaryFraming) {
+            // Senders may flush the line with extra delimiters
+            if (frame.size == 0) {
+                continue;
+            }
+            
+            quint8 opcode = 0;
+            quint32 value = 0;
+            QByteArray &payload = m_responsePayload;
+            if (!SerialFrame::decode(frame.data, frame.size, &opcode, &value, &payload)) {
+                // Lost acknowledgements are recovered by the update job's timeouts
+                emit logMessage(2, "Dropped corrupt serial frame");
+                recordLineError();
+                continue;
+            }
+            
+            if (FLASHUP_LOG_ENABLED(lcSerial, Logging::Debug)) {
+                LogEvent event(lcSerial(), Logging::Debug,
+                               QString("Serial frame: opcode 0x%1, value %2")
+                                   .arg(opcode, 2, 16, QChar('0')).arg(value));
+                event.deviceId = deviceId();
+                event.bytes = payload.size();
+                emit logEvent(event);
+            }
+            if (!handleResponse(opcode, value, payload)) {
+                refused = true;
+            }
+        } else {
+            QByteArray line = frame.trimmed().bytes();
+            
+            if (FLASHUP_LOG_ENABLED(lcSerial, Logging::Debug)) {
+                LogEvent event(lcSerial(), Logging::Debug, QString("Serial response: %1").arg(QString::fromUtf8(line)));
+                event.deviceId = deviceId();
+                emit logEvent(event);
+            }
+            
+            // Map the line onto the binary opcodes
+            bool windowed = maxWindowSize() > 1;
+            bool accepted = true;
+            
+            if (windowed && line.startsWith("ACK:")) {
+                // Per-chunk acknowledgement: "ACK:<offset>"
+                accepted = handleResponse(SerialFrame::ChunkAck, line.mid(4).toLongLong(), QByteArray());
+            } else if (windowed && line.startsWith("NAK:")) {
+                // Chunk rejected, host retransmits: "NAK:<offset>"
+                accepted = handleResponse(SerialFrame::ChunkNak, line.mid(4).toLongLong(), QByteArray());
+            } else if (line.startsWith("ACK")) {
+                accepted = handleResponse(SerialFrame::Ack, 0, QByteArray());
+            } else if (line.startsWith("RESUME:")) {
+                // Committed offset of an interrupted update: "RESUME:<offset>"
+                accepted = handleResponse(SerialFrame::Resume, line.mid(7).toLongLong(), QByteArray());
+            } else if (line.startsWith("INFO:")) {
+                accepted = handleResponse(SerialFrame::InfoReply, 0, line.mid(5));
+            } else if (line.startsWith("STATE:")) {
+                accepted = handleResponse(SerialFrame::State, 0, line.mid(6));
+            } else if (line.startsWith("ERROR:")) {
+                accepted = handleResponse(SerialFrame::Error, 0, line.mid(6));
+            } else if (line.startsWith("BAUD:")) {
+                // Rate picked from a BAUD proposal: "BAUD:<rate>"
+                accepted = handleResponse(SerialFrame::BaudReply, line.mid(5).toLongLong(), QByteArray());
+            } else if (line.startsWith("ECHO:")) {
+                accepted = handleResponse(SerialFrame::EchoReply, 0, line.mid(5));
+            } else if (line.startsWith("FRAMING:")) {
+                // Device accepted binary framing: "FRAMING:cobs"; it sends frames from here on
+                handleFramingReply(line.mid(8));
+            }
+            
+            if (!accepted) {
+                refused = true;
+            }
+        }
+    }
+    
+    // Acknowledgements free the device for more data; a refused chunk does not
+    if (!refused) {
+        reportWriteReadiness();
+    }
+}
+
+bool SerialDevice::handleResponse(quint8 opcode, qint64 value, const QByteArray &payload)
+{
+    // Returns false if the response refused the chunk awaiting its ACK
+    switch (opcode) {
+        case SerialFrame::ChunkAck:
+            // In stop-and-wait mode the acknowledgement answers the chunk command itself
+            if (maxWindowSize() <= 1 && m_waitingForAck && value == m_commandChunkOffset) {
+                finishCommand(true);
+                sendNextCommand();
+                break;
+            }
+            emit chunkAcknowledged(value);
+            break;
+        case SerialFrame::ChunkNak:
+            if (maxWindowSize() <= 1 && m_waitingForAck && value == m_commandChunkOffset) {
+                // Free the command gate now, so the job's resend does not wait for the timeout
+                recordLineError();
+                finishCommand(false);
+                sendNextCommand();
+                return false;
+            }
+            recordLineError();
+            emit chunkRejected(value);
+            break;
+        case SerialFrame::Ack:
             // Acknowledge received, send next command
-            m_timeoutTimer.stop();
-            m_waitingForAck = false;
+            finishCommand(true);
             
             if (!m_pendingCommands.isEmpty()) {
                 sendNextCommand();
             }
-        } else if (line.startsWith("INFO:")) {
+            break;
+        case SerialFrame::Resume:
+            emit resumeOffsetReported(value);
+            break;
+        case SerialFrame::InfoReply:
             // Device info
-            QByteArray info = line.mid(5);
-            emit logMessage(1, QString("Device info: %1").arg(QString::fromUtf8(info)));
-        } else if (line.startsWith("STATE:")) {
-            // Device state change
-            QByteArray stateStr = line.mid(6);
+            parseCapabilities(payload);
+            emit logMessage(1, QString("Device info: %1").arg(QString::fromUtf8(payload)));
             
-            if (stateStr == "IDLE") {
+            if (!m_handshakeComplete && !m_binaryFraming && !m_framingRequested &&
+                m_capabilities.value("framing").split(',').contains("cobs")) {
+                // Switch to binary frames before anyone starts sending firmware
+                m_framingRequested = true;
+                sendCommand(createCommand("FRAMING", "cobs"));
+            } else {
+                completeHandshake();
+            }
+            break;
+        case SerialFrame::State:
+            // Device state change
+            if (payload == "IDLE") {
                 m_state = Idle;
-            } else if (stateStr == "READY") {
+            } else if (payload == "READY") {
                 m_state = Ready;
-            } else if (stateStr == "UPDATING") {
+            } else if (payload == "UPDATING") {
                 m_state = Updating;
-            } else if (stateStr == "REBOOTING") {
+            } else if (payload == "REBOOTING") {
                 m_state = Rebooting;
             }
             
             emit deviceStateChanged(m_state);
-        } else if (line.startsWith("ERROR:")) {
+            break;
+        case SerialFrame::Error:
             // Error message
-            QByteArray errorMsg = line.mid(6);
-            emit logMessage(3, QString("Device error: %1").arg(QString::fromUtf8(errorMsg)));
+            emit logMessage(3, QString("Device error: %1").arg(QString::fromUtf8(payload)));
+            
+            // A device that cannot switch framing keeps talking text
+            if (m_framingRequested) {
+                handleFramingReply(QByteArray());
+            } else if (m_baudChange == BaudProposed) {
+                // Proposal refused, stay at the current rate
+                finishBaudChange();
+            } else if (m_waitingForAck && m_commandChunkOffset >= 0) {
+                // The error answers the chunk in flight
+                finishCommand(false);
+                
+                if (!m_pendingCommands.isEmpty()) {
+                    sendNextCommand();
+                }
+                return false;
+            }
+            break;
+        case SerialFrame::BaudReply:
+            handleBaudReply(static_cast<qint32>(value));
+            break;
+        case SerialFrame::EchoReply:
+            handleEchoReply(payload);
+            break;
+        default:
+            emit logMessage(2, QString("Unknown serial response opcode 0x%1").arg(opcode, 2, 16, QChar('0')));
+            break;
+    }
+    
+    return true;
+}
+
+void SerialDevice::handleFramingReply(const QByteArray &framing)
+{
+    if (!m_framingRequested) {
+        return;
+    }
+    m_framingRequested = false;
+    
+    // The reply stands in for the FRAMING command's ACK
+    m_timeoutTimer.stop();
+    m_waitingForAck = false;
+    
+    m_binaryFraming = framing == "cobs";
+    m_parser.setFraming(m_binaryFraming ? FrameParser::ZeroDelimited : FrameParser::LineDelimited);
+    emit logMessage(1, m_binaryFraming ? "Using binary COBS framing" : "Device declined binary framing");
+    
+    completeHandshake();
+    
+    if (!m_pendingCommands.isEmpty()) {
+        sendNextCommand();
+    }
+}
+
+void SerialDevice::completeHandshake()
+{
+    if (m_handshakeComplete || m_framingRequested || m_baudChange != BaudIdle) {
+        return;
+    }
+    
+    // Speed the line up before firmware starts flowing: "baud=921600,3000000"
+    if (!m_baudNegotiated) {
+        m_baudNegotiated = true;
+        m_baudRates.clear();
+        const QStringList deviceRates = m_capabilities.value("baud").split(',', Qt::SkipEmptyParts);
+        for (qint32 rate : HOST_BAUD_RATES) {
+            if (rate > m_baudRate && rate <= m_maxBaudRate && deviceRates.contains(QString::number(rate))) {
+                m_baudRates.append(rate);
+            }
+        }
+        
+        if (proposeBaudRates(m_baudRates)) {
+            return;
         }
     }
+    
+    m_handshakeComplete = true;
+    emit handshakeCompleted();
+}
+
+bool SerialDevice::proposeBaudRates(const QList<qint32> &rates)
+{
+    if (rates.isEmpty()) {
+        return false;
+    }
+    
+    QStringList list;
+    for (qint32 rate : rates) {
+        list.append(QString::number(rate));
+    }
+    
+    // "BAUD:<rate>,<rate>,...", fastest first; the device answers with its pick
+    m_proposedBaudRates = rates;
+    m_baudChange = BaudProposed;
+    emit logMessage(1, QString("Proposing serial line speeds: %1").arg(list.join(", ")));
+    
+    if (!sendCommand(createCommand("BAUD", list.join(',').toLatin1()))) {
+        m_baudChange = BaudIdle;
+        return false;
+    }
+    return true;
+}
+
+void SerialDevice::handleBaudReply(qint32 baudRate)
+{
+    if (m_baudChange != BaudProposed) {
+        return;
+    }
+    
+    // The device switched right after replying; the command gate stays closed until the probe is answered
+    m_baudChange = BaudProbing;
+    m_probeBaudRate = baudRate;
+    m_probeToken.clear();
+    m_parser.clear();
+    
+    int picked = m_proposedBaudRates.indexOf(baudRate);
+    m_proposedBaudRates = m_proposedBaudRates.mid(picked + 1);
+    
+    if (picked >= 0 && setPortBaudRate(baudRate)) {
+        m_probeToken = QByteArray::number(QRandomGenerator::global()->generate(), 16);
+        writeCommand(createCommand("ECHO", m_probeToken));
+    } else {
+        // Let the probe time out so both ends fall back together
+        emit logMessage(2, QString("Cannot switch serial line to %1 baud").arg(baudRate));
+    }
+    m_timeoutTimer.start(BAUD_PROBE_TIMEOUT_MS);
+}
+
+void SerialDevice::handleEchoReply(const QByteArray &token)
+{
+    if (m_baudChange != BaudProbing || m_probeToken.isEmpty() || token != m_probeToken) {
+        return;
+    }
+    
+    m_baudRate = m_probeBaudRate;
+    emit logMessage(1, QString("Serial line running at %1 baud").arg(m_baudRate));
+    finishBaudChange();
+}
+
+void SerialDevice::finishBaudChange()
+{
+    m_timeoutTimer.stop();
+    m_waitingForAck = false;
+    m_baudChange = BaudIdle;
+    m_probeToken.clear();
+    m_lineErrors = 0;
+    
+    completeHandshake();
+    
+    if (!m_pendingCommands.isEmpty()) {
+        sendNextCommand();
+    }
+    
+    // Chunks held back during the change can go out now
+    reportWriteReadiness();
+}
+
+void SerialDevice::recordLineError()
+{
+    if (m_state != Updating || m_baudChange != BaudIdle || m_baudRate <= DEFAULT_BAUD_RATE) {
+        return;
+    }
+    
+    if (!m_lineErrorTimer.isValid() || m_lineErrorTimer.elapsed() > LINE_ERROR_WINDOW_MS) {
+        m_lineErrors = 0;
+        m_lineErrorTimer.start();
+    }
+    
+    if (++m_lineErrors < LINE_ERROR_THRESHOLD) {
+        return;
+    }
+    
+    emit logMessage(2, QString("%1 line errors at %2 baud, stepping down").arg(m_lineErrors).arg(m_baudRate));
+    m_lineErrors = 0;
+    
+    // A BAUD queued behind a command awaiting its ACK would be taken for an
+    // unanswered proposal when that command times out, so wait for its answer
+    if (m_waitingForAck) {
+        m_stepDownPending = true;
+        return;
+    }
+    stepDownBaudRate();
+}
+
+void SerialDevice::stepDownBaudRate()
+{
+    m_stepDownPending = false;
+    if (m_state != Updating || m_baudChange != BaudIdle) {
+        return;
+    }
+    
+    // Too many errors at this speed: offer every slower rate, down to the default
+    QList<qint32> slower;
+    for (qint32 rate : qAsConst(m_baudRates)) {
+        if (rate < m_baudRate) {
+            slower.append(rate);
+        }
+    }
+    slower.append(DEFAULT_BAUD_RATE);
+    proposeBaudRates(slower);
+}
+
+bool SerialDevice::reportsWriteReadiness() const
+{
+    return true;
+}
+
+bool SerialDevice::canSendChunk() const
+{
+    // Chunks written while the line speed changes would be garbled;
+    // finishBaudChange() reports readiness again
+    return m_baudChange == BaudIdle;
+}
+
+void SerialDevice::reportWriteReadiness()
+{
+    // In stop-and-wait mode the device takes the next chunk once every command is acknowledged
+    if (m_state != Updating || m_baudChange != BaudIdle ||
+        (maxWindowSize() <= 1 && (m_waitingForAck || !m_pendingCommands.isEmpty()))) {
+        return;
+    }
+    
+    qint64 queued = m_reactorPort ? m_reactorPort->bytesToWrite() : m_serialPort.bytesToWrite();
+    qint64 credit = SEND_BUFFER_TARGET - queued;
+    if (credit > 0) {
+        emit readyForMoreData(credit);
+    }
+}
+
+bool SerialDevice::setPortBaudRate(qint32 baudRate)
+{
+    if (m_reactorPort) {
+        return m_reactorPort->setBaudRate(baudRate);
+    }
+    return m_serialPort.setBaudRate(baudRate);
 }
 
 QByteArray SerialDevice::createCommand(const QString &cmd, const QByteArray &data)
 {
+    if (m_binaryFraming) {
+        return SerialFrame::encode(SerialFrame::opcodeFor(cmd), 0, data);
+    }
+    
     // Simple command format: "CMD:data\n"
     QByteArray result = cmd.toUtf8() + ":";
     if (!data.isEmpty()) {
@@ -298,46 +1017,125 @@ QByteArray SerialDevice::createCommand(const QString &cmd, const QByteArray &dat
     return result;
 }
 
-bool SerialDevice::sendCommand(const QByteArray &cmd)
+bool SerialDevice::sendCommand(const QByteArray &cmd, qint64 chunkOffset)
 {
-    if (!m_serialPort.isOpen()) {
+    if (!isPortOpen()) {
         return false;
     }
     
     // If already waiting for ACK, queue the command
     if (m_waitingForAck) {
-        m_pendingCommands.enqueue(cmd);
+        m_pendingCommands.enqueue({cmd, chunkOffset});
         return true;
     }
     
     // Send command
-    qint64 bytesWritten = m_serialPort.write(cmd);
+    qint64 bytesWritten = writePort(cmd);
     if (bytesWritten != cmd.size()) {
         emit logMessage(3, "Failed to write command to serial port");
         return false;
     }
     
     m_waitingForAck = true;
+    m_commandChunkOffset = chunkOffset;
     m_timeoutTimer.start(TIMEOUT_MS);
     
     return true;
 }
 
+bool SerialDevice::writeCommand(const QByteArray &cmd)
+{
+    if (!isPortOpen()) {
+        return false;
+    }
+    
+    qint64 bytesWritten = writePort(cmd);
+    if (bytesWritten != cmd.size()) {
+        emit logMessage(3, "Failed to write command to serial port");
+        return false;
+    }
+    
+    return true;
+}
+
 void SerialDevice::sendNextCommand()
 {
     if (m_pendingCommands.isEmpty() || m_waitingForAck) {
         return;
     }
     
-    QByteArray cmd = m_pendingCommands.dequeue();
+    PendingCommand cmd = m_pendingCommands.dequeue();
     
     // Send command
-    qint64 bytesWritten = m_serialPort.write(cmd);
-    if (bytesWritten != cmd.size()) {
+    qint64 bytesWritten = writePort(cmd.command);
+    if (bytesWritten != cmd.command.size()) {
         emit logMessage(3, "Failed to write command to serial port");
         return;
     }
     
     m_waitingForAck = true;
+    m_commandChunkOffset = cmd.chunkOffset;
     m_timeoutTimer.start(TIMEOUT_MS);
-} 
\ No newline at end of file
+}
+
+void SerialDevice::finishCommand(bool accepted)
+{
+    qint64 chunkOffset = m_commandChunkOffset;
+    m_timeoutTimer.stop();
+    m_waitingForAck = false;
+    m_commandChunkOffset = -1;
+    
+    // Propose before the job hears about the chunk, so its next chunk is held back
+    if (m_stepDownPending) {
+        stepDownBaudRate();
+    }
+    
+    // In stop-and-wait mode the ACK of a chunk command is the chunk's acknowledgement
+    if (chunkOffset >= 0) {
+        if (accepted) {
+            emit chunkAcknowledged(chunkOffset);
+        } else {
+            emit chunkRejected(chunkOffset);
+        }
+    }
+}
+
+bool SerialDevice::isPortOpen() const
+{
+    return m_reactorPort ? m_reactorPort->isOpen() : m_serialPort.isOpen();
+}
+
+qint64 SerialDevice::readPort(char *data, qint64 maxLength)
+{
+    if (m_reactorPort) {
+        return m_reactorPort->read(data, maxLength);
+    }
+    return m_serialPort.read(data, maxLength);
+}
+
+qint64 SerialDevice::bytesAvailable() const
+{
+    return m_reactorPort ? m_reactorPort->bytesAvailable() : m_serialPort.bytesAvailable();
+}
+
+qint64 SerialDevice::writePort(const QByteArray &data)
+{
+    if (m_reactorPort) {
+        return m_reactorPort->write(data.constData(), data.size());
+    }
+    return m_serialPort.write(data);
+}
+
+void SerialDevice::parseCapabilities(const QByteArray &info)
+{
+    // Capabilities are "key=value" tokens anywhere in the INFO text,
+    // e.g. "INFO:ESP32 bootloader 2.1 window=8"
+    const QList<QByteArray> tokens = info.simplified().split(' ');
+    for (const QByteArray &token : tokens) {
+        int separator = token.indexOf('=');
+        if (separator > 0) {
+            m_capabilities[QString::fromUtf8(token.left(separator))] =
+                QString::fromUtf8(token.mid(separator + 1));
+        }
+    }
+}
\ No newline at end of file
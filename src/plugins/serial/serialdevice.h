@@ -2,11 +2,16 @@
 #define SERIALDEVICE_H
 
 #include "core/deviceinterface.h"
+#include "core/frameparser.h"
 
 #include <QSerialPort>
 #include <QTimer>
 #include <QByteArray>
 #include <QQueue>
+#include <QElapsedTimer>
+#include <memory>
+
+class SerialReactorPort;
 
 /**
  * @brief The SerialDevice class implements DeviceInterface for serial devices
@@ -16,12 +21,45 @@ class SerialDevice : public DeviceInterface
     Q_OBJECT
 
 public:
+    /**
+     * @brief I/O backend used for the port
+     */
+    enum Backend {
+        QtSerialPortBackend,    ///< One QSerialPort per device
+        ReactorBackend          ///< Shared epoll reactor (Linux only, see SerialReactor)
+    };
+
     explicit SerialDevice(const QString &portName, QObject *parent = nullptr);
     ~SerialDevice();
 
+    /**
+     * @brief Select the I/O backend for the next connect()
+     *
+     * Defaults to ReactorBackend if FLASHUP_SERIAL_BACKEND is set to "epoll"
+     * and the platform supports it, QtSerialPortBackend otherwise.
+     *
+     * @param backend Backend to use
+     */
+    void setBackend(Backend backend);
+    Backend backend() const;
+
+    /**
+     * @brief Limit the line speed negotiated after the handshake
+     *
+     * Devices that list faster rates in their INFO reply ("baud=921600,3000000")
+     * are switched to the fastest rate both ends support, up to this limit.
+     * Defaults to the FLASHUP_SERIAL_MAX_BAUD environment variable, or
+     * 3000000 if it is not set.
+     *
+     * @param baudRate Highest rate to propose, or 0 to stay at 115200
+     */
+    void setMaxBaudRate(qint32 baudRate);
+    qint32 maxBaudRate() const;
+
     // DeviceInterface interface
     QString deviceId() const override;
     QMap<QString, QString> deviceInfo() const override;
+    QString transportGroup() const override;
     bool connect() override;
     void disconnect() override;
     bool isConnected() const override;
@@ -32,27 +70,102 @@ public:
     bool finalizeUpdate() override;
     bool cancelUpdate() override;
     qint64 optimalChunkSize() const override;
+    qint64 minChunkSize() const override;
+    qint64 maxChunkSize() const override;
+    int maxWindowSize() const override;
+    bool supportsResume() const override;
+    bool resumeUpdate(const QString &firmwareHash) override;
+    bool isHandshakeComplete() const override;
+    bool supportsDelta() const override;
+    QString installedFirmwareHash() const override;
+    bool beginDeltaUpdate(const QString &baseHash, const QString &targetHash,
+                          qint64 targetSize, qint64 patchSize) override;
+    QStringList supportedCompression() const override;
+    bool setPayloadCompression(const QString &compression, qint64 blockSize) override;
+    bool supportsFill() const override;
+    int erasedValue() const override;
+    bool fillFirmwareRange(qint64 offset, qint64 length, quint8 value) override;
+    bool reportsWriteReadiness() const override;
+    bool canSendChunk() const override;
+    QString frameVariant() const override;
+    bool encodeChunkFrame(const QByteArray &data, qint64 offset, QByteArray *frame) override;
+    bool sendEncodedChunk(const QByteArray &frame, qint64 offset) override;
 
 private slots:
     void onReadyRead();
+    void onBytesWritten(qint64 bytes);
     void onError(QSerialPort::SerialPortError error);
     void onTimeout();
     void processResponse();
 
 private:
+    /**
+     * @brief A command queued behind the one awaiting its ACK
+     */
+    struct PendingCommand {
+        QByteArray command;
+        qint64 chunkOffset;     ///< Offset of the chunk it carries, -1 for other commands
+    };
+
     QString m_portName;
     QSerialPort m_serialPort;
+    Backend m_backend;
+    std::shared_ptr<SerialReactorPort> m_reactorPort;
     ConnectionStatus m_status;
     DeviceState m_state;
-    QByteArray m_buffer;
+    FrameParser m_parser;
     QTimer m_timeoutTimer;
-    QQueue<QByteArray> m_pendingCommands;
+    QQueue<PendingCommand> m_pendingCommands;
+    QByteArray m_chunkFrame;
+    QByteArray m_responsePayload;   ///< Decoded binary response, reused for every frame
     bool m_waitingForAck;
+    qint64 m_commandChunkOffset;    ///< Chunk awaiting its ACK in stop-and-wait mode, -1 if none
+    QMap<QString, QString> m_capabilities;
+    bool m_handshakeComplete;
+    bool m_binaryFraming;
+    bool m_framingRequested;
+
+    // Line speed negotiation
+    enum BaudChange {
+        BaudIdle,
+        BaudProposed,   ///< BAUD sent, waiting for the device to pick a rate
+        BaudProbing     ///< Both ends switched, waiting for the echo probe
+    };
+    qint32 m_maxBaudRate;
+    qint32 m_baudRate;
+    qint32 m_probeBaudRate;
+    QList<qint32> m_baudRates;
+    QList<qint32> m_proposedBaudRates;
+    BaudChange m_baudChange;
+    bool m_baudNegotiated;
+    QByteArray m_probeToken;
+    int m_lineErrors;
+    bool m_stepDownPending;         ///< Step-down waiting for the command in flight to be answered
+    QElapsedTimer m_lineErrorTimer;
 
     // Serial protocol commands
     QByteArray createCommand(const QString &cmd, const QByteArray &data = QByteArray());
-    bool sendCommand(const QByteArray &cmd);
+    bool sendCommand(const QByteArray &cmd, qint64 chunkOffset = -1);
+    bool writeCommand(const QByteArray &cmd);
     void sendNextCommand();
+    void finishCommand(bool accepted);
+    void parseCapabilities(const QByteArray &info);
+    bool handleResponse(quint8 opcode, qint64 value, const QByteArray &payload);
+    void handleFramingReply(const QByteArray &framing);
+    void completeHandshake();
+    bool proposeBaudRates(const QList<qint32> &rates);
+    void handleBaudReply(qint32 baudRate);
+    void handleEchoReply(const QByteArray &token);
+    void finishBaudChange();
+    void recordLineError();
+    void stepDownBaudRate();
+    bool setPortBaudRate(qint32 baudRate);
+    void reportWriteReadiness();
+    bool isPortOpen() const;
+    qint64 readPort(char *data, qint64 maxLength);
+    qint64 bytesAvailable() const;
+    qint64 writePort(const QByteArray &data);
+    void onReactorError(const QString &message);
 };
 
 #endif // SERIALDEVICE_H 
\ No newline at end of file
@@ -0,0 +1,179 @@
+#include "serialframe.h"
+#include "core/crc32.h"
+
+#include <QHash>
+#include <QtEndian>
+#include <cstring>
+
+// COBS blocks carry at most 254 data bytes
+const int COBS_MAX_CODE = 0xFF;
+
+namespace {
+
+/**
+ * COBS encoder writing into a buffer sized for the worst case; input can be
+ * fed in pieces so header, payload and trailer need not be concatenated first.
+ */
+class CobsEncoder
+{
+public:
+    explicit CobsEncoder(char *out)
+        : m_out(out),
+          m_codeIndex(0),
+          m_pos(1),
+          m_code(1)
+    {
+    }
+    
+    void append(const char *data, qint64 length)
+    {
+        while (length > 0) {
+            // Copy the run up to the next zero or the end of the block
+            qint64 run = qMin<qint64>(length, COBS_MAX_CODE - m_code);
+            const char *zero = static_cast<const char *>(std::memchr(data, 0, run));
+            qint64 n = zero ? zero - data : run;
+            
+            std::memcpy(m_out + m_pos, data, n);
+            m_pos += n;
+            m_code += static_cast<int>(n);
+            data += n;
+            length -= n;
+            
+            if (zero) {
+                // The zero ends the block and is implied by its code
+                closeBlock();
+                data++;
+                length--;
+            } else if (m_code == COBS_MAX_CODE) {
+                closeBlock();
+            }
+        }
+    }
+    
+    qint64 finish()
+    {
+        m_out[m_codeIndex] = static_cast<char>(m_code);
+        m_out[m_pos++] = 0;
+        return m_pos;
+    }
+
+private:
+    void closeBlock()
+    {
+        m_out[m_codeIndex] = static_cast<char>(m_code);
+        m_codeIndex = m_pos++;
+        m_code = 1;
+    }
+    
+    char *m_out;
+    qint64 m_codeIndex;
+    qint64 m_pos;
+    int m_code;
+};
+
+} // namespace
+
+quint8 SerialFrame::opcodeFor(const QString &command)
+{
+    static const QHash<QString, quint8> opcodes = {
+        {"INFO", Info},
+        {"UPDATE_BEGIN", UpdateBegin},
+        {"CHUNK", Chunk},
+        {"UPDATE_END", UpdateEnd},
+        {"UPDATE_CANCEL", UpdateCancel},
+        {"UPDATE_RESUME", UpdateResume},
+        {"UPDATE_DELTA", UpdateDelta},
+        {"UPDATE_COMPRESSION", UpdateCompression},
+        {"FILL", Fill},
+        {"BAUD", Baud},
+        {"ECHO", Echo}
+    };
+    return opcodes.value(command, 0);
+}
+
+QByteArray SerialFrame::encode(quint8 opcode, quint32 offset, const QByteArray &payload)
+{
+    QByteArray frame;
+    if (!encode(opcode, offset, payload, &frame)) {
+        return QByteArray();
+    }
+    return frame;
+}
+
+bool SerialFrame::encode(quint8 opcode, quint32 offset, const QByteArray &payload, QByteArray *frame)
+{
+    if (payload.size() > MAX_PAYLOAD_SIZE) {
+        return false;
+    }
+    
+    char header[HEADER_SIZE];
+    header[0] = static_cast<char>(opcode);
+    qToLittleEndian(offset, header + 1);
+    qToLittleEndian(static_cast<quint16>(payload.size()), header + 5);
+    
+    char trailer[TRAILER_SIZE];
+    quint32 crc = Crc32::compute(header, HEADER_SIZE);
+    crc = Crc32::compute(payload, crc);
+    qToLittleEndian(crc, trailer);
+    
+    // One code byte per started 254-byte block, plus the delimiter; reserving
+    // first keeps the storage of a reused buffer when it is truncated below
+    qint64 rawSize = HEADER_SIZE + payload.size() + TRAILER_SIZE;
+    int maxSize = static_cast<int>(rawSize + rawSize / (COBS_MAX_CODE - 1) + 2);
+    frame->reserve(maxSize);
+    frame->resize(maxSize);
+    
+    CobsEncoder encoder(frame->data());
+    encoder.append(header, HEADER_SIZE);
+    encoder.append(payload.constData(), payload.size());
+    encoder.append(trailer, TRAILER_SIZE);
+    frame->truncate(static_cast<int>(encoder.finish()));
+    return true;
+}
+
+bool SerialFrame::decode(const char *data, qint64 length, quint8 *opcode, quint32 *offset, QByteArray *payload)
+{
+    // Undo COBS into the payload's own storage; the decoded frame is never
+    // longer than the encoded one
+    payload->reserve(static_cast<int>(length));
+    payload->resize(static_cast<int>(length));
+    char *out = payload->data();
+    qint64 size = 0;
+    qint64 pos = 0;
+    
+    while (pos < length) {
+        int code = static_cast<uchar>(data[pos++]);
+        if (code == 0 || pos + code - 1 > length) {
+            return false;
+        }
+        
+        std::memcpy(out + size, data + pos, code - 1);
+        size += code - 1;
+        pos += code - 1;
+        
+        // Every block but a full one and the last one ends in a zero
+        if (code < COBS_MAX_CODE && pos < length) {
+            out[size++] = 0;
+        }
+    }
+    
+    if (size < HEADER_SIZE + TRAILER_SIZE) {
+        return false;
+    }
+    
+    quint16 payloadSize = qFromLittleEndian<quint16>(out + 5);
+    if (size != HEADER_SIZE + payloadSize + TRAILER_SIZE) {
+        return false;
+    }
+    
+    quint32 crc = Crc32::compute(out, HEADER_SIZE + payloadSize);
+    if (crc != qFromLittleEndian<quint32>(out + HEADER_SIZE + payloadSize)) {
+        return false;
+    }
+    
+    *opcode = static_cast<quint8>(out[0]);
+    *offset = qFromLittleEndian<quint32>(out + 1);
+    std::memmove(out, out + HEADER_SIZE, payloadSize);
+    payload->resize(payloadSize);
+    return true;
+}
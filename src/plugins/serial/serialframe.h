@@ -0,0 +1,101 @@
+#ifndef SERIALFRAME_H
+#define SERIALFRAME_H
+
+#include <QByteArray>
+#include <QString>
+
+/**
+ * @brief The SerialFrame class encodes and decodes binary serial frames
+ *
+ * Used instead of text lines once the device has agreed to binary framing,
+ * so firmware bytes travel unmodified and are never scanned as text.
+ *
+ * Frame layout before COBS encoding (integers little-endian):
+ * - 1 byte:  Opcode
+ * - 4 bytes: Offset (chunk offset, or the value of a reply)
+ * - 2 bytes: Payload length
+ * - Payload
+ * - 4 bytes: CRC-32 of everything above
+ *
+ * The frame is COBS encoded, which removes every zero byte, and followed by
+ * a single 0x00 delimiter, so a receiver can always resynchronise at the
+ * next delimiter after a corrupt or partial frame.
+ */
+class SerialFrame
+{
+public:
+    enum Opcode : quint8 {
+        // Host to device
+        Info = 0x01,
+        UpdateBegin = 0x02,
+        Chunk = 0x03,
+        UpdateEnd = 0x04,
+        UpdateCancel = 0x05,
+        UpdateResume = 0x06,
+        UpdateDelta = 0x07,
+        UpdateCompression = 0x08,
+        Fill = 0x09,
+        Baud = 0x0A,
+        Echo = 0x0B,
+
+        // Device to host
+        Ack = 0x80,
+        ChunkAck = 0x81,
+        ChunkNak = 0x82,
+        Resume = 0x83,
+        InfoReply = 0x84,
+        State = 0x85,
+        Error = 0x86,
+        BaudReply = 0x87,
+        EchoReply = 0x88
+    };
+
+    static const int HEADER_SIZE = 7;
+    static const int TRAILER_SIZE = 4;
+    static const int MAX_PAYLOAD_SIZE = 0xFFFF;
+
+    /**
+     * @brief Get the opcode of a text protocol command
+     * @param command Command name, e.g. "UPDATE_BEGIN"
+     * @return Opcode, or 0 if the command has no binary form
+     */
+    static quint8 opcodeFor(const QString &command);
+
+    /**
+     * @brief Build a delimited frame
+     * @param opcode Opcode
+     * @param offset Offset field
+     * @param payload Payload (at most MAX_PAYLOAD_SIZE bytes)
+     * @return Encoded frame including the trailing delimiter, empty if the payload is too large
+     */
+    static QByteArray encode(quint8 opcode, quint32 offset, const QByteArray &payload = QByteArray());
+
+    /**
+     * @brief Build a delimited frame into an existing buffer
+     *
+     * Reuses the buffer's storage, so encoding one chunk after another into
+     * the same buffer allocates nothing once it is large enough.
+     *
+     * @param opcode Opcode
+     * @param offset Offset field
+     * @param payload Payload (at most MAX_PAYLOAD_SIZE bytes)
+     * @param frame Receives the encoded frame including the trailing delimiter
+     * @return false if the payload is too large
+     */
+    static bool encode(quint8 opcode, quint32 offset, const QByteArray &payload, QByteArray *frame);
+
+    /**
+     * @brief Decode a frame
+     * @param data Encoded frame without the delimiter
+     * @param length Number of bytes
+     * @param opcode Receives the opcode
+     * @param offset Receives the offset field
+     * @param payload Receives the payload; its storage is reused, so decoding
+     *                every response into the same array allocates nothing
+     *                once it is large enough. Undefined if decoding fails.
+     * @return true if the frame is well-formed and its CRC matches
+     */
+    static bool decode(const char *data, qint64 length, quint8 *opcode, quint32 *offset, QByteArray *payload);
+};
+
+#endif // SERIALFRAME_H
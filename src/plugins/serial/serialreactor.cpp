@@ -0,0 +1,516 @@
+#include "serialreactor.h"
+
+#include <QFile>
+#include <QThread>
+#include <QDebug>
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+
+// Per-port buffers; transmit holds a full window of large chunks
+const qint64 RX_BUFFER_SIZE = 64 * 1024;
+const qint64 TX_BUFFER_SIZE = 256 * 1024;
+const int MAX_EVENTS = 64;
+
+// Reserved epoll tag of the wakeup eventfd; port ids start at 1
+const quint64 WAKE_ID = 0;
+
+#ifdef Q_OS_LINUX
+namespace {
+
+speed_t speedFor(qint32 baudRate)
+{
+    switch (baudRate) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 576000: return B576000;
+        case 921600: return B921600;
+        case 1000000: return B1000000;
+        case 1152000: return B1152000;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 2500000: return B2500000;
+        case 3000000: return B3000000;
+        case 3500000: return B3500000;
+        case 4000000: return B4000000;
+        default: return B0;
+    }
+}
+
+bool configureTty(int fd, qint32 baudRate)
+{
+    speed_t speed = speedFor(baudRate);
+    if (speed == B0) {
+        errno = EINVAL;
+        return false;
+    }
+    
+    termios tio;
+    if (tcgetattr(fd, &tio) != 0) {
+        return false;
+    }
+    
+    // Raw 8N1, no flow control; reads return whatever is there, and 0 rather
+    // than EAGAIN once the tty is drained
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    tio.c_iflag &= ~(IXON | IXOFF | IXANY);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+} // namespace
+#endif
+
+SerialReactorPort::SerialReactorPort(SerialReactor *reactor, quint64 id, int fd)
+    : m_reactor(reactor),
+      m_id(id),
+      m_fd(fd),
+      m_open(true),
+      m_interest(0),
+      m_readNotified(false),
+      m_rxBuffer(RX_BUFFER_SIZE),
+      m_txBuffer(TX_BUFFER_SIZE)
+{
+}
+
+SerialReactorPort::~SerialReactorPort()
+{
+#ifdef Q_OS_LINUX
+    // The reactor may still service an event for the port, so the descriptor
+    // lives until the last reference is gone
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+#endif
+}
+
+bool SerialReactorPort::isOpen() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_open;
+}
+
+qint64 SerialReactorPort::write(const char *data, qint64 length)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_open) {
+        return -1;
+    }
+    
+    if (m_txBuffer.freeSpace() < length) {
+        return 0;
+    }
+    
+    m_txBuffer.write(data, length);
+    updateInterest();
+    return length;
+}
+
+qint64 SerialReactorPort::read(char *data, qint64 maxLength)
+{
+    QMutexLocker locker(&m_mutex);
+    
+    bool wasFull = m_rxBuffer.isFull();
+    qint64 n = m_rxBuffer.read(data, maxLength);
+    
+    // Notify again once more bytes arrive after everything was taken
+    if (m_rxBuffer.isEmpty()) {
+        m_readNotified = false;
+    }
+    if (wasFull && n > 0) {
+        updateInterest();
+    }
+    return n;
+}
+
+qint64 SerialReactorPort::readAll(QByteArray &out)
+{
+    QMutexLocker locker(&m_mutex);
+    m_readNotified = false;
+    
+    bool wasFull = m_rxBuffer.isFull();
+    qint64 n = m_rxBuffer.readAll(out);
+    if (wasFull) {
+        updateInterest();
+    }
+    return n;
+}
+
+qint64 SerialReactorPort::bytesAvailable() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_rxBuffer.size();
+}
+
+qint64 SerialReactorPort::bytesToWrite() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_txBuffer.size();
+}
+
+bool SerialReactorPort::setBaudRate(qint32 baudRate)
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_open) {
+        return false;
+    }
+
+#ifdef Q_OS_LINUX
+    if (!configureTty(m_fd, baudRate)) {
+        m_errorString = QString::fromLocal8Bit(std::strerror(errno));
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(baudRate);
+    return false;
+#endif
+}
+
+QString SerialReactorPort::errorString() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_errorString;
+}
+
+void SerialReactorPort::close()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (!m_open) {
+            return;
+        }
+        m_open = false;
+        m_receiver.clear();
+        m_rxBuffer.clear();
+        m_txBuffer.clear();
+    }
+    
+    m_reactor->unregister(this);
+}
+
+void SerialReactorPort::updateInterest()
+{
+#ifdef Q_OS_LINUX
+    // Level-triggered: read while there is room, write while there is data
+    quint32 interest = 0;
+    if (!m_rxBuffer.isFull()) {
+        interest |= EPOLLIN;
+    }
+    if (!m_txBuffer.isEmpty()) {
+        interest |= EPOLLOUT;
+    }
+    
+    if (!m_open || interest == m_interest) {
+        return;
+    }
+    
+    epoll_event event = {};
+    event.events = interest;
+    event.data.u64 = m_id;
+    epoll_ctl(m_reactor->m_epollFd, EPOLL_CTL_MOD, m_fd, &event);
+    m_interest = interest;
+#endif
+}
+
+void SerialReactorPort::notifyReadyRead()
+{
+    // One notification until the owner has read, however many reads happen meanwhile
+    if (m_readNotified || !m_receiver || !m_onReadyRead) {
+        return;
+    }
+    
+    m_readNotified = true;
+    QMetaObject::invokeMethod(m_receiver.data(), m_onReadyRead, Qt::QueuedConnection);
+}
+
+void SerialReactorPort::fail(const QString &message)
+{
+    m_open = false;
+    m_errorString = message;
+    
+    if (m_receiver && m_onError) {
+        auto onError = m_onError;
+        QMetaObject::invokeMethod(m_receiver.data(), [onError, message]() {
+            onError(message);
+        }, Qt::QueuedConnection);
+    }
+    m_receiver.clear();
+}
+
+SerialReactor *SerialReactor::instance()
+{
+    static SerialReactor reactor;
+    return &reactor;
+}
+
+bool SerialReactor::isSupported()
+{
+#ifdef Q_OS_LINUX
+    return true;
+#else
+    return false;
+#endif
+}
+
+SerialReactor::SerialReactor()
+    : m_epollFd(-1),
+      m_wakeFd(-1),
+      m_nextId(WAKE_ID + 1),
+      m_thread(nullptr)
+{
+#ifdef Q_OS_LINUX
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollFd < 0 || m_wakeFd < 0) {
+        qWarning() << "SerialReactor: failed to create epoll instance:" << std::strerror(errno);
+        return;
+    }
+    
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = WAKE_ID;
+    epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_wakeFd, &event);
+    
+    m_thread = QThread::create([this]() { run(); });
+    m_thread->setObjectName("FlashUp serial reactor");
+    m_thread->start();
+#endif
+}
+
+SerialReactor::~SerialReactor()
+{
+#ifdef Q_OS_LINUX
+    if (m_thread) {
+        m_thread->requestInterruption();
+        quint64 one = 1;
+        ssize_t written = ::write(m_wakeFd, &one, sizeof(one));
+        Q_UNUSED(written);
+        m_thread->wait();
+        delete m_thread;
+    }
+    
+    m_ports.clear();
+    if (m_wakeFd >= 0) {
+        ::close(m_wakeFd);
+    }
+    if (m_epollFd >= 0) {
+        ::close(m_epollFd);
+    }
+#endif
+}
+
+std::shared_ptr<SerialReactorPort> SerialReactor::open(const QString &portName, qint32 baudRate,
+                                                       QObject *receiver,
+                                                       std::function<void()> onReadyRead,
+                                                       std::function<void(const QString &)> onError,
+                                                       QString *errorString)
+{
+#ifdef Q_OS_LINUX
+    if (!m_thread) {
+        *errorString = "Serial reactor is not running";
+        return nullptr;
+    }
+    
+    QString path = portName.startsWith('/') ? portName : "/dev/" + portName;
+    int fd = ::open(QFile::encodeName(path).constData(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        *errorString = QString::fromLocal8Bit(std::strerror(errno));
+        return nullptr;
+    }
+    
+    if (!configureTty(fd, baudRate)) {
+        *errorString = QString::fromLocal8Bit(std::strerror(errno));
+        ::close(fd);
+        return nullptr;
+    }
+    
+    QMutexLocker locker(&m_portsMutex);
+    std::shared_ptr<SerialReactorPort> port(new SerialReactorPort(this, m_nextId++, fd));
+    port->m_receiver = receiver;
+    port->m_onReadyRead = std::move(onReadyRead);
+    port->m_onError = std::move(onError);
+    port->m_interest = EPOLLIN;
+    
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = port->m_id;
+    if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        *errorString = QString::fromLocal8Bit(std::strerror(errno));
+        return nullptr;
+    }
+    
+    m_ports.insert(port->m_id, port);
+    return port;
+#else
+    Q_UNUSED(portName);
+    Q_UNUSED(baudRate);
+    Q_UNUSED(receiver);
+    Q_UNUSED(onReadyRead);
+    Q_UNUSED(onError);
+    *errorString = "Serial reactor is only available on Linux";
+    return nullptr;
+#endif
+}
+
+void SerialReactor::unregister(SerialReactorPort *port)
+{
+    // Keep the port alive until the reference from the map is gone outside the lock
+    std::shared_ptr<SerialReactorPort> removed;
+    
+    QMutexLocker locker(&m_portsMutex);
+    removed = m_ports.take(port->m_id);
+#ifdef Q_OS_LINUX
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, port->m_fd, nullptr);
+#endif
+    locker.unlock();
+}
+
+void SerialReactor::run()
+{
+#ifdef Q_OS_LINUX
+    epoll_event events[MAX_EVENTS];
+    
+    while (!QThread::currentThread()->isInterruptionRequested()) {
+        int count = epoll_wait(m_epollFd, events, MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qWarning() << "SerialReactor: epoll_wait failed:" << std::strerror(errno);
+            return;
+        }
+        
+        for (int i = 0; i < count; ++i) {
+            if (events[i].data.u64 == WAKE_ID) {
+                quint64 value;
+                ssize_t n = ::read(m_wakeFd, &value, sizeof(value));
+                Q_UNUSED(n);
+                continue;
+            }
+            
+            // Ports closed since epoll_wait returned are no longer in the map
+            std::shared_ptr<SerialReactorPort> port;
+            {
+                QMutexLocker locker(&m_portsMutex);
+                port = m_ports.value(events[i].data.u64);
+            }
+            
+            if (port) {
+                service(port, events[i].events);
+            }
+        }
+    }
+#endif
+}
+
+void SerialReactor::service(const std::shared_ptr<SerialReactorPort> &port, quint32 events)
+{
+#ifdef Q_OS_LINUX
+    QMutexLocker locker(&port->m_mutex);
+    if (!port->m_open) {
+        return;
+    }
+    
+    // Read straight into the ring buffer until the tty is drained or the buffer
+    // is full; bytes that arrived before a hangup are still taken
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        qint64 received = 0;
+        while (!port->m_rxBuffer.isFull()) {
+            RingBuffer::Span spans[2];
+            int count = port->m_rxBuffer.writeSpans(spans);
+            
+            iovec iov[2];
+            for (int i = 0; i < count; ++i) {
+                iov[i].iov_base = spans[i].data;
+                iov[i].iov_len = static_cast<size_t>(spans[i].size);
+            }
+            
+            ssize_t n = ::readv(port->m_fd, iov, count);
+            if (n > 0) {
+                port->m_rxBuffer.commit(n);
+                received += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+                // With VMIN and VTIME at 0 an empty tty reads as 0 bytes
+                break;
+            } else {
+                // A hard error such as EIO: the adapter is gone
+                if (received > 0) {
+                    port->notifyReadyRead();
+                }
+                port->fail(QString::fromLocal8Bit(std::strerror(errno)));
+                locker.unlock();
+                unregister(port.get());
+                return;
+            }
+        }
+        
+        if (received > 0) {
+            port->notifyReadyRead();
+        }
+    }
+    
+    // The tty reports a hangup through the event, not through read()
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        port->fail("Serial device disconnected");
+        locker.unlock();
+        unregister(port.get());
+        return;
+    }
+    
+    // Flush everything queued in one writev
+    if (events & EPOLLOUT) {
+        while (!port->m_txBuffer.isEmpty()) {
+            RingBuffer::Span spans[2];
+            int count = port->m_txBuffer.readSpans(spans);
+            
+            iovec iov[2];
+            for (int i = 0; i < count; ++i) {
+                iov[i].iov_base = spans[i].data;
+                iov[i].iov_len = static_cast<size_t>(spans[i].size);
+            }
+            
+            ssize_t n = ::writev(port->m_fd, iov, count);
+            if (n > 0) {
+                port->m_txBuffer.discard(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                port->fail(QString::fromLocal8Bit(std::strerror(errno)));
+                locker.unlock();
+                unregister(port.get());
+                return;
+            }
+        }
+    }
+    
+    port->updateInterest();
+#else
+    Q_UNUSED(port);
+    Q_UNUSED(events);
+#endif
+}
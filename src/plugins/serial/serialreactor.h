@@ -0,0 +1,183 @@
+#ifndef SERIALREACTOR_H
+#define SERIALREACTOR_H
+
+#include "core/ringbuffer.h"
+
+#include <QObject>
+#include <QPointer>
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <functional>
+#include <memory>
+
+class QThread;
+class SerialReactor;
+
+/**
+ * @brief The SerialReactorPort class is a serial port serviced by the SerialReactor
+ *
+ * Received bytes collect in a preallocated ring buffer that the reactor
+ * fills with batched reads; written bytes are queued in a second ring
+ * buffer and flushed by the reactor with one writev() per wakeup. The
+ * owner is notified of new data at most once until it has read it.
+ *
+ * All functions are thread-safe.
+ */
+class SerialReactorPort
+{
+public:
+    ~SerialReactorPort();
+
+    /**
+     * @brief Check whether the port is open
+     * @return true until close() is called or the port fails
+     */
+    bool isOpen() const;
+
+    /**
+     * @brief Queue bytes for transmission
+     *
+     * Bytes are queued as a whole or not at all, so commands never go out
+     * truncated.
+     *
+     * @param data Bytes to send
+     * @param length Number of bytes
+     * @return length if queued, 0 if the transmit buffer has no room for
+     *         them, -1 if the port is not open
+     */
+    qint64 write(const char *data, qint64 length);
+
+    /**
+     * @brief Take received bytes
+     * @param data Destination
+     * @param maxLength Maximum number of bytes
+     * @return Number of bytes copied
+     */
+    qint64 read(char *data, qint64 maxLength);
+
+    /**
+     * @brief Move all received bytes to the end of a byte array
+     * @param out Destination
+     * @return Number of bytes moved
+     */
+    qint64 readAll(QByteArray &out);
+
+    /**
+     * @brief Get the number of received bytes waiting to be read
+     */
+    qint64 bytesAvailable() const;
+
+    /**
+     * @brief Get the number of queued bytes not yet written to the device
+     */
+    qint64 bytesToWrite() const;
+
+    /**
+     * @brief Change the line speed
+     * @param baudRate Bits per second
+     * @return true if the tty accepted the speed
+     */
+    bool setBaudRate(qint32 baudRate);
+
+    /**
+     * @brief Get the description of the last error
+     */
+    QString errorString() const;
+
+    /**
+     * @brief Stop servicing the port and close it
+     *
+     * No notifications are delivered once this returns.
+     */
+    void close();
+
+private:
+    friend class SerialReactor;
+
+    SerialReactorPort(SerialReactor *reactor, quint64 id, int fd);
+
+    // Called with m_mutex held
+    void updateInterest();
+    void notifyReadyRead();
+    void fail(const QString &message);
+
+    SerialReactor *m_reactor;
+    quint64 m_id;
+    int m_fd;
+    bool m_open;
+    quint32 m_interest;
+    bool m_readNotified;
+    QString m_errorString;
+    RingBuffer m_rxBuffer;
+    RingBuffer m_txBuffer;
+    QPointer<QObject> m_receiver;
+    std::function<void()> m_onReadyRead;
+    std::function<void(const QString &)> m_onError;
+    mutable QMutex m_mutex;
+};
+
+/**
+ * @brief The SerialReactor class services many serial ports from one epoll thread
+ *
+ * Instead of a QSerialPort with its own notifiers and per-readyRead
+ * allocations for every adapter, all tty file descriptors are registered
+ * with a single epoll instance. One thread waits on it and moves data
+ * between the descriptors and each port's ring buffers, so wakeups and CPU
+ * use per transferred byte stay flat as ports are added.
+ *
+ * Linux only; open() fails elsewhere.
+ */
+class SerialReactor
+{
+public:
+    /**
+     * @brief Get the shared reactor, starting its thread on first use
+     */
+    static SerialReactor *instance();
+
+    ~SerialReactor();
+
+    /**
+     * @brief Check whether the reactor can be used on this platform
+     */
+    static bool isSupported();
+
+    /**
+     * @brief Open a serial port in raw 8N1 mode
+     *
+     * Notifications are delivered through queued calls in the receiver's
+     * thread and are dropped once the receiver is destroyed.
+     *
+     * @param portName Port name (e.g. "ttyUSB0") or device path
+     * @param baudRate Bits per second
+     * @param receiver Object the callbacks run in the context of
+     * @param onReadyRead Called when received bytes are waiting
+     * @param onError Called with a description when the port fails
+     * @param errorString Receives the reason if opening fails
+     * @return Open port, or nullptr on failure
+     */
+    std::shared_ptr<SerialReactorPort> open(const QString &portName, qint32 baudRate,
+                                            QObject *receiver,
+                                            std::function<void()> onReadyRead,
+                                            std::function<void(const QString &)> onError,
+                                            QString *errorString);
+
+private:
+    friend class SerialReactorPort;
+
+    SerialReactor();
+
+    void run();
+    void service(const std::shared_ptr<SerialReactorPort> &port, quint32 events);
+    void unregister(SerialReactorPort *port);
+
+    int m_epollFd;
+    int m_wakeFd;
+    quint64 m_nextId;
+    QThread *m_thread;
+    QHash<quint64, std::shared_ptr<SerialReactorPort>> m_ports;
+    QMutex m_portsMutex;
+};
+
+#endif // SERIALREACTOR_H
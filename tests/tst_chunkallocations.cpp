@@ -0,0 +1,720 @@
+#include "core/chunkbufferpool.h"
+#include "core/deviceinterface.h"
+#include "core/firmwarepackage.h"
+#include "core/firmwarepackagebuilder.h"
+#include "core/transferjournal.h"
+#include "core/updatejob.h"
+#include "plugins/network/networkdevice.h"
+#include "plugins/network/networkframe.h"
+#include "plugins/serial/serialdevice.h"
+#include "plugins/serial/serialframe.h"
+
+#include <QtTest>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QTemporaryDir>
+#include <QVector>
+#include <QtEndian>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+
+#ifdef Q_OS_LINUX
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Constants
+const qint64 CHUNK_SIZE = 1024;
+const int WINDOW_SIZE = 4;
+const qint64 IMAGE_SIZE = 4 * 1024 * 1024;
+const int PEER_POLL_INTERVAL_MS = 100;
+const int TRANSPORT_TIMEOUT_MS = 30000;
+
+// Every heap allocation of the process goes through these. Only the thread
+// running a counter counts, so the journal saving progress on its writer
+// thread does not.
+static thread_local bool t_counting = false;
+static std::atomic<qint64> g_allocations(0);
+
+#ifdef __GLIBC__
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    if (t_counting) {
+        g_allocations++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (t_counting) {
+        g_allocations++;
+    }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (t_counting) {
+        g_allocations++;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+}
+#endif
+
+/**
+ * @brief Counts the heap allocations made by the calling thread during its lifetime
+ */
+class AllocationCounter
+{
+public:
+    AllocationCounter()
+    {
+        g_allocations = 0;
+        t_counting = true;
+    }
+
+    ~AllocationCounter()
+    {
+        t_counting = false;
+    }
+
+    qint64 count() const
+    {
+        return g_allocations.load();
+    }
+};
+
+/**
+ * @brief Windowed device that frames chunks like a binary serial device
+ *
+ * The test acknowledges chunks in the order they were sent.
+ */
+class MockDevice : public DeviceInterface
+{
+public:
+    MockDevice()
+        : m_state(Idle),
+          m_sent(WINDOW_SIZE * 2),
+          m_sentHead(0),
+          m_sentCount(0)
+    {
+        m_frame.reserve(CHUNK_SIZE + 64);
+    }
+
+    QString deviceId() const override { return "mock://device"; }
+    QMap<QString, QString> deviceInfo() const override { return QMap<QString, QString>(); }
+    bool connect() override { return true; }
+    void disconnect() override {}
+    bool isConnected() const override { return true; }
+    ConnectionStatus connectionStatus() const override { return Connected; }
+    DeviceState deviceState() const override { return m_state; }
+    bool beginUpdate() override { return true; }
+    bool finalizeUpdate() override { return true; }
+    bool cancelUpdate() override { return true; }
+    qint64 optimalChunkSize() const override { return CHUNK_SIZE; }
+    int maxWindowSize() const override { return WINDOW_SIZE; }
+
+    bool sendFirmwareChunk(const QByteArray &data, qint64 offset) override
+    {
+        if (m_sentCount == m_sent.size() ||
+            !SerialFrame::encode(SerialFrame::Chunk, static_cast<quint32>(offset), data, &m_frame)) {
+            return false;
+        }
+
+        m_sent[(m_sentHead + m_sentCount++) % m_sent.size()] = offset;
+        return true;
+    }
+
+    void setReady()
+    {
+        m_state = Ready;
+        emit deviceStateChanged(m_state);
+    }
+
+    bool acknowledgeNext()
+    {
+        if (m_sentCount == 0) {
+            return false;
+        }
+
+        qint64 offset = m_sent.at(m_sentHead);
+        m_sentHead = (m_sentHead + 1) % m_sent.size();
+        m_sentCount--;
+        emit chunkAcknowledged(offset);
+        return true;
+    }
+
+    qint64 nextAcknowledged() const
+    {
+        return m_sentCount > 0 ? m_sent.at(m_sentHead) : -1;
+    }
+
+private:
+    DeviceState m_state;
+    QByteArray m_frame;
+    QVector<qint64> m_sent;
+    int m_sentHead;
+    int m_sentCount;
+};
+
+#ifdef Q_OS_LINUX
+/**
+ * @brief Device end of a real transport, served from a thread of its own
+ *
+ * Runs on its own thread, so its allocations are not counted. Every chunk
+ * is acknowledged as soon as it arrives, except the last one, which waits
+ * for release() so the test can stop counting before the job finalizes.
+ */
+class TransportPeer
+{
+public:
+    virtual ~TransportPeer()
+    {
+        stop();
+    }
+
+    void start()
+    {
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    void stop()
+    {
+        m_stopped = true;
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        if (m_fd >= 0) {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+    void release()
+    {
+        m_released = true;
+    }
+
+    qint64 heldOffset() const
+    {
+        return m_heldOffset.load();
+    }
+
+protected:
+    virtual void run() = 0;
+
+    bool waitFor(int fd, short events)
+    {
+        while (!m_stopped) {
+            pollfd descriptor = {fd, events, 0};
+            int n = ::poll(&descriptor, 1, PEER_POLL_INTERVAL_MS);
+            if (n > 0) {
+                return true;
+            }
+            if (n < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool fill()
+    {
+        if (!waitFor(m_fd, POLLIN)) {
+            return false;
+        }
+
+        char buffer[64 * 1024];
+        ssize_t n = ::read(m_fd, buffer, sizeof(buffer));
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return true;
+        }
+        if (n <= 0) {
+            // The host closed its end
+            return false;
+        }
+        m_buffer.append(buffer, static_cast<int>(n));
+        return true;
+    }
+
+    bool take(int length, QByteArray *out)
+    {
+        while (m_buffer.size() < length) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        *out = m_buffer.left(length);
+        m_buffer.remove(0, length);
+        return true;
+    }
+
+    bool takeUntil(char delimiter, QByteArray *out)
+    {
+        int end;
+        while ((end = m_buffer.indexOf(delimiter)) < 0) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        *out = m_buffer.left(end);
+        m_buffer.remove(0, end + 1);
+        return true;
+    }
+
+    bool send(const QByteArray &data)
+    {
+        const char *next = data.constData();
+        qint64 remaining = data.size();
+        while (remaining > 0) {
+            if (!waitFor(m_fd, POLLOUT)) {
+                return false;
+            }
+            ssize_t n = ::write(m_fd, next, static_cast<size_t>(remaining));
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            next += n;
+            remaining -= n;
+        }
+        return true;
+    }
+
+    void holdIfLast(qint64 offset, qint64 size)
+    {
+        if (offset + size < IMAGE_SIZE) {
+            return;
+        }
+
+        m_heldOffset = offset;
+        while (!m_released && !m_stopped) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    int m_fd = -1;
+    std::atomic<bool> m_stopped{false};
+
+private:
+    std::thread m_thread;
+    QByteArray m_buffer;
+    std::atomic<bool> m_released{false};
+    std::atomic<qint64> m_heldOffset{-1};
+};
+
+/**
+ * @brief Windowed network device taking binary chunks on a loopback port
+ */
+class NetworkPeer : public TransportPeer
+{
+public:
+    NetworkPeer()
+    {
+        m_listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (m_listener >= 0 &&
+            ::bind(m_listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+            ::listen(m_listener, 1) == 0 &&
+            ::getsockname(m_listener, reinterpret_cast<sockaddr *>(&address), &length) == 0) {
+            m_port = ntohs(address.sin_port);
+        }
+    }
+
+    ~NetworkPeer() override
+    {
+        stop();
+        if (m_listener >= 0) {
+            ::close(m_listener);
+        }
+    }
+
+    quint16 port() const
+    {
+        return m_port;
+    }
+
+protected:
+    void run() override
+    {
+        if (!waitFor(m_listener, POLLIN)) {
+            return;
+        }
+        m_fd = ::accept4(m_listener, nullptr, nullptr, SOCK_CLOEXEC);
+
+        QByteArray prefix;
+        QByteArray message;
+        while (take(NetworkFrame::SIZE_PREFIX_SIZE, &prefix) &&
+               take(static_cast<int>(qFromLittleEndian<quint32>(prefix.constData())), &message)) {
+            if (NetworkFrame::isBinary(message.constData(), message.size())) {
+                qint64 offset = qFromLittleEndian<qint64>(message.constData() + 4);
+                holdIfLast(offset, message.size() - NetworkFrame::CHUNK_HEADER_SIZE);
+
+                char response[NetworkFrame::SIZE_PREFIX_SIZE + NetworkFrame::RESPONSE_SIZE] = {};
+                qToLittleEndian<quint32>(NetworkFrame::RESPONSE_SIZE, response);
+                response[NetworkFrame::SIZE_PREFIX_SIZE] = static_cast<char>(NetworkFrame::ChunkAck);
+                qToLittleEndian<qint64>(offset, response + NetworkFrame::SIZE_PREFIX_SIZE + 4);
+                send(QByteArray(response, sizeof(response)));
+            } else if (message.contains("\"info\"")) {
+                reply(QByteArray("{\"status\":\"ok\",\"info\":{\"state\":\"ready\",\"binary_chunks\":true,\"window\":")
+                      + QByteArray::number(WINDOW_SIZE) + "}}");
+            } else if (message.contains("begin_update")) {
+                reply("{\"status\":\"ok\",\"update_status\":{\"action\":\"begin_update\",\"success\":true}}");
+            } else if (message.contains("end_update")) {
+                reply("{\"status\":\"ok\",\"update_status\":{\"action\":\"end_update\",\"success\":true}}");
+            }
+        }
+    }
+
+private:
+    void reply(const QByteArray &json)
+    {
+        char prefix[NetworkFrame::SIZE_PREFIX_SIZE];
+        qToLittleEndian<quint32>(static_cast<quint32>(json.size()), prefix);
+        send(QByteArray(prefix, sizeof(prefix)) + json);
+    }
+
+    int m_listener = -1;
+    quint16 m_port = 0;
+};
+
+/**
+ * @brief Windowed serial device switching to COBS frames, on a pseudo terminal
+ */
+class SerialPeer : public TransportPeer
+{
+public:
+    SerialPeer()
+    {
+        // The slave end of a pseudo terminal behaves like a USB serial adapter
+        m_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (m_fd >= 0 && grantpt(m_fd) == 0 && unlockpt(m_fd) == 0) {
+            m_slavePath = QString::fromLocal8Bit(ptsname(m_fd));
+        }
+    }
+
+    ~SerialPeer() override
+    {
+        stop();
+    }
+
+    QString slavePath() const
+    {
+        return m_slavePath;
+    }
+
+protected:
+    void run() override
+    {
+        // Text commands until the host has switched to binary frames
+        QByteArray line;
+        while (takeUntil('\n', &line)) {
+            if (line.startsWith("INFO:")) {
+                send(QByteArray("INFO:test framing=cobs window=") + QByteArray::number(WINDOW_SIZE) + "\nACK\n");
+            } else if (line.startsWith("FRAMING:")) {
+                send("FRAMING:cobs\n");
+                break;
+            }
+        }
+
+        QByteArray frame;
+        QByteArray payload;
+        quint8 opcode = 0;
+        quint32 offset = 0;
+        while (takeUntil('\0', &frame)) {
+            if (frame.isEmpty() ||
+                !SerialFrame::decode(frame.constData(), frame.size(), &opcode, &offset, &payload)) {
+                continue;
+            }
+
+            switch (opcode) {
+                case SerialFrame::UpdateBegin:
+                    send(SerialFrame::encode(SerialFrame::Ack, 0) +
+                         SerialFrame::encode(SerialFrame::State, 0, "UPDATING"));
+                    break;
+                case SerialFrame::Chunk:
+                    holdIfLast(offset, payload.size());
+                    send(SerialFrame::encode(SerialFrame::ChunkAck, offset));
+                    break;
+                case SerialFrame::UpdateEnd:
+                    send(SerialFrame::encode(SerialFrame::Ack, 0) +
+                         SerialFrame::encode(SerialFrame::State, 0, "REBOOTING"));
+                    break;
+                default:
+                    send(SerialFrame::encode(SerialFrame::Ack, 0));
+                    break;
+            }
+        }
+    }
+
+private:
+    QString m_slavePath;
+};
+#endif
+
+class TestChunkAllocations : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void bufferPoolReuse();
+    void serialFrameInPlace();
+    void networkFrameInPlace();
+    void journalRecord();
+    void windowedUpload_data();
+    void windowedUpload();
+    void networkUpload();
+    void serialReactorUpload();
+
+private:
+#ifdef Q_OS_LINUX
+    void uploadThrough(const std::shared_ptr<DeviceInterface> &device, TransportPeer *peer);
+#endif
+
+    QTemporaryDir m_dir;
+    QString m_packagePath;
+};
+
+void TestChunkAllocations::initTestCase()
+{
+#ifndef __GLIBC__
+    QSKIP("Allocations are only counted with glibc");
+#endif
+    QVERIFY(m_dir.isValid());
+
+    // Pseudo-random bytes, so no part of the image is a fill range
+    QByteArray image(static_cast<int>(IMAGE_SIZE), Qt::Uninitialized);
+    quint32 state = 0x12345678;
+    for (int i = 0; i < image.size(); ++i) {
+        state = state * 1103515245 + 12345;
+        image[i] = static_cast<char>(state >> 24);
+    }
+
+    FirmwarePackageBuilder builder;
+    builder.setMetadata("name", "test");
+    builder.setMetadata("version", "1.0.0");
+    builder.setMetadata("target", "mock");
+    builder.setImage(image);
+
+    m_packagePath = m_dir.filePath("firmware.fup");
+    builder.write(m_packagePath);
+}
+
+void TestChunkAllocations::bufferPoolReuse()
+{
+    ChunkBufferPool pool(static_cast<int>(CHUNK_SIZE), 4);
+    QByteArray buffer = pool.acquire();
+    pool.release(buffer);
+
+    AllocationCounter counter;
+    for (int i = 0; i < 100; ++i) {
+        buffer = pool.acquire();
+        buffer.resize(static_cast<int>(CHUNK_SIZE));
+        pool.release(buffer);
+    }
+    QCOMPARE(counter.count(), qint64(0));
+    QCOMPARE(pool.allocations(), qint64(1));
+}
+
+void TestChunkAllocations::serialFrameInPlace()
+{
+    QByteArray chunk(static_cast<int>(CHUNK_SIZE), 'x');
+    QByteArray frame;
+    QByteArray payload;
+    quint8 opcode = 0;
+    quint32 offset = 0;
+
+    // The first round sizes both buffers
+    QVERIFY(SerialFrame::encode(SerialFrame::Chunk, 0, chunk, &frame));
+    QVERIFY(SerialFrame::decode(frame.constData(), frame.size() - 1, &opcode, &offset, &payload));
+
+    AllocationCounter counter;
+    for (quint32 i = 1; i <= 100; ++i) {
+        SerialFrame::encode(SerialFrame::Chunk, i * CHUNK_SIZE, chunk, &frame);
+        SerialFrame::decode(frame.constData(), frame.size() - 1, &opcode, &offset, &payload);
+    }
+    QCOMPARE(counter.count(), qint64(0));
+    QCOMPARE(offset, quint32(100 * CHUNK_SIZE));
+    QCOMPARE(payload, chunk);
+}
+
+void TestChunkAllocations::networkFrameInPlace()
+{
+    QByteArray chunk(static_cast<int>(CHUNK_SIZE), 'x');
+    QByteArray request;
+    NetworkFrame::encodeChunk(0, chunk, &request);
+
+    AllocationCounter counter;
+    for (qint64 i = 1; i <= 100; ++i) {
+        NetworkFrame::encodeChunk(i * CHUNK_SIZE, chunk, &request);
+    }
+    QCOMPARE(counter.count(), qint64(0));
+}
+
+void TestChunkAllocations::journalRecord()
+{
+    TransferJournal journal(m_dir.filePath("journal"));
+    QString deviceId = "mock://device";
+    QString firmwareHash = QString(64, QChar('a'));
+    QString key = journal.entryKey(deviceId, firmwareHash);
+
+    // The first record creates the entry and writes it
+    journal.record(key, deviceId, firmwareHash, 0);
+
+    // Later records stay below the disk write threshold
+    AllocationCounter counter;
+    for (qint64 offset = 1; offset <= 32; ++offset) {
+        journal.record(key, deviceId, firmwareHash, offset * CHUNK_SIZE);
+    }
+    QCOMPARE(counter.count(), qint64(0));
+}
+
+void TestChunkAllocations::windowedUpload_data()
+{
+    QTest::addColumn<int>("accessMode");
+
+    QTest::newRow("mapped") << static_cast<int>(FirmwarePackage::Mapped);
+    QTest::newRow("buffered") << static_cast<int>(FirmwarePackage::Buffered);
+}
+
+void TestChunkAllocations::windowedUpload()
+{
+    QFETCH(int, accessMode);
+
+    auto firmware = std::make_shared<FirmwarePackage>(m_packagePath,
+                                                      static_cast<FirmwarePackage::AccessMode>(accessMode));
+    auto device = std::make_shared<MockDevice>();
+    ChunkBufferPool pool;
+
+    TransferJournal journal(m_dir.filePath(QString("journal-%1").arg(QTest::currentDataTag())));
+
+    UpdateJob job(device, firmware);
+    job.setJournal(&journal);
+    job.setBufferPool(&pool);
+    job.start();
+    device->setReady();
+
+    // The first chunks size the buffers, create the journal entry and build
+    // the progress strings
+    qint64 warmUpEnd = IMAGE_SIZE / 16;
+    while (device->nextAcknowledged() >= 0 && device->nextAcknowledged() < warmUpEnd) {
+        device->acknowledgeNext();
+    }
+    QCOMPARE(device->nextAcknowledged(), warmUpEnd);
+
+    // The rest of the upload, with a progress report per percent and a journal
+    // write per 64 KiB, up to the last chunk, whose acknowledgement ends the job
+    qint64 lastChunk = IMAGE_SIZE - CHUNK_SIZE;
+    qint64 acknowledged = 0;
+    {
+        AllocationCounter counter;
+        while (device->nextAcknowledged() >= 0 && device->nextAcknowledged() < lastChunk) {
+            device->acknowledgeNext();
+            acknowledged++;
+        }
+        QCOMPARE(counter.count(), qint64(0));
+    }
+    QCOMPARE(acknowledged, (lastChunk - warmUpEnd) / CHUNK_SIZE);
+    QCOMPARE(device->nextAcknowledged(), lastChunk);
+
+    device->acknowledgeNext();
+    QCOMPARE(job.state(), UpdateJob::Finalizing);
+}
+
+void TestChunkAllocations::networkUpload()
+{
+#ifdef Q_OS_LINUX
+    NetworkPeer peer;
+    QVERIFY(peer.port() != 0);
+    peer.start();
+
+    uploadThrough(std::make_shared<NetworkDevice>("127.0.0.1", peer.port()), &peer);
+#else
+    QSKIP("Transport peers are only available on Linux");
+#endif
+}
+
+void TestChunkAllocations::serialReactorUpload()
+{
+#ifdef Q_OS_LINUX
+    SerialPeer peer;
+    QVERIFY(!peer.slavePath().isEmpty());
+    peer.start();
+
+    auto device = std::make_shared<SerialDevice>(peer.slavePath());
+    device->setBackend(SerialDevice::ReactorBackend);
+    uploadThrough(device, &peer);
+#else
+    QSKIP("The serial reactor is only available on Linux");
+#endif
+}
+
+#ifdef Q_OS_LINUX
+void TestChunkAllocations::uploadThrough(const std::shared_ptr<DeviceInterface> &device, TransportPeer *peer)
+{
+    auto firmware = std::make_shared<FirmwarePackage>(m_packagePath);
+    ChunkBufferPool pool;
+
+    UpdateJob job(device, firmware);
+    job.setBufferPool(&pool);
+    job.start();
+
+    // The first chunks size the buffers, the transport's read buffers and the
+    // progress strings
+    QTRY_VERIFY_WITH_TIMEOUT(job.bytesTransferred() >= IMAGE_SIZE / 16, TRANSPORT_TIMEOUT_MS);
+
+    // The rest of the upload goes through the event loop, socket notifiers and
+    // reactor callbacks included, up to the last chunk, whose acknowledgement
+    // the peer holds back
+    QElapsedTimer elapsed;
+    elapsed.start();
+    qint64 allocations = 0;
+    {
+        AllocationCounter counter;
+        while ((peer->heldOffset() < 0 || job.bytesTransferred() < peer->heldOffset()) &&
+               job.state() == UpdateJob::Uploading && !elapsed.hasExpired(TRANSPORT_TIMEOUT_MS)) {
+            QCoreApplication::processEvents();
+        }
+        allocations = counter.count();
+    }
+    QCOMPARE(job.state(), UpdateJob::Uploading);
+    QVERIFY(peer->heldOffset() >= 0);
+    QCOMPARE(job.bytesTransferred(), peer->heldOffset());
+    QCOMPARE(allocations, qint64(0));
+
+    peer->release();
+    QTRY_COMPARE_WITH_TIMEOUT(job.state(), UpdateJob::Complete, TRANSPORT_TIMEOUT_MS);
+}
+#endif
+
+QTEST_GUILESS_MAIN(TestChunkAllocations)
+#include "tst_chunkallocations.moc"
@@ -0,0 +1,276 @@
+#include "core/cryptoutils.h"
+#include "core/deltapatch.h"
+#include "core/firmwarepackage.h"
+#include "core/firmwarepackagebuilder.h"
+
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QtEndian>
+
+// Constants
+const int IMAGE_SIZE = 256 * 1024;
+const qint64 TREE_CHUNK_SIZE = 4096;
+const qint64 COMPRESSION_BLOCK_SIZE = 64 * 1024;
+
+// The delta base differs from the image by a small edit, which a patch of a
+// few operations covers
+const int DELTA_EDIT_SIZE = 16;
+const int DELTA_SHIFT_SIZE = 8;
+const qint64 DELTA_PATCH_LIMIT = 256;
+const qint64 DELTA_READ_SIZE = 32;
+
+class TestFirmwarePackage : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void metadataSizes();
+    void roundTrip_data();
+    void roundTrip();
+    void hashTreeImageMismatch();
+    void damagedDeltaPatch();
+
+private:
+    QTemporaryDir m_dir;
+    QByteArray m_image;
+    QByteArray m_deltaBase;
+};
+
+void TestFirmwarePackage::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+
+    // Pseudo-random data with a uniform tail, so the package also gets sparse ranges
+    m_image = QByteArray(IMAGE_SIZE, static_cast<char>(0xFF));
+    quint32 state = 0x12345678;
+    for (int i = 0; i < IMAGE_SIZE * 3 / 4; ++i) {
+        state = state * 1103515245 + 12345;
+        m_image[i] = static_cast<char>(state >> 24);
+    }
+
+    // The installed image: a few bytes changed, and a few missing further on,
+    // so the rest of the new image is shifted against it
+    m_deltaBase = m_image;
+    for (int i = IMAGE_SIZE / 3; i < IMAGE_SIZE / 3 + DELTA_EDIT_SIZE; ++i) {
+        m_deltaBase[i] = static_cast<char>(m_deltaBase.at(i) ^ 0x5A);
+    }
+    m_deltaBase.remove(IMAGE_SIZE / 2, DELTA_SHIFT_SIZE);
+}
+
+void TestFirmwarePackage::metadataSizes()
+{
+    // Growing the manifest a byte at a time gives its size every low byte value,
+    // including those from 0x80 on
+    QByteArray image = m_image.left(4096);
+    for (int length = 0; length < 300; ++length) {
+        FirmwarePackageBuilder builder;
+        builder.setMetadata("name", "test");
+        builder.setMetadata("version", "1.2.3");
+        builder.setMetadata("target", "esp32");
+        builder.setMetadata("description", QString(length, QChar('d')));
+        builder.setImage(image);
+
+        QString path = m_dir.filePath("metadata.fup");
+        builder.write(path);
+
+        try {
+            FirmwarePackage package(path);
+            QCOMPARE(package.metadata().value("description").size(), length);
+            QCOMPARE(package.getChunk(0, image.size()), image);
+        } catch (const std::exception &e) {
+            QFAIL(QString("Description of %1 bytes: %2").arg(length).arg(e.what()).toUtf8().constData());
+        }
+    }
+}
+
+void TestFirmwarePackage::roundTrip_data()
+{
+    QTest::addColumn<QString>("description");
+    QTest::addColumn<qint64>("treeChunkSize");
+    QTest::addColumn<QString>("compression");
+    QTest::addColumn<int>("accessMode");
+    QTest::addColumn<bool>("delta");
+
+    QTest::newRow("plain") << QString() << qint64(0) << QString()
+                           << static_cast<int>(FirmwarePackage::Mapped) << false;
+    QTest::newRow("long metadata") << QString(300, QChar('d')) << qint64(0) << QString()
+                                   << static_cast<int>(FirmwarePackage::Mapped) << false;
+    QTest::newRow("hash tree") << QString() << TREE_CHUNK_SIZE << QString()
+                               << static_cast<int>(FirmwarePackage::Mapped) << false;
+    QTest::newRow("hash tree buffered") << QString() << TREE_CHUNK_SIZE << QString()
+                                        << static_cast<int>(FirmwarePackage::Buffered) << false;
+    QTest::newRow("compressed") << QString() << TREE_CHUNK_SIZE << QString("zlib")
+                                << static_cast<int>(FirmwarePackage::Mapped) << false;
+    QTest::newRow("delta") << QString() << qint64(0) << QString()
+                           << static_cast<int>(FirmwarePackage::Mapped) << true;
+    QTest::newRow("delta hash tree buffered") << QString() << TREE_CHUNK_SIZE << QString()
+                                              << static_cast<int>(FirmwarePackage::Buffered) << true;
+}
+
+void TestFirmwarePackage::roundTrip()
+{
+    QFETCH(QString, description);
+    QFETCH(qint64, treeChunkSize);
+    QFETCH(QString, compression);
+    QFETCH(int, accessMode);
+    QFETCH(bool, delta);
+
+    FirmwarePackageBuilder builder;
+    builder.setMetadata("name", "test");
+    builder.setMetadata("version", "1.2.3");
+    builder.setMetadata("target", "esp32");
+    if (!description.isEmpty()) {
+        builder.setMetadata("description", description);
+    }
+    builder.setImage(m_image);
+    builder.setHashTreeChunkSize(treeChunkSize);
+    if (!compression.isEmpty()) {
+        builder.setCompression(compression, COMPRESSION_BLOCK_SIZE);
+    }
+
+    // A small edit gives a patch of a few operations
+    qint64 patchSize = -1;
+    if (delta) {
+        patchSize = builder.addDeltaBase(m_deltaBase);
+        QVERIFY(patchSize > 0);
+        QVERIFY2(patchSize <= DELTA_PATCH_LIMIT, qPrintable(QString("Patch of %1 bytes").arg(patchSize)));
+    }
+
+    QString path = m_dir.filePath(QString("%1.fup").arg(QString(QTest::currentDataTag()).replace(' ', '-')));
+    builder.write(path);
+
+    std::unique_ptr<FirmwarePackage> package;
+    try {
+        package = std::make_unique<FirmwarePackage>(path, static_cast<FirmwarePackage::AccessMode>(accessMode));
+    } catch (const std::exception &e) {
+        QFAIL(e.what());
+    }
+
+    QCOMPARE(package->metadata().value("name"), QString("test"));
+    QCOMPARE(package->metadata().value("version"), QString("1.2.3"));
+    QCOMPARE(package->size(), qint64(IMAGE_SIZE));
+    QCOMPARE(package->hasHashTree(), treeChunkSize > 0);
+    QCOMPARE(package->compression(), compression);
+
+    // sha256 is the hash of the image, with or without a hash tree
+    QCOMPARE(package->sha256Hash(), CryptoUtils::calculateSHA256(m_image));
+    QVERIFY(package->verify());
+    QCOMPARE(package->getChunk(0, IMAGE_SIZE), m_image);
+    QCOMPARE(package->getChunk(IMAGE_SIZE - 1000, 4000), m_image.right(1000));
+
+    if (!delta) {
+        QVERIFY(package->deltas().isEmpty());
+        return;
+    }
+
+    QCOMPARE(package->deltas().size(), 1);
+    QCOMPARE(package->deltas().at(0).size, patchSize);
+    QCOMPARE(package->findDelta(CryptoUtils::calculateSHA256(m_deltaBase)), 0);
+    QCOMPARE(package->findDelta(CryptoUtils::calculateSHA256(m_image)), -1);
+    QVERIFY(package->verifyDelta(0));
+
+    // Read the patch back the way jobs send it, a chunk at a time into one buffer
+    QByteArray patch;
+    QByteArray buffer;
+    for (qint64 offset = 0; offset < patchSize; offset += DELTA_READ_SIZE) {
+        patch += package->readDeltaChunk(0, offset, DELTA_READ_SIZE, &buffer);
+    }
+    QCOMPARE(patch, DeltaPatch::create(m_deltaBase, m_image));
+    QCOMPARE(DeltaPatch::apply(m_deltaBase, patch), m_image);
+    QVERIFY(package->readDeltaChunk(0, patchSize, DELTA_READ_SIZE, &buffer).isEmpty());
+}
+
+void TestFirmwarePackage::hashTreeImageMismatch()
+{
+    FirmwarePackageBuilder builder;
+    builder.setMetadata("name", "test");
+    builder.setMetadata("version", "1.2.3");
+    builder.setMetadata("target", "esp32");
+    builder.setImage(m_image);
+    builder.setHashTreeChunkSize(TREE_CHUNK_SIZE);
+
+    QString path = m_dir.filePath("tree-mismatch.fup");
+    builder.write(path);
+
+    // Swap the manifest's image hash for another one of the same length; the
+    // chunk table and tree root still match the data
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QByteArray contents = file.readAll();
+    QByteArray imageHash = CryptoUtils::calculateSHA256(m_image).toLatin1();
+    QByteArray otherHash = CryptoUtils::calculateSHA256(m_image.left(1024)).toLatin1();
+    int position = contents.indexOf(imageHash);
+    QVERIFY(position > 0);
+    contents.replace(position, imageHash.size(), otherHash);
+    QVERIFY(file.seek(0));
+    QCOMPARE(file.write(contents), qint64(contents.size()));
+    file.close();
+
+    QVERIFY_EXCEPTION_THROWN(FirmwarePackage package(path), std::runtime_error);
+}
+
+void TestFirmwarePackage::damagedDeltaPatch()
+{
+    QByteArray patch = DeltaPatch::create(m_deltaBase, m_image);
+    QCOMPARE(DeltaPatch::apply(m_deltaBase, patch), m_image);
+
+    // Every truncation drops an operation or cuts one short
+    for (int size = 0; size < patch.size(); ++size) {
+        QVERIFY2(DeltaPatch::apply(m_deltaBase, patch.left(size)).isEmpty(),
+                 qPrintable(QString("Patch truncated to %1 bytes").arg(size)));
+    }
+
+    // Header: magic and target size
+    QByteArray damaged = patch;
+    damaged[0] = 'X';
+    QVERIFY(DeltaPatch::apply(m_deltaBase, damaged).isEmpty());
+
+    damaged = patch;
+    damaged[4] = static_cast<char>(damaged.at(4) + 1);
+    QVERIFY(DeltaPatch::apply(m_deltaBase, damaged).isEmpty());
+
+    // The image starts like its base, so the first operation is a COPY from offset 0
+    QCOMPARE(patch.at(8), char(0x01));
+    damaged = patch;
+    damaged[8] = char(0x7F);
+    QVERIFY(DeltaPatch::apply(m_deltaBase, damaged).isEmpty());
+
+    damaged = patch;
+    qToLittleEndian(static_cast<quint32>(m_deltaBase.size()), damaged.data() + 9);
+    QVERIFY(DeltaPatch::apply(m_deltaBase, damaged).isEmpty());
+
+    // A base too short for the patch's copies
+    QVERIFY(DeltaPatch::apply(m_deltaBase.left(IMAGE_SIZE / 4), patch).isEmpty());
+
+    // Patches that would not be smaller than the image are left out
+    FirmwarePackageBuilder builder;
+    builder.setMetadata("name", "test");
+    builder.setMetadata("version", "1.2.3");
+    builder.setMetadata("target", "esp32");
+    builder.setImage(m_image);
+    QCOMPARE(builder.addDeltaBase(QByteArray(IMAGE_SIZE, '\0')), qint64(-1));
+    QCOMPARE(builder.addDeltaBase(m_deltaBase), qint64(patch.size()));
+
+    QString path = m_dir.filePath("damaged-delta.fup");
+    builder.write(path);
+
+    // Patches are only hashed when checked, so a damaged one loads and fails verification
+    QFile file(path);
+    QVERIFY(file.open(QIODevice::ReadWrite));
+    QByteArray contents = file.readAll();
+    int position = contents.lastIndexOf(patch);
+    QVERIFY(position > 0);
+    contents[position + patch.size() / 2] = static_cast<char>(contents.at(position + patch.size() / 2) ^ 0x01);
+    QVERIFY(file.seek(0));
+    QCOMPARE(file.write(contents), qint64(contents.size()));
+    file.close();
+
+    FirmwarePackage package(path);
+    QCOMPARE(package.deltas().size(), 1);
+    QVERIFY(!package.verifyDelta(0));
+    QVERIFY(!package.verifyDelta(1));
+}
+
+QTEST_GUILESS_MAIN(TestFirmwarePackage)
+#include "tst_firmwarepackage.moc"
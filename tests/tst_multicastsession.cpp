@@ -0,0 +1,255 @@
+#include "core/crc32.h"
+#include "core/firmwarepackage.h"
+#include "core/firmwarepackagebuilder.h"
+#include "plugins/network/multicastframe.h"
+#include "plugins/network/multicastsession.h"
+
+#include <QtTest>
+#include <QNetworkDatagram>
+#include <QSet>
+#include <QTemporaryDir>
+#include <QUdpSocket>
+#include <QtEndian>
+#include <memory>
+
+// Constants
+const int IMAGE_SIZE = 64 * 1024;
+const qint64 CHUNK_SIZE = 1024;
+const int FEC_GROUP_SIZE = 8;
+const int SESSION_TIMEOUT_MS = 10000;
+
+/**
+ * @brief Receiver that joins the group on this host and drops chosen chunks
+ *
+ * Each chunk listed in drops is ignored the first time it arrives. Lost
+ * chunks are rebuilt from the group's parity chunk where only one of the
+ * group is missing, and reported missing at the end of every round.
+ */
+class TestReceiver : public QObject
+{
+public:
+    explicit TestReceiver(const QSet<quint32> &drops)
+        : m_drops(drops),
+          m_session(0),
+          m_size(0),
+          m_chunkSize(0),
+          m_lastRound(0),
+          m_complete(false)
+    {
+        QObject::connect(&m_socket, &QUdpSocket::readyRead, this, [this]() { onReadyRead(); });
+    }
+
+    bool join(const QHostAddress &group, quint16 *port)
+    {
+        if (!m_socket.bind(QHostAddress(QHostAddress::AnyIPv4), 0,
+                           QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)) {
+            return false;
+        }
+        *port = m_socket.localPort();
+        return m_socket.joinMulticastGroup(group);
+    }
+
+    QByteArray image() const { return m_image; }
+    bool isComplete() const { return m_complete; }
+    quint32 lastRound() const { return m_lastRound; }
+    QSet<quint32> recovered() const { return m_recovered; }
+    QSet<quint32> repaired() const { return m_repaired; }
+
+private:
+    void onReadyRead()
+    {
+        while (m_socket.hasPendingDatagrams()) {
+            QNetworkDatagram datagram = m_socket.receiveDatagram();
+            QByteArray data = datagram.data();
+
+            quint8 type = 0;
+            quint32 session = 0;
+            if (!MulticastFrame::decodeHeader(data, &type, &session)) {
+                continue;
+            }
+
+            const char *in = data.constData() + MulticastFrame::HEADER_SIZE;
+            if (type == MulticastFrame::Announce && m_held.isEmpty()) {
+                m_session = session;
+                m_size = qFromLittleEndian<quint64>(in);
+                m_chunkSize = qFromLittleEndian<quint32>(in + 8);
+                m_held = QBitArray(static_cast<int>(qFromLittleEndian<quint32>(in + 12)));
+                m_image = QByteArray(static_cast<int>(m_size), '\0');
+            } else if (session != m_session || m_held.isEmpty()) {
+                continue;
+            } else if (type == MulticastFrame::Data) {
+                onData(qFromLittleEndian<quint32>(in), qFromLittleEndian<quint32>(in + 4),
+                       data.mid(MulticastFrame::DATA_HEADER_SIZE));
+            } else if (type == MulticastFrame::Parity) {
+                onParity(qFromLittleEndian<quint32>(in), static_cast<quint8>(in[4]),
+                         qFromLittleEndian<quint32>(in + 8), data.mid(MulticastFrame::PARITY_HEADER_SIZE));
+            } else if (type == MulticastFrame::RoundEnd) {
+                m_lastRound = qFromLittleEndian<quint32>(in);
+                report(datagram.senderAddress(), static_cast<quint16>(datagram.senderPort()));
+            }
+        }
+    }
+
+    void onData(quint32 index, quint32 crc, const QByteArray &chunk)
+    {
+        if (static_cast<int>(index) >= m_held.size() || m_held.testBit(static_cast<int>(index)) ||
+            Crc32::compute(chunk) != crc) {
+            return;
+        }
+
+        // Lost on the way, once
+        if (m_drops.remove(index)) {
+            return;
+        }
+
+        if (m_lastRound > 0) {
+            m_repaired.insert(index);
+        }
+        store(index, chunk);
+    }
+
+    void onParity(quint32 first, quint8 count, quint32 crc, const QByteArray &parity)
+    {
+        if (Crc32::compute(parity) != crc || static_cast<int>(first + count) > m_held.size()) {
+            return;
+        }
+
+        // One missing chunk of the group is the XOR of the parity and the others
+        int missing = -1;
+        QByteArray chunk = parity;
+        for (quint32 index = first; index < first + count; ++index) {
+            if (!m_held.testBit(static_cast<int>(index))) {
+                if (missing >= 0) {
+                    return;
+                }
+                missing = static_cast<int>(index);
+                continue;
+            }
+            MulticastFrame::xorInto(&chunk, m_image.mid(static_cast<int>(index * m_chunkSize),
+                                                        static_cast<int>(m_chunkSize)));
+        }
+
+        if (missing >= 0) {
+            m_recovered.insert(static_cast<quint32>(missing));
+            store(static_cast<quint32>(missing), chunk);
+        }
+    }
+
+    void store(quint32 index, const QByteArray &chunk)
+    {
+        qint64 offset = static_cast<qint64>(index) * m_chunkSize;
+        int size = static_cast<int>(qMin<qint64>(m_chunkSize, m_size - offset));
+        m_image.replace(static_cast<int>(offset), size, chunk.left(size));
+        m_held.setBit(static_cast<int>(index));
+    }
+
+    void report(const QHostAddress &host, quint16 port)
+    {
+        MulticastFrame::StatusReport status;
+        status.round = m_lastRound;
+        status.received = static_cast<quint32>(m_held.count(true));
+        status.missing = QByteArray((m_held.size() + 7) / 8, '\0');
+        for (int index = 0; index < m_held.size(); ++index) {
+            if (!m_held.testBit(index)) {
+                status.missing[index / 8] = static_cast<char>(status.missing.at(index / 8) | (1 << (index % 8)));
+            }
+        }
+
+        m_complete = status.received == static_cast<quint32>(m_held.size());
+        m_socket.writeDatagram(MulticastFrame::encodeStatus(m_session, status), host, port);
+    }
+
+    QUdpSocket m_socket;
+    QSet<quint32> m_drops;
+    quint32 m_session;
+    qint64 m_size;
+    qint64 m_chunkSize;
+    QBitArray m_held;
+    QByteArray m_image;
+    quint32 m_lastRound;
+    bool m_complete;
+    QSet<quint32> m_recovered;
+    QSet<quint32> m_repaired;
+};
+
+class TestMulticastSession : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void repairsLostChunks();
+
+private:
+    QTemporaryDir m_dir;
+    QByteArray m_image;
+    QString m_packagePath;
+};
+
+void TestMulticastSession::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+
+    // Pseudo-random data, ending in a partial chunk
+    m_image = QByteArray(IMAGE_SIZE - 100, Qt::Uninitialized);
+    quint32 state = 0x12345678;
+    for (int i = 0; i < m_image.size(); ++i) {
+        state = state * 1103515245 + 12345;
+        m_image[i] = static_cast<char>(state >> 24);
+    }
+
+    FirmwarePackageBuilder builder;
+    builder.setMetadata("name", "test");
+    builder.setMetadata("version", "1.0.0");
+    builder.setMetadata("target", "multicast");
+    builder.setImage(m_image);
+
+    m_packagePath = m_dir.filePath("firmware.fup");
+    builder.write(m_packagePath);
+}
+
+void TestMulticastSession::repairsLostChunks()
+{
+    // Chunk 3 and the partial last chunk 63 are the only losses of their
+    // groups, so the parity chunks rebuild them; chunks 9 and 10 share a group,
+    // so they are reported missing and sent again in the next round
+    QSet<quint32> drops = {3, 9, 10, 63};
+    TestReceiver receiver(drops);
+
+    MulticastSession::Options options;
+    options.group = QHostAddress(QStringLiteral("239.255.70.86"));
+    options.chunkSize = CHUNK_SIZE;
+    options.fecGroupSize = FEC_GROUP_SIZE;
+    if (!receiver.join(options.group, &options.port)) {
+        QSKIP("Cannot join a multicast group on this host");
+    }
+
+    // Reports come from the address the group datagrams leave through
+    QUdpSocket probe;
+    probe.connectToHost(options.group, options.port);
+    if (!probe.waitForConnected(1000)) {
+        QSKIP("No route to the multicast group on this host");
+    }
+    QString address = QHostAddress(probe.localAddress().toIPv4Address()).toString();
+    probe.close();
+
+    MulticastSession session(options);
+    QSignalSpy finished(&session, &MulticastSession::receiverFinished);
+
+    auto firmware = std::make_shared<FirmwarePackage>(m_packagePath);
+    QVERIFY(session.addReceiver(address, firmware));
+
+    QTRY_COMPARE_WITH_TIMEOUT(finished.count(), 1, SESSION_TIMEOUT_MS);
+    QCOMPARE(finished.at(0).at(0).toString(), address);
+    QVERIFY(finished.at(0).at(1).toBool());
+    QVERIFY(!session.isRunning());
+
+    QVERIFY(receiver.isComplete());
+    QCOMPARE(receiver.image(), m_image);
+    QCOMPARE(receiver.recovered(), QSet<quint32>({3, 63}));
+    QCOMPARE(receiver.repaired(), QSet<quint32>({9, 10}));
+    QCOMPARE(receiver.lastRound(), quint32(2));
+}
+
+QTEST_GUILESS_MAIN(TestMulticastSession)
+#include "tst_multicastsession.moc"
@@ -0,0 +1,141 @@
+#include "plugins/serial/serialreactor.h"
+
+#include <QtTest>
+
+#ifdef Q_OS_LINUX
+#include <cerrno>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+// Constants
+const int BATCH_COUNT = 20;
+const int BATCH_SIZE = 512;
+
+class TestSerialReactor : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void cleanup();
+    void receivesAfterDrain();
+    void writesQueuedBytes();
+    void hangupReportsDisconnect();
+
+private:
+    void openPort();
+
+    int m_master = -1;
+    QString m_slavePath;
+    QObject m_receiver;
+    std::shared_ptr<SerialReactorPort> m_port;
+    QByteArray m_received;
+    QString m_error;
+};
+
+void TestSerialReactor::init()
+{
+#ifdef Q_OS_LINUX
+    // The slave end of a pseudo terminal behaves like a USB serial adapter
+    m_master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    QVERIFY(m_master >= 0);
+    QVERIFY(grantpt(m_master) == 0);
+    QVERIFY(unlockpt(m_master) == 0);
+    m_slavePath = QString::fromLocal8Bit(ptsname(m_master));
+
+    m_received.clear();
+    m_error.clear();
+    openPort();
+#else
+    QSKIP("The serial reactor is only available on Linux");
+#endif
+}
+
+void TestSerialReactor::cleanup()
+{
+#ifdef Q_OS_LINUX
+    if (m_port) {
+        m_port->close();
+        m_port.reset();
+    }
+    if (m_master >= 0) {
+        ::close(m_master);
+        m_master = -1;
+    }
+#endif
+}
+
+void TestSerialReactor::openPort()
+{
+    QString error;
+    m_port = SerialReactor::instance()->open(m_slavePath, 115200, &m_receiver,
+                                             [this]() {
+                                                 if (m_port) {
+                                                     m_port->readAll(m_received);
+                                                 }
+                                             },
+                                             [this](const QString &message) { m_error = message; },
+                                             &error);
+    QVERIFY2(m_port, qPrintable(error));
+}
+
+void TestSerialReactor::receivesAfterDrain()
+{
+#ifdef Q_OS_LINUX
+    // Each batch is read until the tty is drained; the port must stay open
+    // and pick up the next one
+    QByteArray expected;
+    for (int batch = 0; batch < BATCH_COUNT; ++batch) {
+        QByteArray data(BATCH_SIZE, static_cast<char>('a' + batch % 26));
+        QCOMPARE(::write(m_master, data.constData(), data.size()), static_cast<ssize_t>(data.size()));
+        expected += data;
+
+        QTRY_COMPARE(m_received.size(), expected.size());
+        QVERIFY2(m_error.isEmpty(), qPrintable(m_error));
+        QVERIFY(m_port->isOpen());
+    }
+    QCOMPARE(m_received, expected);
+#endif
+}
+
+void TestSerialReactor::writesQueuedBytes()
+{
+#ifdef Q_OS_LINUX
+    QByteArray data(BATCH_SIZE, 'w');
+    QCOMPARE(m_port->write(data.constData(), data.size()), qint64(data.size()));
+
+    QByteArray written;
+    QTRY_VERIFY([&]() {
+        char buffer[BATCH_SIZE];
+        ssize_t n = ::read(m_master, buffer, sizeof(buffer));
+        if (n > 0) {
+            written.append(buffer, static_cast<int>(n));
+        }
+        return written.size() == data.size();
+    }());
+    QCOMPARE(written, data);
+    QCOMPARE(m_port->bytesToWrite(), qint64(0));
+    QVERIFY(m_port->isOpen());
+#endif
+}
+
+void TestSerialReactor::hangupReportsDisconnect()
+{
+#ifdef Q_OS_LINUX
+    QByteArray data("last bytes");
+    QCOMPARE(::write(m_master, data.constData(), data.size()), static_cast<ssize_t>(data.size()));
+    QTRY_COMPARE(m_received, data);
+
+    // Closing the master hangs up the slave, like unplugging an adapter
+    ::close(m_master);
+    m_master = -1;
+
+    QTRY_VERIFY(!m_error.isEmpty());
+    QVERIFY(!m_port->isOpen());
+#endif
+}
+
+QTEST_GUILESS_MAIN(TestSerialReactor)
+#include "tst_serialreactor.moc"